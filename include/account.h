@@ -14,14 +14,40 @@
 typedef struct mycertfp_ mycertfp_t;
 typedef struct myuser_name_ myuser_name_t;
 typedef struct chanacs_ chanacs_t;
+typedef struct chanacs_index_ chanacs_index_t;
 typedef struct kline_ kline_t;
 typedef struct xline_ xline_t;
 typedef struct qline_ qline_t;
 typedef struct mymemo_ mymemo_t;
 typedef struct svsignore_ svsignore_t;
 
+/* the expiry queues, see expire.c */
+typedef enum {
+	EXPIRE_MYUSER = 0,
+	EXPIRE_MYNICK,
+	EXPIRE_MYCHAN,
+	EXPIRE_KINDS
+} expire_kind_t;
+
+/* lookup state shared by klines, xlines, qlines and svsignores; see node.c */
+typedef struct {
+  mowgli_node_t node;		/* for klnlist, xlnlist, qlnlist or svs_ignore_list */
+  unsigned long seq;		/* insertion order */
+
+  mowgli_node_t mnode;		/* mask index bucket */
+  mowgli_list_t *mbucket;
+  mowgli_node_t nnode;		/* number index bucket */
+  mowgli_list_t *nbucket;
+  mowgli_node_t xnode;		/* CIDR trie (klines, svsignores), exact mask (qlines) */
+  mowgli_list_t *xbucket;
+
+  unsigned int heappos;		/* in the expiry heap, 0 if not there */
+} line_index_t;
+
 /* kline list struct */
 struct kline_ {
+  line_index_t li;
+
   char *user;
   char *host;
   char *reason;
@@ -35,6 +61,8 @@ struct kline_ {
 
 /* xline list struct */
 struct xline_ {
+  line_index_t li;
+
   char *realname;
   char *reason;
   char *setby;
@@ -47,6 +75,8 @@ struct xline_ {
 
 /* qline list struct */
 struct qline_ {
+  line_index_t li;
+
   char *mask;
   char *reason;
   char *setby;
@@ -59,6 +89,8 @@ struct qline_ {
 
 /* services ignore struct */
 struct svsignore_ {
+  line_index_t li;
+
   svsignore_t *svsignore;
 
   char *mask;
@@ -88,7 +120,7 @@ struct myuser_
   unsigned short memoct_new;
   unsigned short memo_ratelimit_num; /* memos sent recently */
   time_t memo_ratelimit_time; /* last time a memo was sent */
-  mowgli_list_t memo_ignores;
+  mowgli_patricia_t *memo_ignores; /* ignored names -> name; NULL if none */
 
   mowgli_list_t access_list;
   mowgli_list_t nicks; /* registered nicks, must include mu->name if nonempty */
@@ -96,6 +128,8 @@ struct myuser_
   language_t *language;
 
   mowgli_list_t cert_fingerprints;
+
+  unsigned int expirepos; /* in the expiry queue, 0 if not there */
 };
 
 /* Keep this synchronized with mu_flags in libathemecore/flags.c */
@@ -135,6 +169,8 @@ struct mynick_
   time_t lastseen;
 
   mowgli_node_t node; /* for myuser_t.nicks */
+
+  unsigned int expirepos; /* in the expiry queue, 0 if not there */
 };
 
 /* record about a name that used to exist */
@@ -162,6 +198,7 @@ struct mychan_
 
   channel_t *chan;
   mowgli_list_t chanacs;
+  chanacs_index_t *chanacs_index;	/* lookup index over chanacs, see account.c */
   time_t registered;
   time_t used;
 
@@ -171,6 +208,8 @@ struct mychan_
   char *mlock_key;
 
   unsigned int flags;
+
+  unsigned int expirepos; /* in the expiry queue, 0 if not there */
 };
 
 /* Keep this synchronized with mc_flags in libathemecore/flags.c */
@@ -210,6 +249,8 @@ struct chanacs_
 
 	mowgli_node_t    cnode;
 	mowgli_node_t    unode;
+	mowgli_node_t    inode;	/* in one list of mychan->chanacs_index */
+	mowgli_list_t   *ilist;
 
 	char setter_uid[IDLEN];
 };
@@ -270,12 +311,22 @@ struct chanacs_
 
 /* struct for account memos */
 struct mymemo_ {
-	char	 sender[NICKLEN];
-	char 	 text[MEMOLEN];
+	stringref sender;
+	char	*text;		/* NULL while memo_store keeps it; see mymemo_text() */
 	time_t	 sent;
 	unsigned int status;
+	unsigned int len;	/* of the text */
+	off_t	 offset;	/* where memo_store keeps the text */
 };
 
+/* keeps memo texts out of memory; see modules/memoserv/memostore */
+typedef struct {
+	/* sets memo->offset and returns true if it took the text */
+	bool (*store)(mymemo_t *memo, const char *text);
+	/* the text, valid until the next call, or NULL */
+	const char *(*fetch)(mymemo_t *memo);
+} memo_store_t;
+
 /* memo status flags */
 #define MEMO_READ          0x00000001
 #define MEMO_CHANNEL       0x00000002
@@ -367,7 +418,13 @@ typedef struct {
 E bool backend_loaded;
 
 /* dbhandler.c */
-E void (*db_save)(void *arg);
+typedef enum {
+	DB_SAVE_BLOCKING,	/* write the database before returning */
+	DB_SAVE_BG_REGULAR,	/* periodic save; skipped while another save is running */
+	DB_SAVE_BG_IMPORTANT,	/* requested save; queued behind a running save */
+} db_save_strategy_t;
+
+E void (*db_save)(void *arg, db_save_strategy_t strategy);
 E void (*db_load)(const char *arg);
 
 /* function.c */
@@ -380,6 +437,7 @@ E mowgli_list_t klnlist;
 E kline_t *kline_add_with_id(const char *user, const char *host, const char *reason, long duration, const char *setby, unsigned long id);
 E kline_t *kline_add(const char *user, const char *host, const char *reason, long duration, const char *setby);
 E kline_t *kline_add_user(user_t *user, const char *reason, long duration, const char *setby);
+E void kline_set_settime(kline_t *k, time_t settime);
 E void kline_delete(kline_t *k);
 E kline_t *kline_find(const char *user, const char *host);
 E kline_t *kline_find_num(unsigned long number);
@@ -388,7 +446,9 @@ E void kline_expire(void *arg);
 
 E mowgli_list_t xlnlist;
 
+E xline_t *xline_add_with_id(const char *realname, const char *reason, long duration, const char *setby, unsigned int id);
 E xline_t *xline_add(const char *realname, const char *reason, long duration, const char *setby);
+E void xline_set_settime(xline_t *x, time_t settime);
 E void xline_delete(const char *realname);
 E xline_t *xline_find(const char *realname);
 E xline_t *xline_find_num(unsigned int number);
@@ -397,7 +457,9 @@ E void xline_expire(void *arg);
 
 E mowgli_list_t qlnlist;
 
+E qline_t *qline_add_with_id(const char *mask, const char *reason, long duration, const char *setby, unsigned int id);
 E qline_t *qline_add(const char *mask, const char *reason, long duration, const char *setby);
+E void qline_set_settime(qline_t *q, time_t settime);
 E void qline_delete(const char *mask);
 E qline_t *qline_find(const char *mask);
 E qline_t *qline_find_match(const char *mask);
@@ -453,6 +515,7 @@ E const char *mychan_get_sts_mlock(mychan_t *mc);
 
 E chanacs_t *chanacs_add(mychan_t *mychan, myentity_t *myuser, unsigned int level, time_t ts, myentity_t *setter);
 E chanacs_t *chanacs_add_host(mychan_t *mychan, const char *host, unsigned int level, time_t ts, myentity_t *setter);
+E void chanacs_unindex(chanacs_t *ca);
 
 E chanacs_t *chanacs_find(mychan_t *mychan, myentity_t *myuser, unsigned int level);
 E unsigned int chanacs_entity_flags(mychan_t *mychan, myentity_t *myuser);
@@ -466,6 +529,7 @@ E chanacs_t *chanacs_find_host_by_user(mychan_t *mychan, user_t *u, unsigned int
 E chanacs_t *chanacs_find_by_mask(mychan_t *mychan, const char *mask, unsigned int level);
 E bool chanacs_user_has_flag(mychan_t *mychan, user_t *u, unsigned int level);
 E unsigned int chanacs_user_flags(mychan_t *mychan, user_t *u);
+E void chanacs_user_flags_batch(mychan_t *mychan, user_t **users, unsigned int *flags, unsigned int count);
 //inline bool chanacs_source_has_flag(mychan_t *mychan, sourceinfo_t *si, unsigned int level);
 E unsigned int chanacs_source_flags(mychan_t *mychan, sourceinfo_t *si);
 
@@ -479,16 +543,37 @@ E bool chanacs_modify_simple(chanacs_t *ca, unsigned int addflags, unsigned int
 E bool chanacs_change(mychan_t *mychan, myentity_t *mt, const char *hostmask, unsigned int *addflags, unsigned int *removeflags, unsigned int restrictflags, myentity_t *setter);
 E bool chanacs_change_simple(mychan_t *mychan, myentity_t *mt, const char *hostmask, unsigned int addflags, unsigned int removeflags, myentity_t *setter);
 
-E void expire_check(void *arg);
 /* Check the database for (version) problems common to all backends */
 E void db_check(void);
 
+/* expire.c */
+E void expire_schedule(expire_kind_t kind, void *obj);
+E void expire_unschedule(expire_kind_t kind, void *obj);
+E void expire_touch(expire_kind_t kind, void *obj);
+E void expire_check(void *arg);
+
+/* memo.c */
+E memo_store_t *memo_store;
+
+E mymemo_t *mymemo_create(const char *sender, const char *text, time_t sent, unsigned int status);
+E mymemo_t *mymemo_create_stored(const char *sender, off_t offset, unsigned int len, time_t sent, unsigned int status);
+E void mymemo_destroy(mymemo_t *memo);
+E const char *mymemo_text(mymemo_t *memo);
+
+E bool memo_ignore_add(myuser_t *mu, const char *name);
+E bool memo_ignore_delete(myuser_t *mu, const char *name);
+E void memo_ignore_clear(myuser_t *mu);
+E const char *memo_ignore_find(myuser_t *mu, const char *name);
+E unsigned int memo_ignore_count(myuser_t *mu);
+E bool memo_ignores(myuser_t *mu, myuser_t *sender);
+
 /* svsignore.c */
 E mowgli_list_t svs_ignore_list;
 
 E svsignore_t *svsignore_find(user_t *user);
 E svsignore_t *svsignore_add(const char *mask, const char *reason);
 E void svsignore_delete(svsignore_t *svsignore);
+E void svsignore_invalidate(user_t *u);
 
 #include "entity-validation.h"
 
@@ -39,6 +39,8 @@
 #include "account.h"
 #include "auth.h"
 #include "tools.h"
+#include "profile.h"
+#include "job.h"
 #include "confprocess.h"
 #include "global.h"
 #include "flags.h"
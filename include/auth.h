@@ -12,8 +12,28 @@
 E void set_password(myuser_t *mu, const char *newpassword);
 E bool verify_password(myuser_t *mu, const char *password);
 
+typedef struct verify_request_ verify_request_t;
+typedef void (*verify_password_cb_t)(myuser_t *mu, bool verified, void *priv);
+
+typedef struct {
+	unsigned int threads;		/* running worker threads */
+	unsigned int queued;		/* requests waiting for a worker */
+	unsigned int outstanding;	/* requests not yet reported back */
+	unsigned int completed;
+	unsigned long total_usec;	/* submission to callback, summed */
+	unsigned long max_usec;
+} verify_stats_t;
+
+E verify_request_t *verify_password_async(myuser_t *mu, const char *password, verify_password_cb_t cb, void *priv);
+E void verify_password_done(verify_request_t *req, bool verified);
+E void verify_password_cancel(verify_request_t *req);
+E void verify_password_forget(myuser_t *mu);
+E void verify_password_drain(void);
+E void verify_password_stats(verify_stats_t *stats);
+
 E bool auth_module_loaded;
 E bool (*auth_user_custom)(myuser_t *mu, const char *password);
+E bool (*auth_user_custom_async)(myuser_t *mu, const char *password, verify_request_t *req);
 
 #endif
 
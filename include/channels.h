@@ -31,6 +31,7 @@ struct channel_
   time_t topicts;
 
   mowgli_list_t members;
+  mowgli_list_t svcmembers; /* chanusers of our own clients, for fantasy */
   mowgli_list_t bans;
 
   unsigned int flags;
@@ -46,6 +47,7 @@ struct chanuser_
   unsigned int modes;
   mowgli_node_t unode;
   mowgli_node_t cnode;
+  mowgli_node_t snode; /* for channel_t.svcmembers */
 };
 
 struct chanban_
@@ -109,8 +111,17 @@ typedef struct {
 			   This also prevents kick/rejoin floods.
 			   If this is NULL, a previous function kicked
 			   the user */
+	bool batched;	/* part of a netjoin; channel_join_batch follows
+			   for everyone still on the channel */
 } hook_channel_joinpart_t;
 
+typedef struct {
+	channel_t *c;
+	chanuser_t **cu; /* the users that joined; as with channel_join,
+			    write NULL in an entry if you kicked that user */
+	unsigned int count;
+} hook_channel_join_batch_t;
+
 typedef struct {
 	user_t *u;
         channel_t *c;
@@ -173,6 +184,7 @@ E void channel_delete(channel_t *c);
 //inline channel_t *channel_find(const char *name);
 
 E chanuser_t *chanuser_add(channel_t *chan, const char *user);
+E void chanuser_add_batch(channel_t *chan, char **users, unsigned int count);
 E void chanuser_delete(channel_t *chan, user_t *user);
 E chanuser_t *chanuser_find(channel_t *chan, user_t *user);
 
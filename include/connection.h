@@ -37,8 +37,16 @@ struct connection_
 	char name[HOSTLEN];
 	char hbuf[BUFSIZE + 1];
 
-	mowgli_list_t recvq;
+	char *recvq;		/* receive buffer, recvq_size bytes */
+	size_t recvq_size;
+	size_t recvq_head;	/* first unread byte */
+	size_t recvq_tail;	/* one past the last received byte */
+	size_t recvq_scan;	/* no newline before this offset */
 	mowgli_list_t sendq;
+	size_t sendq_len;	/* bytes queued */
+	size_t sendq_peak;	/* most bytes ever queued */
+	unsigned long long sendq_bytes;	/* bytes written */
+	unsigned long sendq_writes;	/* write calls made */
 
 	int fd;
 	int pollslot;
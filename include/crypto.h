@@ -19,12 +19,18 @@ typedef struct {
 	const char *(*salt)(void);
 	bool (*needs_param_upgrade)(const char *user_pass_string);
 
+	/* optional reentrant crypt(), writing into buf; providers that
+	 * implement it can be verified on the password worker threads
+	 */
+	const char *(*crypt_r)(const char *key, const char *salt, char *buf, size_t buflen);
+
 	mowgli_node_t node;
 } crypt_impl_t;
 
 E void crypt_register(crypt_impl_t *impl);
 E void crypt_unregister(crypt_impl_t *impl);
 E const crypt_impl_t *crypt_verify_password(const char *user_input, const char *pass);
+E const crypt_impl_t *crypt_verify_password_split(const char *user_input, const char *pass, const crypt_impl_t **deferred, size_t *ndeferred);
 E const crypt_impl_t *crypt_get_default_provider(void);
 
 #endif
@@ -39,7 +39,9 @@ typedef struct {
 
 typedef enum {
 	DB_READ,
-	DB_WRITE
+	DB_WRITE,
+	DB_WRITE_DEFERRED,	/* like DB_WRITE, but db_close() leaves installing the file to db_commit() */
+	DB_APPEND		/* add rows to the end of the file, creating it if needed */
 } database_transaction_t;
 
 struct database_handle_ {
@@ -53,13 +55,19 @@ struct database_handle_ {
 
 typedef struct {
 	database_handle_t *(*db_open)(const char *filename, database_transaction_t txn);
-	void (*db_close)(database_handle_t *db);
+	bool (*db_close)(database_handle_t *db);
 	void (*db_parse)(database_handle_t *db);
+	bool (*db_commit)(const char *filename);
+	bool (*db_flush)(database_handle_t *db);
+	bool (*db_recover)(const char *filename);
 } database_module_t;
 
 E database_handle_t *db_open(const char *filename, database_transaction_t txn);
-E void db_close(database_handle_t *db);
+E bool db_close(database_handle_t *db);
 E void db_parse(database_handle_t *db);
+E bool db_commit(const char *filename);
+E bool db_flush(database_handle_t *db);
+E bool db_recover(const char *filename);
 
 E bool db_read_next_row(database_handle_t *db);
 
@@ -89,7 +97,33 @@ typedef void (*database_handler_f)(database_handle_t *db, const char *type);
 E void db_register_type_handler(const char *type, database_handler_f fun);
 E void db_unregister_type_handler(const char *type);
 E void db_process(database_handle_t *db, const char *type);
+E void db_timing_start(void);
+E void db_timing_report(const char *what);
 E void db_init(void);
 E database_module_t *db_mod;
 
+/* Objects whose changes are reported to the journal, if one is active. */
+typedef enum {
+	DB_JOURNAL_NONE = 0,
+	DB_JOURNAL_MYUSER,
+	DB_JOURNAL_MYNICK,
+	DB_JOURNAL_MYCHAN,
+	DB_JOURNAL_CHANACS,
+	DB_JOURNAL_KLINE
+} db_journal_type_t;
+
+typedef struct {
+	void (*update)(db_journal_type_t type, void *obj);
+	void (*remove)(db_journal_type_t type, void *obj);
+	void (*metadata)(db_journal_type_t type, void *obj, const char *name);
+	void (*rename)(myuser_t *mu, const char *newname);
+} database_journal_t;
+
+E database_journal_t *db_journal;
+
+E void db_journal_update(db_journal_type_t type, void *obj);
+E void db_journal_remove(db_journal_type_t type, void *obj);
+E void db_journal_metadata(void *target, const char *name);
+E void db_journal_rename(myuser_t *mu, const char *newname);
+
 #endif
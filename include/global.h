@@ -44,6 +44,9 @@ struct me
   unsigned int auth;                /* registration auth type             */
   unsigned int emaillimit;          /* maximum number of emails sent      */
   unsigned int emailtime;           /* ... in this amount of time         */
+  unsigned int mta_workers;         /* mta processes running at once      */
+  unsigned int mta_retries;         /* delivery attempts per email        */
+  unsigned int mta_timeout;         /* seconds before a stuck mta is killed */
 
   unsigned long kline_id;	/* unique ID for AKILLs			*/
   unsigned long xline_id;	/* unique ID for AKILLs			*/
@@ -80,6 +83,10 @@ struct ConfOption
   unsigned int kline_time;          /* default expire for klines  */
   unsigned int clone_time;          /* default expire for clone exemptions */
   unsigned int commit_interval;     /* interval between commits   */
+  bool db_save_blocking;            /* don't fork to write the database */
+  bool db_journal;                  /* log changes between database saves */
+  unsigned int db_load_threads;     /* threads tokenizing the database at startup */
+  unsigned int auth_threads;        /* threads hashing passwords for verification */
 
   bool silent;               /* stop sending WALLOPS?      */
   bool join_chans;           /* join registered channels?  */
@@ -14,6 +14,9 @@ typedef void (*hookfn_t)(void *data);
 struct hook_ {
 	stringref name;
 	mowgli_list_t hooks;
+
+	unsigned long calls;
+	unsigned long long usec;	/* in handlers, including nested hooks */
 };
 
 E hook_t *hook_add_event(const char *);
@@ -22,6 +25,8 @@ E void hook_del_hook(const char *, hookfn_t);
 E void hook_add_hook(const char *, hookfn_t);
 E void hook_add_hook_first(const char *, hookfn_t);
 E void hook_call_event(const char *, void *);
+E void hook_run_event(hook_t *, void *);
+E void hook_stats(void (*cb)(hook_t *hook, void *privdata), void *privdata);
 
 E void hook_stop(void);
 E void hook_continue(void *newptr);
@@ -0,0 +1,48 @@
+/*
+ * Copyright (c) 2014- Shaltúre project (http://github.com/shalture)
+ * Rights to this code are as documented in doc/LICENSE.
+ *
+ * Incremental jobs run from the event loop.
+ *
+ */
+
+#ifndef JOB_H
+#define JOB_H
+
+typedef struct job_ job_t;
+
+/* does a little work; returns false once there is nothing left to do */
+typedef bool (*job_step_t)(job_t *job);
+/* called exactly once when the job finishes or is cancelled; frees data */
+typedef void (*job_done_t)(job_t *job);
+
+struct job_ {
+	mowgli_node_t node;
+
+	unsigned int id;
+	char *name;		/* what it does, e.g. "SENDALL" */
+	char *owner;		/* who started it */
+
+	job_step_t step;
+	job_done_t done;
+	void *data;
+
+	unsigned int progress;	/* maintained by step */
+	unsigned int total;
+	time_t started;
+	bool cancelled;
+};
+
+E mowgli_list_t jobs;
+
+E job_t *job_start(const char *name, const char *owner, unsigned int total, job_step_t step, job_done_t done, void *data);
+E void job_cancel(job_t *job);
+E job_t *job_find(unsigned int id);
+
+#endif
+
+/* vim:cinoptions=>s,e0,n0,f0,{0,}0,^0,=s,ps,t0,c3,+s,(2s,us,)20,*30,gs,hs
+ * vim:ts=8
+ * vim:sw=8
+ * vim:noexpandtab
+ */
@@ -13,6 +13,8 @@
 /* cidr.c */
 E int match_ips(const char *mask, const char *address);
 E int match_cidr(const char *mask, const char *address);
+E int parse_ip(const char *address, unsigned char *addr);
+E int parse_cidr(const char *mask, unsigned char *addr, int *cidrlen);
 
 /* match.c */
 #define MATCH_RFC1459   0
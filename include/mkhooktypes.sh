@@ -26,6 +26,46 @@ if [ "$#" != 1 ]; then
 fi
 
 echo "/* Generated by $0 from $1, do not edit! */"
+echo
+echo "/* Hooks known at compile time, resolved once by hooks_init() */"
+echo "#define HOOKTYPES_FOREACH(X) \\"
+while read hook type; do
+	case $hook:$type in
+	[#]*|:)
+		continue
+		;;
+	*)
+		echo "	X($hook) \\"
+		;;
+	esac
+done < "$1"
+echo
+echo
+echo "typedef enum {"
+echo "#define HOOKTYPES_ENUM(name) HOOK_ID_##name,"
+echo "	HOOKTYPES_FOREACH(HOOKTYPES_ENUM)"
+echo "#undef HOOKTYPES_ENUM"
+echo "	HOOK_ID_COUNT"
+echo "} hook_id_t;"
+echo
+echo "E hook_t *hook_table[HOOK_ID_COUNT];"
+echo
+echo "static inline void hook_call_id(hook_id_t id, void *dptr)"
+echo "{"
+echo "	hook_t *h = hook_table[id];"
+echo
+echo "	if (h == NULL)"
+echo "		return;"
+echo
+echo "	h->calls++;"
+echo
+echo "	/* nobody is listening, skip setting up a run context */"
+echo "	if (MOWGLI_LIST_LENGTH(&h->hooks) == 0)"
+echo "		return;"
+echo
+echo "	hook_run_event(h, dptr);"
+echo "}"
+echo
 echo "/* Type checking for hook functions */"
 echo
 while read hook type; do
@@ -34,14 +74,14 @@ while read hook type; do
 		continue
 		;;
 	*:void)
-		echo "#define hook_call_$hook() hook_call_event(\"$hook\", NULL)"
+		echo "#define hook_call_$hook() hook_call_id(HOOK_ID_$hook, NULL)"
 		# Still require a dummy void * function parameter here.
 		echo "#define hook_add_$hook(f) hook_add_hook(\"$hook\", f)"
 		echo "#define hook_add_first_$hook(f) hook_add_hook_first(\"$hook\", f)"
 		echo "#define hook_del_$hook(f) hook_del_hook(\"$hook\", f)"
 		;;
 	*)
-		echo "#define hook_call_$hook(x) hook_call_event(\"$hook\", ENSURE_TYPE(x, $type))"
+		echo "#define hook_call_$hook(x) hook_call_id(HOOK_ID_$hook, ENSURE_TYPE(x, $type))"
 		echo "#define hook_add_$hook(f) hook_add_hook(\"$hook\", (void (*)(void *))ENSURE_TYPE(f, void (*)($type)))"
 		echo "#define hook_add_first_$hook(f) hook_add_hook_first(\"$hook\", (void (*)(void *))ENSURE_TYPE(f, void (*)($type)))"
 		echo "#define hook_del_$hook(f) hook_del_hook(\"$hook\", (void (*)(void *))ENSURE_TYPE(f, void (*)($type)))"
@@ -9,9 +9,13 @@
 #ifndef ATHEME_OBJECT_H
 #define ATHEME_OBJECT_H
 
+typedef struct metadata_key_ metadata_key_t;
+typedef struct metadata_table_ metadata_table_t;
+
 struct metadata_ {
-	stringref name;
-	char *value;
+	stringref name;		/* owned by key */
+	char *value;		/* allocated together with the entry */
+	metadata_key_t *key;	/* interned name, see object.c */
 };
 
 typedef struct metadata_ metadata_t;
@@ -21,8 +25,9 @@ typedef void (*destructor_t)(void *);
 typedef struct {
 	int refcount;
 	destructor_t destructor;
-	mowgli_patricia_t *metadata;
+	metadata_table_t *metadata;	/* NULL until the first metadata_add() */
 	mowgli_patricia_t *privatedata;
+	unsigned int journal_type;	/* db_journal_type_t, for metadata changes */
 #ifdef OBJECT_DEBUG
 	mowgli_node_t dnode;
 #endif
@@ -41,8 +46,25 @@ E void metadata_delete(void *target, const char *name);
 E metadata_t *metadata_find(void *target, const char *name);
 E void metadata_delete_all(void *target);
 
+typedef struct {
+	object_t *obj;
+	unsigned int pos;
+} metadata_iteration_state_t;
+
+/* The current entry may be deleted while iterating; nothing may be added. */
+E metadata_t *metadata_foreach_start(metadata_iteration_state_t *state, void *target);
+E metadata_t *metadata_foreach_next(metadata_iteration_state_t *state);
+
+#define METADATA_FOREACH(md, state, target) \
+	for ((md) = metadata_foreach_start((state), (target)); (md) != NULL; (md) = metadata_foreach_next((state)))
+
+E unsigned int metadata_count(void *target);
+E size_t metadata_footprint(void *target);
+E size_t metadata_key_footprint(unsigned int *count);
+
 E void *privatedata_get(void *target, const char *key);
 E void privatedata_set(void *target, const char *key, void *data);
+E void *privatedata_delete(void *target, const char *key);
 
 #ifdef OBJECT_DEBUG
 E mowgli_list_t object_list;
@@ -61,6 +61,8 @@ struct operclass_ {
   char *privs; /* priv1 priv2 priv3... */
   int flags;
   mowgli_node_t node;
+  unsigned long *privbits; /* privs as a bitset of priv_intern() ids */
+  unsigned int privwords;
 };
 
 #define OPERCLASS_NEEDOPER	0x1 /* only give privs to IRCops */
@@ -88,6 +90,9 @@ E operclass_t *operclass_add(const char *name, const char *privs, int flags);
 E void operclass_delete(operclass_t *operclass);
 E operclass_t *operclass_find(const char *name);
 
+E int priv_intern(const char *priv);
+E int priv_find(const char *priv);
+
 E soper_t *soper_add(const char *name, const char *classname, int flags, const char *password);
 E void soper_delete(soper_t *soper);
 E soper_t *soper_find(myuser_t *myuser);
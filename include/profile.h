@@ -0,0 +1,56 @@
+/*
+ * Copyright (c) 2014- Shaltúre project (http://github.com/shalture)
+ * Rights to this code are as documented in doc/LICENSE.
+ *
+ * Phase timers for profiling uplink bursts.
+ *
+ */
+
+#ifndef PROFILE_H
+#define PROFILE_H
+
+typedef enum {
+	PROF_PARSE = 0,
+	PROF_PCOMMAND_FIND,
+	PROF_USER_ADD,
+	PROF_CHANNEL_ADD,
+	PROF_CHANUSER_ADD,
+	PROF_HOOKS,
+	PROF_SEND,
+	PROF_COUNT
+} prof_phase_t;
+
+typedef struct {
+	unsigned long calls;
+	unsigned long long nsec;	/* including nested phases */
+} prof_counter_t;
+
+/* off unless something like dragon turns it on */
+E bool prof_enabled;
+E prof_counter_t prof_counters[PROF_COUNT];
+E const char *prof_names[PROF_COUNT];
+
+E unsigned long long prof_now(void);
+E void prof_reset(void);
+
+static inline unsigned long long prof_begin(void)
+{
+	return prof_enabled ? prof_now() : 0;
+}
+
+static inline void prof_end(prof_phase_t phase, unsigned long long start)
+{
+	if (!prof_enabled)
+		return;
+
+	prof_counters[phase].calls++;
+	prof_counters[phase].nsec += prof_now() - start;
+}
+
+#endif
+
+/* vim:cinoptions=>s,e0,n0,f0,{0,}0,^0,=s,ps,t0,c3,+s,(2s,us,)20,*30,gs,hs
+ * vim:ts=8
+ * vim:sw=8
+ * vim:noexpandtab
+ */
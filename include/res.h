@@ -26,9 +26,18 @@ typedef struct {
   nsaddr_t addr;
 } dns_reply_t;
 
+/* how a query ended, set just before the callback is called */
+typedef enum {
+  DNS_ANSWER,   /* reply is set */
+  DNS_NEGATIVE, /* the name or record does not exist */
+  DNS_FAILED,   /* server error, bad reply or timeout */
+} dns_result_t;
+
 typedef struct {
   void *ptr; /* pointer used by callback to identify request */
   void (*callback)(void *vptr, dns_reply_t *reply); /* callback to call */
+  dns_result_t result;
+  unsigned int ttl; /* seconds the result may be cached; 0 if not known */
 } dns_query_t;
 
 extern nsaddr_t irc_nsaddr_list[];
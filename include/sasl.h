@@ -49,14 +49,17 @@ typedef struct {
 typedef struct {
 	void (*mech_register) (struct sasl_mechanism_ *mech);
 	void (*mech_unregister) (struct sasl_mechanism_ *mech);
+	void (*mech_step_complete) (struct sasl_session_ *sptr, int rc);
 } sasl_mech_register_func_t;
 
 #define ASASL_FAIL 0 /* client supplied invalid credentials / screwed up their formatting */
 #define ASASL_MORE 1 /* everything looks good so far, but we're not done yet */
 #define ASASL_DONE 2 /* client successfully authenticated */
+#define ASASL_ASYNC 3 /* result comes later, via mech_step_complete() */
 
 #define ASASL_MARKED_FOR_DELETION   1 /* see delete_stale() in saslserv/main.c */
 #define ASASL_NEED_LOG              2 /* user auth success needs to be logged still */
+#define ASASL_STEP_PENDING          4 /* waiting for mech_step_complete() */
 
 #endif
 
@@ -20,6 +20,26 @@ E int sendemail(user_t *u, myuser_t *mu, const char *type, const char *email, co
 #define EMAIL_MEMO	"memo"		/* emailed memos (memo text) */
 #define EMAIL_SETPASS	"setpass"	/* send a password change key (verification code) */
 
+/* mailqueue.c */
+typedef struct mailqueue_item_ mailqueue_item_t;
+
+typedef struct {
+	unsigned int queued;		/* waiting for an mta, including retries */
+	unsigned int running;		/* being delivered */
+	unsigned int delivered;
+	unsigned int retried;
+	unsigned int failed;		/* given up on */
+	unsigned int timedout;		/* mta killed for taking too long */
+	unsigned long total_sec;	/* spooled to delivered, summed */
+	unsigned long max_sec;
+} mailqueue_stats_t;
+
+E void mailqueue_init(void);
+E mailqueue_item_t *mailqueue_begin(const char *email, FILE **out);
+E bool mailqueue_commit(mailqueue_item_t *mi);
+E void mailqueue_abort(mailqueue_item_t *mi);
+E void mailqueue_stats(mailqueue_stats_t *stats);
+
 /* arc4random.c */
 #ifndef HAVE_ARC4RANDOM
 E void arc4random_stir(void);
@@ -38,6 +38,9 @@ struct user_
 	mowgli_node_t snode; /* for server_t.userlist */
 
 	char *certfp; /* client certificate fingerprint */
+
+	svsignore_t *svsignore; /* cached svsignore_find() result */
+	unsigned int svsignore_gen;
 };
 
 #define FLOOD_MSGS_FACTOR 256
@@ -22,7 +22,6 @@
  */
 
 #include "atheme.h"
-#include "uplink.h" /* XXX, for sendq_flush(curr_uplink->conn); */
 #include "datastream.h"
 #include "privs.h"
 #include "authcookie.h"
@@ -123,6 +122,7 @@ myuser_t *myuser_add_id(const char *id, const char *name, const char *pass, cons
 
 	mu = mowgli_heap_alloc(myuser_heap);
 	object_init(object(mu), name, (destructor_t) myuser_delete);
+	db_journal_update(DB_JOURNAL_MYUSER, mu);
 
 	entity(mu)->type = ENT_USER;
 	entity(mu)->name = strshare_get(name);
@@ -169,6 +169,8 @@ myuser_t *myuser_add_id(const char *id, const char *name, const char *pass, cons
 
 	myuser_name_restore(entity(mu)->name, mu);
 
+	expire_schedule(EXPIRE_MYUSER, mu);
+
 	cnt.myuser++;
 
 	return mu;
@@ -203,8 +205,12 @@ void myuser_delete(myuser_t *mu)
 	if (!(runflags & RF_STARTING))
 		slog(LG_DEBUG, "myuser_delete(): %s", entity(mu)->name);
 
+	db_journal_remove(DB_JOURNAL_MYUSER, mu);
+
 	myuser_name_remember(entity(mu)->name, mu);
 
+	verify_password_forget(mu);
+
 	hook_call_myuser_delete(mu);
 
 	/* log them out */
@@ -251,9 +257,11 @@ void myuser_delete(myuser_t *mu)
 
 		mowgli_node_delete(n, &mu->memos);
 		mowgli_node_free(n);
-		free(memo);
+		mymemo_destroy(memo);
 	}
 
+	memo_ignore_clear(mu);
+
 	/* delete access entries */
 	MOWGLI_ITER_FOREACH_SAFE(n, tn, mu->access_list.head)
 		myuser_access_delete(mu, (char *)n->data);
@@ -296,6 +304,8 @@ void myuser_delete(myuser_t *mu)
 	strshare_unref(mu->email_canonical);
 	strshare_unref(entity(mu)->name);
 
+	expire_unschedule(EXPIRE_MYUSER, mu);
+
 	mowgli_heap_free(myuser_heap, mu);
 
 	cnt.myuser--;
@@ -330,6 +340,8 @@ void myuser_rename(myuser_t *mu, const char *name)
 	return_if_fail(name != NULL);
 	return_if_fail(strlen(name) < NICKLEN);
 
+	db_journal_rename(mu, name);
+
 	mowgli_strlcpy(nb, entity(mu)->name, NICKLEN);
 	newname = strshare_get(name);
 
@@ -386,6 +398,8 @@ void myuser_set_email(myuser_t *mu, const char *newemail)
 
 	mu->email = strshare_get(newemail);
 	mu->email_canonical = canonicalize_email(newemail);
+
+	db_journal_update(DB_JOURNAL_MYUSER, mu);
 }
 
 /*
@@ -654,6 +668,7 @@ mynick_t *mynick_add(myuser_t *mu, const char *name)
 
 	mn = mowgli_heap_alloc(mynick_heap);
 	object_init(object(mn), name, (destructor_t) mynick_delete);
+	db_journal_update(DB_JOURNAL_MYNICK, mn);
 
 	mowgli_strlcpy(mn->nick, name, NICKLEN);
 	mn->owner = mu;
@@ -664,6 +679,8 @@ mynick_t *mynick_add(myuser_t *mu, const char *name)
 
 	myuser_name_restore(mn->nick, mu);
 
+	expire_schedule(EXPIRE_MYNICK, mn);
+
 	cnt.mynick++;
 
 	return mn;
@@ -690,11 +707,15 @@ void mynick_delete(mynick_t *mn)
 	if (!(runflags & RF_STARTING))
 		slog(LG_DEBUG, "mynick_delete(): %s", mn->nick);
 
+	db_journal_remove(DB_JOURNAL_MYNICK, mn);
+
 	myuser_name_remember(mn->nick, mn->owner);
 
 	mowgli_patricia_delete(nicklist, mn->nick);
 	mowgli_node_delete(&mn->node, &mn->owner->nicks);
 
+	expire_unschedule(EXPIRE_MYNICK, mn);
+
 	mowgli_heap_free(mynick_heap, mn);
 
 	cnt.mynick--;
@@ -833,7 +854,7 @@ void myuser_name_restore(const char *name, myuser_t *mu)
 {
 	myuser_name_t *mun;
 	metadata_t *md, *md2;
-	mowgli_patricia_iteration_state_t state;
+	metadata_iteration_state_t state;
 	char *copy;
 
 	mun = myuser_name_find(name);
@@ -856,24 +877,21 @@ void myuser_name_restore(const char *name, myuser_t *mu)
 				md2->value, entity(mu)->name, name);
 	}
 
-	if (object(mun)->metadata)
+	METADATA_FOREACH(md, &state, mun)
 	{
-		MOWGLI_PATRICIA_FOREACH(md, &state, object(mun)->metadata)
+		/* prefer current metadata to saved */
+		if (!metadata_find(mu, md->name))
 		{
-			/* prefer current metadata to saved */
-			if (!metadata_find(mu, md->name))
+			if (strcmp(md->name, "private:mark:reason") ||
+					!strncmp(md->value, "(restored) ", 11))
+				metadata_add(mu, md->name, md->value);
+			else
 			{
-				if (strcmp(md->name, "private:mark:reason") ||
-						!strncmp(md->value, "(restored) ", 11))
-					metadata_add(mu, md->name, md->value);
-				else
-				{
-					copy = smalloc(strlen(md->value) + 12);
-					memcpy(copy, "(restored) ", 11);
-					strcpy(copy + 11, md->value);
-					metadata_add(mu, md->name, copy);
-					free(copy);
-				}
+				copy = smalloc(strlen(md->value) + 12);
+				memcpy(copy, "(restored) ", 11);
+				strcpy(copy + 11, md->value);
+				metadata_add(mu, md->name, copy);
+				free(copy);
 			}
 		}
 	}
@@ -928,6 +946,8 @@ mycertfp_t *mycertfp_find(const char *certfp)
  * M Y C H A N *
  ***************/
 
+static void chanacs_index_free(mychan_t *mychan);
+
 /* private destructor for mychan_t. */
 static void mychan_delete(mychan_t *mc)
 {
@@ -938,6 +958,8 @@ static void mychan_delete(mychan_t *mc)
 	if (!(runflags & RF_STARTING))
 		slog(LG_DEBUG, "mychan_delete(): %s", mc->name);
 
+	db_journal_remove(DB_JOURNAL_MYCHAN, mc);
+
 	if (mc->chan != NULL)
 		mc->chan->mychan = NULL;
 
@@ -945,12 +967,16 @@ static void mychan_delete(mychan_t *mc)
 	MOWGLI_ITER_FOREACH_SAFE(n, tn, mc->chanacs.head)
 		object_unref(n->data);
 
+	chanacs_index_free(mc);
+
 	metadata_delete_all(mc);
 
 	mowgli_patricia_delete(mclist, mc->name);
 
 	strshare_unref(mc->name);
 
+	expire_unschedule(EXPIRE_MYCHAN, mc);
+
 	mowgli_heap_free(mychan_heap, mc);
 
 	cnt.mychan--;
@@ -969,6 +995,7 @@ mychan_t *mychan_add(char *name)
 	mc = mowgli_heap_alloc(mychan_heap);
 
 	object_init(object(mc), name, (destructor_t) mychan_delete);
+	db_journal_update(DB_JOURNAL_MYCHAN, mc);
 	mc->name = strshare_get(name);
 	mc->registered = CURRTIME;
 	mc->chan = channel_find(name);
@@ -978,6 +1005,8 @@ mychan_t *mychan_add(char *name)
 
 	mowgli_patricia_add(mclist, mc->name, mc);
 
+	expire_schedule(EXPIRE_MYCHAN, mc);
+
 	cnt.mychan++;
 
 	return mc;
@@ -1358,6 +1387,225 @@ const char *mychan_get_sts_mlock(mychan_t *mc)
  * C H A N A C S *
  *****************/
 
+/*
+ * The access list of a channel is also indexed, so that looking up the
+ * entries that apply to a given account or user does not need to walk
+ * the whole list:
+ *
+ *   - entries for accounts are hashed by entity pointer;
+ *   - entries for groups and exttargets, which match other entities through
+ *     their validator, are kept in a list of their own;
+ *   - host masks are bucketed by the part of their literal tail that
+ *     follows the last '.', ':', '@' or '!', so "*!*@*.example.org" goes in
+ *     the "org" bucket.  Masks that do not end in such a literal tail (or
+ *     that may be CIDR masks) go in a list which is always checked.
+ *
+ * Every chanacs is in exactly one of these lists, through ca->inode.
+ * Within a list, entries are kept in the same order as in mc->chanacs.
+ */
+struct chanacs_index_
+{
+	mowgli_list_t *entities;
+	unsigned int entity_buckets;
+	unsigned int entity_count;
+
+	mowgli_list_t dynamic;
+
+	mowgli_patricia_t *hosts;
+	mowgli_list_t wildhosts;
+};
+
+#define CHANACS_INDEX_MIN_BUCKETS	4
+
+static inline unsigned int chanacs_entity_hash(const myentity_t *mt, unsigned int buckets)
+{
+	uintptr_t h = (uintptr_t) mt >> 4;
+
+	h ^= h >> 11;
+
+	return (unsigned int) h & (buckets - 1);
+}
+
+static inline bool chanacs_host_separator(char c)
+{
+	return c == '.' || c == ':' || c == '@' || c == '!';
+}
+
+/* bucket key for a host mask, or NULL if it goes in the wildcard list */
+static const char *chanacs_mask_key(const char *mask)
+{
+	const char *p, *key = NULL;
+
+	for (p = mask; *p != '\0'; p++)
+	{
+		switch (*p)
+		{
+		case '\\':
+		case '/':
+			return NULL;
+		case '*':
+		case '?':
+		case '&':
+		case '#':
+		case '%':
+			key = NULL;
+			break;
+		default:
+			if (chanacs_host_separator(*p))
+				key = p + 1;
+		}
+	}
+
+	return key != NULL && *key != '\0' ? key : NULL;
+}
+
+/* bucket key that a host mask must have to match name, if any */
+static const char *chanacs_name_key(const char *name)
+{
+	const char *p, *key = name;
+
+	for (p = name; *p != '\0'; p++)
+		if (chanacs_host_separator(*p))
+			key = p + 1;
+
+	return *key != '\0' ? key : NULL;
+}
+
+static chanacs_index_t *chanacs_index_get(mychan_t *mychan)
+{
+	chanacs_index_t *ci = mychan->chanacs_index;
+
+	if (ci == NULL)
+	{
+		ci = smalloc(sizeof *ci);
+		ci->entity_buckets = CHANACS_INDEX_MIN_BUCKETS;
+		ci->entities = smalloc(ci->entity_buckets * sizeof(mowgli_list_t));
+		mychan->chanacs_index = ci;
+	}
+
+	return ci;
+}
+
+static void chanacs_index_free(mychan_t *mychan)
+{
+	chanacs_index_t *ci = mychan->chanacs_index;
+
+	if (ci == NULL)
+		return;
+
+	/* all entries have been removed by now, so every bucket is empty */
+	if (ci->hosts != NULL)
+		mowgli_patricia_destroy(ci->hosts, NULL, NULL);
+
+	free(ci->entities);
+	free(ci);
+
+	mychan->chanacs_index = NULL;
+}
+
+static void chanacs_index_rehash(chanacs_index_t *ci, unsigned int buckets)
+{
+	mowgli_list_t *old = ci->entities;
+	unsigned int i, oldbuckets = ci->entity_buckets;
+	mowgli_node_t *n, *tn;
+
+	ci->entities = smalloc(buckets * sizeof(mowgli_list_t));
+	ci->entity_buckets = buckets;
+
+	for (i = 0; i < oldbuckets; i++)
+	{
+		MOWGLI_ITER_FOREACH_SAFE(n, tn, old[i].head)
+		{
+			chanacs_t *ca = n->data;
+
+			mowgli_node_delete(&ca->inode, &old[i]);
+			ca->ilist = &ci->entities[chanacs_entity_hash(ca->entity, buckets)];
+			mowgli_node_add(ca, &ca->inode, ca->ilist);
+		}
+	}
+
+	free(old);
+}
+
+static mowgli_list_t *chanacs_index_host_bucket(chanacs_index_t *ci, const char *key)
+{
+	if (ci->hosts == NULL || key == NULL)
+		return NULL;
+
+	return mowgli_patricia_retrieve(ci->hosts, key);
+}
+
+static void chanacs_index_add(chanacs_t *ca)
+{
+	chanacs_index_t *ci = chanacs_index_get(ca->mychan);
+
+	if (ca->entity != NULL)
+	{
+		if (isuser(ca->entity))
+		{
+			if (++ci->entity_count > ci->entity_buckets * 2)
+				chanacs_index_rehash(ci, ci->entity_buckets * 4);
+
+			ca->ilist = &ci->entities[chanacs_entity_hash(ca->entity, ci->entity_buckets)];
+		}
+		else
+			ca->ilist = &ci->dynamic;
+	}
+	else
+	{
+		const char *key = chanacs_mask_key(ca->host);
+
+		if (key != NULL)
+		{
+			if (ci->hosts == NULL)
+				ci->hosts = mowgli_patricia_create(irccasecanon);
+
+			if ((ca->ilist = mowgli_patricia_retrieve(ci->hosts, key)) == NULL)
+			{
+				ca->ilist = mowgli_list_create();
+				mowgli_patricia_add(ci->hosts, key, ca->ilist);
+			}
+		}
+		else
+			ca->ilist = &ci->wildhosts;
+	}
+
+	mowgli_node_add(ca, &ca->inode, ca->ilist);
+}
+
+/*
+ * chanacs_unindex(chanacs_t *ca)
+ *
+ * Removes an access entry from its channel's lookup index.  This is done
+ * by chanacs_delete(); it only needs calling directly by code which takes
+ * an entry off mychan->chanacs without destroying it.
+ */
+void chanacs_unindex(chanacs_t *ca)
+{
+	chanacs_index_t *ci;
+
+	return_if_fail(ca != NULL);
+
+	if (ca->ilist == NULL)
+		return;
+
+	ci = ca->mychan->chanacs_index;
+	mowgli_node_delete(&ca->inode, ca->ilist);
+
+	if (ca->entity != NULL)
+	{
+		if (isuser(ca->entity))
+			ci->entity_count--;
+	}
+	else if (ca->ilist != &ci->wildhosts && MOWGLI_LIST_LENGTH(ca->ilist) == 0)
+	{
+		mowgli_patricia_delete(ci->hosts, chanacs_mask_key(ca->host));
+		mowgli_list_free(ca->ilist);
+	}
+
+	ca->ilist = NULL;
+}
+
 /* private destructor for chanacs_t */
 static void chanacs_delete(chanacs_t *ca)
 {
@@ -1368,6 +1616,10 @@ static void chanacs_delete(chanacs_t *ca)
 		slog(LG_DEBUG, "chanacs_delete(): %s -> %s [%s]", ca->mychan->name,
 			ca->entity != NULL ? entity(ca->entity)->name : ca->host,
 			ca->entity != NULL ? "entity" : "hostmask");
+
+	db_journal_remove(DB_JOURNAL_CHANACS, ca);
+
+	chanacs_unindex(ca);
 	mowgli_node_delete(&ca->cnode, &ca->mychan->chanacs);
 
 	if (ca->entity != NULL)
@@ -1423,6 +1675,7 @@ chanacs_t *chanacs_add(mychan_t *mychan, myentity_t *mt, unsigned int level, tim
 	ca = mowgli_heap_alloc(chanacs_heap);
 
 	object_init(object(ca), mt->name, (destructor_t) chanacs_delete);
+	db_journal_update(DB_JOURNAL_CHANACS, ca);
 	ca->mychan = mychan;
 	ca->entity = isdynamic(mt) ? object_ref(mt) : mt;
 	ca->host = NULL;
@@ -1436,6 +1689,7 @@ chanacs_t *chanacs_add(mychan_t *mychan, myentity_t *mt, unsigned int level, tim
 
 	mowgli_node_add(ca, &ca->cnode, &mychan->chanacs);
 	mowgli_node_add(ca, &ca->unode, &mt->chanacs);
+	chanacs_index_add(ca);
 
 	cnt.chanacs++;
 
@@ -1477,6 +1731,7 @@ chanacs_t *chanacs_add_host(mychan_t *mychan, const char *host, unsigned int lev
 	ca = mowgli_heap_alloc(chanacs_heap);
 
 	object_init(object(ca), host, (destructor_t) chanacs_delete);
+	db_journal_update(DB_JOURNAL_CHANACS, ca);
 	ca->mychan = mychan;
 	ca->entity = NULL;
 	ca->host = sstrdup(host);
@@ -1489,12 +1744,27 @@ chanacs_t *chanacs_add_host(mychan_t *mychan, const char *host, unsigned int lev
 		ca->setter_uid[0] = '\0';
 
 	mowgli_node_add(ca, &ca->cnode, &mychan->chanacs);
+	chanacs_index_add(ca);
 
 	cnt.chanacs++;
 
 	return ca;
 }
 
+/* the index list holding any entries for mt itself */
+static mowgli_list_t *chanacs_entity_list(mychan_t *mychan, myentity_t *mt)
+{
+	chanacs_index_t *ci = mychan->chanacs_index;
+
+	if (ci == NULL)
+		return NULL;
+
+	if (isuser(mt))
+		return &ci->entities[chanacs_entity_hash(mt, ci->entity_buckets)];
+
+	return &ci->dynamic;
+}
+
 chanacs_t *chanacs_find(mychan_t *mychan, myentity_t *mt, unsigned int level)
 {
 	mowgli_node_t *n;
@@ -1505,15 +1775,17 @@ chanacs_t *chanacs_find(mychan_t *mychan, myentity_t *mt, unsigned int level)
 	if ((ca = chanacs_find_literal(mychan, mt, level)) != NULL)
 		return ca;
 
-	MOWGLI_ITER_FOREACH(n, mychan->chanacs.head)
+	if (mychan->chanacs_index == NULL)
+		return NULL;
+
+	/* entries for accounts only match that account, which
+	 * chanacs_find_literal() has already looked for. */
+	MOWGLI_ITER_FOREACH(n, mychan->chanacs_index->dynamic.head)
 	{
 		entity_chanacs_validation_vtable_t *vt;
 
 		ca = (chanacs_t *)n->data;
 
-		if (ca->entity == NULL)
-			continue;
-
 		vt = myentity_get_chanacs_validator(ca->entity);
 		if (level != 0x0)
 		{
@@ -1530,19 +1802,34 @@ chanacs_t *chanacs_find(mychan_t *mychan, myentity_t *mt, unsigned int level)
 unsigned int chanacs_entity_flags(mychan_t *mychan, myentity_t *mt)
 {
 	mowgli_node_t *n;
+	mowgli_list_t *l;
 	chanacs_t *ca;
 	unsigned int result = 0;
 
 	return_val_if_fail(mychan != NULL && mt != NULL, 0);
 
-	MOWGLI_ITER_FOREACH(n, mychan->chanacs.head)
+	if (mychan->chanacs_index == NULL)
+		return 0;
+
+	if (isuser(mt))
+	{
+		l = chanacs_entity_list(mychan, mt);
+
+		MOWGLI_ITER_FOREACH(n, l->head)
+		{
+			ca = (chanacs_t *)n->data;
+
+			if (ca->entity == mt)
+				result |= ca->level;
+		}
+	}
+
+	MOWGLI_ITER_FOREACH(n, mychan->chanacs_index->dynamic.head)
 	{
 		entity_chanacs_validation_vtable_t *vt;
 
 		ca = (chanacs_t *)n->data;
 
-		if (ca->entity == NULL)
-			continue;
 		if (ca->entity == mt)
 			result |= ca->level;
 		else
@@ -1566,11 +1853,15 @@ bool chanacs_entity_is_last_founder(mychan_t *mc, myentity_t *mt)
 chanacs_t *chanacs_find_literal(mychan_t *mychan, myentity_t *mt, unsigned int level)
 {
 	mowgli_node_t *n;
+	mowgli_list_t *l;
 	chanacs_t *ca;
 
 	return_val_if_fail(mychan != NULL && mt != NULL, NULL);
 
-	MOWGLI_ITER_FOREACH(n, mychan->chanacs.head)
+	if ((l = chanacs_entity_list(mychan, mt)) == NULL)
+		return NULL;
+
+	MOWGLI_ITER_FOREACH(n, l->head)
 	{
 		ca = (chanacs_t *)n->data;
 
@@ -1586,24 +1877,66 @@ chanacs_t *chanacs_find_literal(mychan_t *mychan, myentity_t *mt, unsigned int l
 	return NULL;
 }
 
+/*
+ * Fills in the index lists that can hold host masks matching any of the
+ * given names (NULL names are skipped); returns how many there are.
+ * lists must have room for nnames + 1 entries.
+ */
+static unsigned int chanacs_host_lists(mychan_t *mychan, const char **names, unsigned int nnames, mowgli_list_t **lists)
+{
+	chanacs_index_t *ci = mychan->chanacs_index;
+	unsigned int i, j, count = 0;
+	mowgli_list_t *l;
+
+	if (ci == NULL)
+		return 0;
+
+	for (i = 0; i < nnames; i++)
+	{
+		if (names[i] == NULL)
+			continue;
+
+		if ((l = chanacs_index_host_bucket(ci, chanacs_name_key(names[i]))) == NULL)
+			continue;
+
+		for (j = 0; j < count; j++)
+			if (lists[j] == l)
+				break;
+
+		if (j == count)
+			lists[count++] = l;
+	}
+
+	lists[count++] = &ci->wildhosts;
+
+	return count;
+}
+
 chanacs_t *chanacs_find_host(mychan_t *mychan, const char *host, unsigned int level)
 {
 	mowgli_node_t *n;
+	mowgli_list_t *lists[2];
+	unsigned int i, nlists;
 	chanacs_t *ca;
 
 	return_val_if_fail(mychan != NULL && host != NULL, NULL);
 
-	MOWGLI_ITER_FOREACH(n, mychan->chanacs.head)
-	{
-		ca = (chanacs_t *)n->data;
+	nlists = chanacs_host_lists(mychan, &host, 1, lists);
 
-		if (level != 0x0)
+	for (i = 0; i < nlists; i++)
+	{
+		MOWGLI_ITER_FOREACH(n, lists[i]->head)
 		{
-			if ((ca->entity == NULL) && (!match(ca->host, host)) && ((ca->level & level) == level))
+			ca = (chanacs_t *)n->data;
+
+			if (level != 0x0)
+			{
+				if ((!match(ca->host, host)) && ((ca->level & level) == level))
+					return ca;
+			}
+			else if (!match(ca->host, host))
 				return ca;
 		}
-		else if ((ca->entity == NULL) && (!match(ca->host, host)))
-			return ca;
 	}
 
 	return NULL;
@@ -1612,17 +1945,24 @@ chanacs_t *chanacs_find_host(mychan_t *mychan, const char *host, unsigned int le
 unsigned int chanacs_host_flags(mychan_t *mychan, const char *host)
 {
 	mowgli_node_t *n;
+	mowgli_list_t *lists[2];
+	unsigned int i, nlists;
 	chanacs_t *ca;
 	unsigned int result = 0;
 
 	return_val_if_fail(mychan != NULL && host != NULL, 0);
 
-	MOWGLI_ITER_FOREACH(n, mychan->chanacs.head)
+	nlists = chanacs_host_lists(mychan, &host, 1, lists);
+
+	for (i = 0; i < nlists; i++)
 	{
-		ca = (chanacs_t *)n->data;
+		MOWGLI_ITER_FOREACH(n, lists[i]->head)
+		{
+			ca = (chanacs_t *)n->data;
 
-		if (ca->entity == NULL && !match(ca->host, host))
-			result |= ca->level;
+			if (!match(ca->host, host))
+				result |= ca->level;
+		}
 	}
 
 	return result;
@@ -1631,39 +1971,72 @@ unsigned int chanacs_host_flags(mychan_t *mychan, const char *host)
 chanacs_t *chanacs_find_host_literal(mychan_t *mychan, const char *host, unsigned int level)
 {
 	mowgli_node_t *n;
+	mowgli_list_t *l;
+	const char *key;
 	chanacs_t *ca;
 
 	if ((!mychan) || (!host))
 		return NULL;
 
-	MOWGLI_ITER_FOREACH(n, mychan->chanacs.head)
+	if (mychan->chanacs_index == NULL)
+		return NULL;
+
+	/* an identical mask is in the bucket host itself would go in */
+	if ((key = chanacs_mask_key(host)) != NULL)
+		l = chanacs_index_host_bucket(mychan->chanacs_index, key);
+	else
+		l = &mychan->chanacs_index->wildhosts;
+
+	if (l == NULL)
+		return NULL;
+
+	MOWGLI_ITER_FOREACH(n, l->head)
 	{
 		ca = (chanacs_t *)n->data;
 
 		if (level != 0x0)
 		{
-			if ((ca->entity == NULL) && (!strcasecmp(ca->host, host)) && ((ca->level & level) == level))
+			if ((!strcasecmp(ca->host, host)) && ((ca->level & level) == level))
 				return ca;
 		}
-		else if ((ca->entity == NULL) && (!strcasecmp(ca->host, host)))
+		else if (!strcasecmp(ca->host, host))
 			return ca;
 	}
 
 	return NULL;
 }
 
+/* index lists that can hold host masks matching u, for next_matching_host_chanacs() */
+static unsigned int chanacs_user_host_lists(mychan_t *mychan, user_t *u, mowgli_list_t **lists)
+{
+	const char *names[3];
+
+	names[0] = u->vhost;
+	names[1] = u->chost;
+	names[2] = u->ip;
+
+	return chanacs_host_lists(mychan, names, 3, lists);
+}
+
 chanacs_t *chanacs_find_host_by_user(mychan_t *mychan, user_t *u, unsigned int level)
 {
 	mowgli_node_t *n;
+	mowgli_list_t *lists[4];
+	unsigned int i, nlists;
 	chanacs_t *ca;
 
 	return_val_if_fail(mychan != NULL && u != NULL, 0);
 
-	for (n = next_matching_host_chanacs(mychan, u, mychan->chanacs.head); n != NULL; n = next_matching_host_chanacs(mychan, u, n->next))
+	nlists = chanacs_user_host_lists(mychan, u, lists);
+
+	for (i = 0; i < nlists; i++)
 	{
-		ca = n->data;
-		if ((ca->level & level) == level)
-			return ca;
+		for (n = next_matching_host_chanacs(mychan, u, lists[i]->head); n != NULL; n = next_matching_host_chanacs(mychan, u, n->next))
+		{
+			ca = n->data;
+			if ((ca->level & level) == level)
+				return ca;
+		}
 	}
 
 	return NULL;
@@ -1672,15 +2045,22 @@ chanacs_t *chanacs_find_host_by_user(mychan_t *mychan, user_t *u, unsigned int l
 static unsigned int chanacs_host_flags_by_user(mychan_t *mychan, user_t *u)
 {
 	mowgli_node_t *n;
+	mowgli_list_t *lists[4];
+	unsigned int i, nlists;
 	unsigned int result = 0;
 	chanacs_t *ca;
 
 	return_val_if_fail(mychan != NULL && u != NULL, 0);
 
-	for (n = next_matching_host_chanacs(mychan, u, mychan->chanacs.head); n != NULL; n = next_matching_host_chanacs(mychan, u, n->next))
+	nlists = chanacs_user_host_lists(mychan, u, lists);
+
+	for (i = 0; i < nlists; i++)
 	{
-		ca = n->data;
-		result |= ca->level;
+		for (n = next_matching_host_chanacs(mychan, u, lists[i]->head); n != NULL; n = next_matching_host_chanacs(mychan, u, n->next))
+		{
+			ca = n->data;
+			result |= ca->level;
+		}
 	}
 
 	slog(LG_DEBUG, "chanacs_host_flags_by_user(%s, %s): return %s", mychan->name, u->nick, bitmask_to_flags(result));
@@ -1734,15 +2114,16 @@ static unsigned int chanacs_entity_flags_by_user(mychan_t *mychan, user_t *u)
 	return_val_if_fail(mychan != NULL, 0);
 	return_val_if_fail(u != NULL, 0);
 
-	MOWGLI_ITER_FOREACH(n, mychan->chanacs.head)
+	if (mychan->chanacs_index == NULL)
+		return 0;
+
+	/* only groups and exttargets have a match_user method */
+	MOWGLI_ITER_FOREACH(n, mychan->chanacs_index->dynamic.head)
 	{
 		chanacs_t *ca = n->data;
 		myentity_t *mt;
 		entity_chanacs_validation_vtable_t *vt;
 
-		if (ca->entity == NULL)
-			continue;
-
 		mt = ca->entity;
 		vt = myentity_get_chanacs_validator(mt);
 
@@ -1781,6 +2162,85 @@ unsigned int chanacs_user_flags(mychan_t *mychan, user_t *u)
 	return result;
 }
 
+/*
+ * chanacs_user_flags_batch(mychan_t *mychan, user_t **users, unsigned int *flags, unsigned int count)
+ *
+ * chanacs_user_flags() for all the users of a netjoin. The group and
+ * exttarget entries are collected from the access list once for the
+ * whole batch; account and host entries are looked up in the index.
+ */
+void chanacs_user_flags_batch(mychan_t *mychan, user_t **users, unsigned int *flags, unsigned int count)
+{
+	struct {
+		chanacs_t *ca;
+		entity_chanacs_validation_vtable_t *vt;
+	} *dynamic = NULL;
+	unsigned int ndynamic = 0, i, j;
+	mowgli_node_t *n;
+	mowgli_list_t *l;
+	myentity_t *mt;
+	chanacs_t *ca;
+	user_t *u;
+
+	return_if_fail(mychan != NULL);
+	return_if_fail(users != NULL && flags != NULL);
+
+	if (mychan->chanacs_index == NULL)
+	{
+		memset(flags, 0, count * sizeof *flags);
+		return;
+	}
+
+	if (MOWGLI_LIST_LENGTH(&mychan->chanacs_index->dynamic) != 0)
+	{
+		dynamic = smalloc(MOWGLI_LIST_LENGTH(&mychan->chanacs_index->dynamic) * sizeof *dynamic);
+
+		MOWGLI_ITER_FOREACH(n, mychan->chanacs_index->dynamic.head)
+		{
+			ca = n->data;
+			dynamic[ndynamic].ca = ca;
+			dynamic[ndynamic].vt = myentity_get_chanacs_validator(ca->entity);
+			ndynamic++;
+		}
+	}
+
+	for (i = 0; i < count; i++)
+	{
+		u = users[i];
+		mt = entity(u->myuser);
+		flags[i] = 0;
+
+		if (mt != NULL && (l = chanacs_entity_list(mychan, mt)) != &mychan->chanacs_index->dynamic)
+		{
+			MOWGLI_ITER_FOREACH(n, l->head)
+			{
+				ca = n->data;
+
+				if (ca->entity == mt)
+					flags[i] |= ca->level;
+			}
+		}
+
+		for (j = 0; j < ndynamic; j++)
+		{
+			ca = dynamic[j].ca;
+
+			if (mt != NULL && (ca->entity == mt || dynamic[j].vt->match_entity(ca, mt) != NULL))
+				flags[i] |= ca->level;
+			else if (dynamic[j].vt->match_user && dynamic[j].vt->match_user(ca, u) != NULL)
+				flags[i] |= ca->level;
+		}
+
+		/* see chanacs_user_flags() */
+		if (u->myuser != NULL && (u->myuser->flags & MU_WAITAUTH))
+			flags[i] &= ~(ca_all & ~CA_AKICK);
+
+		flags[i] |= chanacs_host_flags_by_user(mychan, u);
+	}
+
+	free(dynamic);
+}
+
 unsigned int chanacs_source_flags(mychan_t *mychan, sourceinfo_t *si)
 {
 	if (si->su != NULL)
@@ -1860,6 +2320,8 @@ bool chanacs_modify(chanacs_t *ca, unsigned int *addflags, unsigned int *removef
 	else
 		ca->setter_uid[0] = '\0';
 
+	db_journal_update(DB_JOURNAL_CHANACS, ca);
+
 	return true;
 }
 
@@ -1928,6 +2390,8 @@ bool chanacs_change(mychan_t *mychan, myentity_t *mt, const char *hostmask, unsi
 
 			if (ca->level == 0)
 				object_unref(ca);
+			else
+				db_journal_update(DB_JOURNAL_CHANACS, ca);
 		}
 	}
 	else /* hostmask != NULL */
@@ -1969,6 +2433,8 @@ bool chanacs_change(mychan_t *mychan, myentity_t *mt, const char *hostmask, unsi
 
 			if (ca->level == 0)
 				object_unref(ca);
+			else
+				db_journal_update(DB_JOURNAL_CHANACS, ca);
 		}
 	}
 	return true;
@@ -1984,151 +2450,6 @@ bool chanacs_change_simple(mychan_t *mychan, myentity_t *mt, const char *hostmas
 	return chanacs_change(mychan, mt, hostmask, &a, &r, ca_all, setter);
 }
 
-static int expire_myuser_cb(myentity_t *mt, void *unused)
-{
-	hook_expiry_req_t req;
-	myuser_t *mu = user(mt);
-
-	return_val_if_fail(isuser(mt), 0);
-
-	req.data.mu = mu;
-	req.do_expire = 1;
-	hook_call_user_check_expire(&req);
-
-	/* If they're logged in, update lastlogin time.
-	 * To decrease db traffic, may want to only do
-	 * this if the account would otherwise be
-	 * deleted. -- jilles
-	 */
-	if (MOWGLI_LIST_LENGTH(&mu->logins) > 0)
-	{
-		mu->lastlogin = CURRTIME;
-		return 0;
-	}
-
-	if (!req.do_expire)
-		return 0;
-
-	if (MU_HOLD & mu->flags)
-		return 0;
-
-	if ((nicksvs.expiry > 0 && mu->lastlogin < CURRTIME && (unsigned int)(CURRTIME - mu->lastlogin) >= nicksvs.expiry) ||
-			(mu->flags & MU_WAITAUTH && CURRTIME - mu->registered >= 86400))
-	{
-		/* Don't expire accounts with privs on them in atheme.conf,
-		 * otherwise someone can reregister
-		 * them and take the privs -- jilles */
-		if (is_conf_soper(mu))
-			return 0;
-
-		slog(LG_REGISTER, _("EXPIRE: \2%s\2 from \2%s\2 "), entity(mu)->name, mu->email);
-		slog(LG_VERBOSE, "expire_check(): expiring account %s (unused %ds, email %s, nicks %zu, chanacs %zu)",
-				entity(mu)->name, (int)(CURRTIME - mu->lastlogin),
-				mu->email, MOWGLI_LIST_LENGTH(&mu->nicks),
-				MOWGLI_LIST_LENGTH(&entity(mu)->chanacs));
-		object_dispose(mu);
-	}
-
-	return 0;
-}
-
-void expire_check(void *arg)
-{
-	mynick_t *mn;
-	mychan_t *mc;
-	user_t *u;
-	mowgli_patricia_iteration_state_t state;
-	hook_expiry_req_t req;
-
-	/* Let them know about this and the likely subsequent db_save()
-	 * right away -- jilles */
-	if (curr_uplink != NULL && curr_uplink->conn != NULL)
-		sendq_flush(curr_uplink->conn);
-
-	myentity_foreach_t(ENT_USER, expire_myuser_cb, NULL);
-
-	MOWGLI_PATRICIA_FOREACH(mn, &state, nicklist)
-	{
-		req.do_expire = 1;
-		req.data.mn = mn;
-
-		hook_call_nick_check_expire(&req);
-
-		if (!req.do_expire)
-			continue;
-
-		if (nicksvs.expiry > 0 && mn->lastseen < CURRTIME &&
-				(unsigned int)(CURRTIME - mn->lastseen) >= nicksvs.expiry)
-		{
-			if (MU_HOLD & mn->owner->flags)
-				continue;
-
-			/* do not drop main nick like this */
-			if (!irccasecmp(mn->nick, entity(mn->owner)->name))
-				continue;
-
-			u = user_find_named(mn->nick);
-			if (u != NULL && u->myuser == mn->owner)
-			{
-				/* still logged in, bleh */
-				mn->lastseen = CURRTIME;
-				mn->owner->lastlogin = CURRTIME;
-				continue;
-			}
-
-			slog(LG_REGISTER, _("EXPIRE: \2%s\2 from \2%s\2"), mn->nick, entity(mn->owner)->name);
-			slog(LG_VERBOSE, "expire_check(): expiring nick %s (unused %lds, account %s)",
-					mn->nick, (long)(CURRTIME - mn->lastseen),
-					entity(mn->owner)->name);
-			object_unref(mn);
-		}
-	}
-
-	MOWGLI_PATRICIA_FOREACH(mc, &state, mclist)
-	{
-		req.do_expire = 1;
-		req.data.mc = mc;
-
-		hook_call_channel_check_expire(&req);
-
-		if (!req.do_expire)
-			continue;
-
-		if ((CURRTIME - mc->used) >= 86400 - 3660)
-		{
-			/* keep last used time accurate to
-			 * within a day, making sure an active
-			 * channel will never get "Last used"
-			 * in /cs info -- jilles */
-			if (mychan_isused(mc))
-			{
-				mc->used = CURRTIME;
-				slog(LG_DEBUG, "expire_check(): updating last used time on %s because it appears to be still in use", mc->name);
-				continue;
-			}
-		}
-
-		if (chansvs.expiry > 0 && mc->used < CURRTIME &&
-				(unsigned int)(CURRTIME - mc->used) >= chansvs.expiry)
-		{
-			if (MC_HOLD & mc->flags)
-				continue;
-
-			slog(LG_REGISTER, _("EXPIRE: \2%s\2 from \2%s\2"), mc->name, mychan_founder_names(mc));
-			slog(LG_VERBOSE, "expire_check(): expiring channel %s (unused %lds, founder %s, chanacs %zu)",
-					mc->name, (long)(CURRTIME - mc->used),
-					mychan_founder_names(mc),
-					MOWGLI_LIST_LENGTH(&mc->chanacs));
-
-			hook_call_channel_drop(mc);
-			if (mc->chan != NULL && !(mc->chan->flags & CHAN_LOG))
-				part(mc->name, chansvs.nick);
-
-			object_unref(mc);
-		}
-	}
-}
-
 static int check_myuser_cb(myentity_t *mt, void *unused)
 {
 	myuser_t *mu = user(mt);
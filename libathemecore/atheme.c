@@ -62,9 +62,14 @@ bool strict_mode = true;
 bool offline_mode = false;
 bool permissive_mode = false;
 
-void (*db_save) (void *arg) = NULL;
+void (*db_save) (void *arg, db_save_strategy_t strategy) = NULL;
 void (*db_load) (const char *name) = NULL;
 
+static void db_save_periodic(void *arg)
+{
+	db_save(NULL, DB_SAVE_BG_REGULAR);
+}
+
 /* *INDENT-OFF* */
 static void print_help(void)
 {
@@ -416,7 +421,7 @@ int shalture_main(int argc, char *argv[])
 
 	/* DB commit interval is configurable */
 	if (db_save && !readonly)
-		mowgli_timer_add(base_eventloop, "db_save", db_save, NULL, config_options.commit_interval);
+		mowgli_timer_add(base_eventloop, "db_save", db_save_periodic, NULL, config_options.commit_interval);
 
 	/* check expires every hour */
 	mowgli_timer_add(base_eventloop, "expire_check", expire_check, NULL, 3600);
@@ -429,6 +434,9 @@ int shalture_main(int argc, char *argv[])
 	/* check authcookie expires every ten minutes */
 	mowgli_timer_add(base_eventloop, "authcookie_expire", authcookie_expire, NULL, 600);
 
+	/* pick up email left in the spool */
+	mailqueue_init();
+
 	me.connected = false;
 	uplink_connect();
 
@@ -439,7 +447,7 @@ int shalture_main(int argc, char *argv[])
 	hook_call_shutdown();
 
 	if (db_save && !readonly)
-		db_save(NULL);
+		db_save(NULL, DB_SAVE_BLOCKING);
 
 	remove(pidfilename);
 	errno = 0;
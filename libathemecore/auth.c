@@ -23,8 +23,57 @@
 
 #include "atheme.h"
 
+#ifdef HAVE_PTHREAD
+# include <pthread.h>
+#endif
+
 bool auth_module_loaded = false;
 bool (*auth_user_custom)(myuser_t *mu, const char *password);
+bool (*auth_user_custom_async)(myuser_t *mu, const char *password, verify_request_t *req);
+
+#define VERIFY_MAX_IMPLS	8
+
+struct verify_request_ {
+	myuser_t *mu;			/* NULL once the account is dropped */
+	char *password;
+	char pass[PASSLEN];		/* mu->pass when the request was made */
+
+	const crypt_impl_t *impls[VERIFY_MAX_IMPLS];
+	size_t nimpls;
+	const crypt_impl_t *matched;
+
+	verify_password_cb_t cb;
+	void *priv;
+	bool cancelled;
+	bool custom;			/* handled by an auth module */
+	bool verified;			/* its answer */
+#ifdef HAVE_GETTIMEOFDAY
+	struct timeval submitted;
+#endif
+
+	mowgli_node_t node;		/* verify_outstanding, main thread only */
+	mowgli_node_t qnode;		/* verify_queue, verify_done or verify_custom_done */
+};
+
+static mowgli_list_t verify_outstanding;
+static mowgli_list_t verify_custom_done;
+static mowgli_eventloop_timer_t *verify_custom_timer;
+static unsigned int verify_completed;
+static unsigned long verify_total_usec, verify_max_usec;
+
+#ifdef HAVE_PTHREAD
+static pthread_mutex_t verify_lock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t verify_work = PTHREAD_COND_INITIALIZER;
+static pthread_cond_t verify_idle = PTHREAD_COND_INITIALIZER;
+
+/* protected by verify_lock */
+static mowgli_list_t verify_queue;
+static mowgli_list_t verify_done;
+static unsigned int verify_threads, verify_threads_wanted, verify_busy;
+
+static int verify_pipe[2] = { -1, -1 };
+static mowgli_eventloop_pollable_t *verify_pollable;
+#endif
 
 void set_password(myuser_t *mu, const char *newpassword)
 {
@@ -42,6 +91,37 @@ void set_password(myuser_t *mu, const char *newpassword)
 		mu->flags &= ~MU_CRYPTPASS;			/* just in case */
 		mowgli_strlcpy(mu->pass, newpassword, PASSLEN);
 	}
+
+	db_journal_update(DB_JOURNAL_MYUSER, mu);
+}
+
+/*
+ * The password matched mu->pass using ci: move the account over to the
+ * default crypt provider, or to its current parameters, if needed.
+ */
+static void verify_password_upgrade(myuser_t *mu, const char *password, const crypt_impl_t *ci)
+{
+	const crypt_impl_t *ci_default;
+
+	if (ci == (ci_default = crypt_get_default_provider()))
+	{
+		if (ci->needs_param_upgrade == NULL || !ci->needs_param_upgrade(mu->pass))
+			return;
+
+		slog(LG_INFO, "verify_password(): transitioning to newer parameters for crypt scheme '%s' for account '%s'",
+		              ci->id, entity(mu)->name);
+
+		mowgli_strlcpy(mu->pass, ci->crypt(password, ci->salt()), PASSLEN);
+	}
+	else
+	{
+		slog(LG_INFO, "verify_password(): transitioning from crypt scheme '%s' to '%s' for account '%s'",
+			      ci->id, ci_default->id, entity(mu)->name);
+
+		mowgli_strlcpy(mu->pass, ci_default->crypt(password, ci_default->salt()), PASSLEN);
+	}
+
+	db_journal_update(DB_JOURNAL_MYUSER, mu);
 }
 
 bool verify_password(myuser_t *mu, const char *password)
@@ -55,29 +135,13 @@ bool verify_password(myuser_t *mu, const char *password)
 	if (mu->flags & MU_CRYPTPASS)
 		if (crypto_module_loaded)
 		{
-			const crypt_impl_t *ci, *ci_default;
+			const crypt_impl_t *ci;
 
 			ci = crypt_verify_password(password, mu->pass);
 			if (ci == NULL)
 				return false;
 
-			if (ci == (ci_default = crypt_get_default_provider()))
-			{
-				if (ci->needs_param_upgrade != NULL && ci->needs_param_upgrade(mu->pass))
-				{
-					slog(LG_INFO, "verify_password(): transitioning to newer parameters for crypt scheme '%s' for account '%s'",
-					              ci->id, entity(mu)->name);
-
-					mowgli_strlcpy(mu->pass, ci->crypt(password, ci->salt()), PASSLEN);
-				}
-			}
-			else
-			{
-				slog(LG_INFO, "verify_password(): transitioning from crypt scheme '%s' to '%s' for account '%s'",
-					      ci->id, ci_default->id, entity(mu)->name);
-
-				mowgli_strlcpy(mu->pass, ci_default->crypt(password, ci_default->salt()), PASSLEN);
-			}
+			verify_password_upgrade(mu, password, ci);
 
 			return true;
 		}
@@ -94,3 +158,397 @@ bool verify_password(myuser_t *mu, const char *password)
 		return (strcmp(mu->pass, password) == 0);
 }
 
+/*
+ * Asynchronous password verification.
+ *
+ * Crypt providers with a crypt_r method are run on a pool of
+ * general::auth_threads worker threads, so that a burst of IDENTIFY or
+ * SASL attempts does not hold up the event loop.  Everything touching
+ * accounts (finding them, upgrading hashes, the callback) happens on the
+ * main thread; the workers only see copies of the password and hash.
+ *
+ * Auth modules that talk to another server can set auth_user_custom_async
+ * and answer through verify_password_done() instead.
+ */
+
+static verify_request_t *verify_request_create(myuser_t *mu, const char *password, verify_password_cb_t cb, void *priv)
+{
+	verify_request_t *req;
+
+	req = smalloc(sizeof *req);
+	req->mu = mu;
+	req->password = sstrdup(password);
+	mowgli_strlcpy(req->pass, mu->pass, sizeof req->pass);
+	req->cb = cb;
+	req->priv = priv;
+#ifdef HAVE_GETTIMEOFDAY
+	s_time(&req->submitted);
+#endif
+
+	return req;
+}
+
+static void verify_request_free(verify_request_t *req)
+{
+	explicit_bzero(req->password, strlen(req->password));
+	free(req->password);
+	free(req);
+}
+
+/* runs on the main thread once the hashing is over */
+static void verify_complete(verify_request_t *req)
+{
+	myuser_t *mu = req->mu;
+	bool verified = false;
+#ifdef HAVE_GETTIMEOFDAY
+	struct timeval spent;
+	unsigned long usec;
+
+	e_time(req->submitted, &spent);
+	usec = spent.tv_sec * 1000000UL + spent.tv_usec;
+	verify_total_usec += usec;
+	if (usec > verify_max_usec)
+		verify_max_usec = usec;
+#endif
+
+	verify_completed++;
+	mowgli_node_delete(&req->node, &verify_outstanding);
+
+	if (!req->cancelled)
+	{
+		if (mu == NULL)
+			verified = false;
+		else if (req->custom)
+			verified = req->verified;
+		else if (strcmp(mu->pass, req->pass))
+			/* the password was changed while we were hashing */
+			verified = verify_password(mu, req->password);
+		else if (req->matched != NULL)
+		{
+			verify_password_upgrade(mu, req->password, req->matched);
+			verified = true;
+		}
+
+		req->cb(mu, verified, req->priv);
+	}
+
+	verify_request_free(req);
+}
+
+#ifdef HAVE_PTHREAD
+/* with verify_lock held */
+static void verify_finished(verify_request_t *req)
+{
+	ssize_t ret = 0;
+
+	/* one byte is enough to wake the main thread for the whole list */
+	if (verify_done.head == NULL)
+		ret = write(verify_pipe[1], "", 1);
+
+	(void) ret;
+
+	mowgli_node_add(req, &req->qnode, &verify_done);
+}
+
+static void *verify_worker(void *arg)
+{
+	verify_request_t *req;
+	char buf[PASSLEN];
+	const char *cstr;
+	size_t i;
+
+	pthread_mutex_lock(&verify_lock);
+
+	for (;;)
+	{
+		if (verify_queue.head == NULL)
+		{
+			if (verify_threads > verify_threads_wanted)
+				break;
+
+			pthread_cond_wait(&verify_work, &verify_lock);
+			continue;
+		}
+
+		req = verify_queue.head->data;
+		mowgli_node_delete(&req->qnode, &verify_queue);
+		verify_busy++;
+		pthread_mutex_unlock(&verify_lock);
+
+		for (i = 0; i < req->nimpls && req->matched == NULL; i++)
+		{
+			cstr = req->impls[i]->crypt_r(req->password, req->pass, buf, sizeof buf);
+
+			if (cstr != NULL && !strcmp(cstr, req->pass))
+				req->matched = req->impls[i];
+		}
+
+		explicit_bzero(buf, sizeof buf);
+
+		pthread_mutex_lock(&verify_lock);
+		verify_busy--;
+		verify_finished(req);
+
+		if (verify_busy == 0 && verify_queue.head == NULL)
+			pthread_cond_broadcast(&verify_idle);
+	}
+
+	verify_threads--;
+	pthread_mutex_unlock(&verify_lock);
+
+	return NULL;
+}
+
+static void verify_collect(void)
+{
+	mowgli_list_t done;
+	mowgli_node_t *n, *tn;
+	char buf[64];
+
+	while (read(verify_pipe[0], buf, sizeof buf) > 0)
+		;
+
+	pthread_mutex_lock(&verify_lock);
+	done = verify_done;
+	memset(&verify_done, 0, sizeof verify_done);
+	pthread_mutex_unlock(&verify_lock);
+
+	MOWGLI_ITER_FOREACH_SAFE(n, tn, done.head)
+		verify_complete(n->data);
+}
+
+static void verify_collect_cb(mowgli_eventloop_t *eventloop, mowgli_eventloop_io_t *io,
+	mowgli_eventloop_io_dir_t dir, void *userdata)
+{
+	verify_collect();
+}
+
+/* set up the wakeup pipe and bring the pool to general::auth_threads */
+static bool verify_pool_ready(void)
+{
+	unsigned int wanted = config_options.auth_threads;
+	sigset_t all, old;
+	pthread_t thread;
+	bool ready;
+	int i;
+
+	if (verify_pipe[0] == -1)
+	{
+		if (wanted == 0)
+			return false;
+
+		if (pipe(verify_pipe) < 0)
+		{
+			slog(LG_ERROR, "verify_password_async(): pipe() failed: %s", strerror(errno));
+			verify_pipe[0] = verify_pipe[1] = -1;
+			return false;
+		}
+
+		for (i = 0; i < 2; i++)
+		{
+			fcntl(verify_pipe[i], F_SETFD, FD_CLOEXEC);
+			fcntl(verify_pipe[i], F_SETFL, fcntl(verify_pipe[i], F_GETFL) | O_NONBLOCK);
+		}
+
+		verify_pollable = mowgli_pollable_create(base_eventloop, verify_pipe[0], NULL);
+		mowgli_pollable_setselect(base_eventloop, verify_pollable, MOWGLI_EVENTLOOP_IO_READ, verify_collect_cb);
+	}
+
+	pthread_mutex_lock(&verify_lock);
+
+	verify_threads_wanted = wanted;
+	if (verify_threads > wanted)
+		pthread_cond_broadcast(&verify_work);
+
+	/* signals are for the main thread */
+	sigfillset(&all);
+	pthread_sigmask(SIG_BLOCK, &all, &old);
+
+	while (verify_threads < wanted)
+	{
+		if (pthread_create(&thread, NULL, verify_worker, NULL) != 0)
+		{
+			slog(LG_ERROR, "verify_password_async(): could not start a worker thread");
+			break;
+		}
+
+		pthread_detach(thread);
+		verify_threads++;
+	}
+
+	pthread_sigmask(SIG_SETMASK, &old, NULL);
+
+	ready = wanted > 0 && verify_threads > 0;
+	pthread_mutex_unlock(&verify_lock);
+
+	return ready;
+}
+#endif
+
+/*
+ * verify_password_async()
+ *
+ * Checks a password like verify_password(), but without blocking on
+ * the hash.  cb is called later from the event loop with the account
+ * (NULL if it was dropped meanwhile) and the result.
+ *
+ * Returns NULL, without calling cb, when the check cannot or need not
+ * be done asynchronously; the caller should use verify_password().
+ */
+verify_request_t *verify_password_async(myuser_t *mu, const char *password, verify_password_cb_t cb, void *priv)
+{
+	verify_request_t *req;
+
+	return_val_if_fail(cb != NULL, NULL);
+
+	if (mu == NULL || password == NULL)
+		return NULL;
+
+	if (auth_module_loaded && auth_user_custom)
+	{
+		if (auth_user_custom_async == NULL)
+			return NULL;
+
+		req = verify_request_create(mu, password, cb, priv);
+		req->custom = true;
+		mowgli_node_add(req, &req->node, &verify_outstanding);
+
+		if (!auth_user_custom_async(mu, password, req))
+		{
+			mowgli_node_delete(&req->node, &verify_outstanding);
+			verify_request_free(req);
+			return NULL;
+		}
+
+		return req;
+	}
+
+#ifdef HAVE_PTHREAD
+	/* plaintext passwords are cheap enough as is */
+	if (!(mu->flags & MU_CRYPTPASS) || !crypto_module_loaded)
+		return NULL;
+
+	if (!verify_pool_ready())
+		return NULL;
+
+	req = verify_request_create(mu, password, cb, priv);
+
+	req->nimpls = VERIFY_MAX_IMPLS;
+	req->matched = crypt_verify_password_split(password, mu->pass, req->impls, &req->nimpls);
+
+	mowgli_node_add(req, &req->node, &verify_outstanding);
+
+	pthread_mutex_lock(&verify_lock);
+
+	if (req->matched != NULL || req->nimpls == 0)
+		verify_finished(req);
+	else
+	{
+		mowgli_node_add(req, &req->qnode, &verify_queue);
+		pthread_cond_signal(&verify_work);
+	}
+
+	pthread_mutex_unlock(&verify_lock);
+
+	return req;
+#else
+	return NULL;
+#endif
+}
+
+static void verify_custom_collect(void *unused)
+{
+	mowgli_list_t done = verify_custom_done;
+	mowgli_node_t *n, *tn;
+
+	verify_custom_timer = NULL;
+	memset(&verify_custom_done, 0, sizeof verify_custom_done);
+
+	MOWGLI_ITER_FOREACH_SAFE(n, tn, done.head)
+		verify_complete(n->data);
+}
+
+/*
+ * verify_password_done()
+ *
+ * Called by an auth module to report the result of a request it accepted
+ * from auth_user_custom_async().  This may be called from within
+ * auth_user_custom_async() itself; the requester is told from the event
+ * loop either way.
+ */
+void verify_password_done(verify_request_t *req, bool verified)
+{
+	return_if_fail(req != NULL);
+	return_if_fail(req->custom);
+
+	req->verified = verified;
+	mowgli_node_add(req, &req->qnode, &verify_custom_done);
+
+	if (verify_custom_timer == NULL)
+		verify_custom_timer = mowgli_timer_add_once(base_eventloop, "verify_custom_collect", verify_custom_collect, NULL, 0);
+}
+
+/* the callback for req will not be called; req is freed later */
+void verify_password_cancel(verify_request_t *req)
+{
+	return_if_fail(req != NULL);
+
+	req->cancelled = true;
+}
+
+/* mu is going away; pending requests for it will report failure */
+void verify_password_forget(myuser_t *mu)
+{
+	mowgli_node_t *n;
+
+	MOWGLI_ITER_FOREACH(n, verify_outstanding.head)
+	{
+		verify_request_t *req = n->data;
+
+		if (req->mu == mu)
+			req->mu = NULL;
+	}
+}
+
+/* waits for the workers to go idle and completes every request */
+void verify_password_drain(void)
+{
+#ifdef HAVE_PTHREAD
+	if (verify_pipe[0] == -1)
+		return;
+
+	pthread_mutex_lock(&verify_lock);
+
+	while (verify_busy > 0 || verify_queue.head != NULL)
+		pthread_cond_wait(&verify_idle, &verify_lock);
+
+	pthread_mutex_unlock(&verify_lock);
+
+	verify_collect();
+#endif
+}
+
+void verify_password_stats(verify_stats_t *stats)
+{
+	return_if_fail(stats != NULL);
+
+	memset(stats, 0, sizeof *stats);
+
+#ifdef HAVE_PTHREAD
+	pthread_mutex_lock(&verify_lock);
+	stats->threads = verify_threads;
+	stats->queued = MOWGLI_LIST_LENGTH(&verify_queue);
+	pthread_mutex_unlock(&verify_lock);
+#endif
+
+	stats->outstanding = MOWGLI_LIST_LENGTH(&verify_outstanding);
+	stats->completed = verify_completed;
+	stats->total_usec = verify_total_usec;
+	stats->max_usec = verify_max_usec;
+}
+
+/* vim:cinoptions=>s,e0,n0,f0,{0,}0,^0,=s,ps,t0,c3,+s,(2s,us,)20,*30,gs,hs
+ * vim:ts=8
+ * vim:sw=8
+ * vim:noexpandtab
+ */
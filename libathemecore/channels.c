@@ -80,7 +80,7 @@ void init_channels(void)
  *     - if the creator is me.me these actions must be performed by the
  *       caller (i.e. join()) after joining the service
  */
-channel_t *channel_add(const char *name, time_t ts, server_t *creator)
+static channel_t *do_channel_add(const char *name, time_t ts, server_t *creator)
 {
 	channel_t *c;
 	mychan_t *mc;
@@ -132,6 +132,17 @@ channel_t *channel_add(const char *name, time_t ts, server_t *creator)
 	return c;
 }
 
+channel_t *channel_add(const char *name, time_t ts, server_t *creator)
+{
+	unsigned long long start = prof_begin();
+	channel_t *c;
+
+	c = do_channel_add(name, ts, creator);
+	prof_end(PROF_CHANNEL_ADD, start);
+
+	return c;
+}
+
 /*
  * channel_delete(channel_t *c)
  *
@@ -170,6 +181,8 @@ void channel_delete(channel_t *c)
 		soft_assert(is_internal_client(cu->user) && !me.connected);
 		mowgli_node_delete(&cu->cnode, &c->members);
 		mowgli_node_delete(&cu->unode, &cu->user->channels);
+		if (is_internal_client(cu->user))
+			mowgli_node_delete(&cu->snode, &c->svcmembers);
 		mowgli_heap_free(chanuser_heap, cu);
 		cnt.chanuser--;
 	}
@@ -343,7 +356,7 @@ chanban_t *chanban_find(channel_t *chan, const char *mask, int type)
  * things. It worked fine for shrike, but the old code was restricted
  * to handling only @, @+ and + as prefixes.
  */
-chanuser_t *chanuser_add(channel_t *chan, const char *nick)
+static chanuser_t *do_chanuser_add(channel_t *chan, const char *nick, bool batched, bool *added)
 {
 	user_t *u;
 	chanuser_t *cu, *tcu;
@@ -389,6 +402,7 @@ chanuser_t *chanuser_add(channel_t *chan, const char *nick)
 		/* could be an OPME or other desyncher... */
 		tcu->modes |= flags;
 
+		*added = false;
 		return tcu;
 	}
 
@@ -401,21 +415,92 @@ chanuser_t *chanuser_add(channel_t *chan, const char *nick)
 	cu->modes = flags;
 
 	chan->nummembers++;
-	if (is_internal_client(u))
-		chan->numsvcmembers++;
 
 	mowgli_node_add(cu, &cu->cnode, &chan->members);
 	mowgli_node_add(cu, &cu->unode, &u->channels);
 
+	if (is_internal_client(u))
+	{
+		chan->numsvcmembers++;
+		mowgli_node_add(cu, &cu->snode, &chan->svcmembers);
+	}
+
 	cnt.chanuser++;
 
 	hdata.cu = cu;
+	hdata.batched = batched;
 	hook_call_channel_join(&hdata);
 
 	/* Return NULL if a hook function kicked the user out */
+	*added = true;
 	return hdata.cu;
 }
 
+chanuser_t *chanuser_add(channel_t *chan, const char *nick)
+{
+	unsigned long long start = prof_begin();
+	chanuser_t *cu;
+	bool added;
+
+	cu = do_chanuser_add(chan, nick, false, &added);
+	prof_end(PROF_CHANUSER_ADD, start);
+
+	return cu;
+}
+
+/*
+ * chanuser_add_batch(channel_t *chan, char **nicks, unsigned int count)
+ *
+ * Adds the users of a netjoin (SJOIN, FJOIN, BURST...) to a channel.
+ *
+ * Inputs:
+ *     - channel that the users should belong to
+ *     - nicks/UIDs with prefixes, as for chanuser_add()
+ *     - number of nicks
+ *
+ * Outputs:
+ *     - nothing
+ *
+ * Side Effects:
+ *     - the users are added to the channel as by chanuser_add(), with
+ *       hdata.batched set in their channel_join hooks
+ *     - channel_join_batch hook is called once for the users that were
+ *       not on the channel yet and have not been kicked, so access can be
+ *       checked for all of them at once
+ */
+void chanuser_add_batch(channel_t *chan, char **nicks, unsigned int count)
+{
+	hook_channel_join_batch_t bdata;
+	unsigned long long start;
+	unsigned int i;
+	chanuser_t *cu;
+	bool added;
+
+	return_if_fail(chan != NULL);
+
+	if (count == 0)
+		return;
+
+	bdata.c = chan;
+	bdata.cu = smalloc(count * sizeof(chanuser_t *));
+	bdata.count = 0;
+
+	for (i = 0; i < count; i++)
+	{
+		start = prof_begin();
+		cu = do_chanuser_add(chan, nicks[i], true, &added);
+		prof_end(PROF_CHANUSER_ADD, start);
+
+		if (cu != NULL && added)
+			bdata.cu[bdata.count++] = cu;
+	}
+
+	if (bdata.count != 0)
+		hook_call_channel_join_batch(&bdata);
+
+	free(bdata.cu);
+}
+
 /*
  * chanuser_delete(channel_t *chan, user_t *user)
  *
@@ -450,6 +535,7 @@ void chanuser_delete(channel_t *chan, user_t *user)
 
 	/* this is called BEFORE we remove the user */
 	hdata.cu = cu;
+	hdata.batched = false;
 	hook_call_channel_part(&hdata);
 
 	slog(LG_DEBUG, "chanuser_delete(): %s -> %s (%d)", cu->chan->name, cu->user->nick, cu->chan->nummembers - 1);
@@ -457,14 +543,17 @@ void chanuser_delete(channel_t *chan, user_t *user)
 	mowgli_node_delete(&cu->cnode, &chan->members);
 	mowgli_node_delete(&cu->unode, &user->channels);
 
+	if (is_internal_client(user))
+	{
+		chan->numsvcmembers--;
+		mowgli_node_delete(&cu->snode, &chan->svcmembers);
+	}
+
 	mowgli_heap_free(chanuser_heap, cu);
 
 	chan->nummembers--;
 	cnt.chanuser--;
 
-	if (is_internal_client(user))
-		chan->numsvcmembers--;
-
 	if (chan->nummembers == 0 && !(chan->modes & ircd->perm_mode))
 	{
 		/* empty channels die */
@@ -242,58 +242,80 @@ inet_pton6(const char *src, u_char *dst)
 }
 
 /*
- * match_ips()
+ * parse_ip()
  *
- * Input - cidr ip mask, address
- * Output - 0 = Matched 1 = Did not match
- * switched 0 and 1 to be consistent with atheme's match() -- jilles
+ * Input - address
+ * Output - 4 or 6 with the address in addr (IN6ADDRSZ bytes),
+ *          0 if it is not a valid address
  */
-int match_ips(const char *s1, const char *s2)
+int parse_ip(const char *s, unsigned char *addr)
 {
-	unsigned char ipaddr[IN6ADDRSZ], maskaddr[IN6ADDRSZ];
-	char ipmask[BUFSIZE];
 	char ip[HOSTLEN + 1];
-	char *len;
-	int cidrlen;
 
-	if (s1 == NULL || s2 == NULL)
-		return 1;
+	mowgli_strlcpy(ip, s, sizeof ip);
+
+	if (strchr(ip, ':'))
+		return inet_pton6(ip, addr) ? 6 : 0;
+
+	return inet_pton4(ip, addr) ? 4 : 0;
+}
+
+/*
+ * parse_cidr()
+ *
+ * Input - cidr ip mask
+ * Output - 4 or 6 with the address in addr (IN6ADDRSZ bytes) and the
+ *          prefix length in *cidrlen, 0 if match_ips() never matches it
+ */
+int parse_cidr(const char *s, unsigned char *addr, int *cidrlen)
+{
+	char ipmask[BUFSIZE];
+	char *len;
 
-	mowgli_strlcpy(ipmask, s1, sizeof ipmask);
-	mowgli_strlcpy(ip, s2, sizeof ip);
+	mowgli_strlcpy(ipmask, s, sizeof ipmask);
 
 	len = strrchr(ipmask, '/');
 	if (len == NULL)
-		return 1;
+		return 0;
 
 	*len++ = '\0';
 
-	cidrlen = atoi(len);
-	if (cidrlen == 0)
-		return 1;
+	*cidrlen = atoi(len);
+	if (*cidrlen <= 0)
+		return 0;
 
-	if (strchr(ip, ':') && strchr(ipmask, ':'))
-	{
-		if (cidrlen > 128)
-			return 1;
-		if (!inet_pton6(ip, ipaddr))
-			return 1;
-		if (!inet_pton6(ipmask, maskaddr))
-			return 1;
-		return !comp_with_mask(ipaddr, maskaddr, cidrlen);
-	}
-	else if (!strchr(ip, ':') && !strchr(ipmask, ':'))
+	if (strchr(ipmask, ':'))
 	{
-		if (cidrlen > 32)
-			return 1;
-		if (!inet_pton4(ip, ipaddr))
-			return 1;
-		if (!inet_pton4(ipmask, maskaddr))
-			return 1;
-		return !comp_with_mask(ipaddr, maskaddr, cidrlen);
+		if (*cidrlen > 128)
+			return 0;
+		return inet_pton6(ipmask, addr) ? 6 : 0;
 	}
-	else
+
+	if (*cidrlen > 32)
+		return 0;
+	return inet_pton4(ipmask, addr) ? 4 : 0;
+}
+
+/*
+ * match_ips()
+ *
+ * Input - cidr ip mask, address
+ * Output - 0 = Matched 1 = Did not match
+ * switched 0 and 1 to be consistent with atheme's match() -- jilles
+ */
+int match_ips(const char *s1, const char *s2)
+{
+	unsigned char ipaddr[IN6ADDRSZ], maskaddr[IN6ADDRSZ];
+	int cidrlen, family;
+
+	if (s1 == NULL || s2 == NULL)
+		return 1;
+
+	family = parse_cidr(s1, maskaddr, &cidrlen);
+	if (family == 0 || parse_ip(s2, ipaddr) != family)
 		return 1;
+
+	return !comp_with_mask(ipaddr, maskaddr, cidrlen);
 }
 
 /* match_cidr()
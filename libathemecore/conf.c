@@ -216,6 +216,9 @@ void init_newconf(void)
 	add_uint_conf_item("MAXUSERS", &conf_si_table, 0, &me.maxusers, 0, INT_MAX, 0);
 	add_uint_conf_item("EMAILLIMIT", &conf_si_table, 0, &me.emaillimit, 1, INT_MAX, 10);
 	add_duration_conf_item("EMAILTIME", &conf_si_table, 0, &me.emailtime, "s", 300);
+	add_uint_conf_item("MTA_WORKERS", &conf_si_table, 0, &me.mta_workers, 1, 64, 2);
+	add_uint_conf_item("MTA_RETRIES", &conf_si_table, 0, &me.mta_retries, 1, 100, 5);
+	add_duration_conf_item("MTA_TIMEOUT", &conf_si_table, 0, &me.mta_timeout, "s", 120);
 	add_conf_item("AUTH", &conf_si_table, c_si_auth);
 	add_uint_conf_item("MDLIMIT", &conf_si_table, 0, &me.mdlimit, 0, INT_MAX, 30);
 	add_conf_item("CASEMAPPING", &conf_si_table, c_si_casemapping);
@@ -243,6 +246,10 @@ void init_newconf(void)
 	add_duration_conf_item("KLINE_TIME", &conf_gi_table, 0, &config_options.kline_time, "d", 0);
 	add_duration_conf_item("CLONE_TIME", &conf_gi_table, 0, &config_options.clone_time, "m", 0);
 	add_duration_conf_item("COMMIT_INTERVAL", &conf_gi_table, 0, &config_options.commit_interval, "m", 300);
+	add_bool_conf_item("DB_SAVE_BLOCKING", &conf_gi_table, 0, &config_options.db_save_blocking, false);
+	add_bool_conf_item("DB_JOURNAL", &conf_gi_table, 0, &config_options.db_journal, false);
+	add_uint_conf_item("DB_LOAD_THREADS", &conf_gi_table, 0, &config_options.db_load_threads, 0, 64, 0);
+	add_uint_conf_item("AUTH_THREADS", &conf_gi_table, 0, &config_options.auth_threads, 0, 64, 0);
 	/* XXX: These options should probably move into operserv/clones eventually */
 	add_uint_conf_item("DEFAULT_CLONE_WARN", &conf_gi_table, 0, &config_options.default_clone_warn, 1, INT_MAX, 5);
 	add_uint_conf_item("DEFAULT_CLONE_ALLOWED", &conf_gi_table, 0, &config_options.default_clone_allowed, 1, INT_MAX, 5);
@@ -805,6 +812,9 @@ static void copy_me(struct me *src, struct me *dst)
 	dst->maxusers = src->maxusers;
 	dst->emaillimit = src->emaillimit;
 	dst->emailtime = src->emailtime;
+	dst->mta_workers = src->mta_workers;
+	dst->mta_retries = src->mta_retries;
+	dst->mta_timeout = src->mta_timeout;
 	dst->auth = src->auth;
 }
 
@@ -668,8 +668,8 @@ void connection_setselect_write(connection_t *cptr,
 void connection_stats(void (*stats_cb)(const char *, void *), void *privdata)
 {
 	mowgli_node_t *n;
-	char buf[160];
-	char buf2[20];
+	char buf[256];
+	char buf2[32];
 
 	MOWGLI_ITER_FOREACH(n, connection_list.head)
 	{
@@ -695,6 +695,17 @@ void connection_stats(void (*stats_cb)(const char *, void *), void *privdata)
 			else if (c->flags & CF_SEND_EOF)
 				mowgli_strlcat(buf, " send_eof", sizeof buf);
 		}
+		if (c->sendq_writes != 0)
+		{
+			snprintf(buf2, sizeof buf2, " sendq %zu", c->sendq_len);
+			mowgli_strlcat(buf, buf2, sizeof buf);
+			snprintf(buf2, sizeof buf2, " peak %zu", c->sendq_peak);
+			mowgli_strlcat(buf, buf2, sizeof buf);
+			snprintf(buf2, sizeof buf2, " sent %llu", c->sendq_bytes);
+			mowgli_strlcat(buf, buf2, sizeof buf);
+			snprintf(buf2, sizeof buf2, " writes %lu", c->sendq_writes);
+			mowgli_strlcat(buf, buf2, sizeof buf);
+		}
 		stats_cb(buf, privdata);
 	}
 }
@@ -112,6 +112,9 @@ void crypt_unregister(crypt_impl_t *impl)
 {
 	return_if_fail(impl != NULL);
 
+	/* nothing may still be hashing with this provider */
+	verify_password_drain();
+
 	mowgli_node_delete(&impl->node, &crypt_impl_list);
 
 	crypto_module_loaded = MOWGLI_LIST_LENGTH(&crypt_impl_list) > 0 ? true : false;
@@ -144,6 +147,45 @@ const crypt_impl_t *crypt_verify_password(const char *uinput, const char *pass)
 	return NULL;
 }
 
+/*
+ * crypt_verify_password_split is crypt_verify_password() for callers that
+ * want to do the expensive part elsewhere.  Providers without crypt_r and
+ * the plaintext fallback are checked here; up to *ndeferred providers that
+ * do have crypt_r are stored in deferred, in order, for the caller to try
+ * later.  Returns the matching provider, or NULL if none matched yet.
+ */
+const crypt_impl_t *crypt_verify_password_split(const char *uinput, const char *pass, const crypt_impl_t **deferred, size_t *ndeferred)
+{
+	mowgli_node_t *n;
+	const char *cstr;
+	size_t max = *ndeferred;
+
+	*ndeferred = 0;
+
+	if (!strcmp(fallback_crypt_impl.crypt(uinput, pass), pass))
+		return &fallback_crypt_impl;
+
+	MOWGLI_ITER_FOREACH(n, crypt_impl_list.head)
+	{
+		crypt_impl_t *ci;
+
+		ci = n->data;
+
+		if (ci->crypt_r != NULL && *ndeferred < max)
+		{
+			deferred[(*ndeferred)++] = ci;
+			continue;
+		}
+
+		cstr = ci->crypt(uinput, pass);
+
+		if (cstr != NULL && !strcmp(cstr, pass))
+			return ci;
+	}
+
+	return NULL;
+}
+
 /* vim:cinoptions=>s,e0,n0,f0,{0,}0,^0,=s,ps,t0,c3,+s,(2s,us,)20,*30,gs,hs
  * vim:ts=8
  * vim:sw=8
@@ -8,8 +8,19 @@
 #include "atheme.h"
 
 database_module_t *db_mod = NULL;
+database_journal_t *db_journal = NULL;
 mowgli_patricia_t *db_types = NULL;
 
+/* a row type handler, and what it cost during the last timed load */
+typedef struct {
+	database_handler_f fun;
+	char type[32];
+	unsigned int rows;
+	unsigned long usec;
+} database_type_t;
+
+static bool db_timing = false;
+
 database_handle_t *
 db_open(const char *filename, database_transaction_t txn)
 {
@@ -19,11 +30,11 @@ db_open(const char *filename, database_transaction_t txn)
 	return db_mod->db_open(filename, txn);
 }
 
-void
+bool
 db_close(database_handle_t *db)
 {
-	return_if_fail(db_mod != NULL);
-	return_if_fail(db_mod->db_close != NULL);
+	return_val_if_fail(db_mod != NULL, false);
+	return_val_if_fail(db_mod->db_close != NULL, false);
 
 	return db_mod->db_close(db);
 }
@@ -37,6 +48,48 @@ db_parse(database_handle_t *db)
 	return db_mod->db_parse(db);
 }
 
+/*
+ * Installs a database written with DB_WRITE_DEFERRED, possibly by another
+ * process, in place of the live one.
+ */
+bool
+db_commit(const char *filename)
+{
+	return_val_if_fail(db_mod != NULL, false);
+	return_val_if_fail(db_mod->db_commit != NULL, false);
+
+	return db_mod->db_commit(filename);
+}
+
+/*
+ * Pushes rows written so far on a long-lived handle (such as a journal
+ * opened with DB_APPEND) out to the operating system.
+ */
+bool
+db_flush(database_handle_t *db)
+{
+	return_val_if_fail(db_mod != NULL, false);
+	return_val_if_fail(db_mod->db_flush != NULL, false);
+
+	return db_mod->db_flush(db);
+}
+
+/*
+ * Cuts off a row left incomplete at the end of a file written with
+ * DB_APPEND, e.g. by a crash in the middle of writing it, so that the
+ * file can be read and appended to again.
+ */
+bool
+db_recover(const char *filename)
+{
+	return_val_if_fail(db_mod != NULL, false);
+
+	if (db_mod->db_recover == NULL)
+		return true;
+
+	return db_mod->db_recover(filename);
+}
+
 bool
 db_read_next_row(database_handle_t *db)
 {
@@ -241,11 +294,20 @@ db_commit_row(database_handle_t *db)
 void
 db_register_type_handler(const char *type, database_handler_f fun)
 {
+	database_type_t *dt;
+
 	return_if_fail(db_types != NULL);
 	return_if_fail(type != NULL);
 	return_if_fail(fun != NULL);
 
-	mowgli_patricia_add(db_types, type, fun);
+	if (mowgli_patricia_retrieve(db_types, type) != NULL)
+		return;
+
+	dt = scalloc(sizeof(database_type_t), 1);
+	dt->fun = fun;
+	mowgli_strlcpy(dt->type, type, sizeof dt->type);
+
+	mowgli_patricia_add(db_types, type, dt);
 }
 
 void
@@ -254,26 +316,117 @@ db_unregister_type_handler(const char *type)
 	return_if_fail(db_types != NULL);
 	return_if_fail(type != NULL);
 
-	mowgli_patricia_delete(db_types, type);
+	free(mowgli_patricia_delete(db_types, type));
 }
 
 void
 db_process(database_handle_t *db, const char *type)
 {
-	database_handler_f fun;
+	database_type_t *dt;
+#ifdef HAVE_GETTIMEOFDAY
+	struct timeval start, spent;
+#endif
 
 	return_if_fail(db_types != NULL);
 	return_if_fail(db != NULL);
 	return_if_fail(type != NULL);
 
-	fun = mowgli_patricia_retrieve(db_types, type);
+	dt = mowgli_patricia_retrieve(db_types, type);
+
+	if (!dt)
+	{
+		dt = mowgli_patricia_retrieve(db_types, "???");
+		return_if_fail(dt != NULL);
+	}
+
+	if (!db_timing)
+	{
+		dt->fun(db, type);
+		return;
+	}
+
+#ifdef HAVE_GETTIMEOFDAY
+	s_time(&start);
+	dt->fun(db, type);
+	e_time(start, &spent);
+
+	dt->usec += spent.tv_sec * 1000000UL + spent.tv_usec;
+#else
+	dt->fun(db, type);
+#endif
+	dt->rows++;
+}
+
+/*
+ * Load timing. Between db_timing_start() and db_timing_report(), the time
+ * spent in each row type's handler is accounted to that type; the report
+ * lists the types by total cost.
+ */
+void
+db_timing_start(void)
+{
+	database_type_t *dt;
+	mowgli_patricia_iteration_state_t state;
+
+	return_if_fail(db_types != NULL);
 
-	if (!fun)
+	MOWGLI_PATRICIA_FOREACH(dt, &state, db_types)
 	{
-		fun = mowgli_patricia_retrieve(db_types, "???");
+		dt->rows = 0;
+		dt->usec = 0;
 	}
 
-	fun(db, type);
+	db_timing = true;
+}
+
+static int
+db_timing_compare(const void *a, const void *b)
+{
+	const database_type_t *x = *(database_type_t * const *)a;
+	const database_type_t *y = *(database_type_t * const *)b;
+
+	if (x->usec != y->usec)
+		return x->usec < y->usec ? 1 : -1;
+
+	return x->rows < y->rows ? 1 : x->rows > y->rows ? -1 : 0;
+}
+
+void
+db_timing_report(const char *what)
+{
+	database_type_t *dt, **types;
+	mowgli_patricia_iteration_state_t state;
+	unsigned int i, n = 0, rows = 0;
+	unsigned long usec = 0;
+
+	return_if_fail(db_types != NULL);
+
+	db_timing = false;
+
+	types = smalloc((mowgli_patricia_size(db_types) + 1) * sizeof(database_type_t *));
+
+	MOWGLI_PATRICIA_FOREACH(dt, &state, db_types)
+	{
+		if (dt->rows == 0)
+			continue;
+
+		types[n++] = dt;
+		rows += dt->rows;
+		usec += dt->usec;
+	}
+
+	qsort(types, n, sizeof(database_type_t *), db_timing_compare);
+
+	slog(LG_INFO, "db-timing: %s: %u rows in %lu ms", what, rows, usec / 1000);
+
+	for (i = 0; i < n; i++)
+	{
+		dt = types[i];
+		slog(LG_INFO, "db-timing: %-8s %10u rows %8lu ms %8.2f us/row", dt->type, dt->rows,
+				dt->usec / 1000, (double)dt->usec / dt->rows);
+	}
+
+	free(types);
 }
 
 bool
@@ -289,6 +442,63 @@ db_write_format(database_handle_t *db, const char *fmt, ...)
 	return db_write_word(db, buf);
 }
 
+/*
+ * Journal notifications. The core calls these as persistent objects are
+ * created, changed or destroyed; the storage module decides what, if
+ * anything, to log. Objects are tagged with their type so that metadata
+ * changes can be attributed without knowing what the target is.
+ */
+void
+db_journal_update(db_journal_type_t type, void *obj)
+{
+	return_if_fail(obj != NULL);
+
+	if (type != DB_JOURNAL_KLINE)
+		object(obj)->journal_type = type;
+
+	if (db_journal != NULL)
+		db_journal->update(type, obj);
+}
+
+void
+db_journal_remove(db_journal_type_t type, void *obj)
+{
+	return_if_fail(obj != NULL);
+
+	/* teardown of the object's metadata is implied by its removal */
+	if (type != DB_JOURNAL_KLINE)
+		object(obj)->journal_type = DB_JOURNAL_NONE;
+
+	if (db_journal != NULL)
+		db_journal->remove(type, obj);
+}
+
+void
+db_journal_metadata(void *target, const char *name)
+{
+	db_journal_type_t type;
+
+	return_if_fail(target != NULL);
+	return_if_fail(name != NULL);
+
+	if (db_journal == NULL)
+		return;
+
+	type = object(target)->journal_type;
+	if (type == DB_JOURNAL_MYUSER || type == DB_JOURNAL_MYCHAN || type == DB_JOURNAL_CHANACS)
+		db_journal->metadata(type, target, name);
+}
+
+void
+db_journal_rename(myuser_t *mu, const char *newname)
+{
+	return_if_fail(mu != NULL);
+	return_if_fail(newname != NULL);
+
+	if (db_journal != NULL)
+		db_journal->rename(mu, newname);
+}
+
 void
 db_init(void)
 {
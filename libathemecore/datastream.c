@@ -24,7 +24,14 @@
 #include "atheme.h"
 #include "datastream.h"
 
-#define SENDQSIZE (4096 - 40)
+#ifdef HAVE_WRITEV
+# include <sys/uio.h>
+# define SENDQ_IOVMAX 64
+#endif
+
+#define SENDQ_MINCHUNK 4096
+#define SENDQ_MAXCHUNK 65536
+#define RECVQSIZE 16384
 
 #ifdef MOWGLI_OS_WIN
 # define EWOULDBLOCK	WSAEWOULDBLOCK
@@ -32,70 +39,139 @@
 # define ENOBUFS	WSAENOBUFS
 #endif
 
-/* sendq struct */
+/*
+ * The send queue is a list of chunks. Lines are appended to the last one;
+ * a new chunk is twice the size of the previous one, up to SENDQ_MAXCHUNK
+ * (or as big as one large write needs). sendq_flush() runs once per event
+ * loop iteration while the queue is nonempty and writes as many chunks as
+ * it can with one writev().
+ */
 struct sendq {
 	mowgli_node_t node;
-	int firstused; /* offset of first used byte */
-	int firstfree; /* 1 + offset of last used byte */
-	char buf[SENDQSIZE];
+	size_t size;
+	size_t firstused; /* offset of first used byte */
+	size_t firstfree; /* 1 + offset of last used byte */
+	char buf[];
 };
 
-void sendq_add(connection_t * cptr, char *buf, size_t len)
+static bool sendq_check(connection_t *cptr, size_t len)
 {
-	mowgli_node_t *n;
-	struct sendq *sq;
-	size_t l;
-	int pos = 0;
-
-	return_if_fail(cptr != NULL);
-
 	if (cptr->flags & (CF_DEAD | CF_SEND_EOF))
 	{
 		slog(LG_DEBUG, "sendq_add(): attempted to send to fd %d which is already dead", cptr->fd);
-		return;
+		return false;
 	}
 
-	if (len == 0)
-		return;
-
-	if (cptr->sendq_limit != 0 &&
-			MOWGLI_LIST_LENGTH(&cptr->sendq) * SENDQSIZE + len > cptr->sendq_limit)
+	if (cptr->sendq_limit != 0 && cptr->sendq_len + len > cptr->sendq_limit)
 	{
 		slog(LG_INFO, "sendq_add(): sendq limit exceeded on connection %s[%d]",
 				cptr->name, cptr->fd);
 		cptr->flags |= CF_DEAD;
-		return;
+		return false;
 	}
 
-	if (!sendq_nonempty(cptr))
-		connection_setselect_write(cptr, sendq_flush);
+	return true;
+}
+
+/*
+ * sendq_reserve(connection_t *cptr, size_t len)
+ *
+ * Makes room for len bytes at the end of the send queue, so that a caller
+ * can format data straight into it.
+ *
+ * Inputs:
+ *       - connection
+ *       - number of bytes wanted
+ *
+ * Outputs:
+ *       - where to write the data, or NULL if the connection is dead
+ *
+ * Side Effects:
+ *       - nothing is queued until sendq_commit() is called
+ */
+char *sendq_reserve(connection_t *cptr, size_t len)
+{
+	mowgli_node_t *n;
+	struct sendq *sq = NULL;
+	size_t size = SENDQ_MINCHUNK;
+
+	return_val_if_fail(cptr != NULL, NULL);
+
+	if (cptr->flags & (CF_DEAD | CF_SEND_EOF))
+		return NULL;
 
 	n = cptr->sendq.tail;
 	if (n != NULL)
 	{
 		sq = n->data;
-		l = SENDQSIZE - sq->firstfree;
-		if (l > len)
-			l = len;
-		memcpy(sq->buf + sq->firstfree, buf + pos, l);
-		sq->firstfree += l;
-		pos += l;
-		len -= l;
-	}
+		if (sq->firstused == sq->firstfree)
+			sq->firstused = sq->firstfree = 0;
+		if (sq->size - sq->firstfree >= len)
+			return sq->buf + sq->firstfree;
 
-	while (len > 0)
-	{
-		sq = smalloc(sizeof(struct sendq));
-		sq->firstused = sq->firstfree = 0;
-		mowgli_node_add(sq, &sq->node, &cptr->sendq);
-		l = SENDQSIZE - sq->firstfree;
-		if (l > len)
-			l = len;
-		memcpy(sq->buf + sq->firstfree, buf + pos, l);
-		sq->firstfree += l;
-		pos += l;
-		len -= l;
+		size = sq->size * 2;
+		if (size > SENDQ_MAXCHUNK)
+			size = SENDQ_MAXCHUNK;
 	}
+
+	if (size < len)
+		size = len;
+
+	sq = smalloc(sizeof(struct sendq) + size);
+	sq->size = size;
+	sq->firstused = sq->firstfree = 0;
+	mowgli_node_add(sq, &sq->node, &cptr->sendq);
+
+	return sq->buf;
+}
+
+/*
+ * sendq_commit(connection_t *cptr, size_t len)
+ *
+ * Queues len bytes written to the space returned by sendq_reserve().
+ *
+ * Inputs:
+ *       - connection
+ *       - number of bytes written, at most what was reserved
+ *
+ * Outputs:
+ *       - none
+ *
+ * Side Effects:
+ *       - marks the connection dead if the sendq limit is exceeded
+ */
+void sendq_commit(connection_t *cptr, size_t len)
+{
+	struct sendq *sq;
+
+	return_if_fail(cptr != NULL);
+	return_if_fail(cptr->sendq.tail != NULL);
+
+	if (len == 0 || !sendq_check(cptr, len))
+		return;
+
+	if (!sendq_nonempty(cptr))
+		connection_setselect_write(cptr, sendq_flush);
+
+	sq = cptr->sendq.tail->data;
+	sq->firstfree += len;
+	cptr->sendq_len += len;
+	if (cptr->sendq_len > cptr->sendq_peak)
+		cptr->sendq_peak = cptr->sendq_len;
+}
+
+void sendq_add(connection_t * cptr, char *buf, size_t len)
+{
+	char *p;
+
+	return_if_fail(cptr != NULL);
+
+	if (len == 0 || !sendq_check(cptr, len))
+		return;
+
+	p = sendq_reserve(cptr, len);
+	memcpy(p, buf, len);
+	sendq_commit(cptr, len);
 }
 
 void sendq_add_eof(connection_t * cptr)
@@ -112,26 +188,95 @@ void sendq_add_eof(connection_t * cptr)
 	cptr->flags |= CF_SEND_EOF;
 }
 
-void sendq_flush(connection_t * cptr)
+/* drop len bytes that have been written from the front of the queue */
+static void sendq_consume(connection_t *cptr, size_t len)
 {
-        mowgli_node_t *n, *tn;
-        struct sendq *sq;
-        int l;
+	mowgli_node_t *n, *tn;
+	struct sendq *sq;
+	size_t l;
 
-	return_if_fail(cptr != NULL);
+	cptr->sendq_len -= len;
+
+	MOWGLI_ITER_FOREACH_SAFE(n, tn, cptr->sendq.head)
+	{
+		sq = n->data;
+
+		l = sq->firstfree - sq->firstused;
+		if (l > len)
+			l = len;
+		sq->firstused += l;
+		len -= l;
+
+		if (sq->firstused != sq->firstfree)
+			break;
+
+		if (n->next != NULL)
+		{
+			mowgli_node_delete(&sq->node, &cptr->sendq);
+			free(sq);
+		}
+		else
+			/* keep one struct sendq */
+			sq->firstused = sq->firstfree = 0;
+	}
+}
+
+/* write as much of the queue as one system call takes */
+static ssize_t sendq_write(connection_t *cptr, size_t *wanted)
+{
+	mowgli_node_t *n;
+	struct sendq *sq = NULL;
+#ifdef HAVE_WRITEV
+	struct iovec iov[SENDQ_IOVMAX];
+	int iovcnt = 0;
+
+	*wanted = 0;
+	MOWGLI_ITER_FOREACH(n, cptr->sendq.head)
+	{
+		sq = n->data;
+
+		if (sq->firstused == sq->firstfree)
+			continue;
+
+		iov[iovcnt].iov_base = sq->buf + sq->firstused;
+		iov[iovcnt].iov_len = sq->firstfree - sq->firstused;
+		*wanted += iov[iovcnt].iov_len;
+
+		if (++iovcnt == SENDQ_IOVMAX)
+			break;
+	}
+
+	cptr->sendq_writes++;
+	return writev(cptr->fd, iov, iovcnt);
+#else
+	MOWGLI_ITER_FOREACH(n, cptr->sendq.head)
+	{
+		sq = n->data;
 
-        MOWGLI_ITER_FOREACH_SAFE(n, tn, cptr->sendq.head)
-        {
-                sq = (struct sendq *)n->data;
+		if (sq->firstused != sq->firstfree)
+			break;
+	}
+
+	*wanted = sq->firstfree - sq->firstused;
+	cptr->sendq_writes++;
+	return send(cptr->fd, sq->buf + sq->firstused, *wanted, 0);
+#endif
+}
+
+void sendq_flush(connection_t * cptr)
+{
+	ssize_t l;
+	size_t wanted;
 
-                if (sq->firstused == sq->firstfree)
-                        break;
+	return_if_fail(cptr != NULL);
 
-                if ((l = send(cptr->fd, sq->buf + sq->firstused, sq->firstfree - sq->firstused, 0)) == -1)
-                {
-                        int err = ioerrno();
+	while (cptr->sendq_len > 0)
+	{
+		if ((l = sendq_write(cptr, &wanted)) == -1)
+		{
+			int err = ioerrno();
 
-                        if (!mowgli_eventloop_ignore_errno(err))
+			if (!mowgli_eventloop_ignore_errno(err))
 			{
 				slog(LG_DEBUG, "sendq_flush(): write error %d (%s) on connection %s[%d]",
 						err, strerror(err),
@@ -139,24 +284,16 @@ void sendq_flush(connection_t * cptr)
 				cptr->flags |= CF_DEAD;
 			}
 
-                        return;
-                }
+			return;
+		}
 
-                sq->firstused += l;
-                if (sq->firstused == sq->firstfree)
-                {
-			if (MOWGLI_LIST_LENGTH(&cptr->sendq) > 1)
-			{
-                        	mowgli_node_delete(&sq->node, &cptr->sendq);
-                        	free(sq);
-			}
-			else
-				/* keep one struct sendq */
-				sq->firstused = sq->firstfree = 0;
-                }
-                else
-                        return;
-        }
+		cptr->sendq_bytes += l;
+		sendq_consume(cptr, l);
+
+		/* the socket buffer is full; wait until it is writable again */
+		if ((size_t) l < wanted)
+			return;
+	}
 	if (cptr->flags & CF_SEND_EOF)
 	{
 		/* shut down write end, kill entire connection
@@ -173,18 +310,11 @@ void sendq_flush(connection_t * cptr)
 
 bool sendq_nonempty(connection_t *cptr)
 {
-	mowgli_node_t *n;
-	struct sendq *sq;
-
 	if (cptr->flags & CF_SEND_DEAD)
 		return false;
 	if (cptr->flags & CF_SEND_EOF)
 		return true;
-	n = cptr->sendq.head;
-	if (n == NULL)
-		return false;
-	sq = n->data;
-	return sq->firstfree > sq->firstused;
+	return cptr->sendq_len > 0;
 }
 
 void sendq_set_limit(connection_t *cptr, size_t len)
@@ -192,24 +322,61 @@ void sendq_set_limit(connection_t *cptr, size_t len)
 	cptr->sendq_limit = len;
 }
 
+/*
+ * The receive queue is one contiguous buffer per connection.  Lines are
+ * framed where they were received and handed out as pointers into it;
+ * once the unread part reaches the end of the buffer it is moved back to
+ * the front, which is at most one partial line.
+ */
 int recvq_length(connection_t *cptr)
 {
-	int l = 0;
-	mowgli_node_t *n;
-	struct sendq *sq;
+	return cptr->recvq_tail - cptr->recvq_head;
+}
+
+static void recvq_consume(connection_t *cptr, size_t len)
+{
+	cptr->recvq_head += len;
+	if (cptr->recvq_head == cptr->recvq_tail)
+		cptr->recvq_head = cptr->recvq_tail = cptr->recvq_scan = 0;
+	else if (cptr->recvq_scan < cptr->recvq_head)
+		cptr->recvq_scan = cptr->recvq_head;
+}
 
-	MOWGLI_ITER_FOREACH(n, cptr->recvq.head)
+/* make room for at least one more read at the end of the buffer */
+static size_t recvq_reserve(connection_t *cptr)
+{
+	size_t l;
+
+	if (cptr->recvq == NULL)
 	{
-		sq = n->data;
-		l += sq->firstfree - sq->firstused;
+		cptr->recvq_size = RECVQSIZE;
+		cptr->recvq = smalloc(cptr->recvq_size);
 	}
-	return l;
+
+	if (cptr->recvq_size - cptr->recvq_tail >= BUFSIZE)
+		return cptr->recvq_size - cptr->recvq_tail;
+
+	if (cptr->recvq_head > 0)
+	{
+		l = cptr->recvq_tail - cptr->recvq_head;
+		memmove(cptr->recvq, cptr->recvq + cptr->recvq_head, l);
+		cptr->recvq_scan -= cptr->recvq_head;
+		cptr->recvq_tail = l;
+		cptr->recvq_head = 0;
+	}
+
+	/* the handler is not consuming what we have; keep reading anyway */
+	if (cptr->recvq_tail == cptr->recvq_size)
+	{
+		cptr->recvq_size *= 2;
+		cptr->recvq = srealloc(cptr->recvq, cptr->recvq_size);
+	}
+
+	return cptr->recvq_size - cptr->recvq_tail;
 }
 
 void recvq_put(connection_t *cptr)
 {
-	mowgli_node_t *n;
-	struct sendq *sq = NULL;
 	int l, ll;
 
 	return_if_fail(cptr != NULL);
@@ -228,24 +395,10 @@ void recvq_put(connection_t *cptr)
 		return;
 	}
 
-	n = cptr->recvq.tail;
-	if (n != NULL)
-	{
-		sq = n->data;
-		l = SENDQSIZE - sq->firstfree;
-		if (l == 0)
-			sq = NULL;
-	}
-	if (sq == NULL)
-	{
-		sq = smalloc(sizeof(struct sendq));
-		sq->firstused = sq->firstfree = 0;
-		mowgli_node_add(sq, &sq->node, &cptr->recvq);
-		l = SENDQSIZE;
-	}
+	l = recvq_reserve(cptr);
 	errno = 0;
 
-	l = recv(cptr->fd, sq->buf + sq->firstfree, l, 0);
+	l = recv(cptr->fd, cptr->recvq + cptr->recvq_tail, l, 0);
 	if (l == 0 || (l < 0 && !mowgli_eventloop_ignore_errno(ioerrno())))
 	{
 		if (l == 0)
@@ -256,7 +409,7 @@ void recvq_put(connection_t *cptr)
 		return;
 	}
 	else if (l > 0)
-		sq->firstfree += l;
+		cptr->recvq_tail += l;
 
 	if (cptr->recvq_handler)
 	{
@@ -273,99 +426,89 @@ void recvq_put(connection_t *cptr)
 
 int recvq_get(connection_t *cptr, char *buf, size_t len)
 {
-	mowgli_node_t *n, *tn;
-	struct sendq *sq;
 	size_t l;
-	char *p = buf;
 
 	return_val_if_fail(cptr != NULL, 0);
 
-	MOWGLI_ITER_FOREACH_SAFE(n, tn, cptr->recvq.head)
-	{
-		sq = (struct sendq *)n->data;
+	l = recvq_length(cptr);
+	if (l > len)
+		l = len;
+	if (l == 0)
+		return 0;
 
-		if (sq->firstused == sq->firstfree || len <= 0)
-			break;
+	memcpy(buf, cptr->recvq + cptr->recvq_head, l);
+	recvq_consume(cptr, l);
 
-		l = sq->firstfree - sq->firstused;
-		if (l > len)
-			l = len;
-		memcpy(p, sq->buf + sq->firstused, l);
-
-		p += l;
-		len -= l;
-		sq->firstused += l;
-		if (sq->firstused == sq->firstfree)
-		{
-			if (MOWGLI_LIST_LENGTH(&cptr->recvq) > 1)
-			{
-				mowgli_node_delete(&sq->node, &cptr->recvq);
-				free(sq);
-			}
-			else
-				/* keep one struct sendq */
-				sq->firstused = sq->firstfree = 0;
-		}
-		else
-			return p - buf;
-	}
-	return p - buf;
+	return l;
 }
 
-int recvq_getline(connection_t *cptr, char *buf, size_t len)
+/*
+ * recvq_getline_inplace(connection_t *cptr, size_t len, size_t *count)
+ *
+ * Takes the next line off the receive queue without copying it.
+ *
+ * Inputs:
+ *       - connection to read from
+ *       - maximum line length, including the newline
+ *       - where to store the number of bytes taken
+ *
+ * Outputs:
+ *       - pointer to the line, or NULL if no complete line (and fewer
+ *         than len bytes) has been received yet
+ *
+ * Side Effects:
+ *       - the line is removed from the queue; it stays valid and may be
+ *         modified until the handler returns to recvq_put()
+ *       - CF_NONEWLINE is set if the line was cut off at len bytes
+ */
+char *recvq_getline_inplace(connection_t *cptr, size_t len, size_t *count)
 {
-	mowgli_node_t *n, *tn;
-	struct sendq *sq, *sq2 = NULL;
-	size_t l = 0;
-	char *p = buf;
-	char *newline = NULL;
+	char *line, *newline;
+	size_t l;
 
-	return_val_if_fail(cptr != NULL, 0);
+	return_val_if_fail(cptr != NULL, NULL);
+
+	l = recvq_length(cptr);
+	if (l > len)
+		l = len;
+	line = cptr->recvq + cptr->recvq_head;
+
+	newline = NULL;
+	if (cptr->recvq_scan < cptr->recvq_head + l)
+		newline = memchr(cptr->recvq + cptr->recvq_scan, '\n', cptr->recvq_head + l - cptr->recvq_scan);
 
-	MOWGLI_ITER_FOREACH(n, cptr->recvq.head)
+	if (newline == NULL)
 	{
-		sq2 = n->data;
-		l += sq2->firstfree - sq2->firstused;
-		newline = memchr(sq2->buf + sq2->firstused, '\n', sq2->firstfree - sq2->firstused);
-		if (newline != NULL || l >= len)
-			break;
+		if (l < len)
+		{
+			cptr->recvq_scan = cptr->recvq_head + l;
+			return NULL;
+		}
+		cptr->flags |= CF_NONEWLINE;
 	}
-	if (newline == NULL && l < len)
-		return 0;
-
-	cptr->flags |= CF_NONEWLINE;
-	MOWGLI_ITER_FOREACH_SAFE(n, tn, cptr->recvq.head)
+	else
 	{
-		sq = (struct sendq *)n->data;
+		cptr->flags &= ~CF_NONEWLINE;
+		l = newline - line + 1;
+	}
 
-		if (sq->firstused == sq->firstfree || len <= 0)
-			break;
+	recvq_consume(cptr, l);
+	*count = l;
 
-		l = sq->firstfree - sq->firstused;
-		if (l > len)
-			l = len;
-		if (sq == sq2 && l >= (size_t) (newline - sq->buf - sq->firstused + 1))
-			cptr->flags &= ~CF_NONEWLINE, l = newline - sq->buf - sq->firstused + 1;
-		memcpy(p, sq->buf + sq->firstused, l);
+	return line;
+}
 
-		p += l;
-		len -= l;
-		sq->firstused += l;
-		if (sq->firstused == sq->firstfree)
-		{
-			if (MOWGLI_LIST_LENGTH(&cptr->recvq) > 1)
-			{
-				mowgli_node_delete(&sq->node, &cptr->recvq);
-				free(sq);
-			}
-			else
-				/* keep one struct sendq */
-				sq->firstused = sq->firstfree = 0;
-		}
-		else
-			return p - buf;
-	}
-	return p - buf;
+int recvq_getline(connection_t *cptr, char *buf, size_t len)
+{
+	char *line;
+	size_t count;
+
+	line = recvq_getline_inplace(cptr, len, &count);
+	if (line == NULL)
+		return 0;
+
+	memcpy(buf, line, count);
+	return count;
 }
 
 void sendqrecvq_free(connection_t *cptr)
@@ -373,13 +516,9 @@ void sendqrecvq_free(connection_t *cptr)
 	mowgli_node_t *nptr, *nptr2;
 	struct sendq *sq;
 
-	MOWGLI_ITER_FOREACH_SAFE(nptr, nptr2, cptr->recvq.head)
-	{
-		sq = nptr->data;
-
-		mowgli_node_delete(&sq->node, &cptr->recvq);
-		free(sq);
-	}
+	free(cptr->recvq);
+	cptr->recvq = NULL;
+	cptr->recvq_size = cptr->recvq_head = cptr->recvq_tail = cptr->recvq_scan = 0;
 
 	MOWGLI_ITER_FOREACH_SAFE(nptr, nptr2, cptr->sendq.head)
 	{
@@ -388,6 +527,7 @@ void sendqrecvq_free(connection_t *cptr)
 		mowgli_node_delete(&sq->node, &cptr->sendq);
 		free(sq);
 	}
+	cptr->sendq_len = 0;
 }
 
 /* vim:cinoptions=>s,e0,n0,f0,{0,}0,^0,=s,ps,t0,c3,+s,(2s,us,)20,*30,gs,hs
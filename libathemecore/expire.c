@@ -0,0 +1,544 @@
+/*
+ * Copyright (c) 2014- Shaltúre project (http://github.com/shalture)
+ * Rights to this code are as documented in doc/LICENSE.
+ *
+ * Account, nick and channel expiry.
+ *
+ * Accounts, nicks and channels each sit in a min-heap on the earliest
+ * time they may need attention: when they would expire, or for channels
+ * when their last used time is due to be refreshed. The heaps are lazy:
+ * lastlogin, lastseen and used are set all over the place without telling
+ * us, but they only move forward, so a heap entry is never later than the
+ * real time. When an entry comes up, the object is checked as it is now
+ * and, if it stays, put back at its next due time, but no earlier than
+ * the next run. The exception is a channel that was idle when it was last
+ * looked at: it waits for its expiry time, so whoever starts using it
+ * again calls expire_touch() to have its last used time kept fresh.
+ *
+ * expire_check() runs hourly and starts a job that works through the
+ * entries that are due, a few at a time, so expiry never stalls services.
+ *
+ */
+
+#include "atheme.h"
+#include "uplink.h" /* XXX, for sendq_flush(curr_uplink->conn); */
+#include "datastream.h"
+
+/* objects that are kept although they are due are looked at again after this */
+#define EXPIRE_RECHECK		3600
+
+/* channels in use get their last used time refreshed about once a day */
+#define EXPIRE_CHANNEL_USED	(86400 - 3660)
+
+#define EXPIRE_NEVER		((time_t)LONG_MAX)
+
+typedef struct {
+	time_t due;
+	void *obj;
+} expire_entry_t;
+
+typedef struct {
+	expire_entry_t *v;	/* v[1] is the top */
+	unsigned int count;
+	unsigned int size;
+} expire_queue_t;
+
+static expire_queue_t expire_queues[EXPIRE_KINDS];
+
+static job_t *expire_job = NULL;
+static time_t expire_started;
+
+/* the expiry times due times were last computed with; 0 is never */
+static unsigned int expire_nick_expiry, expire_chan_expiry;
+
+static unsigned int *expire_pos(expire_kind_t kind, void *obj)
+{
+	switch (kind)
+	{
+	  case EXPIRE_MYUSER:
+		  return &((myuser_t *)obj)->expirepos;
+	  case EXPIRE_MYNICK:
+		  return &((mynick_t *)obj)->expirepos;
+	  case EXPIRE_MYCHAN:
+	  default:
+		  return &((mychan_t *)obj)->expirepos;
+	}
+}
+
+static void expire_queue_set(expire_kind_t kind, unsigned int pos, expire_entry_t e)
+{
+	expire_queues[kind].v[pos] = e;
+	*expire_pos(kind, e.obj) = pos;
+}
+
+static void expire_queue_up(expire_kind_t kind, unsigned int pos)
+{
+	expire_queue_t *q = &expire_queues[kind];
+	expire_entry_t e = q->v[pos];
+
+	while (pos > 1 && q->v[pos / 2].due > e.due)
+	{
+		expire_queue_set(kind, pos, q->v[pos / 2]);
+		pos /= 2;
+	}
+
+	expire_queue_set(kind, pos, e);
+}
+
+static void expire_queue_down(expire_kind_t kind, unsigned int pos)
+{
+	expire_queue_t *q = &expire_queues[kind];
+	expire_entry_t e = q->v[pos];
+	unsigned int child;
+
+	while ((child = pos * 2) <= q->count)
+	{
+		if (child < q->count && q->v[child + 1].due < q->v[child].due)
+			child++;
+
+		if (q->v[child].due >= e.due)
+			break;
+
+		expire_queue_set(kind, pos, q->v[child]);
+		pos = child;
+	}
+
+	expire_queue_set(kind, pos, e);
+}
+
+static void expire_queue_add(expire_kind_t kind, void *obj, time_t due)
+{
+	expire_queue_t *q = &expire_queues[kind];
+
+	if (q->count + 1 >= q->size)
+	{
+		q->size = q->size != 0 ? q->size * 2 : 64;
+		q->v = srealloc(q->v, q->size * sizeof(expire_entry_t));
+	}
+
+	q->count++;
+	q->v[q->count].due = due;
+	q->v[q->count].obj = obj;
+	expire_queue_up(kind, q->count);
+}
+
+/*
+ * expire_schedule(expire_kind_t kind, void *obj)
+ *
+ * Puts a new account, nick or channel in the expiry queue. It is looked
+ * at by the first run after this one.
+ *
+ * Inputs:
+ *      - which queue (EXPIRE_MYUSER, EXPIRE_MYNICK or EXPIRE_MYCHAN)
+ *      - the object
+ *
+ * Outputs:
+ *      - none
+ *
+ * Side Effects:
+ *      - the object is added to the queue
+ */
+void expire_schedule(expire_kind_t kind, void *obj)
+{
+	return_if_fail(kind < EXPIRE_KINDS);
+	return_if_fail(obj != NULL);
+	return_if_fail(*expire_pos(kind, obj) == 0);
+
+	expire_queue_add(kind, obj, CURRTIME);
+}
+
+/* takes an object out of its expiry queue; called when it is destroyed */
+void expire_unschedule(expire_kind_t kind, void *obj)
+{
+	expire_queue_t *q = &expire_queues[kind];
+	unsigned int pos, *posp;
+	expire_entry_t last;
+
+	return_if_fail(kind < EXPIRE_KINDS);
+	return_if_fail(obj != NULL);
+
+	posp = expire_pos(kind, obj);
+	if ((pos = *posp) == 0)
+		return;
+
+	*posp = 0;
+	last = q->v[q->count--];
+
+	if (pos > q->count)
+		return;
+
+	expire_queue_set(kind, pos, last);
+	expire_queue_up(kind, pos);
+	expire_queue_down(kind, *expire_pos(kind, last.obj));
+}
+
+/* the earliest time an object may need looking at, going by what it is now */
+static time_t expire_due(expire_kind_t kind, void *obj)
+{
+	myuser_t *mu;
+	mynick_t *mn;
+	mychan_t *mc;
+	time_t due = EXPIRE_NEVER;
+
+	switch (kind)
+	{
+	  case EXPIRE_MYUSER:
+		  mu = obj;
+		  if (nicksvs.expiry > 0)
+			  due = mu->lastlogin + nicksvs.expiry;
+		  if (mu->flags & MU_WAITAUTH && mu->registered + 86400 < due)
+			  due = mu->registered + 86400;
+		  break;
+	  case EXPIRE_MYNICK:
+		  mn = obj;
+		  if (nicksvs.expiry > 0)
+			  due = mn->lastseen + nicksvs.expiry;
+		  break;
+	  case EXPIRE_MYCHAN:
+	  default:
+		  mc = obj;
+		  if (chansvs.expiry > 0)
+			  due = mc->used + chansvs.expiry;
+		  /* a channel nobody is using has its last used time
+		   * updated when someone with access joins, which brings
+		   * it forward with expire_touch(), so until then only
+		   * expiry matters */
+		  if (mc->used + EXPIRE_CHANNEL_USED > CURRTIME && mc->used + EXPIRE_CHANNEL_USED < due)
+			  due = mc->used + EXPIRE_CHANNEL_USED;
+		  break;
+	}
+
+	return due;
+}
+
+/*
+ * expire_touch(expire_kind_t kind, void *obj)
+ *
+ * Moves an object up in its expiry queue if what it is now makes it due
+ * sooner; call it after setting a channel's last used time because
+ * someone with access is on it.
+ *
+ * Inputs:
+ *      - which queue (EXPIRE_MYUSER, EXPIRE_MYNICK or EXPIRE_MYCHAN)
+ *      - the object
+ *
+ * Outputs:
+ *      - none
+ *
+ * Side Effects:
+ *      - the object's due time may be brought forward
+ */
+void expire_touch(expire_kind_t kind, void *obj)
+{
+	expire_queue_t *q = &expire_queues[kind];
+	unsigned int pos;
+	time_t due;
+
+	return_if_fail(kind < EXPIRE_KINDS);
+	return_if_fail(obj != NULL);
+
+	/* not queued, or being looked at right now */
+	if ((pos = *expire_pos(kind, obj)) == 0)
+		return;
+
+	due = expire_due(kind, obj);
+	if (due >= q->v[pos].due)
+		return;
+
+	q->v[pos].due = due;
+	expire_queue_up(kind, pos);
+}
+
+/* puts an object that stays back in its queue, no earlier than the next run */
+static void expire_reschedule(expire_kind_t kind, void *obj)
+{
+	time_t due = expire_due(kind, obj);
+
+	if (due < expire_started + EXPIRE_RECHECK)
+		due = expire_started + EXPIRE_RECHECK;
+
+	expire_queue_add(kind, obj, due);
+}
+
+/* makes everything in a queue due, after the expiry time was shortened */
+static void expire_queue_reset(expire_kind_t kind)
+{
+	expire_queue_t *q = &expire_queues[kind];
+	unsigned int i;
+
+	for (i = 1; i <= q->count; i++)
+		q->v[i].due = 0;
+}
+
+/* how many entries in the subtree at pos are due by t */
+static unsigned int expire_queue_count_due(expire_kind_t kind, unsigned int pos, time_t t)
+{
+	expire_queue_t *q = &expire_queues[kind];
+
+	if (pos > q->count || q->v[pos].due > t)
+		return 0;
+
+	return 1 + expire_queue_count_due(kind, pos * 2, t) + expire_queue_count_due(kind, pos * 2 + 1, t);
+}
+
+/* false if the account has been dropped */
+static bool expire_myuser(myuser_t *mu)
+{
+	hook_expiry_req_t req;
+
+	req.data.mu = mu;
+	req.do_expire = 1;
+	hook_call_user_check_expire(&req);
+
+	/* If they're logged in, update lastlogin time.
+	 * To decrease db traffic, may want to only do
+	 * this if the account would otherwise be
+	 * deleted. -- jilles
+	 * Accounts only come up here once they are due, so it is.
+	 */
+	if (MOWGLI_LIST_LENGTH(&mu->logins) > 0)
+	{
+		mu->lastlogin = CURRTIME;
+		return true;
+	}
+
+	if (!req.do_expire)
+		return true;
+
+	if (MU_HOLD & mu->flags)
+		return true;
+
+	if ((nicksvs.expiry > 0 && mu->lastlogin < CURRTIME && (unsigned int)(CURRTIME - mu->lastlogin) >= nicksvs.expiry) ||
+			(mu->flags & MU_WAITAUTH && CURRTIME - mu->registered >= 86400))
+	{
+		/* Don't expire accounts with privs on them in atheme.conf,
+		 * otherwise someone can reregister
+		 * them and take the privs -- jilles */
+		if (is_conf_soper(mu))
+			return true;
+
+		slog(LG_REGISTER, _("EXPIRE: \2%s\2 from \2%s\2 "), entity(mu)->name, mu->email);
+		slog(LG_VERBOSE, "expire_check(): expiring account %s (unused %ds, email %s, nicks %zu, chanacs %zu)",
+				entity(mu)->name, (int)(CURRTIME - mu->lastlogin),
+				mu->email, MOWGLI_LIST_LENGTH(&mu->nicks),
+				MOWGLI_LIST_LENGTH(&entity(mu)->chanacs));
+		object_dispose(mu);
+		return false;
+	}
+
+	return true;
+}
+
+/* false if the nick has been dropped */
+static bool expire_mynick(mynick_t *mn)
+{
+	hook_expiry_req_t req;
+	user_t *u;
+
+	req.do_expire = 1;
+	req.data.mn = mn;
+
+	hook_call_nick_check_expire(&req);
+
+	if (!req.do_expire)
+		return true;
+
+	if (nicksvs.expiry > 0 && mn->lastseen < CURRTIME &&
+			(unsigned int)(CURRTIME - mn->lastseen) >= nicksvs.expiry)
+	{
+		if (MU_HOLD & mn->owner->flags)
+			return true;
+
+		/* do not drop main nick like this */
+		if (!irccasecmp(mn->nick, entity(mn->owner)->name))
+			return true;
+
+		u = user_find_named(mn->nick);
+		if (u != NULL && u->myuser == mn->owner)
+		{
+			/* still logged in, bleh */
+			mn->lastseen = CURRTIME;
+			mn->owner->lastlogin = CURRTIME;
+			return true;
+		}
+
+		slog(LG_REGISTER, _("EXPIRE: \2%s\2 from \2%s\2"), mn->nick, entity(mn->owner)->name);
+		slog(LG_VERBOSE, "expire_check(): expiring nick %s (unused %lds, account %s)",
+				mn->nick, (long)(CURRTIME - mn->lastseen),
+				entity(mn->owner)->name);
+		object_unref(mn);
+		return false;
+	}
+
+	return true;
+}
+
+/* false if the channel has been dropped */
+static bool expire_mychan(mychan_t *mc)
+{
+	hook_expiry_req_t req;
+
+	req.do_expire = 1;
+	req.data.mc = mc;
+
+	hook_call_channel_check_expire(&req);
+
+	if (!req.do_expire)
+		return true;
+
+	if ((CURRTIME - mc->used) >= EXPIRE_CHANNEL_USED)
+	{
+		/* keep last used time accurate to
+		 * within a day, making sure an active
+		 * channel will never get "Last used"
+		 * in /cs info -- jilles */
+		if (mychan_isused(mc))
+		{
+			mc->used = CURRTIME;
+			slog(LG_DEBUG, "expire_check(): updating last used time on %s because it appears to be still in use", mc->name);
+			return true;
+		}
+	}
+
+	if (chansvs.expiry > 0 && mc->used < CURRTIME &&
+			(unsigned int)(CURRTIME - mc->used) >= chansvs.expiry)
+	{
+		if (MC_HOLD & mc->flags)
+			return true;
+
+		slog(LG_REGISTER, _("EXPIRE: \2%s\2 from \2%s\2"), mc->name, mychan_founder_names(mc));
+		slog(LG_VERBOSE, "expire_check(): expiring channel %s (unused %lds, founder %s, chanacs %zu)",
+				mc->name, (long)(CURRTIME - mc->used),
+				mychan_founder_names(mc),
+				MOWGLI_LIST_LENGTH(&mc->chanacs));
+
+		hook_call_channel_drop(mc);
+		if (mc->chan != NULL && !(mc->chan->flags & CHAN_LOG))
+			part(mc->name, chansvs.nick);
+
+		object_unref(mc);
+		return false;
+	}
+
+	return true;
+}
+
+/* looks at the object that has been due the longest, if any */
+static bool expire_step(job_t *job)
+{
+	expire_kind_t kind, best = EXPIRE_KINDS;
+	expire_queue_t *q;
+	void *obj;
+	bool kept;
+
+	for (kind = 0; kind < EXPIRE_KINDS; kind++)
+	{
+		q = &expire_queues[kind];
+
+		if (q->count == 0 || q->v[1].due > expire_started)
+			continue;
+
+		if (best == EXPIRE_KINDS || q->v[1].due < expire_queues[best].v[1].due)
+			best = kind;
+	}
+
+	if (best == EXPIRE_KINDS)
+		return false;
+
+	/* take it out first: an expired object may linger if referenced */
+	obj = expire_queues[best].v[1].obj;
+	expire_unschedule(best, obj);
+
+	switch (best)
+	{
+	  case EXPIRE_MYUSER:
+		  kept = expire_myuser(obj);
+		  break;
+	  case EXPIRE_MYNICK:
+		  kept = expire_mynick(obj);
+		  break;
+	  case EXPIRE_MYCHAN:
+	  default:
+		  kept = expire_mychan(obj);
+		  break;
+	}
+
+	if (kept)
+		expire_reschedule(best, obj);
+
+	job->progress++;
+	return true;
+}
+
+static void expire_done(job_t *job)
+{
+	slog(LG_DEBUG, "expire_done(): looked at %u of %u due accounts, nicks and channels in %lds%s",
+			job->progress, job->total, (long)(CURRTIME - job->started),
+			job->cancelled ? " (cancelled)" : "");
+
+	expire_job = NULL;
+}
+
+/* whether going from expiry time 'before' to 'now' makes things expire sooner */
+static bool expire_shortened(unsigned int now, unsigned int before)
+{
+	return now != 0 && (before == 0 || now < before);
+}
+
+/*
+ * expire_check(void *arg)
+ *
+ * Starts looking for accounts, nicks and channels to expire, unless the
+ * last run is still going.
+ *
+ * Inputs:
+ *      - none
+ *
+ * Outputs:
+ *      - none
+ *
+ * Side Effects:
+ *      - a job is started which expires whatever is due
+ */
+void expire_check(void *arg)
+{
+	unsigned int total;
+	expire_kind_t kind;
+
+	if (expire_job != NULL)
+		return;
+
+	/* due times computed with a longer expiry may be too late now */
+	if (expire_shortened(nicksvs.expiry, expire_nick_expiry))
+	{
+		expire_queue_reset(EXPIRE_MYUSER);
+		expire_queue_reset(EXPIRE_MYNICK);
+	}
+	if (expire_shortened(chansvs.expiry, expire_chan_expiry))
+		expire_queue_reset(EXPIRE_MYCHAN);
+
+	expire_nick_expiry = nicksvs.expiry;
+	expire_chan_expiry = chansvs.expiry;
+
+	expire_started = CURRTIME;
+
+	total = 0;
+	for (kind = 0; kind < EXPIRE_KINDS; kind++)
+		total += expire_queue_count_due(kind, 1, expire_started);
+
+	if (total == 0)
+		return;
+
+	/* Let them know about this and the likely subsequent db_save()
+	 * right away -- jilles */
+	if (curr_uplink != NULL && curr_uplink->conn != NULL)
+		sendq_flush(curr_uplink->conn);
+
+	expire_job = job_start("EXPIRE", NULL, total, expire_step, expire_done, NULL);
+}
+
+/* vim:cinoptions=>s,e0,n0,f0,{0,}0,^0,=s,ps,t0,c3,+s,(2s,us,)20,*30,gs,hs
+ * vim:ts=8
+ * vim:sw=8
+ * vim:noexpandtab
+ */
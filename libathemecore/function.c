@@ -600,18 +600,6 @@ bool has_ctrl_chars(const char *text)
 	return false;
 }
 
-#ifndef MOWGLI_OS_WIN
-static void sendemail_waited(pid_t pid, int status, void *data)
-{
-	char *email;
-
-	email = data;
-	if (!WIFEXITED(status) || WEXITSTATUS(status) != 0)
-		slog(LG_INFO, "sendemail_waited(): email for %s failed", email);
-	free(email);
-}
-#endif
-
 /* send the specified type of email.
  *
  * u is whoever caused this to be called, the corresponding service
@@ -628,9 +616,7 @@ int sendemail(user_t *u, myuser_t *mu, const char *type, const char *email, cons
 	FILE *in, *out;
 	time_t t;
 	struct tm tm;
-	int pipfds[2];
-	pid_t pid;
-	int rc;
+	mailqueue_item_t *mi;
 	static time_t period_start = 0, lastwallops = 0;
 	static unsigned int emailcount = 0;
 	service_t *svs;
@@ -706,27 +692,12 @@ int sendemail(user_t *u, myuser_t *mu, const char *type, const char *email, cons
 	replace(to, sizeof to, "\\", "\\\\");
 	snprintf(sourceinfo, sizeof sourceinfo, "%s[%s@%s]", u->nick, u->user, u->vhost);
 
-	/* now set up the email */
-	if (pipe(pipfds) < 0)
+	/* now write the email to the spool; mailqueue.c hands it to the mta */
+	if ((mi = mailqueue_begin(email, &out)) == NULL)
 	{
 		fclose(in);
 		return 0;
 	}
-	switch (pid = fork())
-	{
-		case -1:
-			fclose(in);
-			return 0;
-		case 0:
-			connection_close_all_fds();
-			close(pipfds[1]);
-			dup2(pipfds[0], 0);
-			execl(me.mta, me.mta, "-t", "-f", me.register_email, NULL);
-			_exit(255);
-	}
-	close(pipfds[0]);
-	childproc_add(pid, "email", sendemail_waited, sstrdup(email));
-	out = fdopen(pipfds[1], "w");
 
 	while (fgets(buf, BUFSIZE, in))
 	{
@@ -755,14 +726,13 @@ int sendemail(user_t *u, myuser_t *mu, const char *type, const char *email, cons
 
 	fclose(in);
 
-	rc = 1;
-	if (ferror(out))
-		rc = 0;
-	if (fclose(out) < 0)
-		rc = 0;
-	if (rc == 0)
-		slog(LG_ERROR, "sendemail(): mta failure");
-	return rc;
+	if (!mailqueue_commit(mi))
+	{
+		slog(LG_ERROR, "sendemail(): could not spool email for %s", email);
+		return 0;
+	}
+
+	return 1;
 #else
 # warning implement me :(
 	return 0;
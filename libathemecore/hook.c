@@ -26,6 +26,7 @@
 #include "internal.h"
 
 mowgli_patricia_t *hooks;
+hook_t *hook_table[HOOK_ID_COUNT];
 static mowgli_heap_t *hook_heap, *hook_privfn_heap;
 
 typedef struct {
@@ -56,6 +57,11 @@ void hooks_init(void)
 		slog(LG_INFO, "hooks_init(): block allocator failed.");
 		exit(EXIT_SUCCESS);
 	}
+
+	/* these stay around for good, see hook_del_event() */
+#define HOOKTYPES_RESOLVE(name) hook_table[HOOK_ID_##name] = hook_add_event(#name);
+	HOOKTYPES_FOREACH(HOOKTYPES_RESOLVE)
+#undef HOOKTYPES_RESOLVE
 }
 
 static inline hook_t *hook_find(const char *name)
@@ -63,6 +69,17 @@ static inline hook_t *hook_find(const char *name)
 	return mowgli_patricia_retrieve(hooks, name);
 }
 
+static hook_id_t hook_find_id(hook_t *h)
+{
+	unsigned int i;
+
+	for (i = 0; i < HOOK_ID_COUNT; i++)
+		if (hook_table[i] == h)
+			break;
+
+	return i;
+}
+
 hook_t *hook_add_event(const char *name)
 {
 	hook_t *nh;
@@ -95,6 +112,10 @@ void hook_del_event(const char *name)
 	MOWGLI_ITER_FOREACH_SAFE(n, tn, h->hooks.head)
 		hook_destroy(h, n->data);
 
+	/* hook_call_*() use hook_table directly, so keep those hooks */
+	if (hook_find_id(h) != HOOK_ID_COUNT)
+		return;
+
 	mowgli_patricia_delete(hooks, h->name);
 	strshare_unref(h->name);
 
@@ -169,18 +190,48 @@ void hook_add_hook_first(const char *event, hookfn_t handler)
 
 void hook_call_event(const char *event, void *dptr)
 {
-	hook_run_ctx_t ctx;
-	mowgli_node_t *n, *tn;
+	hook_t *h;
 
 	return_if_fail(event != NULL);
 
-	ctx.hook = hook_find(event);
-	if (ctx.hook == NULL)
+	h = hook_find(event);
+	if (h == NULL)
+		return;
+
+	h->calls++;
+
+	if (MOWGLI_LIST_LENGTH(&h->hooks) == 0)
 		return;
 
+	hook_run_event(h, dptr);
+}
+
+/* runs the handlers of a hook; call counting is left to the callers */
+void hook_run_event(hook_t *hook, void *dptr)
+{
+	hook_run_ctx_t ctx;
+	mowgli_node_t *n, *tn;
+	bool outermost;
+	unsigned long long prof_start = 0;
+#ifdef HAVE_GETTIMEOFDAY
+	struct timeval start, spent;
+#endif
+
+	return_if_fail(hook != NULL);
+
+	/* hooks run from hooks are already counted by the outer one */
+	outermost = MOWGLI_LIST_LENGTH(&hook_run_stack) == 0;
+	if (outermost)
+		prof_start = prof_begin();
+
+	ctx.hook = hook;
 	ctx.dptr = dptr;
 	ctx.flags = HF_RUN;
 
+#ifdef HAVE_GETTIMEOFDAY
+	s_time(&start);
+#endif
+
 	mowgli_node_add_head(&ctx, &ctx.node, &hook_run_stack);
 
 	MOWGLI_ITER_FOREACH_SAFE(n, tn, ctx.hook->hooks.head)
@@ -194,6 +245,26 @@ void hook_call_event(const char *event, void *dptr)
 
 out:
 	mowgli_node_delete(&ctx.node, &hook_run_stack);
+
+#ifdef HAVE_GETTIMEOFDAY
+	e_time(start, &spent);
+	hook->usec += spent.tv_sec * 1000000ULL + spent.tv_usec;
+#endif
+
+	if (outermost)
+		prof_end(PROF_HOOKS, prof_start);
+}
+
+void hook_stats(void (*cb)(hook_t *hook, void *privdata), void *privdata)
+{
+	mowgli_patricia_iteration_state_t state;
+	hook_t *h;
+
+	MOWGLI_PATRICIA_FOREACH(h, &state, hooks)
+	{
+		if (h->calls != 0)
+			cb(h, privdata);
+	}
 }
 
 static inline hook_run_ctx_t *hook_run_stack_highest(void)
@@ -19,6 +19,36 @@ E void init_signal_handlers(void);
 
 E void language_init(void);
 
+/* node.c: indexes shared by klines, xlines, qlines and svsignores */
+#define LINE_SUFFIX_LEN		4
+
+typedef struct {
+	mowgli_patricia_t *exact;
+	mowgli_patricia_t *suffix;
+	mowgli_list_t wild;
+} mask_index_t;
+
+typedef struct cidr_node_ cidr_node_t;
+
+struct cidr_node_ {
+	mowgli_list_t lines;	/* must be first, see cidr_trie_del() */
+	cidr_node_t *parent;
+	cidr_node_t *child[2];
+};
+
+typedef bool (*line_match_fn_t)(line_index_t *li, const void *arg);
+
+E unsigned long line_seq;
+
+E void mask_index_init(mask_index_t *mi);
+E void mask_index_add(mask_index_t *mi, const char *mask, line_index_t *li);
+E void mask_index_del(mask_index_t *mi, const char *mask, line_index_t *li);
+E unsigned int mask_index_buckets(mask_index_t *mi, const char **names, unsigned int nnames, mowgli_list_t **out);
+E void cidr_trie_add(cidr_node_t **root, const unsigned char *addr, int bits, line_index_t *li);
+E void cidr_trie_del(cidr_node_t **roots, line_index_t *li);
+E unsigned int cidr_trie_buckets(cidr_node_t *root, const unsigned char *addr, int bits, mowgli_list_t **out);
+E line_index_t *line_find(mowgli_list_t **buckets, unsigned int nbuckets, line_match_fn_t fn, const void *arg);
+
 #endif
 
 /* vim:cinoptions=>s,e0,n0,f0,{0,}0,^0,=s,ps,t0,c3,+s,(2s,us,)20,*30,gs,hs
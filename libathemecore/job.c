@@ -0,0 +1,165 @@
+/*
+ * Copyright (c) 2014- Shaltúre project (http://github.com/shalture)
+ * Rights to this code are as documented in doc/LICENSE.
+ *
+ * Incremental jobs.
+ *
+ * Work that touches every account (or some other large set) would stall
+ * services if it were done inside one command. Instead it is started as
+ * a job: a step function that does one small piece of work at a time. On
+ * each pass of the event loop the jobs get JOB_SLICE_NSEC between them,
+ * taking turns, and anything left waits for the next pass.
+ *
+ */
+
+#include "atheme.h"
+
+/* time all jobs together may take per pass of the event loop */
+#define JOB_SLICE_NSEC		10000000ULL
+
+mowgli_list_t jobs;
+
+static unsigned int job_next_id = 1;
+static job_t *job_running = NULL;
+static mowgli_eventloop_timer_t *job_timer = NULL;
+
+static void job_run(void *unused);
+
+static void job_schedule(void)
+{
+	if (job_timer == NULL && MOWGLI_LIST_LENGTH(&jobs) != 0)
+		job_timer = mowgli_timer_add_once(base_eventloop, "job_run", job_run, NULL, 0);
+}
+
+static void job_finish(job_t *job)
+{
+	mowgli_node_delete(&job->node, &jobs);
+
+	if (job->done != NULL)
+		job->done(job);
+
+	free(job->name);
+	free(job->owner);
+	free(job);
+}
+
+static void job_run(void *unused)
+{
+	unsigned long long deadline;
+	job_t *job;
+	bool more;
+
+	job_timer = NULL;
+	deadline = prof_now() + JOB_SLICE_NSEC;
+
+	while (MOWGLI_LIST_LENGTH(&jobs) != 0 && prof_now() < deadline)
+	{
+		job = jobs.head->data;
+
+		/* take turns: the job goes to the back of the queue */
+		mowgli_node_delete(&job->node, &jobs);
+		mowgli_node_add(job, &job->node, &jobs);
+
+		job_running = job;
+		more = !job->cancelled && job->step(job);
+		job_running = NULL;
+
+		if (!more)
+			job_finish(job);
+	}
+
+	job_schedule();
+}
+
+/*
+ * job_start(const char *name, const char *owner, unsigned int total,
+ *     job_step_t step, job_done_t done, void *data)
+ *
+ * Starts a job. Its steps run from the event loop, beginning with the
+ * next pass.
+ *
+ * Inputs:
+ *      - short name of what the job does
+ *      - who started it
+ *      - how many steps it is expected to take, for progress reports
+ *      - the step function; it is called until it returns false
+ *      - a function called once the job is over, or NULL
+ *      - private data for the step and done functions
+ *
+ * Outputs:
+ *      - the job
+ *
+ * Side Effects:
+ *      - the job is added to the list of jobs
+ */
+job_t *job_start(const char *name, const char *owner, unsigned int total, job_step_t step, job_done_t done, void *data)
+{
+	job_t *job;
+
+	return_val_if_fail(name != NULL, NULL);
+	return_val_if_fail(step != NULL, NULL);
+
+	job = smalloc(sizeof *job);
+	job->id = job_next_id++;
+	job->name = sstrdup(name);
+	job->owner = sstrdup(owner != NULL ? owner : me.name);
+	job->step = step;
+	job->done = done;
+	job->data = data;
+	job->total = total;
+	job->started = CURRTIME;
+
+	mowgli_node_add(job, &job->node, &jobs);
+	job_schedule();
+
+	slog(LG_DEBUG, "job_start(): job %u (%s) for %s, %u steps", job->id, job->name, job->owner, total);
+
+	return job;
+}
+
+/*
+ * job_cancel(job_t *job)
+ *
+ * Stops a job. Its done function sees job->cancelled set.
+ *
+ * Inputs:
+ *      - a job
+ *
+ * Outputs:
+ *      - none
+ *
+ * Side Effects:
+ *      - the job is finished and freed right away, unless this is called
+ *        from its own step function; then that happens once it returns
+ */
+void job_cancel(job_t *job)
+{
+	return_if_fail(job != NULL);
+
+	job->cancelled = true;
+
+	if (job != job_running)
+		job_finish(job);
+}
+
+job_t *job_find(unsigned int id)
+{
+	mowgli_node_t *n;
+	job_t *job;
+
+	MOWGLI_ITER_FOREACH(n, jobs.head)
+	{
+		job = n->data;
+
+		if (job->id == id)
+			return job;
+	}
+
+	return NULL;
+}
+
+/* vim:cinoptions=>s,e0,n0,f0,{0,}0,^0,=s,ps,t0,c3,+s,(2s,us,)20,*30,gs,hs
+ * vim:ts=8
+ * vim:sw=8
+ * vim:noexpandtab
+ */
@@ -0,0 +1,413 @@
+/*
+ * Copyright (c) 2014- Shaltúre project (http://github.com/shalture)
+ * Rights to this code are as documented in doc/LICENSE.
+ *
+ * Outgoing email spool.
+ *
+ * sendemail() renders each message into a file under <datadir>/mailspool
+ * and returns. The files are then fed to at most serverinfo::mta_workers
+ * MTA processes at a time, each reading its message straight from the
+ * spool file. An mta still running after serverinfo::mta_timeout is
+ * killed. Failed deliveries are retried with exponential backoff up to
+ * serverinfo::mta_retries times. Whatever is still in the spool at
+ * startup is queued again.
+ *
+ */
+
+#include "atheme.h"
+
+#ifndef MOWGLI_OS_WIN
+
+#include <dirent.h>
+#include <sys/stat.h>
+#include <sys/wait.h>
+#include <signal.h>
+
+#define MAILQUEUE_RETRY_BASE	60
+#define MAILQUEUE_RETRY_MAX	3600
+
+struct mailqueue_item_
+{
+	mowgli_node_t node;
+	char *path;
+	char *email;
+	FILE *out;		/* while it is being written */
+	long offset;		/* the message starts after our header line */
+	unsigned int attempts;
+	time_t queued;
+	time_t next_try;
+	pid_t pid;
+	mowgli_eventloop_timer_t *timer;	/* kills a stuck mta */
+};
+
+static mowgli_list_t mailqueue_pending;
+static mowgli_list_t mailqueue_running;
+static mailqueue_stats_t mailqueue_counters;
+static unsigned int mailqueue_seq;
+static char mailqueue_dir[BUFSIZE];
+static mowgli_eventloop_timer_t *mailqueue_timer = NULL;
+
+static void mailqueue_done(pid_t pid, int status, void *data);
+
+/* the mta is reaped as usual and its email treated as failed */
+static void mailqueue_timeout(void *arg)
+{
+	mailqueue_item_t *mi = arg;
+
+	mi->timer = NULL;
+
+	slog(LG_ERROR, "mailqueue_timeout(): mta for %s still running after %u seconds; killing it",
+			mi->email, me.mta_timeout);
+	mailqueue_counters.timedout++;
+	kill(mi->pid, SIGKILL);
+}
+
+static void mailqueue_item_free(mailqueue_item_t *mi)
+{
+	free(mi->path);
+	free(mi->email);
+	free(mi);
+}
+
+static void mailqueue_start(mailqueue_item_t *mi)
+{
+	pid_t pid;
+	int fd;
+
+	if ((fd = open(mi->path, O_RDONLY)) < 0)
+	{
+		slog(LG_ERROR, "mailqueue_start(): cannot open %s: %s; dropping email for %s",
+				mi->path, strerror(errno), mi->email);
+		mailqueue_counters.failed++;
+		mowgli_node_delete(&mi->node, &mailqueue_pending);
+		mailqueue_item_free(mi);
+		return;
+	}
+
+	if (lseek(fd, mi->offset, SEEK_SET) < 0 || (pid = fork()) < 0)
+	{
+		slog(LG_ERROR, "mailqueue_start(): cannot start mta for %s: %s", mi->email, strerror(errno));
+		close(fd);
+		mi->next_try = CURRTIME + MAILQUEUE_RETRY_BASE;
+		return;
+	}
+
+	if (pid == 0)
+	{
+		connection_close_all_fds();
+		dup2(fd, 0);
+		if (fd != 0)
+			close(fd);
+		execl(me.mta, me.mta, "-t", "-f", me.register_email, NULL);
+		_exit(255);
+	}
+
+	close(fd);
+
+	mi->pid = pid;
+	mowgli_node_delete(&mi->node, &mailqueue_pending);
+	mowgli_node_add(mi, &mi->node, &mailqueue_running);
+
+	childproc_add(pid, "email", mailqueue_done, mi);
+
+	if (me.mta_timeout != 0)
+		mi->timer = mowgli_timer_add_once(base_eventloop, "mailqueue_timeout", mailqueue_timeout, mi, me.mta_timeout);
+}
+
+/* hands waiting messages to the mta, up to serverinfo::mta_workers at once */
+static void mailqueue_run(void *unused)
+{
+	mowgli_node_t *n, *tn;
+
+	if (me.mta == NULL)
+		return;
+
+	MOWGLI_ITER_FOREACH_SAFE(n, tn, mailqueue_pending.head)
+	{
+		mailqueue_item_t *mi = n->data;
+
+		if (MOWGLI_LIST_LENGTH(&mailqueue_running) >= me.mta_workers)
+			break;
+
+		if (mi->next_try > CURRTIME)
+			continue;
+
+		mailqueue_start(mi);
+	}
+}
+
+static void mailqueue_done(pid_t pid, int status, void *data)
+{
+	mailqueue_item_t *mi = data;
+	char failpath[BUFSIZE];
+	unsigned int delay;
+	time_t latency;
+
+	mowgli_node_delete(&mi->node, &mailqueue_running);
+	mi->pid = 0;
+
+	if (mi->timer != NULL)
+	{
+		mowgli_timer_destroy(base_eventloop, mi->timer);
+		mi->timer = NULL;
+	}
+
+	if (WIFEXITED(status) && WEXITSTATUS(status) == 0)
+	{
+		latency = CURRTIME - mi->queued;
+
+		mailqueue_counters.delivered++;
+		mailqueue_counters.total_sec += latency;
+		if ((unsigned long)latency > mailqueue_counters.max_sec)
+			mailqueue_counters.max_sec = latency;
+
+		unlink(mi->path);
+		mailqueue_item_free(mi);
+	}
+	else if (++mi->attempts >= me.mta_retries)
+	{
+		mailqueue_counters.failed++;
+
+		snprintf(failpath, sizeof failpath, "%s.failed", mi->path);
+		slog(LG_ERROR, "mailqueue_done(): email for %s failed %u times, giving up (left in %s)",
+				mi->email, mi->attempts, failpath);
+		srename(mi->path, failpath);
+		mailqueue_item_free(mi);
+	}
+	else
+	{
+		mailqueue_counters.retried++;
+
+		delay = MAILQUEUE_RETRY_BASE << (mi->attempts - 1);
+		if (delay > MAILQUEUE_RETRY_MAX || mi->attempts > 16)
+			delay = MAILQUEUE_RETRY_MAX;
+		mi->next_try = CURRTIME + delay;
+
+		slog(LG_INFO, "mailqueue_done(): email for %s failed, retrying in %u seconds", mi->email, delay);
+		mowgli_node_add(mi, &mi->node, &mailqueue_pending);
+	}
+
+	mailqueue_run(NULL);
+}
+
+static mailqueue_item_t *mailqueue_item_create(const char *path, const char *email, long offset, time_t queued)
+{
+	mailqueue_item_t *mi;
+
+	mi = smalloc(sizeof *mi);
+	mi->path = sstrdup(path);
+	mi->email = sstrdup(email);
+	mi->offset = offset;
+	mi->queued = queued;
+	mi->next_try = CURRTIME;
+
+	return mi;
+}
+
+/*
+ * mailqueue_begin(const char *email, FILE **out)
+ *
+ * Starts a message to the given address in the spool.
+ *
+ * Inputs:
+ *      - recipient, for logging
+ *      - where to store the file to write the message to
+ *
+ * Outputs:
+ *      - a handle for mailqueue_commit() or mailqueue_abort(), or NULL
+ *
+ * Side Effects:
+ *      - a temporary file is created in the spool
+ */
+mailqueue_item_t *mailqueue_begin(const char *email, FILE **out)
+{
+	mailqueue_item_t *mi;
+	char path[BUFSIZE];
+	FILE *f;
+	int fd;
+
+	return_val_if_fail(email != NULL, NULL);
+	return_val_if_fail(out != NULL, NULL);
+
+	if (*mailqueue_dir == '\0')
+		mailqueue_init();
+
+	snprintf(path, sizeof path, "%s/%lu-%d-%u", mailqueue_dir,
+			(unsigned long)CURRTIME, (int)getpid(), ++mailqueue_seq);
+
+	mi = mailqueue_item_create(path, email, 0, CURRTIME);
+	mi->path = srealloc(mi->path, strlen(path) + 5);
+	strcat(mi->path, ".tmp");
+
+	if ((fd = open(mi->path, O_WRONLY | O_CREAT | O_EXCL, 0600)) < 0 || (f = fdopen(fd, "w")) == NULL)
+	{
+		slog(LG_ERROR, "mailqueue_begin(): cannot create %s: %s", mi->path, strerror(errno));
+		if (fd >= 0)
+			close(fd);
+		mailqueue_item_free(mi);
+		return NULL;
+	}
+
+	fprintf(f, "%s\n", email);
+	mi->offset = ftell(f);
+	mi->out = f;
+
+	*out = f;
+	return mi;
+}
+
+/* puts a finished message in the queue; false if it could not be written */
+bool mailqueue_commit(mailqueue_item_t *mi)
+{
+	char path[BUFSIZE];
+	bool ok;
+
+	return_val_if_fail(mi != NULL, false);
+	return_val_if_fail(mi->out != NULL, false);
+
+	ok = !ferror(mi->out);
+	if (fclose(mi->out) < 0)
+		ok = false;
+	mi->out = NULL;
+
+	mowgli_strlcpy(path, mi->path, sizeof path);
+	path[strlen(path) - 4] = '\0';
+
+	if (!ok || srename(mi->path, path) < 0)
+	{
+		slog(LG_ERROR, "mailqueue_commit(): cannot write %s: %s", mi->path, strerror(errno));
+		unlink(mi->path);
+		mailqueue_item_free(mi);
+		return false;
+	}
+
+	free(mi->path);
+	mi->path = sstrdup(path);
+
+	mowgli_node_add(mi, &mi->node, &mailqueue_pending);
+	mailqueue_run(NULL);
+
+	return true;
+}
+
+void mailqueue_abort(mailqueue_item_t *mi)
+{
+	return_if_fail(mi != NULL);
+
+	if (mi->out != NULL)
+		fclose(mi->out);
+	unlink(mi->path);
+	mailqueue_item_free(mi);
+}
+
+static void mailqueue_recover(void)
+{
+	DIR *dir;
+	struct dirent *de;
+	struct stat st;
+	char path[BUFSIZE], email[BUFSIZE];
+	mailqueue_item_t *mi;
+	size_t len;
+	FILE *f;
+
+	if ((dir = opendir(mailqueue_dir)) == NULL)
+		return;
+
+	while ((de = readdir(dir)) != NULL)
+	{
+		if (de->d_name[0] == '.')
+			continue;
+
+		len = strlen(de->d_name);
+		if (len > 7 && !strcmp(de->d_name + len - 7, ".failed"))
+			continue;
+
+		snprintf(path, sizeof path, "%s/%s", mailqueue_dir, de->d_name);
+
+		/* left over from a crash while writing */
+		if (len > 4 && !strcmp(de->d_name + len - 4, ".tmp"))
+		{
+			unlink(path);
+			continue;
+		}
+
+		if ((f = fopen(path, "r")) == NULL)
+			continue;
+
+		if (fgets(email, sizeof email, f) == NULL || fstat(fileno(f), &st) < 0)
+		{
+			fclose(f);
+			continue;
+		}
+		strip(email);
+
+		mi = mailqueue_item_create(path, email, ftell(f), st.st_mtime);
+		mowgli_node_add(mi, &mi->node, &mailqueue_pending);
+
+		fclose(f);
+	}
+
+	closedir(dir);
+
+	if (MOWGLI_LIST_LENGTH(&mailqueue_pending) != 0)
+		slog(LG_INFO, "mailqueue_recover(): %zu spooled emails queued again", MOWGLI_LIST_LENGTH(&mailqueue_pending));
+}
+
+/* sets up the spool and queues anything left in it */
+void mailqueue_init(void)
+{
+	if (*mailqueue_dir != '\0')
+		return;
+
+	snprintf(mailqueue_dir, sizeof mailqueue_dir, "%s/mailspool", datadir);
+
+	if (mkdir(mailqueue_dir, 0700) < 0 && errno != EEXIST)
+		slog(LG_ERROR, "mailqueue_init(): cannot create %s: %s", mailqueue_dir, strerror(errno));
+
+	mailqueue_recover();
+
+	mailqueue_timer = mowgli_timer_add(base_eventloop, "mailqueue_run", mailqueue_run, NULL, 30);
+	mailqueue_run(NULL);
+}
+
+void mailqueue_stats(mailqueue_stats_t *stats)
+{
+	return_if_fail(stats != NULL);
+
+	*stats = mailqueue_counters;
+	stats->queued = MOWGLI_LIST_LENGTH(&mailqueue_pending);
+	stats->running = MOWGLI_LIST_LENGTH(&mailqueue_running);
+}
+
+#else
+
+void mailqueue_init(void)
+{
+}
+
+mailqueue_item_t *mailqueue_begin(const char *email, FILE **out)
+{
+	return NULL;
+}
+
+bool mailqueue_commit(mailqueue_item_t *mi)
+{
+	return false;
+}
+
+void mailqueue_abort(mailqueue_item_t *mi)
+{
+}
+
+void mailqueue_stats(mailqueue_stats_t *stats)
+{
+	memset(stats, 0, sizeof *stats);
+}
+
+#endif
+
+/* vim:cinoptions=>s,e0,n0,f0,{0,}0,^0,=s,ps,t0,c3,+s,(2s,us,)20,*30,gs,hs
+ * vim:ts=8
+ * vim:sw=8
+ * vim:noexpandtab
+ */
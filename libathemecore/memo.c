@@ -0,0 +1,246 @@
+/*
+ * Copyright (c) 2014- Shaltúre project (http://github.com/shalture)
+ * Rights to this code are as documented in doc/LICENSE.
+ *
+ * Account memos.
+ *
+ * A memo holds its sender as a shared string and its text in an allocation
+ * of its own size. If a memo store is loaded, it may take the text instead,
+ * leaving only where to find it; mymemo_text() then asks the store for it.
+ *
+ * Each account's memo ignore list is a dictionary of the ignored names, so
+ * checking a sender costs a lookup per nick the sender owns rather than a
+ * nick lookup per entry on the list.
+ *
+ */
+
+#include "atheme.h"
+
+memo_store_t *memo_store = NULL;
+
+/*
+ * mymemo_create(const char *sender, const char *text, time_t sent,
+ *     unsigned int status)
+ *
+ * Creates a memo. It is not added to any account.
+ *
+ * Inputs:
+ *      - name of the sender
+ *      - text of the memo
+ *      - when it was sent
+ *      - MEMO_* flags
+ *
+ * Outputs:
+ *      - the new memo
+ *
+ * Side Effects:
+ *      - the text may be written to the memo store
+ */
+mymemo_t *mymemo_create(const char *sender, const char *text, time_t sent, unsigned int status)
+{
+	mymemo_t *memo;
+
+	return_val_if_fail(sender != NULL, NULL);
+	return_val_if_fail(text != NULL, NULL);
+
+	memo = smalloc(sizeof *memo);
+	memo->sender = strshare_get(sender);
+	memo->sent = sent;
+	memo->status = status;
+	memo->len = strlen(text);
+
+	if (memo_store == NULL || !memo_store->store(memo, text))
+		memo->text = sstrdup(text);
+
+	return memo;
+}
+
+/* recreates a memo whose text is already in the memo store */
+mymemo_t *mymemo_create_stored(const char *sender, off_t offset, unsigned int len, time_t sent, unsigned int status)
+{
+	mymemo_t *memo;
+
+	return_val_if_fail(sender != NULL, NULL);
+
+	memo = smalloc(sizeof *memo);
+	memo->sender = strshare_get(sender);
+	memo->sent = sent;
+	memo->status = status;
+	memo->len = len;
+	memo->offset = offset;
+
+	return memo;
+}
+
+void mymemo_destroy(mymemo_t *memo)
+{
+	return_if_fail(memo != NULL);
+
+	strshare_unref(memo->sender);
+	free(memo->text);
+	free(memo);
+}
+
+/*
+ * mymemo_text(mymemo_t *memo)
+ *
+ * Returns the text of a memo.
+ *
+ * Inputs:
+ *      - a memo
+ *
+ * Outputs:
+ *      - its text; if it came from the memo store, only valid until the
+ *        next call. An empty string if the store cannot provide it.
+ *
+ * Side Effects:
+ *      - the text may be read from the memo store
+ */
+const char *mymemo_text(mymemo_t *memo)
+{
+	const char *text;
+
+	return_val_if_fail(memo != NULL, "");
+
+	if (memo->text != NULL)
+		return memo->text;
+
+	if (memo_store == NULL || (text = memo_store->fetch(memo)) == NULL)
+		return "";
+
+	return text;
+}
+
+/*
+ * memo_ignore_add(myuser_t *mu, const char *name)
+ *
+ * Adds a name to an account's memo ignore list.
+ *
+ * Inputs:
+ *      - account whose list to add to
+ *      - name to ignore memos from
+ *
+ * Outputs:
+ *      - false if the name was already on the list, true otherwise
+ *
+ * Side Effects:
+ *      - the list is created if the account had none
+ */
+bool memo_ignore_add(myuser_t *mu, const char *name)
+{
+	return_val_if_fail(mu != NULL, false);
+	return_val_if_fail(name != NULL, false);
+
+	if (mu->memo_ignores == NULL)
+		mu->memo_ignores = mowgli_patricia_create(irccasecanon);
+	else if (mowgli_patricia_retrieve(mu->memo_ignores, name) != NULL)
+		return false;
+
+	mowgli_patricia_add(mu->memo_ignores, name, sstrdup(name));
+	return true;
+}
+
+/* removes a name from the list; false if it was not on it */
+bool memo_ignore_delete(myuser_t *mu, const char *name)
+{
+	char *entry;
+
+	return_val_if_fail(mu != NULL, false);
+	return_val_if_fail(name != NULL, false);
+
+	if (mu->memo_ignores == NULL)
+		return false;
+
+	if ((entry = mowgli_patricia_delete(mu->memo_ignores, name)) == NULL)
+		return false;
+
+	free(entry);
+
+	if (mowgli_patricia_size(mu->memo_ignores) == 0)
+		memo_ignore_clear(mu);
+
+	return true;
+}
+
+static void memo_ignore_free(const char *key, void *data, void *privdata)
+{
+	free(data);
+}
+
+void memo_ignore_clear(myuser_t *mu)
+{
+	return_if_fail(mu != NULL);
+
+	if (mu->memo_ignores == NULL)
+		return;
+
+	mowgli_patricia_destroy(mu->memo_ignores, memo_ignore_free, NULL);
+	mu->memo_ignores = NULL;
+}
+
+/* the name as it was added, or NULL */
+const char *memo_ignore_find(myuser_t *mu, const char *name)
+{
+	return_val_if_fail(mu != NULL, NULL);
+	return_val_if_fail(name != NULL, NULL);
+
+	if (mu->memo_ignores == NULL)
+		return NULL;
+
+	return mowgli_patricia_retrieve(mu->memo_ignores, name);
+}
+
+unsigned int memo_ignore_count(myuser_t *mu)
+{
+	return_val_if_fail(mu != NULL, 0);
+
+	return mu->memo_ignores != NULL ? mowgli_patricia_size(mu->memo_ignores) : 0;
+}
+
+/*
+ * memo_ignores(myuser_t *mu, myuser_t *sender)
+ *
+ * Tells whether an account ignores memos from another.
+ *
+ * Inputs:
+ *      - the recipient
+ *      - the sender
+ *
+ * Outputs:
+ *      - true if a name on the recipient's ignore list belongs to the
+ *        sender: one of its nicks, or its account name if nicks are not
+ *        owned
+ *
+ * Side Effects:
+ *      - none
+ */
+bool memo_ignores(myuser_t *mu, myuser_t *sender)
+{
+	mowgli_node_t *n;
+	mynick_t *mn;
+
+	return_val_if_fail(mu != NULL, false);
+	return_val_if_fail(sender != NULL, false);
+
+	if (mu->memo_ignores == NULL)
+		return false;
+
+	if (nicksvs.no_nick_ownership)
+		return mowgli_patricia_retrieve(mu->memo_ignores, entity(sender)->name) != NULL;
+
+	MOWGLI_ITER_FOREACH(n, sender->nicks.head)
+	{
+		mn = n->data;
+
+		if (mowgli_patricia_retrieve(mu->memo_ignores, mn->nick) != NULL)
+			return true;
+	}
+
+	return false;
+}
+
+/* vim:cinoptions=>s,e0,n0,f0,{0,}0,^0,=s,ps,t0,c3,+s,(2s,us,)20,*30,gs,hs
+ * vim:ts=8
+ * vim:sw=8
+ * vim:noexpandtab
+ */
@@ -24,6 +24,7 @@
 #include "atheme.h"
 #include "uplink.h"
 #include "privs.h"
+#include "internal.h"
 
 mowgli_list_t klnlist;
 mowgli_list_t xlnlist;
@@ -33,6 +34,8 @@ mowgli_heap_t *kline_heap;	/* 16 */
 mowgli_heap_t *xline_heap;	/* 16 */
 mowgli_heap_t *qline_heap;	/* 16 */
 
+static void init_line_indexes(void);
+
 /*************
  * L I S T S *
  *************/
@@ -49,6 +52,7 @@ void init_nodes(void)
 		exit(EXIT_FAILURE);
 	}
 
+	init_line_indexes();
 	init_uplinks();
 	init_servers();
 	init_metadata();
@@ -115,6 +119,411 @@ void remove_illegals()
 	}
 }
 
+/***************************
+ * L I N E   I N D E X E S *
+ ***************************/
+
+/*
+ * klines, xlines and qlines stay in klnlist, xlnlist and qlnlist in the
+ * order they were added, but are also indexed so that checking a user
+ * against them does not have to try every entry:
+ *
+ *   - masks without wildcards are hashed on the whole mask, masks ending
+ *     in at least LINE_SUFFIX_LEN literal characters are hashed on those,
+ *     and the rest are kept in a list which is always tried;
+ *   - kline hosts that are CIDR masks are also put in a binary trie per
+ *     address family, which is walked along the user's IP address;
+ *   - numbers are hashed;
+ *   - lines with a duration are kept in a min-heap on their expiry time.
+ *
+ * Every bucket keeps its entries in insertion order, so taking the entry
+ * with the lowest sequence number over all buckets that may hold a match
+ * finds the same entry a scan of the whole list would.
+ *
+ * The mask index, the CIDR trie and line_find() are also used for
+ * svsignores (see internal.h).
+ */
+
+typedef struct {
+	time_t expires;
+	line_index_t *li;
+} line_heap_entry_t;
+
+typedef struct {
+	line_heap_entry_t *v;	/* v[1] is the top */
+	unsigned int count;
+	unsigned int size;
+} line_heap_t;
+
+unsigned long line_seq;
+
+static mask_index_t kline_hosts;
+static cidr_node_t *kline_cidr[2];	/* IPv4, IPv6 */
+static mowgli_patricia_t *kline_numbers;
+static line_heap_t kline_expiry;
+
+static mask_index_t xline_names;
+static mowgli_patricia_t *xline_numbers;
+static line_heap_t xline_expiry;
+
+static mask_index_t qline_masks;
+static mowgli_patricia_t *qline_exact;
+static mowgli_patricia_t *qline_numbers;
+static line_heap_t qline_expiry;
+
+static void bucket_add(mowgli_patricia_t *tree, const char *key, line_index_t *li, mowgli_node_t *n, mowgli_list_t **bucket)
+{
+	mowgli_list_t *l;
+
+	if ((l = mowgli_patricia_retrieve(tree, key)) == NULL)
+	{
+		l = mowgli_list_create();
+		mowgli_patricia_add(tree, key, l);
+	}
+
+	mowgli_node_add(li, n, l);
+	*bucket = l;
+}
+
+static void bucket_del(mowgli_patricia_t *tree, const char *key, mowgli_node_t *n, mowgli_list_t **bucket)
+{
+	mowgli_node_delete(n, *bucket);
+
+	if (MOWGLI_LIST_LENGTH(*bucket) == 0)
+	{
+		mowgli_patricia_delete(tree, key);
+		mowgli_list_free(*bucket);
+	}
+
+	*bucket = NULL;
+}
+
+static void line_number_add(mowgli_patricia_t *tree, unsigned long number, line_index_t *li)
+{
+	char key[32];
+
+	snprintf(key, sizeof key, "%lu", number);
+	bucket_add(tree, key, li, &li->nnode, &li->nbucket);
+}
+
+static void line_number_del(mowgli_patricia_t *tree, unsigned long number, line_index_t *li)
+{
+	char key[32];
+
+	snprintf(key, sizeof key, "%lu", number);
+	bucket_del(tree, key, &li->nnode, &li->nbucket);
+}
+
+static line_index_t *line_number_find(mowgli_patricia_t *tree, unsigned long number)
+{
+	char key[32];
+	mowgli_list_t *l;
+
+	snprintf(key, sizeof key, "%lu", number);
+	l = mowgli_patricia_retrieve(tree, key);
+
+	return l != NULL ? l->head->data : NULL;
+}
+
+/*
+ * Returns the key a mask is hashed on, setting *exact if it has no
+ * wildcards, or NULL if it goes in the list of masks that are always tried.
+ */
+static const char *mask_index_key(const char *mask, bool *exact)
+{
+	const char *p, *tail = mask;
+
+	*exact = true;
+
+	for (p = mask; *p != '\0'; p++)
+	{
+		switch (*p)
+		{
+		case '\\':
+			*exact = false;
+			return NULL;
+		case '*':
+		case '?':
+		case '&':
+		case '#':
+		case '%':
+			*exact = false;
+			tail = p + 1;
+			break;
+		}
+	}
+
+	if (*exact)
+		return *mask != '\0' ? mask : NULL;
+
+	if (p - tail < LINE_SUFFIX_LEN)
+		return NULL;
+
+	return p - LINE_SUFFIX_LEN;
+}
+
+void mask_index_init(mask_index_t *mi)
+{
+	mi->exact = mowgli_patricia_create(irccasecanon);
+	mi->suffix = mowgli_patricia_create(irccasecanon);
+}
+
+void mask_index_add(mask_index_t *mi, const char *mask, line_index_t *li)
+{
+	const char *key;
+	bool exact;
+
+	if ((key = mask_index_key(mask, &exact)) == NULL)
+	{
+		mowgli_node_add(li, &li->mnode, &mi->wild);
+		li->mbucket = &mi->wild;
+	}
+	else
+		bucket_add(exact ? mi->exact : mi->suffix, key, li, &li->mnode, &li->mbucket);
+}
+
+void mask_index_del(mask_index_t *mi, const char *mask, line_index_t *li)
+{
+	const char *key;
+	bool exact;
+
+	if ((key = mask_index_key(mask, &exact)) == NULL)
+	{
+		mowgli_node_delete(&li->mnode, &mi->wild);
+		li->mbucket = NULL;
+	}
+	else
+		bucket_del(exact ? mi->exact : mi->suffix, key, &li->mnode, &li->mbucket);
+}
+
+/*
+ * Stores the buckets that can hold masks matching any of names (NULL
+ * names are skipped) in out, which needs room for 2 * nnames + 1 of them.
+ * Returns how many there are.
+ */
+unsigned int mask_index_buckets(mask_index_t *mi, const char **names, unsigned int nnames, mowgli_list_t **out)
+{
+	unsigned int i, count = 0;
+	mowgli_list_t *l;
+	size_t len;
+
+	for (i = 0; i < nnames; i++)
+	{
+		if (names[i] == NULL || *names[i] == '\0')
+			continue;
+
+		if ((l = mowgli_patricia_retrieve(mi->exact, names[i])) != NULL)
+			out[count++] = l;
+
+		len = strlen(names[i]);
+		if (len >= LINE_SUFFIX_LEN && (l = mowgli_patricia_retrieve(mi->suffix, names[i] + len - LINE_SUFFIX_LEN)) != NULL)
+			out[count++] = l;
+	}
+
+	out[count++] = &mi->wild;
+
+	return count;
+}
+
+static inline unsigned int cidr_bit(const unsigned char *addr, int i)
+{
+	return (addr[i / 8] >> (7 - i % 8)) & 1;
+}
+
+void cidr_trie_add(cidr_node_t **root, const unsigned char *addr, int bits, line_index_t *li)
+{
+	cidr_node_t *cn;
+	unsigned int b;
+	int i;
+
+	if (*root == NULL)
+		*root = smalloc(sizeof(cidr_node_t));
+
+	cn = *root;
+
+	for (i = 0; i < bits; i++)
+	{
+		b = cidr_bit(addr, i);
+
+		if (cn->child[b] == NULL)
+		{
+			cn->child[b] = smalloc(sizeof(cidr_node_t));
+			cn->child[b]->parent = cn;
+		}
+
+		cn = cn->child[b];
+	}
+
+	mowgli_node_add(li, &li->xnode, &cn->lines);
+	li->xbucket = &cn->lines;
+}
+
+void cidr_trie_del(cidr_node_t **roots, line_index_t *li)
+{
+	cidr_node_t *cn = (cidr_node_t *) li->xbucket, *parent;
+
+	mowgli_node_delete(&li->xnode, &cn->lines);
+	li->xbucket = NULL;
+
+	/* prune the nodes that no longer lead to anything */
+	while (cn != NULL && MOWGLI_LIST_LENGTH(&cn->lines) == 0 && cn->child[0] == NULL && cn->child[1] == NULL)
+	{
+		parent = cn->parent;
+
+		if (parent != NULL)
+			parent->child[parent->child[1] == cn] = NULL;
+		else if (roots[0] == cn)
+			roots[0] = NULL;
+		else
+			roots[1] = NULL;
+
+		free(cn);
+		cn = parent;
+	}
+}
+
+/* stores the non-empty buckets on the path to addr in out, which needs room for bits + 1 */
+unsigned int cidr_trie_buckets(cidr_node_t *root, const unsigned char *addr, int bits, mowgli_list_t **out)
+{
+	cidr_node_t *cn = root;
+	unsigned int count = 0;
+	int i;
+
+	for (i = 0; cn != NULL; i++)
+	{
+		if (MOWGLI_LIST_LENGTH(&cn->lines) != 0)
+			out[count++] = &cn->lines;
+
+		if (i == bits)
+			break;
+
+		cn = cn->child[cidr_bit(addr, i)];
+	}
+
+	return count;
+}
+
+static void line_heap_set(line_heap_t *h, unsigned int pos, line_heap_entry_t e)
+{
+	h->v[pos] = e;
+	e.li->heappos = pos;
+}
+
+static void line_heap_up(line_heap_t *h, unsigned int pos)
+{
+	line_heap_entry_t e = h->v[pos];
+
+	while (pos > 1 && h->v[pos / 2].expires > e.expires)
+	{
+		line_heap_set(h, pos, h->v[pos / 2]);
+		pos /= 2;
+	}
+
+	line_heap_set(h, pos, e);
+}
+
+static void line_heap_down(line_heap_t *h, unsigned int pos)
+{
+	line_heap_entry_t e = h->v[pos];
+	unsigned int child;
+
+	while ((child = pos * 2) <= h->count)
+	{
+		if (child < h->count && h->v[child + 1].expires < h->v[child].expires)
+			child++;
+
+		if (h->v[child].expires >= e.expires)
+			break;
+
+		line_heap_set(h, pos, h->v[child]);
+		pos = child;
+	}
+
+	line_heap_set(h, pos, e);
+}
+
+static void line_heap_add(line_heap_t *h, line_index_t *li, time_t expires)
+{
+	if (h->count + 1 >= h->size)
+	{
+		h->size = h->size != 0 ? h->size * 2 : 64;
+		h->v = srealloc(h->v, h->size * sizeof(line_heap_entry_t));
+	}
+
+	h->count++;
+	h->v[h->count].expires = expires;
+	h->v[h->count].li = li;
+	line_heap_up(h, h->count);
+}
+
+static void line_heap_del(line_heap_t *h, line_index_t *li)
+{
+	unsigned int pos = li->heappos;
+	line_heap_entry_t last;
+
+	if (pos == 0)
+		return;
+
+	li->heappos = 0;
+	last = h->v[h->count--];
+
+	if (pos > h->count)
+		return;
+
+	line_heap_set(h, pos, last);
+	line_heap_up(h, pos);
+	line_heap_down(h, last.li->heappos);
+}
+
+/* the line that expires first, if it has expired by now */
+static line_index_t *line_heap_expired(line_heap_t *h)
+{
+	if (h->count == 0 || h->v[1].expires > CURRTIME)
+		return NULL;
+
+	return h->v[1].li;
+}
+
+/* the entry added first, out of those in buckets for which fn returns true */
+line_index_t *line_find(mowgli_list_t **buckets, unsigned int nbuckets, line_match_fn_t fn, const void *arg)
+{
+	line_index_t *li, *best = NULL;
+	mowgli_node_t *n;
+	unsigned int i;
+
+	for (i = 0; i < nbuckets; i++)
+	{
+		MOWGLI_ITER_FOREACH(n, buckets[i]->head)
+		{
+			li = n->data;
+
+			if (best != NULL && li->seq >= best->seq)
+				break;
+
+			if (fn(li, arg))
+			{
+				best = li;
+				break;
+			}
+		}
+	}
+
+	return best;
+}
+
+static void init_line_indexes(void)
+{
+	mask_index_init(&kline_hosts);
+	kline_numbers = mowgli_patricia_create(noopcanon);
+
+	mask_index_init(&xline_names);
+	xline_numbers = mowgli_patricia_create(noopcanon);
+
+	mask_index_init(&qline_masks);
+	qline_exact = mowgli_patricia_create(irccasecanon);
+	qline_numbers = mowgli_patricia_create(noopcanon);
+}
+
 /*************
  * K L I N E *
  *************/
@@ -122,14 +531,13 @@ void remove_illegals()
 kline_t *kline_add_with_id(const char *user, const char *host, const char *reason, long duration, const char *setby, unsigned long id)
 {
 	kline_t *k;
-	mowgli_node_t *n = mowgli_node_create();
+	unsigned char addr[16];
+	int family, bits;
 
 	slog(LG_DEBUG, "kline_add(): %s@%s -> %s (%ld)", user, host, reason, duration);
 
 	k = mowgli_heap_alloc(kline_heap);
 
-	mowgli_node_add(k, n, &klnlist);
-
 	k->user = sstrdup(user);
 	k->host = sstrdup(host);
 	k->reason = sstrdup(reason);
@@ -139,8 +547,20 @@ kline_t *kline_add_with_id(const char *user, const char *host, const char *reaso
 	k->expires = CURRTIME + duration;
 	k->number = id;
 
+	mowgli_node_add(k, &k->li.node, &klnlist);
+	k->li.seq = ++line_seq;
+
+	mask_index_add(&kline_hosts, k->host, &k->li);
+	if ((family = parse_cidr(k->host, addr, &bits)) != 0)
+		cidr_trie_add(&kline_cidr[family == 6], addr, bits, &k->li);
+	line_number_add(kline_numbers, k->number, &k->li);
+	if (k->duration != 0)
+		line_heap_add(&kline_expiry, &k->li, k->expires);
+
 	cnt.kline++;
 
+	db_journal_update(DB_JOURNAL_KLINE, k);
+
 
 	char treason[BUFSIZE];
 	snprintf(treason, sizeof(treason), "[#%lu] %s", k->number, k->reason);
@@ -164,21 +584,39 @@ kline_t *kline_add_user(user_t *u, const char *reason, long duration, const char
 	return kline_add(user, host, reason, duration, setby);
 }
 
-void kline_delete(kline_t *k)
+/* for database loading: changes when a kline was set, and so when it expires */
+void kline_set_settime(kline_t *k, time_t settime)
 {
-	mowgli_node_t *n;
+	return_if_fail(k != NULL);
+
+	k->settime = settime;
+	k->expires = k->settime + k->duration;
 
+	if (k->duration != 0)
+	{
+		line_heap_del(&kline_expiry, &k->li);
+		line_heap_add(&kline_expiry, &k->li, k->expires);
+	}
+}
+
+void kline_delete(kline_t *k)
+{
 	return_if_fail(k != NULL);
 
 	slog(LG_DEBUG, "kline_delete(): %s@%s -> %s", k->user, k->host, k->reason);
 
+	db_journal_remove(DB_JOURNAL_KLINE, k);
+
 	/* only unkline if ircd has not already removed this -- jilles */
 	if (me.connected && (k->duration == 0 || k->expires > CURRTIME))
 		unkline_sts("*", k->user, k->host);
 
-	n = mowgli_node_find(k, &klnlist);
-	mowgli_node_delete(n, &klnlist);
-	mowgli_node_free(n);
+	mowgli_node_delete(&k->li.node, &klnlist);
+	mask_index_del(&kline_hosts, k->host, &k->li);
+	if (k->li.xbucket != NULL)
+		cidr_trie_del(kline_cidr, &k->li);
+	line_number_del(kline_numbers, k->number, &k->li);
+	line_heap_del(&kline_expiry, &k->li);
 
 	free(k->user);
 	free(k->host);
@@ -190,82 +628,81 @@ void kline_delete(kline_t *k)
 	cnt.kline--;
 }
 
-kline_t *kline_find(const char *user, const char *host)
+struct kline_find_arg {
+	const char *user;
+	const char *host;
+};
+
+static bool kline_match(line_index_t *li, const void *arg)
 {
-	kline_t *k;
-	mowgli_node_t *n;
+	const kline_t *k = (kline_t *) li;
+	const struct kline_find_arg *a = arg;
 
-	MOWGLI_ITER_FOREACH(n, klnlist.head)
-	{
-		k = (kline_t *)n->data;
+	return !match(k->user, a->user) && !match(k->host, a->host);
+}
 
-		if ((!match(k->user, user)) && (!match(k->host, host)))
-			return k;
-	}
+kline_t *kline_find(const char *user, const char *host)
+{
+	mowgli_list_t *buckets[3];
+	struct kline_find_arg a = { user, host };
+	unsigned int nbuckets;
 
-	return NULL;
+	nbuckets = mask_index_buckets(&kline_hosts, &host, 1, buckets);
+
+	return (kline_t *) line_find(buckets, nbuckets, kline_match, &a);
 }
 
 kline_t *kline_find_num(unsigned long number)
 {
-	kline_t *k;
-	mowgli_node_t *n;
+	return (kline_t *) line_number_find(kline_numbers, number);
+}
 
-	MOWGLI_ITER_FOREACH(n, klnlist.head)
-	{
-		k = (kline_t *)n->data;
+static bool kline_match_user(line_index_t *li, const void *arg)
+{
+	const kline_t *k = (kline_t *) li;
+	const user_t *u = arg;
 
-		if (k->number == number)
-			return k;
-	}
+	if (k->duration != 0 && k->expires <= CURRTIME)
+		return false;
 
-	return NULL;
+	return !match(k->user, u->user) && (!match(k->host, u->host) || !match(k->host, u->ip) || !match_ips(k->host, u->ip));
 }
 
 kline_t *kline_find_user(user_t *u)
 {
-	kline_t *k;
-	mowgli_node_t *n;
+	mowgli_list_t *buckets[5 + 129];
+	const char *names[2];
+	unsigned int nbuckets;
+	unsigned char addr[16];
+	int family;
 
-	MOWGLI_ITER_FOREACH(n, klnlist.head)
-	{
-		k = (kline_t *)n->data;
+	names[0] = u->host;
+	names[1] = u->ip;
+	nbuckets = mask_index_buckets(&kline_hosts, names, 2, buckets);
 
-		if (k->duration != 0 && k->expires <= CURRTIME)
-			continue;
-		if (!match(k->user, u->user) && (!match(k->host, u->host) || !match(k->host, u->ip) || !match_ips(k->host, u->ip)))
-			return k;
-	}
+	if (u->ip != NULL && (family = parse_ip(u->ip, addr)) != 0)
+		nbuckets += cidr_trie_buckets(kline_cidr[family == 6], addr, family == 6 ? 128 : 32, buckets + nbuckets);
 
-	return NULL;
+	return (kline_t *) line_find(buckets, nbuckets, kline_match_user, u);
 }
 
 void kline_expire(void *arg)
 {
 	kline_t *k;
 	char *reason;
-	mowgli_node_t *n, *tn;
 
-	MOWGLI_ITER_FOREACH_SAFE(n, tn, klnlist.head)
+	while ((k = (kline_t *) line_heap_expired(&kline_expiry)) != NULL)
 	{
-		k = (kline_t *)n->data;
-
-		if (k->duration == 0)
-			continue;
-
-		if (k->expires <= CURRTIME)
-		{
-			/* TODO: determine validity of k->reason */
-			reason = k->reason ? k->reason : "(none)";
+		/* TODO: determine validity of k->reason */
+		reason = k->reason ? k->reason : "(none)";
 
-			slog(LG_INFO, _("KLINE:EXPIRE: \2%s@%s\2 set \2%s\2 ago by \2%s\2 (reason: %s)"),
-				k->user, k->host, time_ago(k->settime), k->setby, reason);
+		slog(LG_INFO, _("KLINE:EXPIRE: \2%s@%s\2 set \2%s\2 ago by \2%s\2 (reason: %s)"),
+			k->user, k->host, time_ago(k->settime), k->setby, reason);
 
-			verbose_wallops(_("AKILL expired on \2%s@%s\2, set by \2%s\2 (reason: %s)"),
-				k->user, k->host, k->setby, reason);
+		verbose_wallops(_("AKILL expired on \2%s@%s\2, set by \2%s\2 (reason: %s)"),
+			k->user, k->host, k->setby, reason);
 
-			kline_delete(k);
-		}
+		kline_delete(k);
 	}
 }
 
@@ -273,25 +710,34 @@ void kline_expire(void *arg)
  * X L I N E *
  *************/
 
-xline_t *xline_add(const char *realname, const char *reason, long duration, const char *setby)
+static unsigned int xcnt = 0;
+
+xline_t *xline_add_with_id(const char *realname, const char *reason, long duration, const char *setby, unsigned int id)
 {
 	xline_t *x;
-	mowgli_node_t *n = mowgli_node_create();
-	static unsigned int xcnt = 0;
 
 	slog(LG_DEBUG, "xline_add(): %s -> %s (%ld)", realname, reason, duration);
 
 	x = mowgli_heap_alloc(xline_heap);
 
-	mowgli_node_add(x, n, &xlnlist);
-
 	x->realname = sstrdup(realname);
 	x->reason = sstrdup(reason);
 	x->setby = sstrdup(setby);
 	x->duration = duration;
 	x->settime = CURRTIME;
 	x->expires = CURRTIME + duration;
-	x->number = ++xcnt;
+	x->number = id != 0 ? id : ++xcnt;
+	/* numbers handed out later must not collide with loaded ones */
+	if (x->number > xcnt)
+		xcnt = x->number;
+
+	mowgli_node_add(x, &x->li.node, &xlnlist);
+	x->li.seq = ++line_seq;
+
+	mask_index_add(&xline_names, x->realname, &x->li);
+	line_number_add(xline_numbers, x->number, &x->li);
+	if (x->duration != 0)
+		line_heap_add(&xline_expiry, &x->li, x->expires);
 
 	cnt.xline++;
 
@@ -301,26 +747,38 @@ xline_t *xline_add(const char *realname, const char *reason, long duration, cons
 	return x;
 }
 
-void xline_delete(const char *realname)
+xline_t *xline_add(const char *realname, const char *reason, long duration, const char *setby)
 {
-	xline_t *x = xline_find(realname);
-	mowgli_node_t *n;
+	return xline_add_with_id(realname, reason, duration, setby, 0);
+}
 
-	if (!x)
+/* for database loading: changes when an xline was set, and so when it expires */
+void xline_set_settime(xline_t *x, time_t settime)
+{
+	return_if_fail(x != NULL);
+
+	x->settime = settime;
+	x->expires = x->settime + x->duration;
+
+	if (x->duration != 0)
 	{
-		slog(LG_DEBUG, "xline_delete(): called for nonexistant xline: %s", realname);
-		return;
+		line_heap_del(&xline_expiry, &x->li);
+		line_heap_add(&xline_expiry, &x->li, x->expires);
 	}
+}
 
+static void xline_destroy(xline_t *x)
+{
 	slog(LG_DEBUG, "xline_delete(): %s -> %s", x->realname, x->reason);
 
 	/* only unxline if ircd has not already removed this -- jilles */
 	if (me.connected && (x->duration == 0 || x->expires > CURRTIME))
 		unxline_sts("*", x->realname);
 
-	n = mowgli_node_find(x, &xlnlist);
-	mowgli_node_delete(n, &xlnlist);
-	mowgli_node_free(n);
+	mowgli_node_delete(&x->li.node, &xlnlist);
+	mask_index_del(&xline_names, x->realname, &x->li);
+	line_number_del(xline_numbers, x->number, &x->li);
+	line_heap_del(&xline_expiry, &x->li);
 
 	free(x->realname);
 	free(x->reason);
@@ -331,79 +789,76 @@ void xline_delete(const char *realname)
 	cnt.xline--;
 }
 
-xline_t *xline_find(const char *realname)
+void xline_delete(const char *realname)
 {
-	xline_t *x;
-	mowgli_node_t *n;
+	xline_t *x = xline_find(realname);
 
-	MOWGLI_ITER_FOREACH(n, xlnlist.head)
+	if (!x)
 	{
-		x = (xline_t *)n->data;
-
-		if (!match(x->realname, realname))
-			return x;
+		slog(LG_DEBUG, "xline_delete(): called for nonexistant xline: %s", realname);
+		return;
 	}
 
-	return NULL;
+	xline_destroy(x);
 }
 
-xline_t *xline_find_num(unsigned int number)
+static bool xline_match(line_index_t *li, const void *arg)
 {
-	xline_t *x;
-	mowgli_node_t *n;
+	const xline_t *x = (xline_t *) li;
 
-	MOWGLI_ITER_FOREACH(n, xlnlist.head)
-	{
-		x = (xline_t *)n->data;
+	return !match(x->realname, arg);
+}
 
-		if (x->number == number)
-			return x;
-	}
+xline_t *xline_find(const char *realname)
+{
+	mowgli_list_t *buckets[3];
+	unsigned int nbuckets;
 
-	return NULL;
+	nbuckets = mask_index_buckets(&xline_names, &realname, 1, buckets);
+
+	return (xline_t *) line_find(buckets, nbuckets, xline_match, realname);
 }
 
-xline_t *xline_find_user(user_t *u)
+xline_t *xline_find_num(unsigned int number)
 {
-	xline_t *x;
-	mowgli_node_t *n;
+	return (xline_t *) line_number_find(xline_numbers, number);
+}
 
-	MOWGLI_ITER_FOREACH(n, xlnlist.head)
-	{
-		x = (xline_t *)n->data;
+static bool xline_match_user(line_index_t *li, const void *arg)
+{
+	const xline_t *x = (xline_t *) li;
+	const user_t *u = arg;
 
-		if (x->duration != 0 && x->expires <= CURRTIME)
-			continue;
+	if (x->duration != 0 && x->expires <= CURRTIME)
+		return false;
 
-		if (!match(x->realname, u->gecos))
-			return x;
-	}
+	return !match(x->realname, u->gecos);
+}
 
-	return NULL;
+xline_t *xline_find_user(user_t *u)
+{
+	mowgli_list_t *buckets[3];
+	const char *gecos = u->gecos;
+	unsigned int nbuckets;
+
+	nbuckets = mask_index_buckets(&xline_names, &gecos, 1, buckets);
+
+	return (xline_t *) line_find(buckets, nbuckets, xline_match_user, u);
 }
 
 void xline_expire(void *arg)
 {
 	xline_t *x;
-	mowgli_node_t *n, *tn;
 
-	MOWGLI_ITER_FOREACH_SAFE(n, tn, xlnlist.head)
+	while ((x = (xline_t *) line_heap_expired(&xline_expiry)) != NULL)
 	{
-		x = (xline_t *)n->data;
+		slog(LG_INFO, _("XLINE:EXPIRE: \2%s\2 set \2%s\2 ago by \2%s\2"),
+			x->realname, time_ago(x->settime), x->setby);
 
-		if (x->duration == 0)
-			continue;
-
-		if (x->expires <= CURRTIME)
-		{
-			slog(LG_INFO, _("XLINE:EXPIRE: \2%s\2 set \2%s\2 ago by \2%s\2"),
-				x->realname, time_ago(x->settime), x->setby);
+		verbose_wallops(_("XLINE expired on \2%s\2, set by \2%s\2"),
+			x->realname, x->setby);
 
-			verbose_wallops(_("XLINE expired on \2%s\2, set by \2%s\2"),
-				x->realname, x->setby);
-
-			xline_delete(x->realname);
-		}
+		xline_destroy(x);
 	}
 }
 
@@ -411,16 +866,15 @@ void xline_expire(void *arg)
  * Q L I N E *
  *************/
 
-qline_t *qline_add(const char *mask, const char *reason, long duration, const char *setby)
+static unsigned int qcnt = 0;
+
+qline_t *qline_add_with_id(const char *mask, const char *reason, long duration, const char *setby, unsigned int id)
 {
 	qline_t *q;
-	mowgli_node_t *n = mowgli_node_create();
-	static unsigned int qcnt = 0;
 
 	slog(LG_DEBUG, "qline_add(): %s -> %s (%ld)", mask, reason, duration);
 
 	q = mowgli_heap_alloc(qline_heap);
-	mowgli_node_add(q, n, &qlnlist);
 
 	q->mask = sstrdup(mask);
 	q->reason = sstrdup(reason);
@@ -428,7 +882,19 @@ qline_t *qline_add(const char *mask, const char *reason, long duration, const ch
 	q->duration = duration;
 	q->settime = CURRTIME;
 	q->expires = CURRTIME + duration;
-	q->number = ++qcnt;
+	q->number = id != 0 ? id : ++qcnt;
+	/* numbers handed out later must not collide with loaded ones */
+	if (q->number > qcnt)
+		qcnt = q->number;
+
+	mowgli_node_add(q, &q->li.node, &qlnlist);
+	q->li.seq = ++line_seq;
+
+	mask_index_add(&qline_masks, q->mask, &q->li);
+	bucket_add(qline_exact, q->mask, &q->li, &q->li.xnode, &q->li.xbucket);
+	line_number_add(qline_numbers, q->number, &q->li);
+	if (q->duration != 0)
+		line_heap_add(&qline_expiry, &q->li, q->expires);
 
 	cnt.qline++;
 
@@ -438,26 +904,39 @@ qline_t *qline_add(const char *mask, const char *reason, long duration, const ch
 	return q;
 }
 
-void qline_delete(const char *mask)
+qline_t *qline_add(const char *mask, const char *reason, long duration, const char *setby)
 {
-	qline_t *q = qline_find(mask);
-	mowgli_node_t *n;
+	return qline_add_with_id(mask, reason, duration, setby, 0);
+}
 
-	if (!q)
+/* for database loading: changes when a qline was set, and so when it expires */
+void qline_set_settime(qline_t *q, time_t settime)
+{
+	return_if_fail(q != NULL);
+
+	q->settime = settime;
+	q->expires = q->settime + q->duration;
+
+	if (q->duration != 0)
 	{
-		slog(LG_DEBUG, "qline_delete(): called for nonexistant qline: %s", mask);
-		return;
+		line_heap_del(&qline_expiry, &q->li);
+		line_heap_add(&qline_expiry, &q->li, q->expires);
 	}
+}
 
+static void qline_destroy(qline_t *q)
+{
 	slog(LG_DEBUG, "qline_delete(): %s -> %s", q->mask, q->reason);
 
 	/* only unqline if ircd has not already removed this -- jilles */
 	if (me.connected && (q->duration == 0 || q->expires > CURRTIME))
 		unqline_sts("*", q->mask);
 
-	n = mowgli_node_find(q, &qlnlist);
-	mowgli_node_delete(n, &qlnlist);
-	mowgli_node_free(n);
+	mowgli_node_delete(&q->li.node, &qlnlist);
+	mask_index_del(&qline_masks, q->mask, &q->li);
+	bucket_del(qline_exact, q->mask, &q->li.xnode, &q->li.xbucket);
+	line_number_del(qline_numbers, q->number, &q->li);
+	line_heap_del(&qline_expiry, &q->li);
 
 	free(q->mask);
 	free(q->reason);
@@ -468,89 +947,91 @@ void qline_delete(const char *mask)
 	cnt.qline--;
 }
 
-qline_t *qline_find(const char *mask)
+void qline_delete(const char *mask)
 {
-	qline_t *q;
-	mowgli_node_t *n;
+	qline_t *q = qline_find(mask);
 
-	MOWGLI_ITER_FOREACH(n, qlnlist.head)
+	if (!q)
 	{
-		q = (qline_t *)n->data;
-
-		if (!irccasecmp(q->mask, mask))
-			return q;
+		slog(LG_DEBUG, "qline_delete(): called for nonexistant qline: %s", mask);
+		return;
 	}
 
-	return NULL;
+	qline_destroy(q);
 }
 
-qline_t *qline_find_match(const char *mask)
+qline_t *qline_find(const char *mask)
 {
-	qline_t *q;
-	mowgli_node_t *n;
+	mowgli_list_t *l;
 
-	MOWGLI_ITER_FOREACH(n, qlnlist.head)
-	{
-		q = (qline_t *)n->data;
+	l = mowgli_patricia_retrieve(qline_exact, mask);
 
-		if (q->duration != 0 && q->expires <= CURRTIME)
-			continue;
-		if (!match(q->mask, mask))
-			return q;
-	}
+	return l != NULL ? l->head->data : NULL;
+}
 
-	return NULL;
+static bool qline_match(line_index_t *li, const void *arg)
+{
+	const qline_t *q = (qline_t *) li;
+
+	if (q->duration != 0 && q->expires <= CURRTIME)
+		return false;
+
+	return !match(q->mask, arg);
+}
+
+qline_t *qline_find_match(const char *mask)
+{
+	mowgli_list_t *buckets[3];
+	unsigned int nbuckets;
+
+	nbuckets = mask_index_buckets(&qline_masks, &mask, 1, buckets);
+
+	return (qline_t *) line_find(buckets, nbuckets, qline_match, mask);
 }
 
 qline_t *qline_find_num(unsigned int number)
 {
-	qline_t *q;
-	mowgli_node_t *n;
+	return (qline_t *) line_number_find(qline_numbers, number);
+}
 
-	MOWGLI_ITER_FOREACH(n, qlnlist.head)
-	{
-		q = (qline_t *)n->data;
+static bool qline_match_user(line_index_t *li, const void *arg)
+{
+	const qline_t *q = (qline_t *) li;
 
-		if (q->number == number)
-			return q;
-	}
+	if (q->mask[0] == '#' || q->mask[0] == '&')
+		return false;
 
-	return NULL;
+	return qline_match(li, arg);
 }
 
 qline_t *qline_find_user(user_t *u)
 {
-	qline_t *q;
-	mowgli_node_t *n;
+	mowgli_list_t *buckets[3];
+	const char *nick = u->nick;
+	unsigned int nbuckets;
 
-	MOWGLI_ITER_FOREACH(n, qlnlist.head)
-	{
-		q = (qline_t *)n->data;
+	nbuckets = mask_index_buckets(&qline_masks, &nick, 1, buckets);
 
-		if (q->duration != 0 && q->expires <= CURRTIME)
-			continue;
-		if (q->mask[0] == '#' || q->mask[0] == '&')
-			continue;
-		if (!match(q->mask, u->nick))
-			return q;
-	}
-
-	return NULL;
+	return (qline_t *) line_find(buckets, nbuckets, qline_match_user, nick);
 }
 
 qline_t *qline_find_channel(channel_t *c)
 {
-	qline_t *q;
+	mowgli_list_t *l;
 	mowgli_node_t *n;
+	qline_t *q;
+
+	if ((l = mowgli_patricia_retrieve(qline_exact, c->name)) == NULL)
+		return NULL;
 
-	MOWGLI_ITER_FOREACH(n, qlnlist.head)
+	MOWGLI_ITER_FOREACH(n, l->head)
 	{
 		q = (qline_t *)n->data;
 
 		if (q->duration != 0 && q->expires <= CURRTIME)
 			continue;
-		if (!irccasecmp(q->mask, c->name))
-			return q;
+
+		return q;
 	}
 
 	return NULL;
@@ -559,25 +1040,16 @@ qline_t *qline_find_channel(channel_t *c)
 void qline_expire(void *arg)
 {
 	qline_t *q;
-	mowgli_node_t *n, *tn;
 
-	MOWGLI_ITER_FOREACH_SAFE(n, tn, qlnlist.head)
+	while ((q = (qline_t *) line_heap_expired(&qline_expiry)) != NULL)
 	{
-		q = (qline_t *)n->data;
+		slog(LG_INFO, _("QLINE:EXPIRE: \2%s\2 set \2%s\2 ago by \2%s\2"),
+			q->mask, time_ago(q->settime), q->setby);
 
-		if (q->duration == 0)
-			continue;
-
-		if (q->expires <= CURRTIME)
-		{
-			slog(LG_INFO, _("QLINE:EXPIRE: \2%s\2 set \2%s\2 ago by \2%s\2"),
-				q->mask, time_ago(q->settime), q->setby);
+		verbose_wallops(_("QLINE expired on \2%s\2, set by \2%s\2"),
+			q->mask, q->setby);
 
-			verbose_wallops(_("QLINE expired on \2%s\2, set by \2%s\2"),
-				q->mask, q->setby);
-
-			qline_delete(q->mask);
-		}
+		qline_destroy(q);
 	}
 }
 
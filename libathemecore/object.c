@@ -27,17 +27,181 @@
 mowgli_list_t object_list = { NULL, NULL, 0 };
 #endif
 
-mowgli_heap_t *metadata_heap;	/* HEAP_CHANUSER */
+/*
+ * Metadata names are interned in metadata_keys (case-insensitively), so an
+ * entry only points at its key and a lookup of a name nobody has used is a
+ * miss without touching the object. Each object keeps its entries in a
+ * table allocated on the first metadata_add(): a vector sorted by key id
+ * while it is small, an open-addressed hash on the key id past
+ * METADATA_VECTOR_MAX entries. An entry and its value are one allocation.
+ */
+
+#define METADATA_VECTOR_MAX	16
+#define METADATA_HASH_MIN	64
+#define METADATA_HASH(id)	((id) * 2654435761U)
+
+struct metadata_key_ {
+	char *name;
+	unsigned int id;
+	unsigned int refs;	/* entries using this key */
+};
+
+struct metadata_table_ {
+	unsigned int count;	/* entries */
+	unsigned int used;	/* entries and tombstones, when hashed */
+	unsigned int size;	/* slots */
+	bool hashed;
+	metadata_t *slots[];
+};
+
+static mowgli_patricia_t *metadata_keys;
+static unsigned int metadata_key_ids;
+static metadata_t metadata_tombstone;
+
+#define METADATA_DELETED	(&metadata_tombstone)
 
 void init_metadata(void)
 {
-	metadata_heap = sharedheap_get(sizeof(metadata_t));
+	metadata_keys = mowgli_patricia_create(strcasecanon);
+}
+
+static metadata_key_t *metadata_key_get(const char *name)
+{
+	metadata_key_t *key;
+
+	if (metadata_keys == NULL)
+		init_metadata();
+
+	key = mowgli_patricia_retrieve(metadata_keys, name);
+	if (key == NULL)
+	{
+		key = smalloc(sizeof *key);
+		key->name = sstrdup(name);
+		key->id = ++metadata_key_ids;
+		mowgli_patricia_add(metadata_keys, key->name, key);
+	}
+
+	key->refs++;
+	return key;
+}
+
+static void metadata_key_put(metadata_key_t *key)
+{
+	if (--key->refs != 0)
+		return;
+
+	mowgli_patricia_delete(metadata_keys, key->name);
+	free(key->name);
+	free(key);
+}
+
+static size_t metadata_table_bytes(unsigned int size)
+{
+	return sizeof(metadata_table_t) + size * sizeof(metadata_t *);
+}
+
+/* the vector position of key, or where it would go */
+static unsigned int metadata_vector_pos(metadata_table_t *t, metadata_key_t *key)
+{
+	unsigned int lo = 0, hi = t->count, mid;
 
-	if (metadata_heap == NULL)
+	while (lo < hi)
 	{
-		slog(LG_ERROR, "init_metadata(): block allocator failure.");
-		exit(EXIT_FAILURE);
+		mid = (lo + hi) / 2;
+		if (t->slots[mid]->key->id < key->id)
+			lo = mid + 1;
+		else
+			hi = mid;
 	}
+
+	return lo;
+}
+
+static metadata_t **metadata_table_find(metadata_table_t *t, metadata_key_t *key)
+{
+	unsigned int i, mask;
+
+	if (!t->hashed)
+	{
+		i = metadata_vector_pos(t, key);
+		return i < t->count && t->slots[i]->key == key ? &t->slots[i] : NULL;
+	}
+
+	mask = t->size - 1;
+	for (i = METADATA_HASH(key->id) & mask; t->slots[i] != NULL; i = (i + 1) & mask)
+		if (t->slots[i] != METADATA_DELETED && t->slots[i]->key == key)
+			return &t->slots[i];
+
+	return NULL;
+}
+
+static void metadata_hash_add(metadata_table_t *t, metadata_t *md)
+{
+	unsigned int i, mask = t->size - 1;
+
+	for (i = METADATA_HASH(md->key->id) & mask; t->slots[i] != NULL && t->slots[i] != METADATA_DELETED; i = (i + 1) & mask)
+		;
+
+	if (t->slots[i] == NULL)
+		t->used++;
+	t->slots[i] = md;
+	t->count++;
+}
+
+static metadata_table_t *metadata_table_rehash(metadata_table_t *t, unsigned int size)
+{
+	metadata_table_t *nt;
+	unsigned int i;
+
+	nt = smalloc(metadata_table_bytes(size));
+	nt->size = size;
+	nt->hashed = true;
+
+	for (i = 0; i < (t->hashed ? t->size : t->count); i++)
+		if (t->slots[i] != NULL && t->slots[i] != METADATA_DELETED)
+			metadata_hash_add(nt, t->slots[i]);
+
+	free(t);
+	return nt;
+}
+
+/* md's key must not be in t yet */
+static metadata_table_t *metadata_table_add(metadata_table_t *t, metadata_t *md)
+{
+	unsigned int pos, size;
+
+	if (t == NULL)
+	{
+		t = smalloc(metadata_table_bytes(2));
+		t->size = 2;
+	}
+
+	if (!t->hashed && t->count < METADATA_VECTOR_MAX)
+	{
+		if (t->count == t->size)
+		{
+			t->size *= 2;
+			t = srealloc(t, metadata_table_bytes(t->size));
+		}
+
+		pos = metadata_vector_pos(t, md->key);
+		memmove(&t->slots[pos + 1], &t->slots[pos], (t->count - pos) * sizeof(metadata_t *));
+		t->slots[pos] = md;
+		t->count++;
+
+		return t;
+	}
+
+	/* keep at most half the slots used, counting tombstones */
+	if (!t->hashed || (t->used + 1) * 2 > t->size)
+	{
+		for (size = METADATA_HASH_MIN; (t->count + 1) * 4 > size; size *= 2)
+			;
+		t = metadata_table_rehash(t, size);
+	}
+
+	metadata_hash_add(t, md);
+	return t;
 }
 
 /*
@@ -63,6 +227,7 @@ void object_init(object_t *obj, const char *name, destructor_t des)
 
 	obj->destructor = des;
 	obj->refcount = 1;
+	obj->journal_type = DB_JOURNAL_NONE;
 
 #ifdef OBJECT_DEBUG
 	mowgli_node_add(obj, &obj->dnode, &object_list);
@@ -180,7 +345,10 @@ void object_unref(void *obj)
 void object_dispose(void *object)
 {
 	object_t *obj;
-	mowgli_patricia_t *privatedata, *metadata;
+	mowgli_patricia_t *privatedata;
+	metadata_table_t *metadata;
+	metadata_t *md;
+	unsigned int i;
 
 	return_if_fail(object != NULL);
 	obj = object(object);
@@ -212,32 +380,48 @@ void object_dispose(void *object)
 	if (privatedata != NULL)
 		mowgli_patricia_destroy(privatedata, NULL, NULL);
 
+	/* whatever the destructor did not delete goes quietly; the table
+	 * is kept until here while disposing, see metadata_delete() */
 	if (metadata != NULL)
-		mowgli_patricia_destroy(metadata, NULL, NULL);
+	{
+		for (i = 0; i < (metadata->hashed ? metadata->size : metadata->count); i++)
+		{
+			md = metadata->slots[i];
+			if (md == NULL || md == METADATA_DELETED)
+				continue;
+
+			metadata_key_put(md->key);
+			free(md);
+		}
+
+		free(metadata);
+	}
 }
 
 metadata_t *metadata_add(void *target, const char *name, const char *value)
 {
 	object_t *obj;
 	metadata_t *md;
+	size_t len;
 
 	return_val_if_fail(name != NULL, NULL);
 	return_val_if_fail(value != NULL, NULL);
 
 	obj = object(target);
 
-	if (obj->metadata == NULL)
-		obj->metadata = mowgli_patricia_create(strcasecanon);
-
 	if (metadata_find(target, name))
 		metadata_delete(target, name);
 
-	md = mowgli_heap_alloc(metadata_heap);
+	len = strlen(value);
+	md = smalloc(sizeof(metadata_t) + len + 1);
+	md->key = metadata_key_get(name);
+	md->name = md->key->name;
+	md->value = (char *)(md + 1);
+	memcpy(md->value, value, len + 1);
 
-	md->name = strshare_get(name);
-	md->value = sstrdup(value);
+	obj->metadata = metadata_table_add(obj->metadata, md);
 
-	mowgli_patricia_add(obj->metadata, md->name, md);
+	db_journal_metadata(target, md->name);
 
 	return md;
 }
@@ -245,54 +429,155 @@ metadata_t *metadata_add(void *target, const char *name, const char *value)
 void metadata_delete(void *target, const char *name)
 {
 	object_t *obj;
-	metadata_t *md = metadata_find(target, name);
+	metadata_table_t *t;
+	metadata_key_t *key;
+	metadata_t **slot, *md;
+	unsigned int pos;
 
-	if (!md)
-		return;
+	return_if_fail(target != NULL);
+	return_if_fail(name != NULL);
 
 	obj = object(target);
+	t = obj->metadata;
+
+	if (t == NULL || metadata_keys == NULL)
+		return;
+
+	key = mowgli_patricia_retrieve(metadata_keys, name);
+	if (key == NULL || (slot = metadata_table_find(t, key)) == NULL)
+		return;
+
+	md = *slot;
 
-	if (obj->metadata == NULL)
-		obj->metadata = mowgli_patricia_create(strcasecanon);
+	if (t->hashed)
+		*slot = METADATA_DELETED;
+	else
+	{
+		pos = slot - t->slots;
+		memmove(&t->slots[pos], &t->slots[pos + 1], (t->count - pos - 1) * sizeof(metadata_t *));
+	}
+	t->count--;
 
-	mowgli_patricia_delete(obj->metadata, name);
+	/* object_dispose() frees the table after the destructor is done */
+	if (t->count == 0 && obj->refcount != -1)
+	{
+		free(t);
+		obj->metadata = NULL;
+	}
 
-	strshare_unref(md->name);
-	free(md->value);
+	db_journal_metadata(target, md->name);
 
-	mowgli_heap_free(metadata_heap, md);
+	metadata_key_put(md->key);
+	free(md);
 }
 
 metadata_t *metadata_find(void *target, const char *name)
 {
 	object_t *obj;
+	metadata_key_t *key;
+	metadata_t **slot;
 
 	return_val_if_fail(target != NULL, NULL);
 	return_val_if_fail(name != NULL, NULL);
 
 	obj = object(target);
 
-	if (obj->metadata == NULL)
-		obj->metadata = mowgli_patricia_create(strcasecanon);
+	if (obj->metadata == NULL || metadata_keys == NULL)
+		return NULL;
+
+	if ((key = mowgli_patricia_retrieve(metadata_keys, name)) == NULL)
+		return NULL;
 
-	return mowgli_patricia_retrieve(obj->metadata, name);
+	slot = metadata_table_find(obj->metadata, key);
+
+	return slot != NULL ? *slot : NULL;
 }
 
 void metadata_delete_all(void *target)
 {
-	object_t *obj;
 	metadata_t *md;
+	metadata_iteration_state_t state;
+
+	METADATA_FOREACH(md, &state, target)
+	{
+		metadata_delete(target, md->name);
+	}
+}
+
+metadata_t *metadata_foreach_start(metadata_iteration_state_t *state, void *target)
+{
+	metadata_table_t *t;
+
+	state->obj = object(target);
+	t = state->obj->metadata;
+
+	/* downwards, so deleting the current entry moves nothing not yet seen */
+	state->pos = t == NULL ? 0 : t->hashed ? t->size : t->count;
+
+	return metadata_foreach_next(state);
+}
+
+metadata_t *metadata_foreach_next(metadata_iteration_state_t *state)
+{
+	metadata_table_t *t;
+	metadata_t *md;
+
+	while ((t = state->obj->metadata) != NULL && state->pos > 0)
+	{
+		md = t->slots[--state->pos];
+
+		if (!t->hashed || (md != NULL && md != METADATA_DELETED))
+			return md;
+	}
+
+	return NULL;
+}
+
+unsigned int metadata_count(void *target)
+{
+	metadata_table_t *t = object(target)->metadata;
+
+	return t != NULL ? t->count : 0;
+}
+
+/* bytes held by the object's metadata, not counting the shared keys */
+size_t metadata_footprint(void *target)
+{
+	metadata_table_t *t = object(target)->metadata;
+	metadata_iteration_state_t state;
+	metadata_t *md;
+	size_t bytes;
+
+	if (t == NULL)
+		return 0;
+
+	bytes = metadata_table_bytes(t->size);
+
+	METADATA_FOREACH(md, &state, target)
+		bytes += sizeof(metadata_t) + strlen(md->value) + 1;
+
+	return bytes;
+}
+
+/* bytes held by the interned keys, not counting their dictionary */
+size_t metadata_key_footprint(unsigned int *count)
+{
 	mowgli_patricia_iteration_state_t state;
+	metadata_key_t *key;
+	size_t bytes = 0;
 
-	obj = object(target);
+	*count = 0;
 
-	if (obj->metadata == NULL)
-		obj->metadata = mowgli_patricia_create(strcasecanon);
+	if (metadata_keys == NULL)
+		return 0;
 
-	MOWGLI_PATRICIA_FOREACH(md, &state, obj->metadata)
+	MOWGLI_PATRICIA_FOREACH(key, &state, metadata_keys)
 	{
-		metadata_delete(obj, md->name);
+		bytes += sizeof(metadata_key_t) + strlen(key->name) + 1;
+		(*count)++;
 	}
+
+	return bytes;
 }
 
 void *privatedata_get(void *target, const char *key)
@@ -317,6 +602,17 @@ void privatedata_set(void *target, const char *key, void *data)
 	mowgli_patricia_add(obj->privatedata, key, data);
 }
 
+void *privatedata_delete(void *target, const char *key)
+{
+	object_t *obj;
+
+	obj = object(target);
+	if (obj->privatedata == NULL)
+		return NULL;
+
+	return mowgli_patricia_delete(obj->privatedata, key);
+}
+
 /* vim:cinoptions=>s,e0,n0,f0,{0,}0,^0,=s,ps,t0,c3,+s,(2s,us,)20,*30,gs,hs
  * vim:ts=8
  * vim:sw=8
@@ -36,23 +36,33 @@ static void irc_recvq_handler(connection_t *cptr)
 {
 	bool wasnonl;
 	char parsebuf[BUFSIZE + 1];
-	int count;
+	char *line;
+	size_t count;
+	unsigned long long start;
 
 	wasnonl = cptr->flags & CF_NONEWLINE ? true : false;
-	count = recvq_getline(cptr, parsebuf, sizeof parsebuf - 1);
-	if (count <= 0)
+	line = recvq_getline_inplace(cptr, BUFSIZE, &count);
+	if (line == NULL || count == 0)
 		return;
 	cnt.bin += count;
 	/* ignore the excessive part of a too long line */
 	if (wasnonl)
 		return;
 	me.uplinkpong = CURRTIME;
-	if (parsebuf[count - 1] == '\n')
+	if (line[count - 1] == '\n')
 		count--;
-	if (count > 0 && parsebuf[count - 1] == '\r')
+	else
+	{
+		/* cut off; terminating it in place would clobber the rest */
+		memcpy(parsebuf, line, count);
+		line = parsebuf;
+	}
+	if (count > 0 && line[count - 1] == '\r')
 		count--;
-	parsebuf[count] = '\0';
-	parse(parsebuf);
+	line[count] = '\0';
+	start = prof_begin();
+	parse(line);
+	prof_end(PROF_PARSE, start);
 }
 
 static void ping_uplink(void *arg)
@@ -90,7 +90,13 @@ void pcommand_delete(const char *token)
 
 pcommand_t *pcommand_find(const char *token)
 {
-	return mowgli_patricia_retrieve(pcommands, token);
+	unsigned long long start = prof_begin();
+	pcommand_t *pc;
+
+	pc = mowgli_patricia_retrieve(pcommands, token);
+	prof_end(PROF_PCOMMAND_FIND, start);
+
+	return pc;
 }
 
 /* vim:cinoptions=>s,e0,n0,f0,{0,}0,^0,=s,ps,t0,c3,+s,(2s,us,)20,*30,gs,hs
@@ -34,6 +34,20 @@ static operclass_t *user_r = NULL;
 static operclass_t *authenticated_r = NULL;
 static operclass_t *ircop_r = NULL;
 
+/* privilege names are interned into small ids, which index the bitsets */
+#define PRIV_BITS		(sizeof(unsigned long) * CHAR_BIT)
+#define PRIV_CACHE_SIZE		64
+
+static mowgli_patricia_t *priv_ids;
+static char **priv_names;
+static unsigned int priv_count, priv_alloc;
+
+/* most checks pass the same PRIV_* literals, so remember them by address */
+static struct {
+	const char *priv;
+	int id;
+} priv_cache[PRIV_CACHE_SIZE];
+
 void init_privs(void)
 {
 	operclass_heap = sharedheap_get(sizeof(operclass_t));
@@ -45,12 +59,112 @@ void init_privs(void)
 		exit(EXIT_FAILURE);
 	}
 
+	priv_ids = mowgli_patricia_create(strcasecanon);
+
 	/* create built-in operclasses. */
 	user_r = operclass_add("user", "", OPERCLASS_BUILTIN);
 	authenticated_r = operclass_add("authenticated", AC_AUTHENTICATED, OPERCLASS_BUILTIN);
 	ircop_r = operclass_add("ircop", "", OPERCLASS_BUILTIN);
 }
 
+/*****************
+ * P R I V   I D S *
+ *****************/
+
+/*
+ * priv_intern(const char *priv)
+ *
+ * Returns the id of a privilege name, assigning the next free one if the
+ * name is new. Ids are never reused.
+ */
+int priv_intern(const char *priv)
+{
+	int id;
+
+	return_val_if_fail(priv != NULL, -1);
+
+	if ((id = priv_find(priv)) >= 0)
+		return id;
+
+	if (priv_count == priv_alloc)
+	{
+		priv_alloc = priv_alloc ? priv_alloc * 2 : 64;
+		priv_names = srealloc(priv_names, priv_alloc * sizeof(char *));
+	}
+
+	id = priv_count++;
+	priv_names[id] = sstrdup(priv);
+	mowgli_patricia_add(priv_ids, priv_names[id], (void *)(uintptr_t)(id + 1));
+
+	return id;
+}
+
+/*
+ * priv_find(const char *priv)
+ *
+ * Returns the id of a privilege name, or -1 if no operclass has ever
+ * listed it (in which case nobody has it).
+ */
+int priv_find(const char *priv)
+{
+	unsigned int slot = ((uintptr_t)priv >> 3) % PRIV_CACHE_SIZE;
+	int id;
+
+	return_val_if_fail(priv != NULL, -1);
+
+	/* the address may have been reused for another string; check */
+	if (priv_cache[slot].priv == priv &&
+			!strcasecmp(priv_names[priv_cache[slot].id], priv))
+		return priv_cache[slot].id;
+
+	id = (int)(uintptr_t)mowgli_patricia_retrieve(priv_ids, priv) - 1;
+	if (id >= 0)
+	{
+		priv_cache[slot].priv = priv;
+		priv_cache[slot].id = id;
+	}
+
+	return id;
+}
+
+static void operclass_build_privs(operclass_t *operclass)
+{
+	char *privs, *priv, *saveptr = NULL;
+	unsigned int word, words;
+	int id;
+
+	free(operclass->privbits);
+	operclass->privbits = NULL;
+	operclass->privwords = 0;
+
+	privs = sstrdup(operclass->privs);
+	for (priv = strtok_r(privs, " ", &saveptr); priv != NULL; priv = strtok_r(NULL, " ", &saveptr))
+	{
+		id = priv_intern(priv);
+		word = id / PRIV_BITS;
+
+		if (word >= operclass->privwords)
+		{
+			words = word + 1;
+			operclass->privbits = srealloc(operclass->privbits, words * sizeof(unsigned long));
+			memset(operclass->privbits + operclass->privwords, 0,
+					(words - operclass->privwords) * sizeof(unsigned long));
+			operclass->privwords = words;
+		}
+
+		operclass->privbits[word] |= 1UL << (id % PRIV_BITS);
+	}
+	free(privs);
+}
+
+static inline bool operclass_has_id(const operclass_t *operclass, int id)
+{
+	if (operclass == NULL || id < 0 || (unsigned int)id / PRIV_BITS >= operclass->privwords)
+		return false;
+
+	return (operclass->privbits[id / PRIV_BITS] & (1UL << (id % PRIV_BITS))) != 0;
+}
+
 /*************************
  * O P E R C L A S S E S *
  *************************/
@@ -75,6 +189,7 @@ operclass_t *operclass_add(const char *name, const char *privs, int flags)
 		free(operclass->privs);
 		operclass->privs = sstrdup(privs);
 		operclass->flags = flags | (builtin ? OPERCLASS_BUILTIN : 0);
+		operclass_build_privs(operclass);
 
 		return operclass;
 	}
@@ -85,6 +200,7 @@ operclass_t *operclass_add(const char *name, const char *privs, int flags)
 	operclass->name = sstrdup(name);
 	operclass->privs = sstrdup(privs);
 	operclass->flags = flags;
+	operclass_build_privs(operclass);
 
 	mowgli_node_add(operclass, &operclass->node, &operclasslist);
 
@@ -123,6 +239,7 @@ void operclass_delete(operclass_t *operclass)
 
 	free(operclass->name);
 	free(operclass->privs);
+	free(operclass->privbits);
 
 	mowgli_heap_free(operclass_heap, operclass);
 	cnt.operclass--;
@@ -290,36 +407,11 @@ bool is_conf_soper(myuser_t *myuser)
 	return false;
 }
 
-/* name1 name2 name3... */
-static bool string_in_list(const char *str, const char *name)
-{
-	char *p;
-	int l;
-
-	if (str == NULL)
-		return false;
-	l = strlen(name);
-	while (*str != '\0')
-	{
-		p = strchr(str, ' ');
-		if (p != NULL ? p - str == l && !strncasecmp(str, name, p - str) : !strcasecmp(str, name))
-			return true;
-		if (p == NULL)
-			return false;
-		str = p;
-		while (*str == ' ')
-			str++;
-	}
-	return false;
-}
-
 bool has_priv_operclass(operclass_t *operclass, const char *priv)
 {
 	if (operclass == NULL)
 		return false;
-	if (string_in_list(operclass->privs, priv))
-		return true;
-	return false;
+	return operclass_has_id(operclass, priv_find(priv));
 }
 
 bool has_any_privs(sourceinfo_t *si)
@@ -342,26 +434,17 @@ bool has_any_privs_user(user_t *u)
 	return false;
 }
 
-bool has_priv(sourceinfo_t *si, const char *priv)
-{
-	return si->su != NULL ? has_priv_user(si->su, priv) :
-		has_priv_myuser(si->smu, priv);
-}
-
-bool has_priv_user(user_t *u, const char *priv)
+static bool has_priv_user_id(user_t *u, int id)
 {
 	operclass_t *operclass;
 
-	if (priv == NULL)
-		return true;
-
 	if (u == NULL)
 		return false;
 
-	if (has_priv_operclass(user_r, priv))
+	if (operclass_has_id(user_r, id))
 		return true;
 
-	if (is_ircop(u) && has_priv_operclass(ircop_r, priv))
+	if (is_ircop(u) && operclass_has_id(ircop_r, id))
 		return true;
 
 	if (u->myuser == NULL || u->myuser->flags & MU_WAITAUTH)
@@ -370,7 +453,7 @@ bool has_priv_user(user_t *u, const char *priv)
 	}
 	else
 	{
-		if (has_priv_operclass(authenticated_r, priv))
+		if (operclass_has_id(authenticated_r, id))
 			return true;
 
 		if (is_soper(u->myuser))
@@ -382,7 +465,7 @@ bool has_priv_user(user_t *u, const char *priv)
 				return false;
 			if (u->myuser->soper->password != NULL && !(u->flags & UF_SOPER_PASS))
 				return false;
-			if (has_priv_operclass(operclass, priv))
+			if (operclass_has_id(operclass, id))
 				return true;
 		}
 	}
@@ -390,16 +473,14 @@ bool has_priv_user(user_t *u, const char *priv)
 	return false;
 }
 
-bool has_priv_myuser(myuser_t *mu, const char *priv)
+static bool has_priv_myuser_id(myuser_t *mu, int id)
 {
 	operclass_t *operclass;
 
-	if (priv == NULL)
-		return true;
 	if (mu == NULL || mu->flags & MU_WAITAUTH)
 		return false;
 
-	if (has_priv_operclass(authenticated_r, priv))
+	if (operclass_has_id(authenticated_r, id))
 		return true;
 
 	if (!is_soper(mu))
@@ -407,29 +488,57 @@ bool has_priv_myuser(myuser_t *mu, const char *priv)
 	operclass = mu->soper->operclass;
 	if (operclass == NULL)
 		return false;
-	if (has_priv_operclass(operclass, priv))
+	if (operclass_has_id(operclass, id))
 		return true;
 
 	return false;
 }
 
+static bool has_priv_id(sourceinfo_t *si, int id)
+{
+	return si->su != NULL ? has_priv_user_id(si->su, id) :
+		has_priv_myuser_id(si->smu, id);
+}
+
+bool has_priv(sourceinfo_t *si, const char *priv)
+{
+	if (priv == NULL)
+		return true;
+
+	return has_priv_id(si, priv_find(priv));
+}
+
+bool has_priv_user(user_t *u, const char *priv)
+{
+	if (priv == NULL)
+		return true;
+
+	return has_priv_user_id(u, priv_find(priv));
+}
+
+bool has_priv_myuser(myuser_t *mu, const char *priv)
+{
+	if (priv == NULL)
+		return true;
+
+	return has_priv_myuser_id(mu, priv_find(priv));
+}
+
 bool has_all_operclass(sourceinfo_t *si, operclass_t *operclass)
 {
-	char *privs2;
-	char *priv;
+	unsigned int word;
+	unsigned long bits;
+	int bit;
 
-	privs2 = sstrdup(operclass->privs);
-	priv = strtok(privs2, " ");
-	while (priv != NULL)
+	for (word = 0; word < operclass->privwords; word++)
 	{
-		if (!has_priv(si, priv))
+		for (bits = operclass->privbits[word], bit = 0; bits != 0; bits >>= 1, bit++)
 		{
-			free(privs2);
-			return false;
+			if ((bits & 1) && !has_priv_id(si, word * PRIV_BITS + bit))
+				return false;
 		}
-		priv = strtok(NULL, " ");
 	}
-	free(privs2);
+
 	return true;
 }
 
@@ -0,0 +1,50 @@
+/*
+ * Copyright (c) 2014- Shaltúre project (http://github.com/shalture)
+ * Rights to this code are as documented in doc/LICENSE.
+ *
+ * Phase timers for profiling uplink bursts.  The core brackets a few hot
+ * entry points with prof_begin()/prof_end(); they cost one branch while
+ * prof_enabled is false.
+ *
+ */
+
+#include "atheme.h"
+
+bool prof_enabled = false;
+prof_counter_t prof_counters[PROF_COUNT];
+
+const char *prof_names[PROF_COUNT] = {
+	[PROF_PARSE]		= "parse",
+	[PROF_PCOMMAND_FIND]	= "pcommand_find",
+	[PROF_USER_ADD]		= "user_add",
+	[PROF_CHANNEL_ADD]	= "channel_add",
+	[PROF_CHANUSER_ADD]	= "chanuser_add",
+	[PROF_HOOKS]		= "hooks",
+	[PROF_SEND]		= "send",
+};
+
+unsigned long long prof_now(void)
+{
+#ifdef CLOCK_MONOTONIC
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (unsigned long long) ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+#else
+	struct timeval tv;
+
+	gettimeofday(&tv, NULL);
+	return (unsigned long long) tv.tv_sec * 1000000000ULL + tv.tv_usec * 1000ULL;
+#endif
+}
+
+void prof_reset(void)
+{
+	memset(prof_counters, 0, sizeof prof_counters);
+}
+
+/* vim:cinoptions=>s,e0,n0,f0,{0,}0,^0,=s,ps,t0,c3,+s,(2s,us,)20,*30,gs,hs
+ * vim:ts=8
+ * vim:sw=8
+ * vim:noexpandtab
+ */
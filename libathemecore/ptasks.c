@@ -85,6 +85,12 @@ static void connection_stats_cb(const char *line, void *privdata)
 	numeric_sts(me.me, 249, ((user_t *)privdata), "F :%s", line);
 }
 
+static void hook_stats_cb(hook_t *hook, void *privdata)
+{
+	numeric_sts(me.me, 249, ((user_t *)privdata), "M :%-28s %10lu %7zu %12llu",
+		    hook->name, hook->calls, MOWGLI_LIST_LENGTH(&hook->hooks), hook->usec);
+}
+
 void handle_stats(user_t *u, char req)
 {
 	kline_t *k;
@@ -197,6 +203,15 @@ void handle_stats(user_t *u, char req)
 
 		  break;
 
+	  case 'M':
+	  case 'm':
+		  if (!has_priv_user(u, PRIV_SERVER_AUSPEX))
+			  break;
+
+		  numeric_sts(me.me, 249, u, "M :%-28s %10s %7s %12s", "Hook", "Calls", "Subscr", "Usec");
+		  hook_stats(hook_stats_cb, u);
+		  break;
+
 	  case 'o':
 	  case 'O':
 		  if (!has_priv_user(u, PRIV_VIEWPRIVS))
@@ -468,8 +483,9 @@ handle_channel_message(sourceinfo_t *si, char *target, bool is_notice, char *mes
 {
 	char *vec[3];
 	hook_cmessage_data_t cdata;
-	mowgli_node_t *n, *tn;
-	mowgli_list_t l = { NULL, NULL, 0 };
+	mowgli_node_t *n;
+	service_t *svsbuf[16], **svslist = svsbuf;
+	unsigned int i, count = 0;
 	service_t *svs;
 
 	/* Call hook here */
@@ -487,13 +503,13 @@ handle_channel_message(sourceinfo_t *si, char *target, bool is_notice, char *mes
 	vec[1] = message;
 	vec[2] = NULL;
 
-	MOWGLI_ITER_FOREACH(n, cdata.c->members.head)
+	if (cdata.c->numsvcmembers > ARRAY_SIZE(svsbuf))
+		svslist = smalloc(cdata.c->numsvcmembers * sizeof *svslist);
+
+	MOWGLI_ITER_FOREACH(n, cdata.c->svcmembers.head)
 	{
 		chanuser_t *cu = (chanuser_t *) n->data;
 
-		if (!is_internal_client(cu->user))
-			continue;
-
 		svs = service_find_nick(cu->user->nick);
 
 		if (svs == NULL)
@@ -502,21 +518,22 @@ handle_channel_message(sourceinfo_t *si, char *target, bool is_notice, char *mes
 		if (svs->chanmsg == false)
 			continue;
 
-		mowgli_node_add(svs, mowgli_node_create(), &l);
+		svslist[count++] = svs;
 	}
 	/* Note: this assumes a fantasy command will not remove another
-	 * service.
+	 * service. It may make services part the channel, though.
 	 */
-	MOWGLI_ITER_FOREACH_SAFE(n, tn, l.head)
+	for (i = 0; i < count; i++)
 	{
-		si->service = n->data;
+		si->service = svslist[i];
 		if (is_notice)
 			si->service->notice_handler(si, 2, vec);
 		else
 			si->service->handler(si, 2, vec);
-		mowgli_node_delete(n, &l);
-		mowgli_node_free(n);
 	}
+
+	if (svslist != svsbuf)
+		free(svslist);
 }
 
 void handle_message(sourceinfo_t *si, char *target, bool is_notice, char *message)
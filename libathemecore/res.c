@@ -87,6 +87,7 @@ static int check_question(struct reslist *request, RESHEADER * header, char *buf
 static int proc_answer(struct reslist *request, RESHEADER * header, char *, char *);
 static struct reslist *find_id(int id);
 static dns_reply_t *make_dnsreply(struct reslist *request);
+static void res_callback(struct reslist *request, dns_reply_t *reply, dns_result_t result, unsigned int ttl);
 
 /*
  * int
@@ -175,7 +176,7 @@ static time_t timeout_query_list(time_t now)
 		{
 			if (--request->retries <= 0)
 			{
-				(*request->query->callback) (request->query->ptr, NULL);
+				res_callback(request, NULL, DNS_FAILED, 0);
 				rem_request(request);
 				continue;
 			}
@@ -735,6 +736,73 @@ static int proc_answer(struct reslist *request, RESHEADER * header, char *buf, c
 	return (1);
 }
 
+/*
+ * proc_negative_ttl - find how long a reply saying there is no such
+ * name or record may be cached: the smaller of the TTL and MINIMUM of
+ * the SOA record in the authority section (RFC 2308), or 0 without one
+ */
+static unsigned int proc_negative_ttl(RESHEADER * header, char *buf, char *eob)
+{
+	unsigned char *current = (unsigned char *)buf + sizeof(RESHEADER);
+	unsigned char *end = (unsigned char *)eob;
+	unsigned char *rdata, *rdend;
+	unsigned long ttl, minimum;
+	unsigned int count;
+	int n, type, rd_length;
+
+	/* check_question() made sure there is exactly one question */
+	if ((n = irc_dn_skipname(current, end)) < 0)
+		return 0;
+	current += (size_t) n + QFIXEDSZ;
+
+	for (count = header->ancount + header->nscount; count > 0; count--)
+	{
+		if (current >= end || (n = irc_dn_skipname(current, end)) < 0)
+			return 0;
+		current += (size_t) n;
+
+		if (current + ANSWER_FIXED_SIZE > end)
+			return 0;
+
+		type = irc_ns_get16(current);
+		current += TYPE_SIZE + CLASS_SIZE;
+
+		ttl = irc_ns_get32(current);
+		current += TTL_SIZE;
+
+		rd_length = irc_ns_get16(current);
+		current += RDLENGTH_SIZE;
+
+		rdata = current;
+		rdend = current + rd_length;
+		if (rdend > end)
+			return 0;
+		current = rdend;
+
+		/* answers (CNAMEs leading nowhere) come first; skip them */
+		if (type != T_SOA || count > header->nscount)
+			continue;
+
+		/* MNAME, RNAME, then SERIAL REFRESH RETRY EXPIRE MINIMUM */
+		if ((n = irc_dn_skipname(rdata, rdend)) < 0)
+			return 0;
+		rdata += n;
+		if ((n = irc_dn_skipname(rdata, rdend)) < 0)
+			return 0;
+		rdata += n;
+		if (rdata + 5 * NS_INT32SZ > rdend)
+			return 0;
+
+		minimum = irc_ns_get32(rdata + 4 * NS_INT32SZ);
+		if (ttl > 0x7fffffffUL)
+			ttl = 0;
+
+		return ttl < minimum ? ttl : minimum;
+	}
+
+	return 0;
+}
+
 /*
  * res_read_single_reply - read a dns reply from the nameserver and process it.
  * Return value: 1 if a packet was read, 0 otherwise
@@ -795,9 +863,9 @@ static int res_read_single_reply(connection_t *F)
 
 	if ((header->rcode != NO_ERRORS) || (header->ancount == 0))
 	{
-		if (NXDOMAIN == header->rcode)
+		if (NXDOMAIN == header->rcode || NO_ERRORS == header->rcode)
 		{
-			(*request->query->callback) (request->query->ptr, NULL);
+			res_callback(request, NULL, DNS_NEGATIVE, proc_negative_ttl(header, buf, buf + rc));
 			rem_request(request);
 		}
 		else
@@ -806,7 +874,7 @@ static int res_read_single_reply(connection_t *F)
 			 * If a bad error was returned, we stop here and dont send
 			 * send any more (no retries granted).
 			 */
-			(*request->query->callback) (request->query->ptr, NULL);
+			res_callback(request, NULL, DNS_FAILED, 0);
 			rem_request(request);
 		}
 		return 1;
@@ -827,7 +895,7 @@ static int res_read_single_reply(connection_t *F)
 				 * got a PTR response with no name, something bogus is happening
 				 * don't bother trying again, the client address doesn't resolve
 				 */
-				(*request->query->callback) (request->query->ptr, reply);
+				res_callback(request, NULL, DNS_FAILED, 0);
 				rem_request(request);
 				return 1;
 			}
@@ -851,7 +919,7 @@ static int res_read_single_reply(connection_t *F)
 			 * got a name and address response, client resolved
 			 */
 			reply = make_dnsreply(request);
-			(*request->query->callback) (request->query->ptr, reply);
+			res_callback(request, reply, DNS_ANSWER, request->ttl);
 			free(reply);
 			rem_request(request);
 		}
@@ -859,7 +927,7 @@ static int res_read_single_reply(connection_t *F)
 	else
 	{
 		/* couldn't decode, give up -- jilles */
-		(*request->query->callback) (request->query->ptr, NULL);
+		res_callback(request, NULL, DNS_FAILED, 0);
 		rem_request(request);
 	}
 	return 1;
@@ -871,6 +939,17 @@ static void res_readreply(connection_t *cptr)
 		;
 }
 
+/*
+ * res_callback - tell the owner of a query how it ended
+ */
+static void res_callback(struct reslist *request, dns_reply_t *reply, dns_result_t result, unsigned int ttl)
+{
+	request->query->result = result;
+	request->query->ttl = ttl;
+
+	(*request->query->callback) (request->query->ptr, reply);
+}
+
 static dns_reply_t *make_dnsreply(struct reslist *request)
 {
 	dns_reply_t *cp;
@@ -29,8 +29,9 @@
 int sts(const char *fmt, ...)
 {
 	va_list ap;
-	char buf[513];
+	char *buf;
 	int len;
+	unsigned long long start;
 
 	if (!me.connected)
 		return 0;
@@ -39,18 +40,29 @@ int sts(const char *fmt, ...)
 	return_val_if_fail(curr_uplink->conn != NULL, 0);
 	return_val_if_fail(fmt != NULL, 0);
 
+	start = prof_begin();
+
+	/* format straight into the send queue */
+	buf = sendq_reserve(curr_uplink->conn, 512);
+	if (buf == NULL)
+		return 0;
+
 	va_start(ap, fmt);
-	vsnprintf(buf, 511, fmt, ap); /* leave two bytes for \r\n */
+	len = vsnprintf(buf, 511, fmt, ap); /* leave two bytes for \r\n */
 	va_end(ap);
 
-	len = strlen(buf);
+	if (len < 0)
+		return 0;
+	if (len > 510)
+		len = 510;
 	buf[len++] = '\r';
 	buf[len++] = '\n';
-	buf[len] = '\0';
 
 	cnt.bout += len;
 
-	sendq_add(curr_uplink->conn, buf, len);
+	/* commit before logging: a log channel sends through sts() too */
+	sendq_commit(curr_uplink->conn, len);
+	prof_end(PROF_SEND, start);
 
 	slog(LG_RAWDATA, "<- %.*s", len, buf);
 
@@ -22,9 +22,31 @@
  */
 
 #include "atheme.h"
+#include "internal.h"
 
 mowgli_list_t svs_ignore_list;
 
+/*
+ * Ignores are indexed like klines (see node.c): on the literal tail of the
+ * whole nick!user@host mask, with masks whose host is a CIDR range in a
+ * trie per address family instead. A user's result is cached on the user
+ * until the ignore list or the user's nick, username or host changes.
+ */
+static mask_index_t svsignore_masks;
+static cidr_node_t *svsignore_cidr[2];	/* IPv4, IPv6 */
+static unsigned int svsignore_gen = 1;
+
+/* parses the host part of a nick!user@addr/bits mask */
+static int svsignore_cidr_mask(const char *mask, unsigned char *addr, int *bits)
+{
+	const char *host = strrchr(mask, '@');
+
+	if (host == NULL || strchr(host, '/') == NULL)
+		return 0;
+
+	return parse_cidr(host + 1, addr, bits);
+}
+
 /*
  * svsignore_add(const char *mask, const char *reason)
  *
@@ -46,20 +68,55 @@ mowgli_list_t svs_ignore_list;
 svsignore_t *svsignore_add(const char *mask, const char *reason)
 {
         svsignore_t *svsignore;
-        mowgli_node_t *n = mowgli_node_create();
+        unsigned char addr[16];
+        int family, bits;
+
+        if (svsignore_masks.exact == NULL)
+                mask_index_init(&svsignore_masks);
 
         svsignore = smalloc(sizeof(svsignore_t));
 
-        mowgli_node_add(svsignore, n, &svs_ignore_list);
+        mowgli_node_add(svsignore, &svsignore->li.node, &svs_ignore_list);
+        svsignore->li.seq = ++line_seq;
 
         svsignore->mask = sstrdup(mask);
         svsignore->settime = CURRTIME;
         svsignore->reason = sstrdup(reason);
         cnt.svsignore++;
 
+        if ((family = svsignore_cidr_mask(svsignore->mask, addr, &bits)) != 0)
+                cidr_trie_add(&svsignore_cidr[family == 6], addr, bits, &svsignore->li);
+        else
+                mask_index_add(&svsignore_masks, svsignore->mask, &svsignore->li);
+
+        svsignore_gen++;
+
         return svsignore;
 }
 
+struct svsignore_find_arg {
+	const char *mask;	/* nick!user@host */
+	size_t hostpos;		/* where host starts in mask */
+};
+
+static bool svsignore_match(line_index_t *li, const void *arg)
+{
+	const svsignore_t *svsignore = (svsignore_t *) li;
+	const struct svsignore_find_arg *a = arg;
+	size_t len;
+	char mask[BUFSIZE], nickuser[BUFSIZE];
+
+	if (li->xbucket == NULL)
+		return !match(svsignore->mask, a->mask);
+
+	/* in the CIDR trie, so the address is in range; check nick!user */
+	len = strrchr(svsignore->mask, '@') - svsignore->mask;
+	mowgli_strlcpy(mask, svsignore->mask, len < sizeof mask ? len + 1 : sizeof mask);
+	mowgli_strlcpy(nickuser, a->mask, a->hostpos);
+
+	return !match(mask, nickuser);
+}
+
 /*
  * svsignore_find(user_t *source)
  *
@@ -73,33 +130,67 @@ svsignore_t *svsignore_add(const char *mask, const char *reason)
  *     - if none match, NULL
  *
  * Side Effects:
- *     - none
+ *     - the result is cached on the user
  */
 svsignore_t *svsignore_find(user_t *source)
 {
-        svsignore_t *svsignore;
-        mowgli_node_t *n;
+        mowgli_list_t *buckets[3 + 129];
+        struct svsignore_find_arg a;
+        const char *names[1];
+        unsigned int nbuckets;
+        unsigned char addr[16];
+        int family;
         char host[BUFSIZE];
 
 	if (!use_svsignore)
 		return NULL;
 
+	if (source->svsignore_gen == svsignore_gen)
+		return source->svsignore;
+
+	source->svsignore = NULL;
+	source->svsignore_gen = svsignore_gen;
+
+	if (MOWGLI_LIST_LENGTH(&svs_ignore_list) == 0)
+		return NULL;
+
         *host = '\0';
         mowgli_strlcpy(host, source->nick, BUFSIZE);
         mowgli_strlcat(host, "!", BUFSIZE);
         mowgli_strlcat(host, source->user, BUFSIZE);
         mowgli_strlcat(host, "@", BUFSIZE);
+        a.hostpos = strlen(host);
         mowgli_strlcat(host, source->host, BUFSIZE);
 
-        MOWGLI_ITER_FOREACH(n, svs_ignore_list.head)
-        {
-                svsignore = (svsignore_t *)n->data;
+        names[0] = host;
+        nbuckets = mask_index_buckets(&svsignore_masks, names, 1, buckets);
+
+        if (source->ip != NULL && (family = parse_ip(source->ip, addr)) != 0)
+                nbuckets += cidr_trie_buckets(svsignore_cidr[family == 6], addr, family == 6 ? 128 : 32, buckets + nbuckets);
 
-                if (!match(svsignore->mask, host))
-                        return svsignore;
-        }
+        a.mask = host;
+        source->svsignore = (svsignore_t *) line_find(buckets, nbuckets, svsignore_match, &a);
 
-        return NULL;
+        return source->svsignore;
+}
+
+/*
+ * svsignore_invalidate(user_t *u)
+ *
+ * Forgets the cached svsignore_find() result for a user.
+ *
+ * Inputs:
+ *     - user whose nick, username or host changed
+ *
+ * Outputs:
+ *     - nothing
+ *
+ * Side Effects:
+ *     - none
+ */
+void svsignore_invalidate(user_t *u)
+{
+	u->svsignore_gen = 0;
 }
 
 /*
@@ -118,12 +209,18 @@ svsignore_t *svsignore_find(user_t *source)
  */
 void svsignore_delete(svsignore_t *svsignore)
 {
-	mowgli_node_t *n;
+	mowgli_node_delete(&svsignore->li.node, &svs_ignore_list);
+
+	if (svsignore->li.xbucket != NULL)
+		cidr_trie_del(svsignore_cidr, &svsignore->li);
+	else
+		mask_index_del(&svsignore_masks, svsignore->mask, &svsignore->li);
 
-	n = mowgli_node_find(svsignore, &svs_ignore_list);
-	mowgli_node_delete(n, &svs_ignore_list);
+	svsignore_gen++;
+	cnt.svsignore--;
 
 	free(svsignore->mask);
+	free(svsignore->setby);
 	free(svsignore->reason);
 	free(svsignore);
 }
@@ -81,7 +81,7 @@ void init_users(void)
  *     - if successful, a user is created and added to the users DTree.
  *     - if unsuccessful, a kill has been sent if necessary
  */
-user_t *user_add(const char *nick, const char *user, const char *host,
+static user_t *do_user_add(const char *nick, const char *user, const char *host,
 	const char *vhost, const char *ip, const char *uid, const char *gecos,
 	server_t *server, time_t ts)
 {
@@ -186,6 +186,19 @@ user_t *user_add(const char *nick, const char *user, const char *host,
 	return hdata.u;
 }
 
+user_t *user_add(const char *nick, const char *user, const char *host,
+	const char *vhost, const char *ip, const char *uid, const char *gecos,
+	server_t *server, time_t ts)
+{
+	unsigned long long start = prof_begin();
+	user_t *u;
+
+	u = do_user_add(nick, user, host, vhost, ip, uid, gecos, server, ts);
+	prof_end(PROF_USER_ADD, start);
+
+	return u;
+}
+
 /*
  * user_delete(user_t *u, const char *comment)
  *
@@ -493,6 +506,7 @@ bool user_changenick(user_t *u, const char *nick, time_t ts)
 
 	strshare_unref(u->nick);
 	u->nick = strshare_get(nick);
+	svsignore_invalidate(u);
 
 	u->ts = ts;
 
@@ -22,6 +22,20 @@
    binddn -- distinguished name to bind to for searching (optional)
    bindauth -- password for the distinguished name (optional, must specify if binddn given)
 
+ and optionally:
+
+   connections -- number of connections used for logins (default 4)
+   max_pending -- logins allowed to wait for a free connection (default 64)
+   timeout -- seconds before a login attempt is given up (default 5)
+   cache_ttl -- seconds a successful login is remembered (default 300)
+   negative_cache_ttl -- seconds a failed login is remembered (default 30)
+
+ Logins through verify_password_async() (NickServ IDENTIFY, SASL PLAIN)
+ use the asynchronous libldap API on a pool of connections watched by
+ the event loop.  Other password checks still block, on a connection of
+ their own, for at most the timeout.  Both go through the result cache,
+ which only stores a salted digest of the password.
+
 */
 
 #include "atheme.h"
@@ -40,187 +54,844 @@ struct
 	char *binddn;
 	char *bindauth;
 	bool useDN;
+	bool ok;
+	unsigned int connections;
+	unsigned int max_pending;
+	unsigned int timeout;
+	unsigned int cache_ttl;
+	unsigned int negative_cache_ttl;
 } ldap_config;
-LDAP *ldap_conn;
 
-static void ldap_config_ready(void *unused)
+typedef enum {
+	LDAP_JOB_BIND_SEARCHER,		/* binding as binddn for the search */
+	LDAP_JOB_SEARCH,		/* looking up the user's DN */
+	LDAP_JOB_BIND_USER,		/* binding as the user */
+} ldap_job_state_t;
+
+typedef enum {
+	LDAP_AUTH_ERROR,		/* no answer from the server; not cached */
+	LDAP_AUTH_OK,
+	LDAP_AUTH_BAD,			/* wrong password or no such user */
+} ldap_auth_result_t;
+
+typedef struct ldap_conn_ ldap_conn_t;
+
+typedef struct {
+	char *name;
+	char *password;
+	unsigned char digest[16];
+	verify_request_t *req;		/* NULL for blocking checks */
+
+	ldap_job_state_t state;
+	ldap_auth_result_t result;
+	bool done;
+	bool retried;			/* a connection already failed under us */
+	bool soft_error;		/* a user bind failed for another reason */
+
+	char **dns;
+	size_t ndns, dnpos;
+
+	time_t deadline;
+	ldap_conn_t *conn;
+	mowgli_node_t node;		/* ldap_queue */
+} ldap_job_t;
+
+struct ldap_conn_ {
+	LDAP *ld;
+	int fd;
+	mowgli_eventloop_pollable_t *pollable;
+	bool sync;			/* ldap_sync_conn, not watched */
+	bool connecting;		/* waiting to become writable */
+	bool stale;			/* close once the current job is done */
+	int msgid;
+	ldap_job_t *job;
+	mowgli_node_t node;		/* ldap_conns */
+};
+
+typedef struct {
+	char *name;
+	unsigned char digest[16];
+	bool ok;
+	time_t expires;
+} ldap_cache_entry_t;
+
+static mowgli_list_t ldap_conns;
+static mowgli_list_t ldap_queue;
+static ldap_conn_t *ldap_sync_conn;
+
+static mowgli_patricia_t *ldap_cache;
+static unsigned char ldap_cache_salt[16];
+
+static mowgli_eventloop_timer_t *ldap_timeout_timer;
+static mowgli_eventloop_timer_t *ldap_cache_timer;
+
+static void ldap_dispatch(void);
+static void ldap_conn_readable(mowgli_eventloop_t *eventloop, mowgli_eventloop_io_t *io,
+	mowgli_eventloop_io_dir_t dir, void *userdata);
+static void ldap_conn_writable(mowgli_eventloop_t *eventloop, mowgli_eventloop_io_t *io,
+	mowgli_eventloop_io_dir_t dir, void *userdata);
+
+static void ldap_warn(const char *what, int res)
 {
-	int res;
-	char *p;
 	static time_t lastwarning;
 
-	if (ldap_conn != NULL)
-		ldap_unbind_ext_s(ldap_conn, NULL, NULL);
-	ldap_conn = NULL;
-	if (ldap_config.url == NULL)
+	slog(LG_ERROR, "%s failed: %s", what, ldap_err2string(res));
+	if (CURRTIME > lastwarning + 300)
 	{
-		slog(LG_ERROR, "ldap_config_ready(): ldap {} missing url definition");
-		return;
+		slog(LG_INFO, "LDAP:ERROR: \2%s\2", ldap_err2string(res));
+		wallops("Problem with LDAP server: %s", ldap_err2string(res));
+		lastwarning = CURRTIME;
 	}
-	if ((ldap_config.dnformat == NULL) && ((ldap_config.base == NULL) || (ldap_config.attribute == NULL)))
+}
+
+/*
+ * Result cache.
+ */
+
+static void ldap_digest(const char *name, const char *password, unsigned char *digest)
+{
+	md5_state_t ctx;
+
+	md5_init(&ctx);
+	md5_append(&ctx, ldap_cache_salt, sizeof ldap_cache_salt);
+	md5_append(&ctx, (const unsigned char *)name, strlen(name) + 1);
+	md5_append(&ctx, (const unsigned char *)password, strlen(password));
+	md5_finish(&ctx, digest);
+}
+
+static void ldap_cache_free(const char *key, void *data, void *privdata)
+{
+	ldap_cache_entry_t *ce = data;
+
+	free(ce->name);
+	free(ce);
+}
+
+/* returns LDAP_AUTH_OK or LDAP_AUTH_BAD if cached, LDAP_AUTH_ERROR if not */
+static ldap_auth_result_t ldap_cache_lookup(ldap_job_t *job)
+{
+	ldap_cache_entry_t *ce;
+
+	ce = mowgli_patricia_retrieve(ldap_cache, job->name);
+	if (ce == NULL || ce->expires <= CURRTIME || memcmp(ce->digest, job->digest, sizeof ce->digest))
+		return LDAP_AUTH_ERROR;
+
+	return ce->ok ? LDAP_AUTH_OK : LDAP_AUTH_BAD;
+}
+
+static void ldap_cache_store(ldap_job_t *job)
+{
+	ldap_cache_entry_t *ce;
+	unsigned int ttl;
+
+	ttl = job->result == LDAP_AUTH_OK ? ldap_config.cache_ttl : ldap_config.negative_cache_ttl;
+
+	ce = mowgli_patricia_retrieve(ldap_cache, job->name);
+	if (ttl == 0)
 	{
-		slog(LG_ERROR, "ldap_config_ready(): ldap {} block requires dnformat or base & attribute definition");
+		if (ce != NULL)
+		{
+			mowgli_patricia_delete(ldap_cache, ce->name);
+			ldap_cache_free(NULL, ce, NULL);
+		}
 		return;
 	}
-	if (ldap_config.binddn != NULL && ldap_config.bindauth == NULL)
+
+	if (ce == NULL)
 	{
-		slog(LG_ERROR, "ldap_config_ready(): ldap{} block requires bindauth to be defined if binddn is defined");
-		return;
+		ce = smalloc(sizeof *ce);
+		ce->name = sstrdup(job->name);
+		mowgli_patricia_add(ldap_cache, ce->name, ce);
 	}
 
-	if (ldap_config.dnformat != NULL)
+	memcpy(ce->digest, job->digest, sizeof ce->digest);
+	ce->ok = job->result == LDAP_AUTH_OK;
+	ce->expires = CURRTIME + ttl;
+}
+
+static void ldap_cache_expire(void *unused)
+{
+	mowgli_patricia_iteration_state_t state;
+	ldap_cache_entry_t *ce;
+
+	MOWGLI_PATRICIA_FOREACH(ce, &state, ldap_cache)
 	{
-		ldap_config.useDN = true;
-		p = strchr(ldap_config.dnformat, '%');
-		if (p == NULL || p[1] != 's' || strchr(p + 1, '%'))
+		if (ce->expires <= CURRTIME)
 		{
-			slog(LG_ERROR, "ldap_config_ready(): dnformat must contain exactly one %%s and no other %%");
-			return;
+			mowgli_patricia_delete(ldap_cache, ce->name);
+			ldap_cache_free(NULL, ce, NULL);
 		}
 	}
-	else
-		ldap_config.useDN = false;
+}
+
+/*
+ * Jobs.
+ */
+
+static ldap_job_t *ldap_job_create(const char *name, const char *password, verify_request_t *req)
+{
+	ldap_job_t *job;
+
+	job = smalloc(sizeof *job);
+	job->name = sstrdup(name);
+	job->password = sstrdup(password);
+	job->req = req;
+	job->deadline = CURRTIME + ldap_config.timeout;
+	ldap_digest(name, password, job->digest);
+
+	return job;
+}
+
+static void ldap_job_free(ldap_job_t *job)
+{
+	size_t i;
+
+	for (i = 0; i < job->ndns; i++)
+		free(job->dns[i]);
+	free(job->dns);
+
+	explicit_bzero(job->password, strlen(job->password));
+	free(job->password);
+	free(job->name);
+	free(job);
+}
+
+static void ldap_job_finish(ldap_job_t *job, ldap_auth_result_t result)
+{
+	job->done = true;
+	job->result = result;
+
+	if (result == LDAP_AUTH_BAD)
+		slog(LG_INFO, "ldap_auth_user(%s): ldap auth bind failed", job->name);
+
+	if (result != LDAP_AUTH_ERROR)
+		ldap_cache_store(job);
+
+	/* blocking checks are freed by their caller */
+	if (job->req != NULL)
+	{
+		verify_password_done(job->req, result == LDAP_AUTH_OK);
+		ldap_job_free(job);
+	}
+}
+
+/* RFC 4515 escaping for an assertion value in a search filter */
+static void ldap_escape_filter(char *buf, size_t size, const char *value)
+{
+	static const char hex[] = "0123456789abcdef";
+	size_t i = 0;
+
+	for (; *value != '\0' && i + 4 < size; value++)
+	{
+		if (strchr("*()\\", *value) != NULL)
+		{
+			buf[i++] = '\\';
+			buf[i++] = hex[(unsigned char)*value >> 4];
+			buf[i++] = hex[(unsigned char)*value & 15];
+		}
+		else
+			buf[i++] = *value;
+	}
+
+	buf[i] = '\0';
+}
+
+/* sends the request for the job's current state */
+static int ldap_job_send(ldap_conn_t *conn)
+{
+	ldap_job_t *job = conn->job;
+	struct berval cred;
+	char buf[512], value[256];
+
+	switch (job->state)
+	{
+	case LDAP_JOB_BIND_SEARCHER:
+		cred.bv_val = ldap_config.bindauth;
+		cred.bv_len = ldap_config.bindauth != NULL ? strlen(ldap_config.bindauth) : 0;
+
+		return ldap_sasl_bind(conn->ld, ldap_config.binddn, LDAP_SASL_SIMPLE, &cred, NULL, NULL, &conn->msgid);
+
+	case LDAP_JOB_SEARCH:
+		ldap_escape_filter(value, sizeof value, job->name);
+		snprintf(buf, sizeof buf, "(%s=%s)", ldap_config.attribute, value);
+
+		return ldap_search_ext(conn->ld, ldap_config.base, LDAP_SCOPE_SUBTREE, buf, (char *[]){ LDAP_NO_ATTRS, NULL }, 0, NULL, NULL, NULL, 0, &conn->msgid);
+
+	case LDAP_JOB_BIND_USER:
+	default:
+		cred.bv_val = job->password;
+		cred.bv_len = strlen(job->password);
+
+		if (ldap_config.useDN)
+		{
+			snprintf(buf, sizeof buf, ldap_config.dnformat, job->name);
+			return ldap_sasl_bind(conn->ld, buf, LDAP_SASL_SIMPLE, &cred, NULL, NULL, &conn->msgid);
+		}
+
+		return ldap_sasl_bind(conn->ld, job->dns[job->dnpos], LDAP_SASL_SIMPLE, &cred, NULL, NULL, &conn->msgid);
+	}
+}
+
+/*
+ * Connections.
+ */
+
+static ldap_conn_t *ldap_conn_create(bool sync)
+{
+	ldap_conn_t *conn;
+	LDAP *ld;
+	int res;
 
 	ldap_set_option(NULL, LDAP_OPT_PROTOCOL_VERSION, &(const int)
 			{
 			3});
-	res = ldap_initialize(&ldap_conn, ldap_config.url);
+	res = ldap_initialize(&ld, ldap_config.url);
 	if (res != LDAP_SUCCESS)
 	{
-		slog(LG_ERROR, "ldap_config_ready(): ldap_initialize(%s) failed: %s", ldap_config.url, ldap_err2string(res));
-		if (CURRTIME > lastwarning + 300)
-		{
-			slog(LG_INFO, "LDAP:ERROR: \2%s\2", ldap_err2string(res));
-			wallops("Problem with LDAP server: %s", ldap_err2string(res));
-			lastwarning = CURRTIME;
-		}
+		ldap_warn("ldap_conn_create(): ldap_initialize()", res);
+		return NULL;
+	}
+
+	/* short timeouts, because blocking checks block atheme as a whole */
+	ldap_set_option(ld, LDAP_OPT_TIMEOUT, &(const struct timeval){1, 0});
+	ldap_set_option(ld, LDAP_OPT_NETWORK_TIMEOUT, &(const struct timeval){1, 0});
+	ldap_set_option(ld, LDAP_OPT_DEREF, &(const int){false});
+	ldap_set_option(ld, LDAP_OPT_REFERRALS, &(const int){false});
+#ifdef LDAP_OPT_CONNECT_ASYNC
+	if (!sync)
+		ldap_set_option(ld, LDAP_OPT_CONNECT_ASYNC, LDAP_OPT_ON);
+#endif
+
+	conn = smalloc(sizeof *conn);
+	conn->ld = ld;
+	conn->fd = -1;
+	conn->msgid = -1;
+	conn->sync = sync;
+
+	if (!sync)
+		mowgli_node_add(conn, &conn->node, &ldap_conns);
+
+	return conn;
+}
+
+static void ldap_conn_destroy(ldap_conn_t *conn)
+{
+	if (conn->sync)
+		ldap_sync_conn = NULL;
+	else
+		mowgli_node_delete(&conn->node, &ldap_conns);
+
+	if (conn->pollable != NULL)
+		mowgli_pollable_destroy(base_eventloop, conn->pollable);
+
+	ldap_unbind_ext_s(conn->ld, NULL, NULL);
+	free(conn);
+}
+
+/* (re)register the connection's socket with the event loop */
+static void ldap_conn_watch(ldap_conn_t *conn)
+{
+	int fd = -1;
+
+	if (conn->sync)
 		return;
+
+	ldap_get_option(conn->ld, LDAP_OPT_DESC, &fd);
+
+	if (fd != conn->fd && conn->pollable != NULL)
+	{
+		mowgli_pollable_destroy(base_eventloop, conn->pollable);
+		conn->pollable = NULL;
 	}
 
-	/* short timeouts, because this blocks atheme as a whole */
-	ldap_set_option(ldap_conn, LDAP_OPT_TIMEOUT, &(const struct timeval){1, 0});
-	ldap_set_option(ldap_conn, LDAP_OPT_NETWORK_TIMEOUT, &(const struct timeval){1, 0});
-	ldap_set_option(ldap_conn, LDAP_OPT_DEREF, &(const int){false});
-	ldap_set_option(ldap_conn, LDAP_OPT_REFERRALS, &(const int){false});
+	conn->fd = fd;
+	if (fd < 0)
+		return;
+
+	if (conn->pollable == NULL)
+		conn->pollable = mowgli_pollable_create(base_eventloop, fd, conn);
+
+	mowgli_pollable_setselect(base_eventloop, conn->pollable, MOWGLI_EVENTLOOP_IO_READ, conn->connecting ? NULL : ldap_conn_readable);
+	mowgli_pollable_setselect(base_eventloop, conn->pollable, MOWGLI_EVENTLOOP_IO_WRITE, conn->connecting ? ldap_conn_writable : NULL);
 }
 
-static bool ldap_auth_user(myuser_t *mu, const char *password)
+/* the connection is broken: close it and retry or fail its job */
+static void ldap_conn_failed(ldap_conn_t *conn, int res)
 {
-	int res;
-	struct berval cred;
-	LDAPMessage *message, *entry;
+	ldap_job_t *job = conn->job;
 
-	if (ldap_conn == NULL)
+	ldap_conn_destroy(conn);
+
+	if (job == NULL)
+		return;
+
+	job->conn = NULL;
+
+	if (!job->retried && (res == LDAP_SERVER_DOWN || res == LDAP_CONNECT_ERROR))
 	{
-		ldap_config_ready(NULL);
+		/* the server may just have closed an idle connection */
+		job->retried = true;
+
+		/* blocking checks pick up a new connection themselves */
+		if (job->req != NULL)
+			mowgli_node_add_head(job, &job->node, &ldap_queue);
+		return;
 	}
-	if (ldap_conn == NULL)
+
+	ldap_warn("ldap_auth_user()", res);
+	ldap_job_finish(job, LDAP_AUTH_ERROR);
+}
+
+/* send the job's next request; false if the connection went away */
+static bool ldap_conn_step(ldap_conn_t *conn)
+{
+	int res = ldap_job_send(conn);
+
+#ifdef LDAP_X_CONNECTING
+	if (res == LDAP_X_CONNECTING)
 	{
-		slog(LG_INFO, "ldap_auth_user(): no connection");
-		return false;
+		conn->connecting = true;
+		ldap_conn_watch(conn);
+		return true;
 	}
+#endif
+
+	conn->connecting = false;
 
-	if (strchr(entity(mu)->name, ' '))
+	if (res != LDAP_SUCCESS)
 	{
-		slog(LG_INFO, "ldap_auth_user(%s): bad name: found space", entity(mu)->name);
+		ldap_conn_failed(conn, res);
 		return false;
 	}
-	if (strchr(entity(mu)->name, ','))
+
+	ldap_conn_watch(conn);
+	return true;
+}
+
+static bool ldap_conn_start(ldap_conn_t *conn, ldap_job_t *job)
+{
+	size_t i;
+
+	for (i = 0; i < job->ndns; i++)
+		free(job->dns[i]);
+	free(job->dns);
+	job->dns = NULL;
+	job->ndns = job->dnpos = 0;
+	job->soft_error = false;
+
+	job->state = ldap_config.useDN ? LDAP_JOB_BIND_USER : LDAP_JOB_BIND_SEARCHER;
+	job->conn = conn;
+	conn->job = job;
+
+	return ldap_conn_step(conn);
+}
+
+/* the job on conn is over; false if the connection went away */
+static bool ldap_conn_end(ldap_conn_t *conn, ldap_auth_result_t result)
+{
+	ldap_job_t *job = conn->job;
+
+	conn->job = NULL;
+	conn->msgid = -1;
+	job->conn = NULL;
+
+	ldap_job_finish(job, result);
+
+	if (conn->stale)
 	{
-		slog(LG_INFO, "ldap_auth_user(%s): bad name: found comma", entity(mu)->name);
+		ldap_conn_destroy(conn);
 		return false;
 	}
-	if (strchr(entity(mu)->name, '/'))
+
+	return true;
+}
+
+/* handle a complete answer to the job's last request */
+static bool ldap_conn_result(ldap_conn_t *conn, LDAPMessage *res)
+{
+	ldap_job_t *job = conn->job;
+	LDAPMessage *entry;
+	char *dn;
+	int err, rc;
+
+	if (job->state == LDAP_JOB_SEARCH)
 	{
-		slog(LG_INFO, "ldap_auth_user(%s): bad name: found /", entity(mu)->name);
-		return false;
+		for (entry = ldap_first_entry(conn->ld, res); entry != NULL; entry = ldap_next_entry(conn->ld, entry))
+		{
+			if ((dn = ldap_get_dn(conn->ld, entry)) == NULL)
+				continue;
+
+			job->dns = srealloc(job->dns, (job->ndns + 1) * sizeof job->dns[0]);
+			job->dns[job->ndns++] = sstrdup(dn);
+			ldap_memfree(dn);
+		}
 	}
 
-/* Use DN to find exact match */
-	if (ldap_config.useDN)
+	rc = ldap_parse_result(conn->ld, res, &err, NULL, NULL, NULL, NULL, 1);
+	if (rc != LDAP_SUCCESS)
+		err = rc;
+
+	switch (job->state)
 	{
-		char dn[512];
-		cred.bv_len = strlen(password);
-		/* sstrdup it to remove the const */
-		cred.bv_val = sstrdup(password);
+	case LDAP_JOB_BIND_SEARCHER:
+		if (err != LDAP_SUCCESS)
+		{
+			slog(LG_INFO, "ldap_auth_user(): ldap_bind failed: %s", ldap_err2string(err));
+			return ldap_conn_end(conn, LDAP_AUTH_ERROR);
+		}
+
+		job->state = LDAP_JOB_SEARCH;
+		return ldap_conn_step(conn);
 
-		snprintf(dn, sizeof dn, ldap_config.dnformat, entity(mu)->name);
-		res = ldap_sasl_bind_s(ldap_conn, dn, LDAP_SASL_SIMPLE, &cred, NULL, NULL, NULL);
-		if (res == LDAP_SERVER_DOWN)
+	case LDAP_JOB_SEARCH:
+		if (err != LDAP_SUCCESS && job->ndns == 0)
 		{
-			ldap_config_ready(NULL);
-			res = ldap_sasl_bind_s(ldap_conn, dn, LDAP_SASL_SIMPLE, &cred, NULL, NULL, NULL);
+			slog(LG_INFO, "ldap_auth_user(%s): ldap search failed: %s", job->name, ldap_err2string(err));
+			return ldap_conn_end(conn, LDAP_AUTH_ERROR);
 		}
-		if (res == LDAP_SUCCESS)
-			return true;
-		else if (res == LDAP_INVALID_CREDENTIALS)
+
+		if (job->ndns == 0)
+			return ldap_conn_end(conn, LDAP_AUTH_BAD);
+
+		job->state = LDAP_JOB_BIND_USER;
+		return ldap_conn_step(conn);
+
+	case LDAP_JOB_BIND_USER:
+	default:
+		if (err == LDAP_SUCCESS)
+			return ldap_conn_end(conn, LDAP_AUTH_OK);
+
+		if (err != LDAP_INVALID_CREDENTIALS)
 		{
-			slog(LG_INFO, "ldap_auth_user(%s): ldap auth bind failed: %s", entity(mu)->name, ldap_err2string(res));
-			return false;
+			slog(LG_INFO, "ldap_auth_user(%s): ldap_bind failed: %s", job->name, ldap_err2string(err));
+			job->soft_error = true;
 		}
-		slog(LG_INFO, "ldap_auth_user(): ldap_bind_s failed: %s", ldap_err2string(res));
-		return false;
 
+		if (!ldap_config.useDN && ++job->dnpos < job->ndns)
+			return ldap_conn_step(conn);
 
-/* Use base + attribute search for Auth */
+		return ldap_conn_end(conn, job->soft_error ? LDAP_AUTH_ERROR : LDAP_AUTH_BAD);
 	}
-	else
-	{
-		char what[512];
-		char *binddn = NULL;
+}
 
-		cred.bv_len = 0;
+static void ldap_conn_readable(mowgli_eventloop_t *eventloop, mowgli_eventloop_io_t *io,
+	mowgli_eventloop_io_dir_t dir, void *userdata)
+{
+	ldap_conn_t *conn = userdata;
+	LDAPMessage *res;
+	int rc, err;
+
+	/* libldap may have buffered more than one answer */
+	for (;;)
+	{
+		rc = ldap_result(conn->ld, conn->job != NULL ? conn->msgid : LDAP_RES_ANY, LDAP_MSG_ALL, &(struct timeval){0, 0}, &res);
+		if (rc == 0)
+			break;
 
-		if (ldap_config.binddn != NULL && ldap_config.bindauth != NULL)
+		if (rc < 0)
 		{
-			binddn = ldap_config.binddn;
-			cred.bv_val = ldap_config.bindauth;
-			cred.bv_len = strlen(ldap_config.bindauth);
+			err = LDAP_SERVER_DOWN;
+			ldap_get_option(conn->ld, LDAP_OPT_RESULT_CODE, &err);
+			ldap_conn_failed(conn, err);
+			break;
 		}
 
-		res = ldap_sasl_bind_s(ldap_conn, binddn, LDAP_SASL_SIMPLE, &cred, NULL, NULL, NULL);
-		if (res == LDAP_SERVER_DOWN)
+		/* an idle connection has nothing to hear about */
+		if (conn->job == NULL)
 		{
-			ldap_config_ready(NULL);
-			res = ldap_sasl_bind_s(ldap_conn, binddn, LDAP_SASL_SIMPLE, &cred, NULL, NULL, NULL);
+			ldap_msgfree(res);
+			continue;
 		}
-		if (res != LDAP_SUCCESS)
+
+		if (!ldap_conn_result(conn, res))
+			break;
+	}
+
+	ldap_dispatch();
+}
+
+static void ldap_conn_writable(mowgli_eventloop_t *eventloop, mowgli_eventloop_io_t *io,
+	mowgli_eventloop_io_dir_t dir, void *userdata)
+{
+	ldap_conn_t *conn = userdata;
+
+	/* connected (or failed to); send the request again */
+	ldap_conn_step(conn);
+	ldap_dispatch();
+}
+
+/* hand waiting jobs to idle connections, opening more if allowed */
+static void ldap_dispatch(void)
+{
+	mowgli_node_t *n;
+	ldap_conn_t *conn;
+	ldap_job_t *job;
+
+	while (ldap_queue.head != NULL)
+	{
+		conn = NULL;
+
+		MOWGLI_ITER_FOREACH(n, ldap_conns.head)
 		{
-			slog(LG_INFO, "ldap_auth_user(): ldap_bind_s failed: %s", ldap_err2string(res));
-			return false;
+			ldap_conn_t *c = n->data;
+
+			if (c->job == NULL && !c->stale)
+			{
+				conn = c;
+				break;
+			}
 		}
 
-		sprintf(what, "%s=%s", ldap_config.attribute, entity(mu)->name);
-		if ((res = ldap_search_ext_s(ldap_conn, ldap_config.base, LDAP_SCOPE_SUBTREE, what, NULL, 0, NULL, NULL, NULL, 0, &message)) != LDAP_SUCCESS)
+		if (conn == NULL && MOWGLI_LIST_LENGTH(&ldap_conns) < ldap_config.connections)
 		{
-			slog(LG_INFO, "ldap_auth_user(%s): ldap search failed: %s", entity(mu)->name, ldap_err2string(res));
-			return false;
+			if ((conn = ldap_conn_create(false)) == NULL)
+			{
+				while (ldap_queue.head != NULL)
+				{
+					job = ldap_queue.head->data;
+					mowgli_node_delete(&job->node, &ldap_queue);
+					ldap_job_finish(job, LDAP_AUTH_ERROR);
+				}
+				return;
+			}
 		}
 
-		cred.bv_len = strlen(password);
-		/* sstrdup it to remove the const */
-		cred.bv_val = sstrdup(password);
+		if (conn == NULL)
+			return;
+
+		job = ldap_queue.head->data;
+		mowgli_node_delete(&job->node, &ldap_queue);
+		ldap_conn_start(conn, job);
+	}
+}
+
+static void ldap_check_timeouts(void *unused)
+{
+	mowgli_node_t *n, *tn;
+
+	MOWGLI_ITER_FOREACH_SAFE(n, tn, ldap_conns.head)
+	{
+		ldap_conn_t *conn = n->data;
+		ldap_job_t *job = conn->job;
+
+		if (job == NULL || job->deadline > CURRTIME)
+			continue;
+
+		/* the server may be wedged; don't reuse the connection */
+		slog(LG_INFO, "ldap_auth_user(%s): timed out", job->name);
+		conn->job = NULL;
+		job->conn = NULL;
+		ldap_conn_destroy(conn);
+		ldap_job_finish(job, LDAP_AUTH_ERROR);
+	}
+
+	MOWGLI_ITER_FOREACH_SAFE(n, tn, ldap_queue.head)
+	{
+		ldap_job_t *job = n->data;
+
+		if (job->deadline > CURRTIME)
+			continue;
+
+		slog(LG_INFO, "ldap_auth_user(%s): timed out waiting for a connection", job->name);
+		mowgli_node_delete(&job->node, &ldap_queue);
+		ldap_job_finish(job, LDAP_AUTH_ERROR);
+	}
+
+	ldap_dispatch();
+}
+
+static void ldap_config_ready(void *unused)
+{
+	mowgli_node_t *n, *tn;
+	char *p;
+
+	ldap_config.ok = false;
+
+	/* the server may have changed: close what isn't in use, and the
+	 * rest once their job is done
+	 */
+	MOWGLI_ITER_FOREACH_SAFE(n, tn, ldap_conns.head)
+	{
+		ldap_conn_t *conn = n->data;
+
+		if (conn->job == NULL)
+			ldap_conn_destroy(conn);
+		else
+			conn->stale = true;
+	}
+	if (ldap_sync_conn != NULL)
+		ldap_conn_destroy(ldap_sync_conn);
+
+	if (ldap_config.url == NULL)
+	{
+		slog(LG_ERROR, "ldap_config_ready(): ldap {} missing url definition");
+		return;
+	}
+	if ((ldap_config.dnformat == NULL) && ((ldap_config.base == NULL) || (ldap_config.attribute == NULL)))
+	{
+		slog(LG_ERROR, "ldap_config_ready(): ldap {} block requires dnformat or base & attribute definition");
+		return;
+	}
+	if (ldap_config.binddn != NULL && ldap_config.bindauth == NULL)
+	{
+		slog(LG_ERROR, "ldap_config_ready(): ldap{} block requires bindauth to be defined if binddn is defined");
+		return;
+	}
 
-		for (entry = ldap_first_message(ldap_conn, message); entry && ldap_msgtype(entry) == LDAP_RES_SEARCH_ENTRY; entry = ldap_next_message(ldap_conn, entry))
+	if (ldap_config.dnformat != NULL)
+	{
+		ldap_config.useDN = true;
+		p = strchr(ldap_config.dnformat, '%');
+		if (p == NULL || p[1] != 's' || strchr(p + 1, '%'))
 		{
+			slog(LG_ERROR, "ldap_config_ready(): dnformat must contain exactly one %%s and no other %%");
+			return;
+		}
+	}
+	else
+		ldap_config.useDN = false;
+
+	ldap_config.ok = true;
+
+	/* the directory may answer differently now */
+	mowgli_patricia_destroy(ldap_cache, ldap_cache_free, NULL);
+	ldap_cache = mowgli_patricia_create(irccasecanon);
+}
+
+static bool ldap_check_name(const char *name)
+{
+	if (strchr(name, ' '))
+	{
+		slog(LG_INFO, "ldap_auth_user(%s): bad name: found space", name);
+		return false;
+	}
+	if (strchr(name, ','))
+	{
+		slog(LG_INFO, "ldap_auth_user(%s): bad name: found comma", name);
+		return false;
+	}
+	if (strchr(name, '/'))
+	{
+		slog(LG_INFO, "ldap_auth_user(%s): bad name: found /", name);
+		return false;
+	}
+
+	return true;
+}
+
+static bool ldap_auth_user_async(myuser_t *mu, const char *password, verify_request_t *req)
+{
+	ldap_job_t *job;
+	ldap_auth_result_t cached;
+
+	/* loaded after the configuration was read */
+	if (!ldap_config.ok)
+		ldap_config_ready(NULL);
+
+	if (!ldap_config.ok || !ldap_check_name(entity(mu)->name))
+	{
+		verify_password_done(req, false);
+		return true;
+	}
+
+	job = ldap_job_create(entity(mu)->name, password, req);
+
+	if ((cached = ldap_cache_lookup(job)) != LDAP_AUTH_ERROR)
+	{
+		verify_password_done(req, cached == LDAP_AUTH_OK);
+		ldap_job_free(job);
+		return true;
+	}
 
-			res = ldap_sasl_bind_s(ldap_conn, ldap_get_dn(ldap_conn, entry), LDAP_SASL_SIMPLE, &cred, NULL, NULL, NULL);
-			if (res == LDAP_SUCCESS)
+	mowgli_node_add(job, &job->node, &ldap_queue);
+	ldap_dispatch();
+
+	/* no connection free and too many waiting already */
+	if (MOWGLI_LIST_LENGTH(&ldap_queue) > ldap_config.max_pending)
+	{
+		job = ldap_queue.tail->data;
+		slog(LG_INFO, "ldap_auth_user(%s): too many logins waiting for the LDAP server", job->name);
+		mowgli_node_delete(&job->node, &ldap_queue);
+		ldap_job_finish(job, LDAP_AUTH_ERROR);
+	}
+
+	return true;
+}
+
+static bool ldap_auth_user(myuser_t *mu, const char *password)
+{
+	ldap_job_t *job;
+	ldap_conn_t *conn;
+	LDAPMessage *res;
+	ldap_auth_result_t result;
+	int rc, err;
+
+	if (!ldap_config.ok)
+		ldap_config_ready(NULL);
+	if (!ldap_config.ok)
+	{
+		slog(LG_INFO, "ldap_auth_user(): no connection");
+		return false;
+	}
+
+	if (!ldap_check_name(entity(mu)->name))
+		return false;
+
+	job = ldap_job_create(entity(mu)->name, password, NULL);
+
+	if ((result = ldap_cache_lookup(job)) != LDAP_AUTH_ERROR)
+	{
+		ldap_job_free(job);
+		return result == LDAP_AUTH_OK;
+	}
+
+	while (!job->done)
+	{
+		if ((conn = job->conn) == NULL)
+		{
+			if (ldap_sync_conn == NULL && (ldap_sync_conn = ldap_conn_create(true)) == NULL)
 			{
-				ldap_msgfree(message);
-				return true;
+				ldap_job_finish(job, LDAP_AUTH_ERROR);
+				break;
 			}
+
+			ldap_conn_start(ldap_sync_conn, job);
+			continue;
 		}
 
-		ldap_msgfree(message);
+		rc = ldap_result(conn->ld, conn->msgid, LDAP_MSG_ALL, &(struct timeval){ldap_config.timeout, 0}, &res);
+		if (rc == 0)
+		{
+			slog(LG_INFO, "ldap_auth_user(%s): timed out", job->name);
+			conn->job = NULL;
+			job->conn = NULL;
+			ldap_conn_destroy(conn);
+			ldap_job_finish(job, LDAP_AUTH_ERROR);
+			break;
+		}
+
+		if (rc < 0)
+		{
+			err = LDAP_SERVER_DOWN;
+			ldap_get_option(conn->ld, LDAP_OPT_RESULT_CODE, &err);
+			ldap_conn_failed(conn, err);
+			continue;
+		}
+
+		ldap_conn_result(conn, res);
 	}
 
-	slog(LG_INFO, "ldap_auth_user(%s): ldap auth bind failed: %s", entity(mu)->name, ldap_err2string(res));
-	return false;
+	result = job->result;
+	ldap_job_free(job);
+
+	return result == LDAP_AUTH_OK;
 }
 
 void _modinit(module_t * m)
 {
+	arc4random_buf(ldap_cache_salt, sizeof ldap_cache_salt);
+	ldap_cache = mowgli_patricia_create(irccasecanon);
+
 	hook_add_event("config_ready");
 	hook_add_config_ready(ldap_config_ready);
 
@@ -231,20 +902,56 @@ void _modinit(module_t * m)
 	add_dupstr_conf_item("ATTRIBUTE", &conf_ldap_table, 0, &ldap_config.attribute, NULL);
 	add_dupstr_conf_item("BINDDN", &conf_ldap_table, 0, &ldap_config.binddn, NULL);
 	add_dupstr_conf_item("BINDAUTH", &conf_ldap_table, 0, &ldap_config.bindauth, NULL);
+	add_uint_conf_item("CONNECTIONS", &conf_ldap_table, 0, &ldap_config.connections, 1, 64, 4);
+	add_uint_conf_item("MAX_PENDING", &conf_ldap_table, 0, &ldap_config.max_pending, 0, INT_MAX, 64);
+	add_duration_conf_item("TIMEOUT", &conf_ldap_table, 0, &ldap_config.timeout, "s", 5);
+	add_duration_conf_item("CACHE_TTL", &conf_ldap_table, 0, &ldap_config.cache_ttl, "s", 300);
+	add_duration_conf_item("NEGATIVE_CACHE_TTL", &conf_ldap_table, 0, &ldap_config.negative_cache_ttl, "s", 30);
+
+	ldap_timeout_timer = mowgli_timer_add(base_eventloop, "ldap_check_timeouts", ldap_check_timeouts, NULL, 1);
+	ldap_cache_timer = mowgli_timer_add(base_eventloop, "ldap_cache_expire", ldap_cache_expire, NULL, 60);
 
 	auth_user_custom = &ldap_auth_user;
+	auth_user_custom_async = &ldap_auth_user_async;
 
 	auth_module_loaded = true;
 }
 
 void _moddeinit(module_unload_intent_t intent)
 {
+	mowgli_node_t *n, *tn;
+
 	auth_user_custom = NULL;
+	auth_user_custom_async = NULL;
 
 	auth_module_loaded = false;
 
-	if (ldap_conn != NULL)
-		ldap_unbind_ext_s(ldap_conn, NULL, NULL);
+	/* answer everyone still waiting */
+	MOWGLI_ITER_FOREACH_SAFE(n, tn, ldap_queue.head)
+	{
+		ldap_job_t *job = n->data;
+
+		mowgli_node_delete(&job->node, &ldap_queue);
+		ldap_job_finish(job, LDAP_AUTH_ERROR);
+	}
+
+	MOWGLI_ITER_FOREACH_SAFE(n, tn, ldap_conns.head)
+	{
+		ldap_conn_t *conn = n->data;
+		ldap_job_t *job = conn->job;
+
+		ldap_conn_destroy(conn);
+		if (job != NULL)
+			ldap_job_finish(job, LDAP_AUTH_ERROR);
+	}
+
+	if (ldap_sync_conn != NULL)
+		ldap_conn_destroy(ldap_sync_conn);
+
+	mowgli_timer_destroy(base_eventloop, ldap_timeout_timer);
+	mowgli_timer_destroy(base_eventloop, ldap_cache_timer);
+
+	mowgli_patricia_destroy(ldap_cache, ldap_cache_free, NULL);
 
 	hook_del_config_ready(ldap_config_ready);
 	del_conf_item("URL", &conf_ldap_table);
@@ -253,6 +960,11 @@ void _moddeinit(module_unload_intent_t intent)
 	del_conf_item("ATTRIBUTE", &conf_ldap_table);
 	del_conf_item("BINDDN", &conf_ldap_table);
 	del_conf_item("BINDAUTH", &conf_ldap_table);
+	del_conf_item("CONNECTIONS", &conf_ldap_table);
+	del_conf_item("MAX_PENDING", &conf_ldap_table);
+	del_conf_item("TIMEOUT", &conf_ldap_table);
+	del_conf_item("CACHE_TTL", &conf_ldap_table);
+	del_conf_item("NEGATIVE_CACHE_TTL", &conf_ldap_table);
 	del_top_conf("LDAP");
 }
 
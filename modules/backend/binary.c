@@ -0,0 +1,954 @@
+/*
+ * Copyright (c) 2014- Shaltúre project (http://github.com/shalture)
+ * Rights to this code are as documented in doc/LICENSE.
+ *
+ * A compact binary database backend.  It stores the same rows as OpenSEX,
+ * but each row is a length-prefixed record of typed cells, row types are
+ * interned into small integers on first use, and integers are written as
+ * varints.  Files are read through mmap(2) where available, so loading does
+ * not have to lex the database one character at a time.
+ *
+ * File layout:
+ *
+ *   "SHDB" <version byte>
+ *   record*
+ *
+ *   record   := varint(0) varint(id) varint(len) bytes[len]  -- defines row type <id>
+ *             | varint(id) varint(len) cell*                  -- row of type <id>; len covers the cells
+ *
+ *   cell     := 'W' varint(len) bytes[len]   -- word
+ *             | 'S' varint(len) bytes[len]   -- multiword string (rest of the row)
+ *             | 'U' varint(n)                -- non-negative integer
+ *             | 'M' varint(-n)               -- negative integer
+ *
+ * Integers are always rendered canonically, so reading an integer cell as a
+ * word gives back exactly the text OpenSEX would have stored.
+ */
+
+#include "atheme.h"
+
+#ifndef MOWGLI_OS_WIN
+# include <sys/mman.h>
+#endif
+
+DECLARE_MODULE_V1
+(
+	"backend/binary", true, _modinit, NULL,
+	PACKAGE_STRING,
+	"Shaltúre developers <https://github.com/shalture>"
+);
+
+#define BINARY_MAGIC		"SHDB"
+#define BINARY_MAGIC_LEN	4
+#define BINARY_VERSION		1
+
+#define CELL_WORD		'W'
+#define CELL_STR		'S'
+#define CELL_UINT		'U'
+#define CELL_NEG		'M'
+
+/* longest rendering of a 64-bit integer, plus sign and NUL */
+#define NUMBUF			22
+
+typedef struct binary_ {
+	/* Reading state */
+	unsigned char *map;
+	size_t maplen;
+	bool mapped;
+	size_t pos;
+
+	const unsigned char *cur;	/* next cell of the current row */
+	const unsigned char *rowend;
+	const char *rowtype;		/* returned by the first read_word() of a row */
+
+	char *scratch;			/* NUL-terminated copies of the current row's cells */
+	size_t scratchsize;
+	char *sp;
+
+	char **types;
+	unsigned int typecount;
+
+	/* Writing state */
+	FILE *f;
+	mowgli_patricia_t *typeids;
+	unsigned int nexttype;
+	unsigned int rowid;
+
+	unsigned char *wbuf;
+	size_t wlen, wsize;
+} binary_t;
+
+/***************************************************************************************************/
+
+static bool get_varint(const unsigned char **p, const unsigned char *end, uint64_t *res)
+{
+	uint64_t v = 0;
+	unsigned int shift = 0;
+
+	while (*p < end && shift < 64)
+	{
+		unsigned char c = *(*p)++;
+
+		v |= (uint64_t)(c & 0x7f) << shift;
+		if (!(c & 0x80))
+		{
+			*res = v;
+			return true;
+		}
+
+		shift += 7;
+	}
+
+	return false;
+}
+
+static size_t put_varint(unsigned char *p, uint64_t v)
+{
+	size_t n = 0;
+
+	do
+	{
+		unsigned char c = v & 0x7f;
+
+		v >>= 7;
+		if (v != 0)
+			c |= 0x80;
+		p[n++] = c;
+	} while (v != 0);
+
+	return n;
+}
+
+static void binary_corrupt(database_handle_t *db, const char *what)
+{
+	slog(LG_ERROR, "binary: %s at %s row %d: database is corrupt", what, db->file, db->line);
+	slog(LG_ERROR, "binary: exiting to avoid data loss");
+	exit(EXIT_FAILURE);
+}
+
+/* returns the space a cell takes once copied out into the scratch buffer */
+static bool binary_skip_cell(const unsigned char **p, const unsigned char *end, size_t *need)
+{
+	uint64_t v;
+	unsigned char kind;
+
+	if (*p >= end)
+		return false;
+
+	kind = *(*p)++;
+	if (!get_varint(p, end, &v))
+		return false;
+
+	switch (kind)
+	{
+	case CELL_WORD:
+	case CELL_STR:
+		if (v > (uint64_t)(end - *p))
+			return false;
+		*p += v;
+		*need += v + 1;
+		return true;
+	case CELL_UINT:
+	case CELL_NEG:
+		*need += NUMBUF;
+		return true;
+	default:
+		return false;
+	}
+}
+
+/***************************************************************************************************/
+
+static void binary_define_type(database_handle_t *db, const unsigned char **p, const unsigned char *end)
+{
+	binary_t *bs = (binary_t *)db->priv;
+	uint64_t id, len;
+
+	if (!get_varint(p, end, &id) || !get_varint(p, end, &len) || len > (uint64_t)(end - *p) || id == 0 || id > 65535)
+		binary_corrupt(db, "bad row type definition");
+
+	if (id >= bs->typecount)
+	{
+		unsigned int newcount = id + 16;
+
+		bs->types = srealloc(bs->types, newcount * sizeof(char *));
+		memset(bs->types + bs->typecount, 0, (newcount - bs->typecount) * sizeof(char *));
+		bs->typecount = newcount;
+	}
+
+	free(bs->types[id]);
+	bs->types[id] = sstrndup((const char *)*p, len);
+	*p += len;
+}
+
+static bool binary_read_next_row(database_handle_t *db)
+{
+	binary_t *bs = (binary_t *)db->priv;
+	const unsigned char *p, *end, *q;
+	uint64_t id, len;
+	size_t need = 1;
+
+	end = bs->map + bs->maplen;
+
+	for (;;)
+	{
+		p = bs->map + bs->pos;
+		if (p >= end)
+			return false;
+
+		if (!get_varint(&p, end, &id))
+			binary_corrupt(db, "truncated record");
+
+		if (id != 0)
+			break;
+
+		binary_define_type(db, &p, end);
+		bs->pos = p - bs->map;
+	}
+
+	if (id >= bs->typecount || bs->types[id] == NULL)
+		binary_corrupt(db, "row of undefined type");
+
+	if (!get_varint(&p, end, &len) || len > (uint64_t)(end - p))
+		binary_corrupt(db, "truncated row");
+
+	bs->cur = p;
+	bs->rowend = p + len;
+	bs->rowtype = bs->types[id];
+	bs->pos = bs->rowend - bs->map;
+
+	/* size the scratch buffer for every cell of the row up front, since
+	 * callers keep pointers to earlier cells while reading later ones.
+	 */
+	for (q = bs->cur; q < bs->rowend; )
+		if (!binary_skip_cell(&q, bs->rowend, &need))
+			binary_corrupt(db, "bad cell");
+
+	if (need > bs->scratchsize)
+	{
+		bs->scratchsize = need > 2 * bs->scratchsize ? need : 2 * bs->scratchsize;
+		bs->scratch = srealloc(bs->scratch, bs->scratchsize);
+	}
+	bs->sp = bs->scratch;
+
+	db->line++;
+	db->token = 0;
+	return true;
+}
+
+/* copies the next cell out as text, or returns NULL at the end of the row */
+static const char *binary_next_cell(database_handle_t *db, unsigned char *kind, uint64_t *num)
+{
+	binary_t *bs = (binary_t *)db->priv;
+	const unsigned char *p = bs->cur;
+	char *res = bs->sp;
+	uint64_t v;
+
+	if (p == NULL || p >= bs->rowend)
+		return NULL;
+
+	*kind = *p++;
+	get_varint(&p, bs->rowend, &v);
+
+	switch (*kind)
+	{
+	case CELL_WORD:
+	case CELL_STR:
+		memcpy(res, p, v);
+		res[v] = '\0';
+		p += v;
+		bs->sp += v + 1;
+		break;
+	case CELL_UINT:
+		bs->sp += snprintf(res, NUMBUF, "%" PRIu64, v) + 1;
+		break;
+	case CELL_NEG:
+		bs->sp += snprintf(res, NUMBUF, "-%" PRIu64, v) + 1;
+		break;
+	}
+
+	if (num != NULL)
+		*num = v;
+
+	bs->cur = p;
+	db->token++;
+	return res;
+}
+
+static const char *binary_read_word(database_handle_t *db)
+{
+	binary_t *bs = (binary_t *)db->priv;
+	unsigned char kind;
+
+	if (bs->rowtype != NULL)
+	{
+		const char *type = bs->rowtype;
+
+		bs->rowtype = NULL;
+		return type;
+	}
+
+	return binary_next_cell(db, &kind, NULL);
+}
+
+/* returns the rest of the row.  Rows converted from OpenSEX carry multiword
+ * strings as several word cells, so join whatever is left with spaces.
+ */
+static const char *binary_read_str(database_handle_t *db)
+{
+	binary_t *bs = (binary_t *)db->priv;
+	const char *res, *next;
+	unsigned char kind;
+
+	bs->rowtype = NULL;
+
+	if ((res = binary_next_cell(db, &kind, NULL)) == NULL)
+		return NULL;
+
+	/* cells are laid out back to back in the scratch buffer, so turning
+	 * each separating NUL into a space joins them in place.
+	 */
+	while ((next = binary_next_cell(db, &kind, NULL)) != NULL)
+		((char *)next)[-1] = ' ';
+
+	return res;
+}
+
+static bool binary_read_int(database_handle_t *db, int *res)
+{
+	binary_t *bs = (binary_t *)db->priv;
+	const char *s;
+	char *rp;
+	unsigned char kind;
+	uint64_t v;
+
+	bs->rowtype = NULL;
+
+	if ((s = binary_next_cell(db, &kind, &v)) == NULL)
+		return false;
+
+	if (kind == CELL_UINT)
+	{
+		*res = (int)v;
+		return true;
+	}
+	else if (kind == CELL_NEG)
+	{
+		*res = (int)-(int64_t)v;
+		return true;
+	}
+
+	*res = strtol(s, &rp, 0);
+	return *s && !*rp;
+}
+
+static bool binary_read_uint(database_handle_t *db, unsigned int *res)
+{
+	binary_t *bs = (binary_t *)db->priv;
+	const char *s;
+	char *rp;
+	unsigned char kind;
+	uint64_t v;
+
+	bs->rowtype = NULL;
+
+	if ((s = binary_next_cell(db, &kind, &v)) == NULL)
+		return false;
+
+	if (kind == CELL_UINT)
+	{
+		*res = (unsigned int)v;
+		return true;
+	}
+
+	*res = strtoul(s, &rp, 0);
+	return *s && !*rp;
+}
+
+static bool binary_read_time(database_handle_t *db, time_t *res)
+{
+	binary_t *bs = (binary_t *)db->priv;
+	const char *s;
+	char *rp;
+	unsigned char kind;
+	uint64_t v;
+
+	bs->rowtype = NULL;
+
+	if ((s = binary_next_cell(db, &kind, &v)) == NULL)
+		return false;
+
+	if (kind == CELL_UINT)
+	{
+		*res = (time_t)v;
+		return true;
+	}
+
+	*res = strtoul(s, &rp, 0);
+	return *s && !*rp;
+}
+
+/***************************************************************************************************/
+
+static void binary_reserve(binary_t *bs, size_t len)
+{
+	if (bs->wlen + len <= bs->wsize)
+		return;
+
+	while (bs->wlen + len > bs->wsize)
+		bs->wsize *= 2;
+
+	bs->wbuf = srealloc(bs->wbuf, bs->wsize);
+}
+
+static void binary_put_num(binary_t *bs, unsigned char kind, uint64_t v)
+{
+	binary_reserve(bs, 1 + 10);
+	bs->wbuf[bs->wlen++] = kind;
+	bs->wlen += put_varint(bs->wbuf + bs->wlen, v);
+}
+
+static void binary_put_string(binary_t *bs, unsigned char kind, const char *s)
+{
+	size_t len = strlen(s);
+
+	binary_reserve(bs, 1 + 10 + len);
+	bs->wbuf[bs->wlen++] = kind;
+	bs->wlen += put_varint(bs->wbuf + bs->wlen, len);
+	memcpy(bs->wbuf + bs->wlen, s, len);
+	bs->wlen += len;
+}
+
+/* only words that read back identically may be stored as integers */
+static bool binary_canonical_number(const char *s, uint64_t *v, bool *neg)
+{
+	const char *p = s;
+	size_t digits;
+
+	*neg = (*p == '-');
+	if (*neg)
+		p++;
+
+	digits = strlen(p);
+	if (digits == 0 || digits > 18 || (*p == '0' && (digits > 1 || *neg)))
+		return false;
+
+	for (*v = 0; *p != '\0'; p++)
+	{
+		if (!isdigit((unsigned char)*p))
+			return false;
+		*v = *v * 10 + (*p - '0');
+	}
+
+	return true;
+}
+
+static bool binary_start_row(database_handle_t *db, const char *type)
+{
+	binary_t *bs;
+	unsigned int id;
+
+	return_val_if_fail(db != NULL, false);
+	return_val_if_fail(type != NULL, false);
+	bs = (binary_t *)db->priv;
+
+	id = (uintptr_t)mowgli_patricia_retrieve(bs->typeids, type);
+	if (id == 0)
+	{
+		unsigned char hdr[30];
+		size_t len = strlen(type), n = 0;
+
+		id = bs->nexttype++;
+		mowgli_patricia_add(bs->typeids, type, (void *)(uintptr_t)id);
+
+		n += put_varint(hdr + n, 0);
+		n += put_varint(hdr + n, id);
+		n += put_varint(hdr + n, len);
+		fwrite(hdr, 1, n, bs->f);
+		fwrite(type, 1, len, bs->f);
+	}
+
+	bs->rowid = id;
+	bs->wlen = 0;
+
+	return true;
+}
+
+static bool binary_write_word(database_handle_t *db, const char *word)
+{
+	binary_t *bs;
+	uint64_t v;
+	bool neg;
+
+	return_val_if_fail(db != NULL, false);
+	bs = (binary_t *)db->priv;
+
+	if (word == NULL)
+		word = "*";
+
+	if (binary_canonical_number(word, &v, &neg))
+		binary_put_num(bs, neg ? CELL_NEG : CELL_UINT, v);
+	else
+		binary_put_string(bs, CELL_WORD, word);
+
+	return true;
+}
+
+static bool binary_write_str(database_handle_t *db, const char *str)
+{
+	return_val_if_fail(db != NULL, false);
+
+	binary_put_string((binary_t *)db->priv, CELL_STR, str != NULL ? str : "*");
+
+	return true;
+}
+
+static bool binary_write_int(database_handle_t *db, int num)
+{
+	return_val_if_fail(db != NULL, false);
+
+	if (num < 0)
+		binary_put_num((binary_t *)db->priv, CELL_NEG, -(int64_t)num);
+	else
+		binary_put_num((binary_t *)db->priv, CELL_UINT, num);
+
+	return true;
+}
+
+static bool binary_write_uint(database_handle_t *db, unsigned int num)
+{
+	return_val_if_fail(db != NULL, false);
+
+	binary_put_num((binary_t *)db->priv, CELL_UINT, num);
+
+	return true;
+}
+
+static bool binary_write_time(database_handle_t *db, time_t tm)
+{
+	return_val_if_fail(db != NULL, false);
+
+	/* OpenSEX writes times as %lu, so do the same for compatibility. */
+	binary_put_num((binary_t *)db->priv, CELL_UINT, (unsigned long)tm);
+
+	return true;
+}
+
+static bool binary_commit_row(database_handle_t *db)
+{
+	binary_t *bs;
+	unsigned char hdr[20];
+	size_t n = 0;
+
+	return_val_if_fail(db != NULL, false);
+	bs = (binary_t *)db->priv;
+
+	n += put_varint(hdr + n, bs->rowid);
+	n += put_varint(hdr + n, bs->wlen);
+	fwrite(hdr, 1, n, bs->f);
+	fwrite(bs->wbuf, 1, bs->wlen, bs->f);
+
+	db->line++;
+
+	return true;
+}
+
+static database_vtable_t binary_vt = {
+	.name = "binary",
+
+	.read_next_row = binary_read_next_row,
+
+	.read_word = binary_read_word,
+	.read_str = binary_read_str,
+	.read_int = binary_read_int,
+	.read_uint = binary_read_uint,
+	.read_time = binary_read_time,
+
+	.start_row = binary_start_row,
+	.write_word = binary_write_word,
+	.write_str = binary_write_str,
+	.write_int = binary_write_int,
+	.write_uint = binary_write_uint,
+	.write_time = binary_write_time,
+	.commit_row = binary_commit_row
+};
+
+/***************************************************************************************************/
+
+static void binary_db_parse(database_handle_t *db)
+{
+	binary_t *bs = (binary_t *)db->priv;
+	const char *type;
+
+	while (db_read_next_row(db))
+	{
+		type = bs->rowtype;
+		bs->rowtype = NULL;
+		db_process(db, type);
+	}
+}
+
+static bool binary_map_file(binary_t *bs, int fd, const char *path)
+{
+	struct stat sb;
+	ssize_t r;
+	size_t done = 0;
+
+	if (fstat(fd, &sb) < 0)
+		return false;
+
+	bs->maplen = sb.st_size;
+	if (bs->maplen == 0)
+		return true;
+
+#ifndef MOWGLI_OS_WIN
+	bs->map = mmap(NULL, bs->maplen, PROT_READ, MAP_PRIVATE, fd, 0);
+	if (bs->map != MAP_FAILED)
+	{
+		bs->mapped = true;
+# ifdef MADV_SEQUENTIAL
+		madvise(bs->map, bs->maplen, MADV_SEQUENTIAL);
+# endif
+		return true;
+	}
+
+	slog(LG_DEBUG, "db-open-read: mmap of '%s' failed (%s); reading it instead", path, strerror(errno));
+#endif
+
+	bs->map = smalloc(bs->maplen);
+	while (done < bs->maplen)
+	{
+		if ((r = read(fd, bs->map + done, bs->maplen - done)) <= 0)
+		{
+			free(bs->map);
+			bs->map = NULL;
+			return false;
+		}
+
+		done += r;
+	}
+
+	return true;
+}
+
+static database_handle_t *binary_db_open_read(const char *filename)
+{
+	database_handle_t *db;
+	binary_t *bs;
+	int fd;
+	int errno1;
+	char path[BUFSIZE];
+
+	snprintf(path, BUFSIZE, "%s/%s", datadir, filename != NULL ? filename : "services.db");
+	fd = open(path, O_RDONLY);
+	if (fd < 0)
+	{
+		errno1 = errno;
+
+		/* ENOENT can happen if the database does not exist yet. */
+		if (errno == ENOENT)
+		{
+			slog(LG_ERROR, "db-open-read: database '%s' does not yet exist; a new one will be created.", path);
+			return NULL;
+		}
+
+		slog(LG_ERROR, "db-open-read: cannot open '%s' for reading: %s", path, strerror(errno1));
+		wallops(_("\2DATABASE ERROR\2: db-open-read: cannot open '%s' for reading: %s"), path, strerror(errno1));
+		return NULL;
+	}
+
+	bs = scalloc(sizeof(binary_t), 1);
+
+	if (!binary_map_file(bs, fd, path))
+	{
+		errno1 = errno;
+		close(fd);
+		free(bs);
+
+		slog(LG_ERROR, "db-open-read: cannot read '%s': %s", path, strerror(errno1));
+		wallops(_("\2DATABASE ERROR\2: db-open-read: cannot read '%s': %s"), path, strerror(errno1));
+		return NULL;
+	}
+
+	close(fd);
+
+	if (bs->maplen < BINARY_MAGIC_LEN + 1 || memcmp(bs->map, BINARY_MAGIC, BINARY_MAGIC_LEN))
+	{
+		slog(LG_ERROR, "db-open-read: '%s' is not a binary database; convert it with dbverify first", path);
+		slog(LG_ERROR, "db-open-read: exiting to avoid data loss");
+		exit(EXIT_FAILURE);
+	}
+
+	if (bs->map[BINARY_MAGIC_LEN] != BINARY_VERSION)
+		slog(LG_ERROR, "binary: format version %d is unsupported.  dazed and confused, but trying to continue.", bs->map[BINARY_MAGIC_LEN]);
+
+	bs->pos = BINARY_MAGIC_LEN + 1;
+	bs->scratchsize = 512;
+	bs->scratch = smalloc(bs->scratchsize);
+
+	db = scalloc(sizeof(database_handle_t), 1);
+	db->priv = bs;
+	db->vt = &binary_vt;
+	db->txn = DB_READ;
+	db->file = sstrdup(path);
+	db->line = 0;
+	db->token = 0;
+
+	return db;
+}
+
+static database_handle_t *binary_db_open_write(const char *filename, database_transaction_t txn)
+{
+	database_handle_t *db;
+	binary_t *bs;
+	int fd;
+	FILE *f;
+	int errno1;
+	struct stat sb;
+	char bpath[BUFSIZE], path[BUFSIZE];
+
+	snprintf(bpath, BUFSIZE, "%s/%s", datadir, filename != NULL ? filename : "services.db");
+
+	mowgli_strlcpy(path, bpath, sizeof path);
+	if (txn == DB_APPEND)
+		fd = open(path, O_WRONLY | O_CREAT | O_APPEND, S_IRUSR | S_IWUSR | S_IRGRP | S_IWGRP);
+	else
+	{
+		mowgli_strlcat(path, ".new", sizeof path);
+		fd = open(path, O_WRONLY | O_CREAT | O_TRUNC, S_IRUSR | S_IWUSR | S_IRGRP | S_IWGRP);
+	}
+
+	if (fd < 0 || ! (f = fdopen(fd, txn == DB_APPEND ? "ab" : "wb")))
+	{
+		errno1 = errno;
+		slog(LG_ERROR, "db-open-write: cannot open '%s' for writing: %s", path, strerror(errno1));
+		wallops(_("\2DATABASE ERROR\2: db-open-write: cannot open '%s' for writing: %s"), path, strerror(errno1));
+		return NULL;
+	}
+
+	/*
+	 * Appended segments start with an empty type table; the reader lets
+	 * later type definitions replace earlier ones, so ids may be reused.
+	 */
+	if (txn != DB_APPEND || fstat(fd, &sb) != 0 || sb.st_size == 0)
+	{
+		fwrite(BINARY_MAGIC, 1, BINARY_MAGIC_LEN, f);
+		fputc(BINARY_VERSION, f);
+	}
+
+	bs = scalloc(sizeof(binary_t), 1);
+	bs->f = f;
+	bs->typeids = mowgli_patricia_create(NULL);
+	bs->nexttype = 1;
+	bs->wsize = 512;
+	bs->wbuf = smalloc(bs->wsize);
+
+	db = scalloc(sizeof(database_handle_t), 1);
+	db->priv = bs;
+	db->vt = &binary_vt;
+	db->txn = txn;
+	db->file = sstrdup(bpath);
+	db->line = 0;
+	db->token = 0;
+
+	return db;
+}
+
+static database_handle_t *binary_db_open(const char *filename, database_transaction_t txn)
+{
+	if (txn != DB_READ)
+		return binary_db_open_write(filename, txn);
+	return binary_db_open_read(filename);
+}
+
+/* replace the old database with the new one, using an atomic rename */
+static bool binary_db_install(const char *path)
+{
+	int errno1;
+	char oldpath[BUFSIZE];
+
+	mowgli_strlcpy(oldpath, path, sizeof oldpath);
+	mowgli_strlcat(oldpath, ".new", sizeof oldpath);
+
+	if (srename(oldpath, path) < 0)
+	{
+		errno1 = errno;
+		slog(LG_ERROR, "db_save(): cannot rename %s to %s: %s", oldpath, path, strerror(errno1));
+		wallops(_("\2DATABASE ERROR\2: db_save(): cannot rename %s to %s: %s"), oldpath, path, strerror(errno1));
+		return false;
+	}
+
+	hook_call_db_saved();
+	return true;
+}
+
+static bool binary_db_commit(const char *filename)
+{
+	char path[BUFSIZE];
+
+	snprintf(path, BUFSIZE, "%s/%s", datadir, filename != NULL ? filename : "services.db");
+
+	return binary_db_install(path);
+}
+
+static bool binary_db_close(database_handle_t *db)
+{
+	binary_t *bs;
+	unsigned int i;
+	int errno1;
+	bool ok = true;
+
+	return_val_if_fail(db != NULL, false);
+	bs = db->priv;
+
+	if (db->txn == DB_READ)
+	{
+#ifndef MOWGLI_OS_WIN
+		if (bs->mapped)
+			munmap(bs->map, bs->maplen);
+		else
+#endif
+			free(bs->map);
+
+		for (i = 0; i < bs->typecount; i++)
+			free(bs->types[i]);
+		free(bs->types);
+		free(bs->scratch);
+	}
+	else
+	{
+		if (ferror(bs->f))
+			ok = false;
+		if (fclose(bs->f) != 0)
+			ok = false;
+
+		if (!ok)
+		{
+			errno1 = errno;
+			slog(LG_ERROR, "db_save(): cannot write %s%s: %s", db->file, db->txn == DB_APPEND ? "" : ".new", strerror(errno1));
+			wallops(_("\2DATABASE ERROR\2: db_save(): cannot write %s%s: %s"), db->file, db->txn == DB_APPEND ? "" : ".new", strerror(errno1));
+		}
+		else if (db->txn == DB_WRITE)
+			ok = binary_db_install(db->file);
+
+		mowgli_patricia_destroy(bs->typeids, NULL, NULL);
+		free(bs->wbuf);
+	}
+
+	free(bs);
+	free(db->file);
+	free(db);
+
+	return ok;
+}
+
+static bool binary_db_flush(database_handle_t *db)
+{
+	binary_t *bs;
+
+	return_val_if_fail(db != NULL, false);
+	bs = db->priv;
+
+	return fflush(bs->f) == 0 && !ferror(bs->f);
+}
+
+/* returns the offset just past the last complete record */
+static size_t binary_complete_length(const binary_t *bs)
+{
+	const unsigned char *p, *end = bs->map + bs->maplen;
+	size_t pos = BINARY_MAGIC_LEN + 1;
+	uint64_t id, len;
+
+	if (bs->maplen < pos)
+		return 0;
+
+	while (pos < bs->maplen)
+	{
+		p = bs->map + pos;
+
+		if (!get_varint(&p, end, &id))
+			break;
+		if (id == 0 && !get_varint(&p, end, &id))
+			break;
+		if (!get_varint(&p, end, &len) || len > (uint64_t)(end - p))
+			break;
+
+		pos = p + len - bs->map;
+	}
+
+	return pos;
+}
+
+/* drops a record cut short at the end of an appended file */
+static bool binary_db_recover(const char *filename)
+{
+	binary_t bs;
+	size_t good;
+	int fd, errno1;
+	char path[BUFSIZE];
+
+	snprintf(path, BUFSIZE, "%s/%s", datadir, filename != NULL ? filename : "services.db");
+
+	if ((fd = open(path, O_RDWR)) < 0)
+		return errno == ENOENT;
+
+	memset(&bs, 0, sizeof bs);
+	if (!binary_map_file(&bs, fd, path))
+		goto fail;
+
+	/* let the reader complain about a file that is not ours */
+	if (bs.maplen >= BINARY_MAGIC_LEN && memcmp(bs.map, BINARY_MAGIC, BINARY_MAGIC_LEN))
+		good = bs.maplen;
+	else
+		good = binary_complete_length(&bs);
+
+#ifndef MOWGLI_OS_WIN
+	if (bs.mapped)
+		munmap(bs.map, bs.maplen);
+	else
+#endif
+		free(bs.map);
+
+	if (good < bs.maplen)
+	{
+		slog(LG_ERROR, "binary-recover: dropping an incomplete record (%zu bytes) at the end of %s",
+				bs.maplen - good, path);
+		if (ftruncate(fd, good) < 0)
+			goto fail;
+	}
+
+	close(fd);
+	return true;
+
+fail:
+	errno1 = errno;
+	close(fd);
+	slog(LG_ERROR, "binary-recover: cannot check %s: %s", path, strerror(errno1));
+	return false;
+}
+
+static database_module_t binary_mod = {
+	.db_open = binary_db_open,
+	.db_close = binary_db_close,
+	.db_parse = binary_db_parse,
+	.db_commit = binary_db_commit,
+	.db_flush = binary_db_flush,
+	.db_recover = binary_db_recover,
+};
+
+void _modinit(module_t *m)
+{
+	MODULE_TRY_REQUEST_DEPENDENCY(m, "backend/corestorage");
+
+	m->mflags = MODTYPE_CORE;
+
+	db_mod = &binary_mod;
+
+	backend_loaded = true;
+}
+
+/* vim:cinoptions=>s,e0,n0,f0,{0,}0,^0,=s,ps,t0,c3,+s,(2s,us,)20,*30,gs,hs
+ * vim:ts=8
+ * vim:sw=8
+ * vim:noexpandtab
+ */
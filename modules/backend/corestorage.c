@@ -18,6 +18,10 @@
 
 #include "atheme.h"
 
+#ifdef HAVE_FORK
+# include <sys/wait.h>
+#endif
+
 DECLARE_MODULE_V1
 (
 	"backend/corestorage", true, _modinit, NULL,
@@ -30,6 +34,135 @@ unsigned int their_ca_all;
 
 extern mowgli_list_t modules;
 
+/* journaling state, see corestorage_journal_start() */
+static bool journal_enabled = false;
+static bool journal_replaying = false;
+static unsigned int journal_gen = 0;
+static unsigned int snapshot_gen = 0;
+
+/* row writers shared between full saves and the journal */
+static void corestorage_write_myuser(database_handle_t *db, myuser_t *mu)
+{
+	/* MU <name> <pass> <email> <registered> <lastlogin> <failnum*> <lastfail*>
+	 * <lastfailon*> <flags> <language>
+	 *
+	 *  * failnum, lastfail, and lastfailon are deprecated (moved to metadata)
+	 */
+	char *flags = gflags_tostr(mu_flags, MOWGLI_LIST_LENGTH(&mu->logins) ? mu->flags & ~MU_NOBURSTLOGIN : mu->flags);
+	db_start_row(db, "MU");
+	db_write_word(db, entity(mu)->id);
+	db_write_word(db, entity(mu)->name);
+	db_write_word(db, mu->pass);
+	db_write_word(db, mu->email);
+	db_write_time(db, mu->registered);
+	db_write_time(db, mu->lastlogin);
+	db_write_word(db, flags);
+	db_write_word(db, language_get_name(mu->language));
+	db_commit_row(db);
+}
+
+static void corestorage_write_mynick(database_handle_t *db, mynick_t *mn)
+{
+	db_start_row(db, "MN");
+	db_write_word(db, entity(mn->owner)->name);
+	db_write_word(db, mn->nick);
+	db_write_time(db, mn->registered);
+	db_write_time(db, mn->lastseen);
+	db_commit_row(db);
+}
+
+static void corestorage_write_mychan(database_handle_t *db, mychan_t *mc)
+{
+	char *flags = gflags_tostr(mc_flags, mc->flags);
+
+	/* MC <name> <registered> <used> <flags> <mlock_on> <mlock_off> <mlock_limit> [mlock_key] */
+	db_start_row(db, "MC");
+	db_write_word(db, mc->name);
+	db_write_time(db, mc->registered);
+	db_write_time(db, mc->used);
+	db_write_word(db, flags);
+	db_write_uint(db, mc->mlock_on);
+	db_write_uint(db, mc->mlock_off);
+	db_write_uint(db, mc->mlock_limit);
+	db_write_word(db, mc->mlock_key ? mc->mlock_key : "");
+	db_commit_row(db);
+}
+
+static void corestorage_write_chanacs(database_handle_t *db, chanacs_t *ca)
+{
+	myentity_t *setter = NULL;
+
+	db_start_row(db, "CA");
+	db_write_word(db, ca->mychan->name);
+	db_write_word(db, ca->entity ? ca->entity->name : ca->host);
+	db_write_word(db, bitmask_to_flags(ca->level));
+	db_write_time(db, ca->tmodified);
+
+	if (*ca->setter_uid != '\0' && (setter = myentity_find_uid(ca->setter_uid)))
+		db_write_word(db, setter->name);
+	else
+		db_write_word(db, "*");
+
+	db_commit_row(db);
+}
+
+static const char *corestorage_metadata_row(db_journal_type_t type)
+{
+	switch (type)
+	{
+	case DB_JOURNAL_MYUSER:
+		return "MDU";
+	case DB_JOURNAL_MYCHAN:
+		return "MDC";
+	default:
+		return "MDA";
+	}
+}
+
+/* the cells naming the object an MDU, MDC or MDA row belongs to */
+static void corestorage_write_metadata_owner(database_handle_t *db, db_journal_type_t type, void *obj)
+{
+	chanacs_t *ca;
+
+	switch (type)
+	{
+	case DB_JOURNAL_MYUSER:
+		db_write_word(db, entity((myuser_t *)obj)->name);
+		break;
+	case DB_JOURNAL_MYCHAN:
+		db_write_word(db, ((mychan_t *)obj)->name);
+		break;
+	default:
+		ca = obj;
+		db_write_word(db, ca->mychan->name);
+		db_write_word(db, (ca->entity) ? ca->entity->name : ca->host);
+		break;
+	}
+}
+
+static void corestorage_write_metadata(database_handle_t *db, db_journal_type_t type, void *obj, metadata_t *md)
+{
+	db_start_row(db, corestorage_metadata_row(type));
+	corestorage_write_metadata_owner(db, type, obj);
+	db_write_word(db, md->name);
+	db_write_str(db, md->value);
+	db_commit_row(db);
+}
+
+static void corestorage_write_kline(database_handle_t *db, kline_t *k)
+{
+	/* KL <user> <host> <duration> <settime> <setby> <reason> */
+	db_start_row(db, "KL");
+	db_write_uint(db, k->number);
+	db_write_word(db, k->user);
+	db_write_word(db, k->host);
+	db_write_uint(db, k->duration);
+	db_write_time(db, k->settime);
+	db_write_word(db, k->setby);
+	db_write_str(db, k->reason);
+	db_commit_row(db);
+}
+
 /* write atheme.db (core fields) */
 static void
 corestorage_db_save(database_handle_t *db)
@@ -48,6 +181,9 @@ corestorage_db_save(database_handle_t *db)
 	mowgli_node_t *n, *tn;
 	mowgli_patricia_iteration_state_t state;
 	myentity_iteration_state_t mestate;
+	metadata_iteration_state_t mdstate;
+	mowgli_patricia_iteration_state_t igstate;
+	const char *ignore;
 
 	errno = 0;
 
@@ -73,59 +209,53 @@ corestorage_db_save(database_handle_t *db)
 	db_write_word(db, bitmask_to_flags(ca_all));
 	db_commit_row(db);
 
+	/* journals from this generation on apply on top of this file */
+	if (journal_enabled)
+	{
+		db_start_row(db, "JGEN");
+		db_write_uint(db, journal_gen);
+		db_commit_row(db);
+	}
+
 	slog(LG_DEBUG, "db_save(): saving myusers");
 
 	MYENTITY_FOREACH_T(ment, &mestate, ENT_USER)
 	{
 		mu = user(ment);
-		/* MU <name> <pass> <email> <registered> <lastlogin> <failnum*> <lastfail*>
-		 * <lastfailon*> <flags> <language>
-		 *
-		 *  * failnum, lastfail, and lastfailon are deprecated (moved to metadata)
-		 */
-		char *flags = gflags_tostr(mu_flags, MOWGLI_LIST_LENGTH(&mu->logins) ? mu->flags & ~MU_NOBURSTLOGIN : mu->flags);
-		db_start_row(db, "MU");
-		db_write_word(db, entity(mu)->id);
-		db_write_word(db, entity(mu)->name);
-		db_write_word(db, mu->pass);
-		db_write_word(db, mu->email);
-		db_write_time(db, mu->registered);
-		db_write_time(db, mu->lastlogin);
-		db_write_word(db, flags);
-		db_write_word(db, language_get_name(mu->language));
-		db_commit_row(db);
+		corestorage_write_myuser(db, mu);
 
-		if (object(mu)->metadata)
-		{
-			MOWGLI_PATRICIA_FOREACH(md, &state, object(mu)->metadata)
-			{
-				db_start_row(db, "MDU");
-				db_write_word(db, entity(mu)->name);
-				db_write_word(db, md->name);
-				db_write_str(db, md->value);
-				db_commit_row(db);
-			}
-		}
+		METADATA_FOREACH(md, &mdstate, mu)
+			corestorage_write_metadata(db, DB_JOURNAL_MYUSER, mu, md);
 
 		MOWGLI_ITER_FOREACH(tn, mu->memos.head)
 		{
 			mymemo_t *mz = (mymemo_t *)tn->data;
 
-			db_start_row(db, "ME");
+			/* texts the memo store keeps stay where they are */
+			db_start_row(db, mz->text != NULL ? "ME" : "MES");
 			db_write_word(db, entity(mu)->name);
 			db_write_word(db, mz->sender);
 			db_write_time(db, mz->sent);
 			db_write_uint(db, mz->status);
-			db_write_str(db, mz->text);
+			if (mz->text != NULL)
+				db_write_str(db, mz->text);
+			else
+			{
+				db_write_format(db, "%llu", (unsigned long long)mz->offset);
+				db_write_uint(db, mz->len);
+			}
 			db_commit_row(db);
 		}
 
-		MOWGLI_ITER_FOREACH(tn, mu->memo_ignores.head)
+		if (mu->memo_ignores != NULL)
 		{
-			db_start_row(db, "MI");
-			db_write_word(db, entity(mu)->name);
-			db_write_word(db, (char *)tn->data);
-			db_commit_row(db);
+			MOWGLI_PATRICIA_FOREACH(ignore, &igstate, mu->memo_ignores)
+			{
+				db_start_row(db, "MI");
+				db_write_word(db, entity(mu)->name);
+				db_write_word(db, ignore);
+				db_commit_row(db);
+			}
 		}
 
 		MOWGLI_ITER_FOREACH(tn, mu->access_list.head)
@@ -137,16 +267,7 @@ corestorage_db_save(database_handle_t *db)
 		}
 
 		MOWGLI_ITER_FOREACH(tn, mu->nicks.head)
-		{
-			mynick_t *mn = tn->data;
-
-			db_start_row(db, "MN");
-			db_write_word(db, entity(mu)->name);
-			db_write_word(db, mn->nick);
-			db_write_time(db, mn->registered);
-			db_write_time(db, mn->lastseen);
-			db_commit_row(db);
-		}
+			corestorage_write_mynick(db, tn->data);
 
 		MOWGLI_ITER_FOREACH(tn, mu->cert_fingerprints.head)
 		{
@@ -166,96 +287,35 @@ corestorage_db_save(database_handle_t *db)
 
 	MOWGLI_PATRICIA_FOREACH(mc, &state, mclist)
 	{
-		mowgli_patricia_iteration_state_t state2;
-
-		char *flags = gflags_tostr(mc_flags, mc->flags);
-		/* find a founder */
-		mu = NULL;
-		MOWGLI_ITER_FOREACH(tn, mc->chanacs.head)
-		{
-			ca = (chanacs_t *)tn->data;
-			if (ca->entity != NULL && ca->level & CA_FOUNDER)
-			{
-				mu = user(ca->entity);
-				break;
-			}
-		}
-		/* MC <name> <registered> <used> <flags> <mlock_on> <mlock_off> <mlock_limit> [mlock_key] */
-		db_start_row(db, "MC");
-		db_write_word(db, mc->name);
-		db_write_time(db, mc->registered);
-		db_write_time(db, mc->used);
-		db_write_word(db, flags);
-		db_write_uint(db, mc->mlock_on);
-		db_write_uint(db, mc->mlock_off);
-		db_write_uint(db, mc->mlock_limit);
-		db_write_word(db, mc->mlock_key ? mc->mlock_key : "");
-		db_commit_row(db);
+		corestorage_write_mychan(db, mc);
 
 		MOWGLI_ITER_FOREACH(tn, mc->chanacs.head)
 		{
-			myentity_t *setter = NULL;
 			ca = (chanacs_t *)tn->data;
+			corestorage_write_chanacs(db, ca);
 
-			db_start_row(db, "CA");
-			db_write_word(db, ca->mychan->name);
-			db_write_word(db, ca->entity ? ca->entity->name : ca->host);
-			db_write_word(db, bitmask_to_flags(ca->level));
-			db_write_time(db, ca->tmodified);
-
-			if (*ca->setter_uid != '\0' && (setter = myentity_find_uid(ca->setter_uid)))
-				db_write_word(db, setter->name);
-			else
-				db_write_word(db, "*");
-
-			db_commit_row(db);
-
-			if (object(ca)->metadata)
-			{
-				MOWGLI_PATRICIA_FOREACH(md, &state2, object(ca)->metadata)
-				{
-					db_start_row(db, "MDA");
-					db_write_word(db, ca->mychan->name);
-					db_write_word(db, (ca->entity) ? ca->entity->name : ca->host);
-					db_write_word(db, md->name);
-					db_write_str(db, md->value);
-					db_commit_row(db);
-				}
-			}
+			METADATA_FOREACH(md, &mdstate, ca)
+				corestorage_write_metadata(db, DB_JOURNAL_CHANACS, ca, md);
 		}
 
-		if (object(mc)->metadata)
-		{
-			MOWGLI_PATRICIA_FOREACH(md, &state2, object(mc)->metadata)
-			{
-				db_start_row(db, "MDC");
-				db_write_word(db, mc->name);
-				db_write_word(db, md->name);
-				db_write_str(db, md->value);
-				db_commit_row(db);
-			}
-		}
+		METADATA_FOREACH(md, &mdstate, mc)
+			corestorage_write_metadata(db, DB_JOURNAL_MYCHAN, mc, md);
 	}
 
 	/* Old names */
 	MOWGLI_PATRICIA_FOREACH(mun, &state, oldnameslist)
 	{
-		mowgli_patricia_iteration_state_t state2;
-
 		db_start_row(db, "NAM");
 		db_write_word(db, mun->name);
 		db_commit_row(db);
 
-		if (object(mun)->metadata)
+		METADATA_FOREACH(md, &mdstate, mun)
 		{
-			MOWGLI_PATRICIA_FOREACH(md, &state2, object(mun)->metadata)
-			{
-				db_start_row(db, "MDN");
-				db_write_word(db, mun->name);
-				db_write_word(db, md->name);
-				db_write_str(db, md->value);
-				db_commit_row(db);
-			}
+			db_start_row(db, "MDN");
+			db_write_word(db, mun->name);
+			db_write_word(db, md->name);
+			db_write_str(db, md->value);
+			db_commit_row(db);
 		}
 	}
 
@@ -308,17 +368,7 @@ corestorage_db_save(database_handle_t *db)
 	MOWGLI_ITER_FOREACH(n, klnlist.head)
 	{
 		k = (kline_t *)n->data;
-
-		/* KL <user> <host> <duration> <settime> <setby> <reason> */
-		db_start_row(db, "KL");
-		db_write_uint(db, k->number);
-		db_write_word(db, k->user);
-		db_write_word(db, k->host);
-		db_write_uint(db, k->duration);
-		db_write_time(db, k->settime);
-		db_write_word(db, k->setby);
-		db_write_str(db, k->reason);
-		db_commit_row(db);
+		corestorage_write_kline(db, k);
 	}
 
 	slog(LG_DEBUG, "db_save(): saving xlines");
@@ -410,13 +460,15 @@ static void corestorage_h_mu(database_handle_t *db, const char *type)
 
 	name = db_sread_word(db);
 
-	if (myuser_find(name))
+	/* the journal records accounts again whenever they change */
+	mu = myuser_find(name);
+	if (mu != NULL && !journal_replaying)
 	{
 		slog(LG_INFO, "db-h-mu: line %d: skipping duplicate account %s", db->line, name);
 		return;
 	}
 
-	if (strict_mode && uid && myuser_find_uid(uid))
+	if (mu == NULL && strict_mode && uid && myuser_find_uid(uid))
 	{
 		slog(LG_INFO, "db-h-mu: line %d: skipping account %s with duplicate UID %s", db->line, name, uid);
 		return;
@@ -435,8 +487,16 @@ static void corestorage_h_mu(database_handle_t *db, const char *type)
 	}
 	language = db_read_word(db);
 
+	if (mu != NULL)
+	{
+		mowgli_strlcpy(mu->pass, pass, PASSLEN);
+		if (strcmp(mu->email, email))
+			myuser_set_email(mu, email);
+		mu->flags = flags;
+	}
+	else
+		mu = myuser_add_id(uid, name, pass, email, flags);
 
-	mu = myuser_add_id(uid, name, pass, email, flags);
 	mu->registered = reg;
 	mu->lastlogin = login;
 	if (language)
@@ -463,11 +523,44 @@ static void corestorage_h_me(database_handle_t *db, const char *type)
 		return;
 	}
 
-	mz = smalloc(sizeof *mz);
-	mowgli_strlcpy(mz->sender, src, NICKLEN);
-	mowgli_strlcpy(mz->text, text, MEMOLEN);
-	mz->sent = sent;
-	mz->status = status;
+	mz = mymemo_create(src, text, sent, status);
+
+	if (!(mz->status & MEMO_READ))
+		mu->memoct_new++;
+
+	mowgli_node_add(mz, mowgli_node_create(), &mu->memos);
+}
+
+static void corestorage_h_mes(database_handle_t *db, const char *type)
+{
+	const char *dest, *src;
+	time_t sent;
+	unsigned int status, len;
+	unsigned long long offset;
+	myuser_t *mu;
+	mymemo_t *mz;
+	static bool warned = false;
+
+	dest = db_sread_word(db);
+	src = db_sread_word(db);
+	sent = db_sread_time(db);
+	status = db_sread_int(db);
+	offset = strtoull(db_sread_word(db), NULL, 10);
+	len = db_sread_uint(db);
+
+	if (!(mu = myuser_find(dest)))
+	{
+		slog(LG_DEBUG, "db-h-mes: line %d: memo for unknown account %s", db->line, dest);
+		return;
+	}
+
+	if (memo_store == NULL && !warned)
+	{
+		slog(LG_ERROR, "db-h-mes: line %d: memo texts are in the memo store, but modules/memoserv/memostore is not loaded", db->line);
+		warned = true;
+	}
+
+	mz = mymemo_create_stored(src, offset, len, sent, status);
 
 	if (!(mz->status & MEMO_READ))
 		mu->memoct_new++;
@@ -490,7 +583,7 @@ static void corestorage_h_mi(database_handle_t *db, const char *type)
 		return;
 	}
 
-	mowgli_node_add(sstrdup(target), mowgli_node_create(), &mu->memo_ignores);
+	memo_ignore_add(mu, target);
 }
 
 static void corestorage_h_ac(database_handle_t *db, const char *type)
@@ -530,10 +623,22 @@ static void corestorage_h_mn(database_handle_t *db, const char *type)
 		return;
 	}
 
-	if (mynick_find(nick))
+	if ((mn = mynick_find(nick)) != NULL)
 	{
-		slog(LG_INFO, "db-h-mn: line %d: skipping duplicate nick %s for account %s", db->line, nick, user);
-		return;
+		if (!journal_replaying)
+		{
+			slog(LG_INFO, "db-h-mn: line %d: skipping duplicate nick %s for account %s", db->line, nick, user);
+			return;
+		}
+
+		if (mn->owner == mu)
+		{
+			mn->registered = reg;
+			mn->lastseen = seen;
+			return;
+		}
+
+		object_unref(mn);
 	}
 
 	mn = mynick_add(mu, nick);
@@ -608,9 +713,16 @@ static void corestorage_h_mc(database_handle_t *db, const char *type)
 	const char *key;
 	const char *sflags;
 	unsigned int flags = 0;
+	mychan_t *mc = NULL;
 
 	mowgli_strlcpy(buf, name, sizeof buf);
-	mychan_t *mc = mychan_add(buf);
+	if (journal_replaying && (mc = mychan_find(buf)) != NULL)
+	{
+		free(mc->mlock_key);
+		mc->mlock_key = NULL;
+	}
+	else
+		mc = mychan_add(buf);
 
 	mc->registered = db_sread_time(db);
 	mc->used = db_sread_time(db);
@@ -751,6 +863,7 @@ static void corestorage_h_ca(database_handle_t *db, const char *type)
 	mychan_t *mc;
 	myentity_t *mt;
 	myentity_t *setter;
+	chanacs_t *ca;
 
 	chan = db_sread_word(db);
 	target = db_sread_word(db);
@@ -769,6 +882,12 @@ static void corestorage_h_ca(database_handle_t *db, const char *type)
 	if (dbv >= 9)
 		setter = myentity_find(db_sread_word(db));
 
+	if ((mc == NULL || (mt == NULL && !validhostmask(target))) && journal_replaying)
+	{
+		slog(LG_INFO, "db-h-ca: line %d: skipping journaled chanacs %s on %s", db->line, target, chan);
+		return;
+	}
+
 	if (mc == NULL)
 	{
 		slog(LG_INFO, "db-h-ca: line %d: chanacs for nonexistent channel %s - exiting to avoid data loss", db->line, chan);
@@ -785,6 +904,21 @@ static void corestorage_h_ca(database_handle_t *db, const char *type)
 		exit(EXIT_FAILURE);
 	}
 
+	if (journal_replaying)
+	{
+		ca = mt != NULL ? chanacs_find_literal(mc, mt, 0) : chanacs_find_host_literal(mc, target, 0);
+		if (ca != NULL)
+		{
+			ca->level = flags & ca_all;
+			ca->tmodified = tmod;
+			if (setter != NULL)
+				mowgli_strlcpy(ca->setter_uid, setter->id, IDLEN);
+			else
+				ca->setter_uid[0] = '\0';
+			return;
+		}
+	}
+
 	if (mt == NULL && validhostmask(target))
 	{
 		chanacs_add_host(mc, target, flags, tmod, setter);
@@ -838,12 +972,14 @@ static void corestorage_h_kl(database_handle_t *db, const char *type)
 	setby = db_sread_word(db);
 	reason = db_sread_str(db);
 
+	if (journal_replaying && id != 0 && kline_find_num(id) != NULL)
+		return;
+
 	mowgli_strlcpy(buf, reason, sizeof buf);
 	strip(buf);
 
 	k = kline_add_with_id(user, host, buf, duration, setby, id ? id : ++me.kline_id);
-	k->settime = settime;
-	k->expires = k->settime + k->duration;
+	kline_set_settime(k, settime);
 }
 
 static void corestorage_h_xid(database_handle_t *db, const char *type)
@@ -872,12 +1008,8 @@ static void corestorage_h_xl(database_handle_t *db, const char *type)
 	mowgli_strlcpy(buf, reason, sizeof buf);
 	strip(buf);
 
-	x = xline_add(realname, buf, duration, setby);
-	x->settime = settime;
-	x->expires = x->settime + x->duration;
-
-	if (id)
-		x->number = id;
+	x = xline_add_with_id(realname, buf, duration, setby, id);
+	xline_set_settime(x, settime);
 }
 
 static void corestorage_h_qid(database_handle_t *db, const char *type)
@@ -906,12 +1038,8 @@ static void corestorage_h_ql(database_handle_t *db, const char *type)
 	mowgli_strlcpy(buf, reason, sizeof buf);
 	strip(buf);
 
-	q = qline_add(mask, buf, duration, setby);
-	q->settime = settime;
-	q->expires = q->settime + q->duration;
-
-	if (id)
-		q->number = id;
+	q = qline_add_with_id(mask, buf, duration, setby, id);
+	qline_set_settime(q, settime);
 }
 
 static void corestorage_ignore_row(database_handle_t *db, const char *type)
@@ -919,28 +1047,654 @@ static void corestorage_ignore_row(database_handle_t *db, const char *type)
 	return;
 }
 
+static void corestorage_h_jgen(database_handle_t *db, const char *type)
+{
+	snapshot_gen = db_sread_uint(db);
+}
+
+static void corestorage_h_jdmu(database_handle_t *db, const char *type)
+{
+	const char *name = db_sread_word(db);
+	myuser_t *mu;
+
+	if ((mu = myuser_find(name)) != NULL)
+		object_unref(mu);
+}
+
+static void corestorage_h_jrmu(database_handle_t *db, const char *type)
+{
+	const char *oldname = db_sread_word(db);
+	const char *newname = db_sread_word(db);
+	myuser_t *mu, *mu2;
+
+	mu = myuser_find(oldname);
+	mu2 = myuser_find(newname);
+	if (mu == NULL || (mu2 != NULL && mu2 != mu))
+	{
+		slog(LG_INFO, "db-h-jrmu: line %d: cannot rename account %s to %s", db->line, oldname, newname);
+		return;
+	}
+
+	myuser_rename(mu, newname);
+}
+
+static void corestorage_h_jdmn(database_handle_t *db, const char *type)
+{
+	const char *nick = db_sread_word(db);
+	mynick_t *mn;
+
+	if ((mn = mynick_find(nick)) != NULL)
+		object_unref(mn);
+}
+
+static void corestorage_h_jdmc(database_handle_t *db, const char *type)
+{
+	const char *name = db_sread_word(db);
+	mychan_t *mc;
+
+	if ((mc = mychan_find(name)) == NULL)
+		return;
+
+	hook_call_channel_drop(mc);
+	object_unref(mc);
+}
+
+static void corestorage_h_jdca(database_handle_t *db, const char *type)
+{
+	const char *chan = db_sread_word(db);
+	const char *target = db_sread_word(db);
+	mychan_t *mc;
+	myentity_t *mt;
+	chanacs_t *ca;
+
+	if ((mc = mychan_find(chan)) == NULL)
+		return;
+
+	if ((mt = myentity_find(target)) != NULL)
+		ca = chanacs_find_literal(mc, mt, 0);
+	else
+		ca = chanacs_find_host_literal(mc, target, 0);
+
+	if (ca != NULL)
+		object_unref(ca);
+}
+
+static void corestorage_h_jdmd(database_handle_t *db, const char *type)
+{
+	const char *mdtype = db_sread_word(db);
+	const char *name = db_sread_word(db);
+	const char *mask, *prop;
+	void *obj = NULL;
+
+	if (!strcmp(mdtype, "MDU"))
+		obj = myuser_find(name);
+	else if (!strcmp(mdtype, "MDC"))
+		obj = mychan_find(name);
+	else if (!strcmp(mdtype, "MDA"))
+	{
+		mask = db_sread_word(db);
+		obj = chanacs_find_by_mask(mychan_find(name), mask, CA_NONE);
+	}
+
+	prop = db_sread_word(db);
+
+	if (obj != NULL)
+		metadata_delete(obj, prop);
+}
+
+static void corestorage_h_jdkl(database_handle_t *db, const char *type)
+{
+	unsigned int id = db_sread_uint(db);
+	kline_t *k;
+
+	if ((k = kline_find_num(id)) != NULL)
+		kline_delete(k);
+}
+
+/*
+ * The journal.
+ *
+ * Between full saves, changes to accounts, nicks, channels, access entries,
+ * their metadata and klines are appended to services.db.journal.<gen>.
+ * Each full save starts a new generation and records it in the snapshot
+ * (JGEN); on startup the snapshot is loaded and every journal from its
+ * generation onwards is replayed. Once a snapshot has been installed, the
+ * journals before it are redundant and are removed, so full saves act as
+ * compactions of the journal.
+ *
+ * Objects are logged as whole rows (the same MU, MC, CA ... rows a full
+ * save writes) at the end of the event loop iteration in which they
+ * changed, which is what lets a newly registered channel pick up the
+ * fields its creator sets after mychan_add(). Removals are logged right
+ * away, after anything still queued, since the object is about to go.
+ * Changes the core does not report (memos, most flag changes) still wait
+ * for the next full save.
+ */
+typedef struct {
+	db_journal_type_t type;
+	void *obj;
+	char *name;		/* metadata property, or NULL for the object itself */
+	mowgli_node_t node;
+} journal_entry_t;
+
+static database_handle_t *journal = NULL;
+static mowgli_list_t journal_pending = { NULL, NULL, 0 };
+static mowgli_patricia_t *journal_index = NULL;	/* journal_pending by object and property */
+static mowgli_eventloop_timer_t *journal_flush_timer = NULL;
+
+static void corestorage_journal_flush(void *arg);
+
+static void corestorage_journal_name(char *buf, size_t len, unsigned int gen)
+{
+	snprintf(buf, len, "services.db.journal.%u", gen);
+}
+
+static void corestorage_journal_write_entry(journal_entry_t *je)
+{
+	metadata_t *md;
+
+	if (je->name != NULL)
+	{
+		if ((md = metadata_find(je->obj, je->name)) != NULL)
+			corestorage_write_metadata(journal, je->type, je->obj, md);
+		else
+		{
+			db_start_row(journal, "JDMD");
+			db_write_word(journal, corestorage_metadata_row(je->type));
+			corestorage_write_metadata_owner(journal, je->type, je->obj);
+			db_write_word(journal, je->name);
+			db_commit_row(journal);
+		}
+		return;
+	}
+
+	switch (je->type)
+	{
+	case DB_JOURNAL_MYUSER:
+		corestorage_write_myuser(journal, je->obj);
+		db_start_row(journal, "LUID");
+		db_write_word(journal, myentity_get_last_uid());
+		db_commit_row(journal);
+		break;
+	case DB_JOURNAL_MYNICK:
+		corestorage_write_mynick(journal, je->obj);
+		break;
+	case DB_JOURNAL_MYCHAN:
+		corestorage_write_mychan(journal, je->obj);
+		break;
+	case DB_JOURNAL_CHANACS:
+		corestorage_write_chanacs(journal, je->obj);
+		break;
+	case DB_JOURNAL_KLINE:
+		corestorage_write_kline(journal, je->obj);
+		db_start_row(journal, "KID");
+		db_write_uint(journal, me.kline_id);
+		db_commit_row(journal);
+		break;
+	default:
+		break;
+	}
+}
+
+/* property names are case-insensitive, and the index folds case */
+static void corestorage_journal_key(char *buf, size_t len, void *obj, const char *name)
+{
+	snprintf(buf, len, "%p %s", obj, name != NULL ? name : "");
+}
+
+static void corestorage_journal_entry_free(journal_entry_t *je)
+{
+	char key[BUFSIZE];
+
+	corestorage_journal_key(key, sizeof key, je->obj, je->name);
+	mowgli_patricia_delete(journal_index, key);
+	mowgli_node_delete(&je->node, &journal_pending);
+	free(je->name);
+	free(je);
+}
+
+/* writes out everything queued so far, in the order it changed */
+static void corestorage_journal_write_pending(void)
+{
+	mowgli_node_t *n, *tn;
+
+	MOWGLI_ITER_FOREACH_SAFE(n, tn, journal_pending.head)
+	{
+		journal_entry_t *je = n->data;
+
+		if (journal != NULL)
+			corestorage_journal_write_entry(je);
+		corestorage_journal_entry_free(je);
+	}
+}
+
+static void corestorage_journal_schedule(void)
+{
+	if (journal_flush_timer == NULL)
+		journal_flush_timer = mowgli_timer_add_once(base_eventloop, "db_journal_flush", corestorage_journal_flush, NULL, 0);
+}
+
+static bool corestorage_journal_open(unsigned int gen)
+{
+	char name[BUFSIZE];
+
+	corestorage_journal_name(name, sizeof name, gen);
+	if ((journal = db_open(name, DB_APPEND)) == NULL)
+		return false;
+
+	/* replay may start at any journal, so each says what it was written against */
+	db_start_row(journal, "DBV");
+	db_write_int(journal, 12);
+	db_commit_row(journal);
+
+	db_start_row(journal, "CF");
+	db_write_word(journal, bitmask_to_flags(ca_all));
+	db_commit_row(journal);
+
+	return true;
+}
+
+static void corestorage_journal_close(void)
+{
+	if (journal == NULL)
+		return;
+
+	corestorage_journal_write_pending();
+	db_close(journal);
+	journal = NULL;
+}
+
+static void corestorage_journal_flush(void *arg)
+{
+	journal_flush_timer = NULL;
+
+	if (journal == NULL)
+		return;
+
+	corestorage_journal_write_pending();
+
+	if (!db_flush(journal))
+	{
+		slog(LG_ERROR, "corestorage: cannot write journal %s; journaling suspended until the next database save", journal->file);
+		wallops(_("\2DATABASE ERROR\2: cannot write journal %s; journaling suspended until the next database save"), journal->file);
+		db_close(journal);
+		journal = NULL;
+	}
+}
+
+/* removes journals made redundant by the snapshot of generation gen */
+static void corestorage_journal_prune(unsigned int gen)
+{
+	char name[BUFSIZE], path[BUFSIZE];
+
+	while (gen-- > 0)
+	{
+		corestorage_journal_name(name, sizeof name, gen);
+		snprintf(path, sizeof path, "%s/%s", datadir, name);
+		if (unlink(path) < 0)
+			break;
+	}
+}
+
+/* starts a new generation; called just before a full save takes its snapshot */
+static void corestorage_journal_rotate(void)
+{
+	char name[BUFSIZE], path[BUFSIZE];
+
+	corestorage_journal_close();
+
+	journal_gen++;
+
+	/* a leftover from an earlier run must not be appended to */
+	corestorage_journal_name(name, sizeof name, journal_gen);
+	snprintf(path, sizeof path, "%s/%s", datadir, name);
+	unlink(path);
+
+	corestorage_journal_open(journal_gen);
+}
+
+static void corestorage_journal_queue(db_journal_type_t type, void *obj, const char *name)
+{
+	journal_entry_t *je;
+	char key[BUFSIZE];
+
+	if (journal == NULL)
+		return;
+
+	corestorage_journal_key(key, sizeof key, obj, name);
+
+	if (journal_index == NULL)
+		journal_index = mowgli_patricia_create(strcasecanon);
+	else if (mowgli_patricia_retrieve(journal_index, key) != NULL)
+		return;
+
+	je = smalloc(sizeof *je);
+	je->type = type;
+	je->obj = obj;
+	je->name = name != NULL ? sstrdup(name) : NULL;
+	mowgli_patricia_add(journal_index, key, je);
+	mowgli_node_add(je, &je->node, &journal_pending);
+
+	corestorage_journal_schedule();
+}
+
+static void corestorage_journal_update(db_journal_type_t type, void *obj)
+{
+	corestorage_journal_queue(type, obj, NULL);
+}
+
+static void corestorage_journal_metadata(db_journal_type_t type, void *obj, const char *name)
+{
+	corestorage_journal_queue(type, obj, name);
+}
+
+static void corestorage_journal_remove(db_journal_type_t type, void *obj)
+{
+	mowgli_node_t *n, *tn;
+	chanacs_t *ca;
+	mynick_t *mn;
+
+	MOWGLI_ITER_FOREACH_SAFE(n, tn, journal_pending.head)
+	{
+		journal_entry_t *je = n->data;
+
+		if (je->obj == obj)
+			corestorage_journal_entry_free(je);
+	}
+
+	if (journal == NULL)
+		return;
+
+	corestorage_journal_write_pending();
+
+	switch (type)
+	{
+	case DB_JOURNAL_MYUSER:
+		db_start_row(journal, "JDMU");
+		db_write_word(journal, entity((myuser_t *)obj)->name);
+		db_commit_row(journal);
+		break;
+	case DB_JOURNAL_MYNICK:
+		mn = obj;
+		/* replaying the account's removal takes its nicks with it */
+		if (object(mn->owner)->journal_type == DB_JOURNAL_NONE)
+			return;
+		db_start_row(journal, "JDMN");
+		db_write_word(journal, mn->nick);
+		db_commit_row(journal);
+		break;
+	case DB_JOURNAL_MYCHAN:
+		db_start_row(journal, "JDMC");
+		db_write_word(journal, ((mychan_t *)obj)->name);
+		db_commit_row(journal);
+		break;
+	case DB_JOURNAL_CHANACS:
+		ca = obj;
+		/* likewise for access entries of a channel or account being dropped */
+		if (object(ca->mychan)->journal_type == DB_JOURNAL_NONE)
+			return;
+		if (ca->entity != NULL && isuser(ca->entity) && object(ca->entity)->journal_type == DB_JOURNAL_NONE)
+			return;
+		db_start_row(journal, "JDCA");
+		db_write_word(journal, ca->mychan->name);
+		db_write_word(journal, ca->entity ? ca->entity->name : ca->host);
+		db_commit_row(journal);
+		break;
+	case DB_JOURNAL_KLINE:
+		db_start_row(journal, "JDKL");
+		db_write_uint(journal, ((kline_t *)obj)->number);
+		db_commit_row(journal);
+		break;
+	default:
+		return;
+	}
+
+	corestorage_journal_schedule();
+}
+
+static void corestorage_journal_rename(myuser_t *mu, const char *newname)
+{
+	if (journal == NULL)
+		return;
+
+	corestorage_journal_write_pending();
+
+	db_start_row(journal, "JRMU");
+	db_write_word(journal, entity(mu)->name);
+	db_write_word(journal, newname);
+	db_commit_row(journal);
+
+	corestorage_journal_schedule();
+}
+
+static database_journal_t corestorage_journal = {
+	.update = corestorage_journal_update,
+	.remove = corestorage_journal_remove,
+	.metadata = corestorage_journal_metadata,
+	.rename = corestorage_journal_rename,
+};
+
+/* replays the journals belonging to the loaded snapshot and opens the live one */
+static void corestorage_journal_start(void)
+{
+	database_handle_t *db;
+	struct stat sb;
+	unsigned int gen;
+	char name[BUFSIZE], path[BUFSIZE];
+
+	journal_enabled = true;
+	journal_gen = snapshot_gen;
+	journal_replaying = true;
+
+	for (gen = snapshot_gen; ; gen++)
+	{
+		corestorage_journal_name(name, sizeof name, gen);
+		snprintf(path, sizeof path, "%s/%s", datadir, name);
+		if (stat(path, &sb) < 0)
+			break;
+
+		journal_gen = gen;
+
+		/* a crash may have cut the last row short; it never took effect */
+		if (!db_recover(name))
+			slog(LG_ERROR, "corestorage: cannot check journal %s for an incomplete last row", path);
+		else if (stat(path, &sb) < 0)
+			break;
+
+		if (sb.st_size == 0)
+			continue;
+
+		slog(LG_INFO, "corestorage: replaying journal %s", path);
+
+		if ((db = db_open(name, DB_READ)) == NULL)
+			break;
+
+		db_parse(db);
+		db_close(db);
+	}
+
+	journal_replaying = false;
+
+	corestorage_journal_prune(snapshot_gen);
+	corestorage_journal_open(journal_gen);
+
+	db_journal = &corestorage_journal;
+}
+
 static void corestorage_db_load(const char *filename)
 {
 	database_handle_t *db;
 
+	db_timing_start();
+
 	db = db_open(filename, DB_READ);
+	if (db != NULL)
+	{
+		db_parse(db);
+		db_close(db);
+	}
+
+	if (filename == NULL && config_options.db_journal && !readonly)
+		corestorage_journal_start();
+
+	db_timing_report(filename != NULL ? filename : "services.db");
+}
+
+static void corestorage_db_write_blocking(void *filename)
+{
+	database_handle_t *db;
+
+	db = db_open(filename, DB_WRITE);
 	if (db == NULL)
 		return;
 
-	db_parse(db);
-	db_close(db);
+	corestorage_db_save(db);
+	hook_call_db_write(db);
+
+	if (db_close(db) && filename == NULL && journal_enabled)
+		corestorage_journal_prune(journal_gen);
 }
 
-static void corestorage_db_write(void *filename)
+#ifdef HAVE_FORK
+/* state of the forked writer, if any */
+static pid_t child_pid = 0;
+static char *child_filename = NULL;
+static unsigned int child_gen;
+static time_t child_started;
+static bool save_pending = false;
+
+static void corestorage_db_write(void *filename, db_save_strategy_t strategy);
+
+static void corestorage_child_reset(void)
+{
+	child_pid = 0;
+	free(child_filename);
+	child_filename = NULL;
+}
+
+static void corestorage_db_saved_cb(pid_t pid, int status, void *data)
+{
+	return_if_fail(pid == child_pid);
+
+	if (WIFEXITED(status) && WEXITSTATUS(status) == 0)
+	{
+		slog(LG_DEBUG, "db_save(): child %d finished in %ld seconds", (int) pid, (long) (CURRTIME - child_started));
+		if (db_commit(child_filename) && child_filename == NULL && journal_enabled)
+			corestorage_journal_prune(child_gen);
+	}
+	else
+	{
+		slog(LG_ERROR, "db_save(): child %d failed (status %d); database not updated", (int) pid, status);
+		wallops(_("\2DATABASE ERROR\2: db_save(): background save failed; database not updated"));
+	}
+
+	corestorage_child_reset();
+
+	if (save_pending)
+	{
+		save_pending = false;
+		corestorage_db_write(NULL, DB_SAVE_BG_IMPORTANT);
+	}
+}
+
+/* abandons a running background save, e.g. before a blocking one */
+static void corestorage_child_kill(void)
+{
+	int status;
+
+	if (child_pid == 0)
+		return;
+
+	slog(LG_DEBUG, "db_save(): abandoning background save in child %d", (int) child_pid);
+
+	childproc_delete_all(corestorage_db_saved_cb);
+	kill(child_pid, SIGKILL);
+	waitpid(child_pid, &status, 0);
+
+	corestorage_child_reset();
+	save_pending = false;
+}
+
+static void corestorage_db_write_child(void *filename)
 {
 	database_handle_t *db;
+	bool ok;
 
-	db = db_open(filename, DB_WRITE);
+	/* we must not talk to the uplink or anyone else from here */
+	connection_close_all_fds();
+
+	db = db_open(filename, DB_WRITE_DEFERRED);
+	if (db == NULL)
+		_exit(EXIT_FAILURE);
 
 	corestorage_db_save(db);
 	hook_call_db_write(db);
 
-	db_close(db);
+	ok = db_close(db);
+
+	_exit(ok ? EXIT_SUCCESS : EXIT_FAILURE);
+}
+#endif
+
+static void corestorage_db_write(void *filename, db_save_strategy_t strategy)
+{
+#ifdef HAVE_FORK
+	pid_t pid;
+
+	/* general::db_save_blocking covers every save, not just the periodic one */
+	if (config_options.db_save_blocking)
+		strategy = DB_SAVE_BLOCKING;
+
+	if (child_pid != 0)
+	{
+		switch (strategy)
+		{
+		case DB_SAVE_BG_REGULAR:
+			slog(LG_DEBUG, "db_save(): background save already in progress; skipping");
+			return;
+		case DB_SAVE_BG_IMPORTANT:
+			/* the running child may not see the change that prompted this */
+			save_pending = true;
+			return;
+		case DB_SAVE_BLOCKING:
+			corestorage_child_kill();
+			break;
+		}
+	}
+
+	if (filename == NULL && journal_enabled)
+		corestorage_journal_rotate();
+
+	if (strategy == DB_SAVE_BLOCKING || db_mod == NULL || db_mod->db_commit == NULL)
+	{
+		corestorage_db_write_blocking(filename);
+		return;
+	}
+
+	switch ((pid = fork()))
+	{
+	case -1:
+		slog(LG_ERROR, "db_save(): fork failed (%s); saving in the foreground", strerror(errno));
+		corestorage_db_write_blocking(filename);
+		return;
+	case 0:
+		corestorage_db_write_child(filename);
+		/* NOTREACHED */
+	default:
+		child_pid = pid;
+		child_filename = filename != NULL ? sstrdup(filename) : NULL;
+		child_gen = journal_gen;
+		child_started = CURRTIME;
+		childproc_add(pid, "db_save", corestorage_db_saved_cb, NULL);
+		slog(LG_DEBUG, "db_save(): writing database in child %d", (int) pid);
+		return;
+	}
+#else
+	if (filename == NULL && journal_enabled)
+		corestorage_journal_rotate();
+
+	corestorage_db_write_blocking(filename);
+#endif
 }
 
 void _modinit(module_t *m)
@@ -956,6 +1710,7 @@ void _modinit(module_t *m)
 	db_register_type_handler("CF", corestorage_h_cf);
 	db_register_type_handler("MU", corestorage_h_mu);
 	db_register_type_handler("ME", corestorage_h_me);
+	db_register_type_handler("MES", corestorage_h_mes);
 	db_register_type_handler("MI", corestorage_h_mi);
 	db_register_type_handler("AC", corestorage_h_ac);
 	db_register_type_handler("MN", corestorage_h_mn);
@@ -980,6 +1735,15 @@ void _modinit(module_t *m)
 
 	db_register_type_handler("DE", corestorage_ignore_row);
 
+	db_register_type_handler("JGEN", corestorage_h_jgen);
+	db_register_type_handler("JDMU", corestorage_h_jdmu);
+	db_register_type_handler("JRMU", corestorage_h_jrmu);
+	db_register_type_handler("JDMN", corestorage_h_jdmn);
+	db_register_type_handler("JDMC", corestorage_h_jdmc);
+	db_register_type_handler("JDCA", corestorage_h_jdca);
+	db_register_type_handler("JDMD", corestorage_h_jdmd);
+	db_register_type_handler("JDKL", corestorage_h_jdkl);
+
 	db_register_type_handler("???", corestorage_h_unknown);
 
 	backend_loaded = true;
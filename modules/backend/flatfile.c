@@ -215,12 +215,7 @@ static void flatfile_db_load(const char *filename)
 			if (!sender || !mtime || !text)
 				continue;
 
-			mz = smalloc(sizeof(mymemo_t));
-
-			mowgli_strlcpy(mz->sender, sender, NICKLEN);
-			mowgli_strlcpy(mz->text, text, MEMOLEN);
-			mz->sent = mtime;
-			mz->status = status;
+			mz = mymemo_create(sender, text, mtime, status);
 
 			if (!(mz->status & MEMO_READ))
 				mu->memoct_new++;
@@ -230,7 +225,7 @@ static void flatfile_db_load(const char *filename)
 		else if (!strcmp("MI", item))
 		{
 			/* memo ignore */
-			char *user, *target, *strbuf;
+			char *user, *target;
 
 			user = strtok(NULL, " ");
 			target = strtok(NULL, "\n");
@@ -243,9 +238,7 @@ static void flatfile_db_load(const char *filename)
 				continue;
 			}
 
-			strbuf = sstrdup(target);
-
-			mowgli_node_add(strbuf, mowgli_node_create(), &mu->memo_ignores);
+			memo_ignore_add(mu, target);
 		}
 		else if (!strcmp("AC", item))
 		{
@@ -624,9 +617,7 @@ static void flatfile_db_load(const char *filename)
 			strip(reason);
 
 			k = kline_add(user, host, reason, duration, setby);
-			k->settime = settime;
-			/* XXX this is not nice, oh well -- jilles */
-			k->expires = k->settime + k->duration;
+			kline_set_settime(k, settime);
 
 			kin++;
 		}
@@ -653,10 +644,7 @@ static void flatfile_db_load(const char *filename)
 			strip(reason);
 
 			x = xline_add(realname, reason, duration, setby);
-			x->settime = settime;
-
-			/* XXX this is not nice, oh well -- jilles */
-			x->expires = x->settime + x->duration;
+			xline_set_settime(x, settime);
 
 			xin++;
 		}
@@ -683,10 +671,7 @@ static void flatfile_db_load(const char *filename)
 			strip(reason);
 
 			q = qline_add(mask, reason, duration, setby);
-			q->settime = settime;
-
-			/* XXX this is not nice, oh well -- jilles */
-			q->expires = q->settime + q->duration;
+			qline_set_settime(q, settime);
 
 			qin++;
 		}
@@ -724,7 +709,7 @@ static void flatfile_db_load(const char *filename)
 	free(buf);
 
 	slog(LG_DEBUG, "db_load(): ------------------------- done -------------------------");
-	db_save(NULL);
+	db_save(NULL, DB_SAVE_BLOCKING);
 
 	slog(LG_INFO, "Your database has been converted to the new OpenSEX format automatically.");
 	slog(LG_INFO, "You must now change the backend module in the config file to ensure that the OpenSEX database is loaded.");
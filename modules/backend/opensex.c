@@ -10,6 +10,11 @@
 
 #include "atheme.h"
 
+#ifdef HAVE_PTHREAD
+# include <pthread.h>
+# include <signal.h>
+#endif
+
 DECLARE_MODULE_V1
 (
 	"backend/opensex", true, _modinit, NULL,
@@ -28,9 +33,175 @@ typedef struct opensex_ {
 	unsigned int grver;
 } opensex_t;
 
+#ifdef HAVE_PTHREAD
+/*
+ * Threaded loading. The file is read into memory and cut at line
+ * boundaries into one chunk per thread. Each thread splits its chunk into
+ * rows, separates the row type and checks the row, and the main thread
+ * feeds the rows to their handlers in file order as each chunk becomes
+ * ready. Handlers still run one at a time on the main thread, so nothing
+ * they touch needs locking.
+ */
+#define OPENSEX_CHUNK_MIN	(256 * 1024)
+
+typedef struct {
+	char *type;
+	char *rest;
+	unsigned int line;	/* within the chunk */
+} opensex_row_t;
+
+typedef struct {
+	char *start, *end;
+	opensex_row_t *rows;
+	unsigned int nrows, rowsize;
+	unsigned int lines;
+	unsigned int badline;	/* first line with a NUL byte in it, if any */
+	pthread_t thread;
+	bool threaded;
+} opensex_chunk_t;
+
+static void *opensex_tokenize_chunk(void *arg)
+{
+	opensex_chunk_t *c = arg;
+	opensex_row_t *row;
+	char *p, *nl, *sp;
+
+	for (p = c->start; p < c->end; p = nl + 1)
+	{
+		/* the buffer has room for a terminator after the last line */
+		if ((nl = memchr(p, '\n', c->end - p)) == NULL)
+			nl = c->end;
+		*nl = '\0';
+		c->lines++;
+
+		if (strlen(p) != (size_t)(nl - p) && c->badline == 0)
+			c->badline = c->lines;
+
+		if (*p == '\0' || strchr("#\t \r", *p))
+			continue;
+
+		if (c->nrows == c->rowsize)
+		{
+			c->rowsize = c->rowsize != 0 ? c->rowsize * 2 : 1024;
+			c->rows = srealloc(c->rows, c->rowsize * sizeof(opensex_row_t));
+		}
+
+		row = &c->rows[c->nrows++];
+		row->type = p;
+		row->line = c->lines;
+
+		if ((sp = strchr(p, ' ')) != NULL)
+		{
+			*sp = '\0';
+			row->rest = sp + 1;
+		}
+		else
+			row->rest = NULL;
+	}
+
+	return NULL;
+}
+
+static bool opensex_db_parse_threaded(database_handle_t *db)
+{
+	opensex_t *rs = (opensex_t *)db->priv;
+	opensex_chunk_t *chunks, *c;
+	struct stat sb;
+	sigset_t all, old;
+	char *buf, *nl;
+	size_t len, off, end;
+	unsigned int nchunks, i, j, line = 0;
+
+	if (fstat(fileno(rs->f), &sb) < 0 || sb.st_size < 2 * OPENSEX_CHUNK_MIN)
+		return false;
+
+	len = sb.st_size;
+	nchunks = MIN(config_options.db_load_threads, len / OPENSEX_CHUNK_MIN);
+	if (nchunks < 2)
+		return false;
+
+	buf = smalloc(len + 1);
+	if (fread(buf, 1, len, rs->f) != len)
+	{
+		slog(LG_ERROR, "opensex-parse: error reading %s: %s", db->file, ferror(rs->f) ? strerror(errno) : "file shrank while loading");
+		slog(LG_ERROR, "opensex-parse: exiting to avoid data loss");
+		exit(EXIT_FAILURE);
+	}
+	buf[len] = '\0';
+
+	chunks = scalloc(nchunks, sizeof(opensex_chunk_t));
+
+	for (i = 0, off = 0; i < nchunks; i++, off = end)
+	{
+		end = len;
+		if (i < nchunks - 1)
+		{
+			end = MAX(off, len / nchunks * (i + 1));
+			if ((nl = memchr(buf + end, '\n', len - end)) != NULL)
+				end = nl - buf + 1;
+			else
+				end = len;
+		}
+
+		chunks[i].start = buf + off;
+		chunks[i].end = buf + end;
+	}
+
+	/* signals are for the main thread */
+	sigfillset(&all);
+	pthread_sigmask(SIG_BLOCK, &all, &old);
+	for (i = 0; i < nchunks; i++)
+		chunks[i].threaded = pthread_create(&chunks[i].thread, NULL, opensex_tokenize_chunk, &chunks[i]) == 0;
+	pthread_sigmask(SIG_SETMASK, &old, NULL);
+
+	slog(LG_DEBUG, "opensex-parse: loading %s in %u chunks", db->file, nchunks);
+
+	for (i = 0; i < nchunks; i++)
+	{
+		c = &chunks[i];
+
+		if (c->threaded)
+			pthread_join(c->thread, NULL);
+		else
+			opensex_tokenize_chunk(c);
+
+		if (c->badline != 0)
+		{
+			slog(LG_ERROR, "opensex-parse: %s line %u contains a NUL byte", db->file, line + c->badline);
+			slog(LG_ERROR, "opensex-parse: exiting to avoid data loss");
+			exit(EXIT_FAILURE);
+		}
+
+		for (j = 0; j < c->nrows; j++)
+		{
+			rs->token = c->rows[j].rest;
+			db->line = line + c->rows[j].line;
+			db->token = 1;
+
+			db_process(db, c->rows[j].type);
+		}
+
+		line += c->lines;
+		free(c->rows);
+	}
+
+	rs->token = NULL;
+	free(chunks);
+	free(buf);
+
+	return true;
+}
+#endif
+
 static void opensex_db_parse(database_handle_t *db)
 {
 	const char *cmd;
+
+#ifdef HAVE_PTHREAD
+	if (config_options.db_load_threads > 1 && opensex_db_parse_threaded(db))
+		return;
+#endif
+
 	while (db_read_next_row(db))
 	{
 		cmd = db_read_word(db);
@@ -284,22 +455,28 @@ static database_handle_t *opensex_db_open_read(const char *filename)
 	return db;
 }
 
-static database_handle_t *opensex_db_open_write(const char *filename)
+static database_handle_t *opensex_db_open_write(const char *filename, database_transaction_t txn)
 {
 	database_handle_t *db;
 	opensex_t *rs;
 	int fd;
 	FILE *f;
 	int errno1;
+	struct stat sb;
 	char bpath[BUFSIZE], path[BUFSIZE];
 
 	snprintf(bpath, BUFSIZE, "%s/%s", datadir, filename != NULL ? filename : "services.db");
 
 	mowgli_strlcpy(path, bpath, sizeof path);
-	mowgli_strlcat(path, ".new", sizeof path);
+	if (txn == DB_APPEND)
+		fd = open(path, O_WRONLY | O_CREAT | O_APPEND, S_IRUSR | S_IWUSR | S_IRGRP | S_IWGRP);
+	else
+	{
+		mowgli_strlcat(path, ".new", sizeof path);
+		fd = open(path, O_WRONLY | O_CREAT | O_TRUNC, S_IRUSR | S_IWUSR | S_IRGRP | S_IWGRP);
+	}
 
-	fd = open(path, O_WRONLY | O_CREAT, S_IRUSR | S_IWUSR | S_IRGRP | S_IWGRP);
-	if (fd < 0 || ! (f = fdopen(fd, "w")))
+	if (fd < 0 || ! (f = fdopen(fd, txn == DB_APPEND ? "a" : "w")))
 	{
 		errno1 = errno;
 		slog(LG_ERROR, "db-open-write: cannot open '%s' for writing: %s", path, strerror(errno1));
@@ -314,11 +491,15 @@ static database_handle_t *opensex_db_open_write(const char *filename)
 	db = scalloc(sizeof(database_handle_t), 1);
 	db->priv = rs;
 	db->vt = &opensex_vt;
-	db->txn = DB_WRITE;
+	db->txn = txn;
 	db->file = sstrdup(bpath);
 	db->line = 0;
 	db->token = 0;
 
+	/* an existing file we are appending to already has its header */
+	if (txn == DB_APPEND && fstat(fd, &sb) == 0 && sb.st_size > 0)
+		return db;
+
 	db_start_row(db, "GRVER");
 	db_write_int(db, rs->grver);
 	db_commit_row(db);
@@ -328,50 +509,147 @@ static database_handle_t *opensex_db_open_write(const char *filename)
 
 static database_handle_t *opensex_db_open(const char *filename, database_transaction_t txn)
 {
-	if (txn == DB_WRITE)
-		return opensex_db_open_write(filename);
+	if (txn != DB_READ)
+		return opensex_db_open_write(filename, txn);
 	return opensex_db_open_read(filename);
 }
 
-static void opensex_db_close(database_handle_t *db)
+/* replace the old database with the new one, using an atomic rename */
+static bool opensex_db_install(const char *path)
+{
+	int errno1;
+	char oldpath[BUFSIZE];
+
+	mowgli_strlcpy(oldpath, path, sizeof oldpath);
+	mowgli_strlcat(oldpath, ".new", sizeof oldpath);
+
+	if (srename(oldpath, path) < 0)
+	{
+		errno1 = errno;
+		slog(LG_ERROR, "db_save(): cannot rename services.db.new to services.db: %s", strerror(errno1));
+		wallops(_("\2DATABASE ERROR\2: db_save(): cannot rename services.db.new to services.db: %s"), strerror(errno1));
+		return false;
+	}
+
+	hook_call_db_saved();
+	return true;
+}
+
+static bool opensex_db_commit(const char *filename)
+{
+	char path[BUFSIZE];
+
+	snprintf(path, BUFSIZE, "%s/%s", datadir, filename != NULL ? filename : "services.db");
+
+	return opensex_db_install(path);
+}
+
+static bool opensex_db_close(database_handle_t *db)
 {
 	opensex_t *rs;
 	int errno1;
-	char oldpath[BUFSIZE], newpath[BUFSIZE];
+	bool ok = true;
 
-	return_if_fail(db != NULL);
+	return_val_if_fail(db != NULL, false);
 	rs = db->priv;
 
-	mowgli_strlcpy(oldpath, db->file, sizeof oldpath);
-	mowgli_strlcat(oldpath, ".new", sizeof oldpath);
+	if (db->txn != DB_READ && ferror(rs->f))
+		ok = false;
 
-	mowgli_strlcpy(newpath, db->file, sizeof newpath);
+	if (fclose(rs->f) != 0)
+		ok = false;
 
-	fclose(rs->f);
-
-	if (db->txn == DB_WRITE)
+	if (db->txn == DB_APPEND && !ok)
 	{
-		/* now, replace the old database with the new one, using an atomic rename */
-		if (srename(oldpath, newpath) < 0)
-		{
-			errno1 = errno;
-			slog(LG_ERROR, "db_save(): cannot rename services.db.new to services.db: %s", strerror(errno1));
-			wallops(_("\2DATABASE ERROR\2: db_save(): cannot rename services.db.new to services.db: %s"), strerror(errno1));
-		}
-
-		hook_call_db_saved();
+		errno1 = errno;
+		slog(LG_ERROR, "db-close: cannot write %s: %s", db->file, strerror(errno1));
+		wallops(_("\2DATABASE ERROR\2: db-close: cannot write %s: %s"), db->file, strerror(errno1));
+	}
+	else if (db->txn != DB_READ && !ok)
+	{
+		errno1 = errno;
+		slog(LG_ERROR, "db_save(): cannot write %s.new: %s", db->file, strerror(errno1));
+		wallops(_("\2DATABASE ERROR\2: db_save(): cannot write %s.new: %s"), db->file, strerror(errno1));
 	}
+	else if (db->txn == DB_WRITE)
+		ok = opensex_db_install(db->file);
 
 	free(rs->buf);
 	free(rs);
 	free(db->file);
 	free(db);
+
+	return ok;
+}
+
+static bool opensex_db_flush(database_handle_t *db)
+{
+	opensex_t *rs;
+
+	return_val_if_fail(db != NULL, false);
+	rs = db->priv;
+
+	return fflush(rs->f) == 0 && !ferror(rs->f);
+}
+
+/* drops whatever follows the last newline of an appended file */
+static bool opensex_db_recover(const char *filename)
+{
+	char path[BUFSIZE], buf[BUFSIZE];
+	struct stat sb;
+	off_t end, off;
+	size_t len;
+	int fd, errno1;
+
+	snprintf(path, BUFSIZE, "%s/%s", datadir, filename != NULL ? filename : "services.db");
+
+	if ((fd = open(path, O_RDWR)) < 0)
+		return errno == ENOENT;
+
+	if (fstat(fd, &sb) < 0)
+		goto fail;
+
+	for (end = sb.st_size; end > 0; end = off)
+	{
+		off = end > BUFSIZE ? end - BUFSIZE : 0;
+		if (pread(fd, buf, end - off, off) != end - off)
+			goto fail;
+
+		for (len = end - off; len > 0 && buf[len - 1] != '\n'; len--)
+			;
+
+		if (len > 0)
+		{
+			end = off + len;
+			break;
+		}
+	}
+
+	if (end < sb.st_size)
+	{
+		slog(LG_ERROR, "opensex-recover: dropping an incomplete line (%lld bytes) at the end of %s",
+				(long long)(sb.st_size - end), path);
+		if (ftruncate(fd, end) < 0)
+			goto fail;
+	}
+
+	close(fd);
+	return true;
+
+fail:
+	errno1 = errno;
+	close(fd);
+	slog(LG_ERROR, "opensex-recover: cannot check %s: %s", path, strerror(errno1));
+	return false;
 }
 
 static database_module_t opensex_mod = {
 	.db_open = opensex_db_open,
 	.db_close = opensex_db_close,
 	.db_parse = opensex_db_parse,
+	.db_commit = opensex_db_commit,
+	.db_flush = opensex_db_flush,
+	.db_recover = opensex_db_recover,
 };
 
 void _modinit(module_t *m)
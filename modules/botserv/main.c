@@ -970,9 +970,9 @@ static void bs_cmd_unassign(sourceinfo_t *si, int parc, char *parv[])
 
 void _modinit(module_t *m)
 {
-	if (!module_find_published("backend/opensex"))
+	if (db_mod == NULL)
 	{
-		slog(LG_INFO, "Module %s requires use of the OpenSEX database backend, refusing to load.", m->name);
+		slog(LG_INFO, "Module %s requires a row-based database backend such as OpenSEX, refusing to load.", m->name);
 		m->mflags = MODTYPE_FAIL;
 		return;
 	}
@@ -1150,7 +1150,10 @@ bs_part(hook_channel_joinpart_t *hdata)
 	bot = bs_mychan_find_bot(mc);
 	if (CURRTIME - mc->used >= 3600)
 		if (chanacs_user_flags(mc, cu->user) & CA_USEDUPDATE)
+		{
 			mc->used = CURRTIME;
+			expire_touch(EXPIRE_MYCHAN, mc);
+		}
 	/*
 	* When channel_part is fired, we haven't yet removed the
 	* user from the room. So, the channel will have two members
@@ -265,6 +265,8 @@ static void write_chanfixdb(database_handle_t *db)
 {
 	chanfix_channel_t *chan;
 	mowgli_patricia_iteration_state_t state;
+	metadata_iteration_state_t state2;
+	metadata_t *md;
 
 	return_if_fail(db != NULL);
 
@@ -305,19 +307,13 @@ static void write_chanfixdb(database_handle_t *db)
 			db_commit_row(db);
 		}
 
-		if (object(chan)->metadata != NULL)
+		METADATA_FOREACH(md, &state2, chan)
 		{
-			mowgli_patricia_iteration_state_t state2;
-			metadata_t *md;
-
-			MOWGLI_PATRICIA_FOREACH(md, &state2, object(chan)->metadata)
-			{
-				db_start_row(db, "CFMD");
-				db_write_word(db, chan->name);
-				db_write_word(db, md->name);
-				db_write_str(db, md->value);
-				db_commit_row(db);
-			}
+			db_start_row(db, "CFMD");
+			db_write_word(db, chan->name);
+			db_write_word(db, md->name);
+			db_write_str(db, md->value);
+			db_commit_row(db);
 		}
 	}
 }
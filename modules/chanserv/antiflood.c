@@ -28,7 +28,19 @@ DECLARE_MODULE_V1
 );
 
 static int antiflood_msg_time = 60;
-static int antiflood_msg_count = 10;
+
+/* messages a channel must have seen before flooding is considered */
+#define MQUEUE_MSG_COUNT	10
+
+/* messages remembered per channel: the count plus the one that tips it
+ * over, as the old list-based queue only dropped its oldest entry once it
+ * had grown past the count */
+#define MQUEUE_SIZE		(MQUEUE_MSG_COUNT + 1)
+
+/* power of two, comfortably larger than MQUEUE_SIZE */
+#define MQUEUE_TABLE_SIZE	32
+
+#define PRIVDATA_KEY_MQUEUE	"antiflood:mqueue"
 
 #define METADATA_KEY_ENFORCE_METHOD	"private:antiflood:enforce-method"
 
@@ -47,87 +59,162 @@ typedef enum {
 	MQ_ENFORCE_LINE,
 } mqueue_enforce_strategy_t;
 
-typedef struct {
-	char *name;
-	size_t max;
-	time_t last_used;
-	mowgli_list_t entries;
-} mqueue_t;
-
 typedef struct {
 	stringref source;
-	char *message;
 	time_t time;
+	uint64_t hash;		/* of the case-folded message */
+	unsigned int next;	/* next entry from the same source */
+} mqueue_entry_t;
+
+typedef struct {
+	uint64_t key;
+	unsigned int count;	/* 0 means the slot is free */
+	unsigned int first;	/* oldest and newest entries with this key */
+	unsigned int last;
+} mqueue_count_t;
+
+/*
+ * The last MQUEUE_SIZE messages in a channel, oldest first, plus how
+ * many of them carry each message hash and each source. The counts are
+ * updated as entries come and go, so deciding whether to enforce never
+ * looks at the other entries.
+ */
+typedef struct {
+	mychan_t *mc;
+	time_t last_used;
 	mowgli_node_t node;
-} msg_t;
 
-static mowgli_heap_t *msg_heap = NULL;
+	unsigned int head;
+	unsigned int len;
+	mqueue_entry_t entries[MQUEUE_SIZE];
 
-static void
-msg_destroy(msg_t *msg, mqueue_t *mq)
+	mqueue_count_t msgs[MQUEUE_TABLE_SIZE];
+	mqueue_count_t sources[MQUEUE_TABLE_SIZE];
+} mqueue_t;
+
+static mowgli_list_t mqueue_list;
+static mowgli_heap_t *mqueue_heap = NULL;
+static mowgli_eventloop_timer_t *mqueue_gc_timer = NULL;
+
+/* FNV-1a over the message, ignoring case like strcasecmp() */
+static uint64_t
+mqueue_hash(const char *message)
 {
-	free(msg->message);
-	strshare_unref(msg->source);
-	mowgli_node_delete(&msg->node, &mq->entries);
+	uint64_t hash = 0xcbf29ce484222325ULL;
+	const unsigned char *p;
 
-	mowgli_heap_free(msg_heap, msg);
+	for (p = (const unsigned char *)message; *p != '\0'; p++)
+	{
+		hash ^= tolower(*p);
+		hash *= 0x100000001b3ULL;
+	}
+
+	return hash;
 }
 
-static msg_t *
-msg_create(mqueue_t *mq, user_t *u, const char *message)
+static inline unsigned int
+mqueue_slot(uint64_t key)
 {
-	msg_t *msg;
+	key ^= key >> 33;
+	key *= 0xff51afd7ed558ccdULL;
+	key ^= key >> 33;
 
-	msg = mowgli_heap_alloc(msg_heap);
-	msg->message = sstrdup(message);
-	msg->time = CURRTIME;
-	msg->source = u->uid != NULL ? strshare_ref(u->uid) : strshare_ref(u->nick);
+	return key & (MQUEUE_TABLE_SIZE - 1);
+}
 
-	if (MOWGLI_LIST_LENGTH(&mq->entries) > mq->max)
-	{
-		msg_t *head_msg = mq->entries.head->data;
-		msg_destroy(head_msg, mq);
-	}
+/* returns the slot for key, or the free slot it would go in */
+static mqueue_count_t *
+mqueue_count_find(mqueue_count_t *table, uint64_t key)
+{
+	unsigned int i;
 
-	mowgli_node_add(msg, &msg->node, &mq->entries);
-	mq->last_used = CURRTIME;
+	for (i = mqueue_slot(key); table[i].count != 0; i = (i + 1) & (MQUEUE_TABLE_SIZE - 1))
+		if (table[i].key == key)
+			break;
 
-	return msg;
+	return &table[i];
 }
 
-static mowgli_patricia_t *mqueue_trie = NULL;
-static mowgli_heap_t *mqueue_heap = NULL;
-static mowgli_eventloop_timer_t *mqueue_gc_timer = NULL;
+static void
+mqueue_count_remove(mqueue_count_t *table, mqueue_count_t *c)
+{
+	unsigned int i, j, k;
 
-static mqueue_t *
-mqueue_create(const char *name)
+	/* shift later members of the probe run back into the hole */
+	i = j = c - table;
+	for (;;)
+	{
+		j = (j + 1) & (MQUEUE_TABLE_SIZE - 1);
+		if (table[j].count == 0)
+			break;
+
+		k = mqueue_slot(table[j].key);
+		if (i <= j ? (i < k && k <= j) : (i < k || k <= j))
+			continue;
+
+		table[i] = table[j];
+		i = j;
+	}
+
+	table[i].count = 0;
+}
+
+static void
+mqueue_pop(mqueue_t *mq)
 {
-	mqueue_t *mq;
+	mqueue_entry_t *e;
+	mqueue_count_t *c;
 
-	mq = mowgli_heap_alloc(mqueue_heap);
-	mq->name = sstrdup(name);
-	mq->last_used = CURRTIME;
-	mq->max = antiflood_msg_count;
+	e = &mq->entries[mq->head];
 
-	mowgli_patricia_add(mqueue_trie, mq->name, mq);
+	c = mqueue_count_find(mq->msgs, e->hash);
+	if (--c->count == 0)
+		mqueue_count_remove(mq->msgs, c);
 
-	return mq;
+	c = mqueue_count_find(mq->sources, (uintptr_t)e->source);
+	if (--c->count == 0)
+		mqueue_count_remove(mq->sources, c);
+	else
+		c->first = e->next;
+
+	strshare_unref(e->source);
+
+	mq->head = (mq->head + 1) % MQUEUE_SIZE;
+	mq->len--;
 }
 
 static void
-mqueue_free(mqueue_t *mq)
+mqueue_push(mqueue_t *mq, user_t *u, const char *message)
 {
-	mowgli_node_t *n, *tn;
+	mqueue_entry_t *e;
+	mqueue_count_t *c;
+	unsigned int idx;
 
-	MOWGLI_ITER_FOREACH_SAFE(n, tn, mq->entries.head)
-	{
-		msg_t *msg = n->data;
+	if (mq->len == MQUEUE_SIZE)
+		mqueue_pop(mq);
+
+	idx = (mq->head + mq->len) % MQUEUE_SIZE;
+	e = &mq->entries[idx];
+	e->source = u->uid != NULL ? strshare_ref(u->uid) : strshare_ref(u->nick);
+	e->time = CURRTIME;
+	e->hash = mqueue_hash(message);
+
+	c = mqueue_count_find(mq->msgs, e->hash);
+	if (c->count++ == 0)
+		c->key = e->hash;
 
-		msg_destroy(msg, mq);
+	c = mqueue_count_find(mq->sources, (uintptr_t)e->source);
+	if (c->count++ == 0)
+	{
+		c->key = (uintptr_t)e->source;
+		c->first = idx;
 	}
+	else
+		mq->entries[c->last].next = idx;
+	c->last = idx;
 
-	free(mq->name);
-	mowgli_heap_free(mqueue_heap, mq);
+	mq->len++;
+	mq->last_used = CURRTIME;
 }
 
 static mqueue_t *
@@ -135,37 +222,41 @@ mqueue_get(mychan_t *mc)
 {
 	mqueue_t *mq;
 
-	mq = mowgli_patricia_retrieve(mqueue_trie, mc->name);
-	if (mq == NULL)
-		mq = mqueue_create(mc->name);
+	mq = privatedata_get(mc, PRIVDATA_KEY_MQUEUE);
+	if (mq != NULL)
+		return mq;
 
-	return mq;
-}
+	mq = mowgli_heap_alloc(mqueue_heap);
+	memset(mq, 0, sizeof *mq);
+	mq->mc = mc;
+	mq->last_used = CURRTIME;
 
-static void
-mqueue_destroy(mqueue_t *mq)
-{
-	mowgli_patricia_delete(mqueue_trie, mq->name);
+	privatedata_set(mc, PRIVDATA_KEY_MQUEUE, mq);
+	mowgli_node_add(mq, &mq->node, &mqueue_list);
 
-	mqueue_free(mq);
+	return mq;
 }
 
 static void
-mqueue_trie_destroy_cb(const char *key, void *data, void *privdata)
+mqueue_destroy(mqueue_t *mq)
 {
-	mqueue_t *mq = data;
+	while (mq->len > 0)
+		mqueue_pop(mq);
 
-	mqueue_free(mq);
+	privatedata_delete(mq->mc, PRIVDATA_KEY_MQUEUE);
+	mowgli_node_delete(&mq->node, &mqueue_list);
+	mowgli_heap_free(mqueue_heap, mq);
 }
 
 static void
 mqueue_gc(void *unused)
 {
-	mowgli_patricia_iteration_state_t iter;
-	mqueue_t *mq;
+	mowgli_node_t *n, *tn;
 
-	MOWGLI_PATRICIA_FOREACH(mq, &iter, mqueue_trie)
+	MOWGLI_ITER_FOREACH_SAFE(n, tn, mqueue_list.head)
 	{
+		mqueue_t *mq = n->data;
+
 		if ((mq->last_used + 3600) < CURRTIME)
 			mqueue_destroy(mq);
 	}
@@ -174,49 +265,26 @@ mqueue_gc(void *unused)
 static mqueue_enforce_strategy_t
 mqueue_should_enforce(mqueue_t *mq)
 {
-	msg_t *oldest, *newest;
-	time_t age_delta;
+	mqueue_entry_t *oldest, *newest;
+	mqueue_count_t *c;
 
-	if (MOWGLI_LIST_LENGTH(&mq->entries) < mq->max)
+	if (mq->len < MQUEUE_MSG_COUNT)
 		return MQ_ENFORCE_NONE;
 
-	oldest = mq->entries.head->data;
-	newest = mq->entries.tail->data;
+	oldest = &mq->entries[mq->head];
+	newest = &mq->entries[(mq->head + mq->len - 1) % MQUEUE_SIZE];
 
-	if (oldest == NULL || newest == NULL || oldest == newest)
+	if (newest->time - oldest->time > antiflood_msg_time)
 		return MQ_ENFORCE_NONE;
 
-	age_delta = newest->time - oldest->time;
-
-	if (age_delta <= antiflood_msg_time)
-	{
-		mowgli_node_t *n;
-		size_t msg_matches = 0, usr_matches = 0;
-		time_t usr_first_seen = 0;
-
-		MOWGLI_ITER_FOREACH(n, mq->entries.head)
-		{
-			msg_t *msg = n->data;
-
-			if (!strcasecmp(msg->message, newest->message))
-				msg_matches++;
-
-			if (msg->source == newest->source)
-			{
-				usr_matches++;
-
-				if (!usr_first_seen)
-					usr_first_seen = msg->time;
-			}
-		}
-
-		if (msg_matches > (antiflood_msg_count / 2))
-			return MQ_ENFORCE_MSG;
+	c = mqueue_count_find(mq->msgs, newest->hash);
+	if (c->count > (MQUEUE_MSG_COUNT / 2))
+		return MQ_ENFORCE_MSG;
 
-		if (usr_matches > (antiflood_msg_count / 2) &&
-			((newest->time - usr_first_seen) < antiflood_msg_time / 4))
-			return MQ_ENFORCE_LINE;
-	}
+	c = mqueue_count_find(mq->sources, (uintptr_t)newest->source);
+	if (c->count > (MQUEUE_MSG_COUNT / 2) &&
+		((newest->time - mq->entries[c->first].time) < antiflood_msg_time / 4))
+		return MQ_ENFORCE_LINE;
 
 	return MQ_ENFORCE_NONE;
 }
@@ -346,7 +414,6 @@ on_channel_message(hook_cmessage_data_t *data)
 	chanuser_t *cu;
 	mychan_t *mc;
 	mqueue_t *mq;
-	msg_t *msg;
 
 	return_if_fail(data != NULL);
 	return_if_fail(data->msg != NULL);
@@ -364,7 +431,7 @@ on_channel_message(hook_cmessage_data_t *data)
 	mq = mqueue_get(mc);
 	return_if_fail(mq != NULL);
 
-	msg = msg_create(mq, data->u, data->msg);
+	mqueue_push(mq, data->u, data->msg);
 
 	/* never enforce against any user who has special CSTATUS flags. */
 	if (cu->modes)
@@ -390,8 +457,9 @@ on_channel_drop(mychan_t *mc)
 {
 	mqueue_t *mq;
 
-	mq = mqueue_get(mc);
-	return_if_fail(mq != NULL);
+	mq = privatedata_get(mc, PRIVDATA_KEY_MQUEUE);
+	if (mq == NULL)
+		return;
 
 	mqueue_destroy(mq);
 }
@@ -532,10 +600,7 @@ _modinit(module_t *m)
 	hook_add_event("channel_drop");
 	hook_add_channel_drop(on_channel_drop);
 
-	msg_heap = sharedheap_get(sizeof(msg_t));
-
 	mqueue_heap = sharedheap_get(sizeof(mqueue_t));
-	mqueue_trie = mowgli_patricia_create(irccasecanon);
 	mqueue_gc_timer = mowgli_timer_add(base_eventloop, "mqueue_gc", mqueue_gc, NULL, 300);
 
 	antiflood_unenforce_timer = mowgli_timer_add(base_eventloop, "antiflood_unenforce", antiflood_unenforce_timer_cb, NULL, 3600);
@@ -548,12 +613,16 @@ _modinit(module_t *m)
 void
 _moddeinit(module_unload_intent_t intent)
 {
+	mowgli_node_t *n, *tn;
+
 	command_delete(&cs_set_antiflood, *cs_set_cmdtree);
 
 	hook_del_channel_message(on_channel_message);
 	hook_del_channel_drop(on_channel_drop);
 
-	mowgli_patricia_destroy(mqueue_trie, mqueue_trie_destroy_cb, NULL);
+	MOWGLI_ITER_FOREACH_SAFE(n, tn, mqueue_list.head)
+		mqueue_destroy(n->data);
+
 	mowgli_timer_destroy(base_eventloop, mqueue_gc_timer);
 	mowgli_timer_destroy(base_eventloop, antiflood_unenforce_timer);
 
@@ -38,7 +38,7 @@ static void cs_cmd_info(sourceinfo_t *si, int parc, char *parv[])
 	struct tm tm;
 	myuser_t *mu;
 	metadata_t *md;
-	mowgli_patricia_iteration_state_t state;
+	metadata_iteration_state_t state;
 	hook_channel_req_t req;
 	bool hide_info, hide_acl;
 
@@ -133,7 +133,7 @@ static void cs_cmd_info(sourceinfo_t *si, int parc, char *parv[])
 
 	if (!hide_info)
 	{
-		MOWGLI_PATRICIA_FOREACH(md, &state, object(mc)->metadata)
+		METADATA_FOREACH(md, &state, mc)
 		{
 			if (!strncmp(md->name, "private:", 8))
 				continue;
@@ -19,6 +19,7 @@ DECLARE_MODULE_V1
 );
 
 static void cs_join(hook_channel_joinpart_t *hdata);
+static void cs_join_batch(hook_channel_join_batch_t *data);
 static void cs_part(hook_channel_joinpart_t *hdata);
 static void cs_register(hook_channel_req_t *mc);
 static void cs_succession(hook_channel_succession_req_t *data);
@@ -272,6 +273,7 @@ void _modinit(module_t *m)
 	chansvs.me = service_add("chanserv", chanserv);
 
 	hook_add_event("channel_join");
+	hook_add_event("channel_join_batch");
 	hook_add_event("channel_part");
 	hook_add_event("channel_register");
 	hook_add_event("channel_succession");
@@ -283,6 +285,7 @@ void _modinit(module_t *m)
 	hook_add_event("user_identify");
 	hook_add_event("shutdown");
 	hook_add_channel_join(cs_join);
+	hook_add_channel_join_batch(cs_join_batch);
 	hook_add_channel_part(cs_part);
 	hook_add_channel_register(cs_register);
 	hook_add_channel_succession(cs_succession);
@@ -328,6 +331,7 @@ void _moddeinit(module_unload_intent_t intent)
 
 	hook_del_config_ready(chanserv_config_ready);
 	hook_del_channel_join(cs_join);
+	hook_del_channel_join_batch(cs_join_batch);
 	hook_del_channel_part(cs_part);
 	hook_del_channel_register(cs_register);
 	hook_del_channel_succession(cs_succession);
@@ -341,40 +345,40 @@ void _moddeinit(module_unload_intent_t intent)
 	mowgli_timer_destroy(base_eventloop, cs_leave_empty_timer);
 }
 
-static void cs_join(hook_channel_joinpart_t *hdata)
+/* stay on a channel that a kick is about to empty -- jilles */
+static void cs_join_inhabit(mychan_t *mc, channel_t *chan)
 {
-	chanuser_t *cu = hdata->cu;
-	user_t *u;
-	channel_t *chan;
-	mychan_t *mc;
-	unsigned int flags;
-	bool noop;
-	bool secure;
-	metadata_t *md;
-	chanacs_t *ca2;
-	char akickreason[120] = "User is banned from this channel", *p;
-
-	if (cu == NULL || is_internal_client(cu->user))
-		return;
-	u = cu->user;
-	chan = cu->chan;
-
-	/* first check if this is a registered channel at all */
-	mc = mychan_find(chan->name);
-	if (mc == NULL)
-		return;
+	mc->flags |= MC_INHABIT;
+	if (chan->numsvcmembers == 0)
+		join(chan->name, chansvs.nick);
+}
 
-	flags = chanacs_user_flags(mc, u);
-	noop = mc->flags & MC_NOOP || (u->myuser != NULL &&
-			u->myuser->flags & MU_NOOP);
-	/* attempt to deop people recreating channels, if the more
-	 * sophisticated mechanism is disabled */
-	secure = mc->flags & MC_SECURE || (!chansvs.changets &&
-			chan->nummembers == 1 && chan->ts > CURRTIME - 300);
+/* A second user joined and was not kicked; we do not need
+ * to stay on the channel artificially.
+ * If there is only one user, stay in the channel to avoid
+ * triggering autocycle-for-ops scripts and immediately
+ * destroying channels with kick on split riding.
+ */
+static void cs_join_uninhabit(mychan_t *mc, channel_t *chan)
+{
+	mc->flags &= ~MC_INHABIT;
+	if (!(mc->flags & MC_GUARD) && !(chan->flags & CHAN_LOG) && chanuser_find(chan, chansvs.me->me))
+		part(chan->name, chansvs.nick);
+}
 
-	if (chan->nummembers == 1 && mc->flags & MC_GUARD &&
-		metadata_find(mc, "private:botserv:bot-assigned") == NULL)
-		join(chan->name, chansvs.nick);
+/*
+ * Decides whether a joining user may stay. If not, queues the bans or
+ * mode changes that go with the kick and returns the kick reason; the
+ * caller flushes the modestack and kicks. alone means nobody else (other
+ * than services) is on the channel.
+ */
+static const char *cs_join_kick_reason(mychan_t *mc, chanuser_t *cu, unsigned int flags, bool alone, char *akickreason, size_t akickreasonlen)
+{
+	user_t *u = cu->user;
+	channel_t *chan = cu->chan;
+	metadata_t *md;
+	chanacs_t *ca2;
+	char *p;
 
 	/*
 	 * CS SET RESTRICTED: if they don't have any access (excluding AKICK)
@@ -382,39 +386,24 @@ static void cs_join(hook_channel_joinpart_t *hdata)
 	 */
 	if ((mc->flags & MC_RESTRICTED) && !(flags & CA_ALLPRIVS) && !has_priv_user(u, PRIV_JOIN_STAFFONLY))
 	{
-		/* Stay on channel if this would empty it -- jilles */
-		if (chan->nummembers - chan->numsvcmembers == 1)
-		{
-			mc->flags |= MC_INHABIT;
-			if (chan->numsvcmembers == 0)
-				join(chan->name, chansvs.nick);
-		}
 		if (mc->mlock_on & CMODE_INVITE || chan->modes & CMODE_INVITE)
 		{
 			if (!(chan->modes & CMODE_INVITE))
 				check_modes(mc, true);
 			remove_banlike(chansvs.me->me, chan, ircd->invex_mchar, u);
-			modestack_flush_channel(chan);
 		}
 		else
 		{
 			ban(chansvs.me->me, chan, u);
 			remove_ban_exceptions(chansvs.me->me, chan, u);
 		}
-		try_kick(chansvs.me->me, chan, u, "You are not authorized to be on this channel");
-		hdata->cu = NULL;
-		return;
+		return "You are not authorized to be on this channel";
 	}
 
 	if (flags & CA_AKICK && !(flags & CA_EXEMPT))
 	{
-		/* Stay on channel if this would empty it -- jilles */
-		if (chan->nummembers - chan->numsvcmembers == 1)
-		{
-			mc->flags |= MC_INHABIT;
-			if (chan->numsvcmembers == 0)
-				join(chan->name, chansvs.nick);
-		}
+		mowgli_strlcpy(akickreason, "User is banned from this channel", akickreasonlen);
+
 		/* use a user-given ban mask if possible -- jilles */
 		ca2 = chanacs_find_host_by_user(mc, u, CA_AKICK);
 		if (ca2 != NULL)
@@ -423,7 +412,6 @@ static void cs_join(hook_channel_joinpart_t *hdata)
 			{
 				chanban_add(chan, ca2->host, 'b');
 				modestack_mode_param(chansvs.nick, chan, MTYPE_ADD, 'b', ca2->host);
-				modestack_flush_channel(chan);
 			}
 		}
 		else
@@ -438,7 +426,7 @@ static void cs_join(hook_channel_joinpart_t *hdata)
 			md = metadata_find(ca2, "reason");
 			if (md != NULL && *md->value != '|')
 			{
-				snprintf(akickreason, sizeof akickreason,
+				snprintf(akickreason, akickreasonlen,
 						"Banned: %s", md->value);
 				p = strchr(akickreason, '|');
 				if (p != NULL)
@@ -453,9 +441,7 @@ static void cs_join(hook_channel_joinpart_t *hdata)
 				p[1] = '\0';
 			}
 		}
-		try_kick(chansvs.me->me, chan, u, akickreason);
-		hdata->cu = NULL;
-		return;
+		return akickreason;
 	}
 
 	/* Kick out users who may be recreating channels mlocked +i.
@@ -471,35 +457,26 @@ static void cs_join(hook_channel_joinpart_t *hdata)
 	 */
 	if (mc->mlock_on & CMODE_INVITE && !(flags & CA_INVITE) &&
 			(!me.bursting || mc->flags & MC_RECREATED) &&
-			(!(u->server->flags & SF_EOB) || (chan->nummembers - chan->numsvcmembers == 1)) &&
+			(!(u->server->flags & SF_EOB) || alone) &&
 			(!ircd->invex_mchar || !next_matching_ban(chan, u, ircd->invex_mchar, chan->bans.head)))
 	{
-		if (chan->nummembers - chan->numsvcmembers == 1)
-		{
-			mc->flags |= MC_INHABIT;
-			if (chan->numsvcmembers == 0)
-				join(chan->name, chansvs.nick);
-		}
 		if (!(chan->modes & CMODE_INVITE))
 			check_modes(mc, true);
-		modestack_flush_channel(chan);
-		try_kick(chansvs.me->me, chan, u, "Invite only channel");
-		hdata->cu = NULL;
-		return;
+		return "Invite only channel";
 	}
 
-	/* A second user joined and was not kicked; we do not need
-	 * to stay on the channel artificially.
-	 * If there is only one user, stay in the channel to avoid
-	 * triggering autocycle-for-ops scripts and immediately
-	 * destroying channels with kick on split riding.
-	 */
-	if (mc->flags & MC_INHABIT && chan->nummembers - chan->numsvcmembers >= 2)
-	{
-		mc->flags &= ~MC_INHABIT;
-		if (!(mc->flags & MC_GUARD) && !(chan->flags & CHAN_LOG) && chanuser_find(chan, chansvs.me->me))
-			part(chan->name, chansvs.nick);
-	}
+	return NULL;
+}
+
+/* sets or removes the status modes of a user who stays */
+static void cs_join_status(mychan_t *mc, chanuser_t *cu, unsigned int flags, bool secure)
+{
+	user_t *u = cu->user;
+	channel_t *chan = cu->chan;
+	bool noop;
+
+	noop = mc->flags & MC_NOOP || (u->myuser != NULL &&
+			u->myuser->flags & MU_NOOP);
 
 	if (ircd->uses_owner)
 	{
@@ -574,21 +551,190 @@ static void cs_join(hook_channel_joinpart_t *hdata)
 			cu->modes |= CSTATUS_VOICE;
 		}
 	}
+}
 
-	if (u->server->flags & SF_EOB && (md = metadata_find(mc, "private:entrymsg")))
+/* entry message and url; entrymsg and url are looked up by the caller */
+static void cs_join_greet(mychan_t *mc, chanuser_t *cu, unsigned int flags, metadata_t *entrymsg, metadata_t *url)
+{
+	user_t *u = cu->user;
+
+	if (u->server->flags & SF_EOB && entrymsg != NULL)
 	{
-		if (metadata_find(mc, "private:botserv:bot-assigned") == NULL)
-		{
-			if (!u->myuser || !(u->myuser->flags & MU_NOGREET))
-				notice(chansvs.nick, cu->user->nick, "[%s] %s", mc->name, md->value);
-		}
+		if (!u->myuser || !(u->myuser->flags & MU_NOGREET))
+			notice(chansvs.nick, cu->user->nick, "[%s] %s", mc->name, entrymsg->value);
 	}
 
-	if (u->server->flags & SF_EOB && (md = metadata_find(mc, "url")))
-		numeric_sts(me.me, 328, cu->user, "%s :%s", mc->name, md->value);
+	if (u->server->flags & SF_EOB && url != NULL)
+		numeric_sts(me.me, 328, cu->user, "%s :%s", mc->name, url->value);
 
 	if (flags & CA_USEDUPDATE)
+	{
 		mc->used = CURRTIME;
+		expire_touch(EXPIRE_MYCHAN, mc);
+	}
+}
+
+static void cs_join(hook_channel_joinpart_t *hdata)
+{
+	chanuser_t *cu = hdata->cu;
+	user_t *u;
+	channel_t *chan;
+	mychan_t *mc;
+	unsigned int flags;
+	bool secure, alone;
+	metadata_t *entrymsg;
+	const char *reason;
+	char akickreason[120];
+
+	/* netjoins are handled all at once by cs_join_batch() */
+	if (cu == NULL || hdata->batched || is_internal_client(cu->user))
+		return;
+	u = cu->user;
+	chan = cu->chan;
+
+	/* first check if this is a registered channel at all */
+	mc = mychan_find(chan->name);
+	if (mc == NULL)
+		return;
+
+	flags = chanacs_user_flags(mc, u);
+	alone = chan->nummembers - chan->numsvcmembers == 1;
+	/* attempt to deop people recreating channels, if the more
+	 * sophisticated mechanism is disabled */
+	secure = mc->flags & MC_SECURE || (!chansvs.changets &&
+			chan->nummembers == 1 && chan->ts > CURRTIME - 300);
+
+	if (chan->nummembers == 1 && mc->flags & MC_GUARD &&
+		metadata_find(mc, "private:botserv:bot-assigned") == NULL)
+		join(chan->name, chansvs.nick);
+
+	reason = cs_join_kick_reason(mc, cu, flags, alone, akickreason, sizeof akickreason);
+	if (reason != NULL)
+	{
+		/* Stay on channel if this would empty it -- jilles */
+		if (alone)
+			cs_join_inhabit(mc, chan);
+		modestack_flush_channel(chan);
+		try_kick(chansvs.me->me, chan, u, reason);
+		hdata->cu = NULL;
+		return;
+	}
+
+	if (mc->flags & MC_INHABIT && chan->nummembers - chan->numsvcmembers >= 2)
+		cs_join_uninhabit(mc, chan);
+
+	cs_join_status(mc, cu, flags, secure);
+
+	entrymsg = metadata_find(mc, "private:entrymsg");
+	if (entrymsg != NULL && metadata_find(mc, "private:botserv:bot-assigned") != NULL)
+		entrymsg = NULL;
+	cs_join_greet(mc, cu, flags, entrymsg, metadata_find(mc, "url"));
+}
+
+/*
+ * The users of a netjoin, after their channel_join hooks: access for all
+ * of them is computed in one go, the mode changes go out as one modestack
+ * flush, and whoever has to go is kicked after that.
+ */
+static void cs_join_batch(hook_channel_join_batch_t *data)
+{
+	channel_t *chan = data->c;
+	mychan_t *mc;
+	chanuser_t *cu;
+	user_t **users;
+	unsigned int *flags, *joined;
+	struct {
+		unsigned int idx;
+		char *reason;
+	} *kicks;
+	unsigned int i, count = 0, present = 0, nkick = 0, others, remaining;
+	bool was_empty, secure, need_inhabit = false;
+	metadata_t *entrymsg, *url;
+	const char *reason;
+	char akickreason[120];
+
+	mc = mychan_find(chan->name);
+	if (mc == NULL)
+		return;
+
+	users = smalloc(data->count * sizeof *users);
+	flags = smalloc(data->count * sizeof *flags);
+	joined = smalloc(data->count * sizeof *joined);
+	kicks = smalloc(data->count * sizeof *kicks);
+
+	for (i = 0; i < data->count; i++)
+	{
+		cu = data->cu[i];
+		if (cu == NULL)
+			continue;
+		present++;
+		if (is_internal_client(cu->user))
+			continue;
+		joined[count] = i;
+		users[count++] = cu->user;
+	}
+
+	chanacs_user_flags_batch(mc, users, flags, count);
+
+	/* the channel held nobody but this netjoin */
+	was_empty = chan->nummembers == present;
+	/* users (not services) that were there before */
+	others = chan->nummembers - chan->numsvcmembers - count;
+
+	if (was_empty && count != 0 && mc->flags & MC_GUARD &&
+		metadata_find(mc, "private:botserv:bot-assigned") == NULL)
+		join(chan->name, chansvs.nick);
+
+	entrymsg = metadata_find(mc, "private:entrymsg");
+	if (entrymsg != NULL && metadata_find(mc, "private:botserv:bot-assigned") != NULL)
+		entrymsg = NULL;
+	url = metadata_find(mc, "url");
+
+	for (i = 0; i < count; i++)
+	{
+		cu = data->cu[joined[i]];
+
+		/* the first one in is as good as alone, as in cs_join() */
+		reason = cs_join_kick_reason(mc, cu, flags[i], others + i - nkick == 0, akickreason, sizeof akickreason);
+		if (reason != NULL)
+		{
+			if (others + i - nkick == 0)
+				need_inhabit = true;
+			kicks[nkick].idx = joined[i];
+			kicks[nkick].reason = sstrdup(reason);
+			nkick++;
+			continue;
+		}
+
+		secure = mc->flags & MC_SECURE || (!chansvs.changets &&
+				was_empty && i == 0 && chan->ts > CURRTIME - 300);
+		cs_join_status(mc, cu, flags[i], secure);
+		cs_join_greet(mc, cu, flags[i], entrymsg, url);
+	}
+
+	remaining = chan->nummembers - chan->numsvcmembers - nkick;
+
+	/* Stay on channel if the kicks would empty it -- jilles */
+	if (need_inhabit && remaining < 2)
+		cs_join_inhabit(mc, chan);
+
+	modestack_flush_channel(chan);
+
+	for (i = 0; i < nkick; i++)
+	{
+		cu = data->cu[kicks[i].idx];
+		try_kick(chansvs.me->me, chan, cu->user, kicks[i].reason);
+		data->cu[kicks[i].idx] = NULL;
+		free(kicks[i].reason);
+	}
+
+	if (mc->flags & MC_INHABIT && remaining >= 2)
+		cs_join_uninhabit(mc, chan);
+
+	free(users);
+	free(flags);
+	free(joined);
+	free(kicks);
 }
 
 static void cs_part(hook_channel_joinpart_t *hdata)
@@ -607,7 +753,10 @@ static void cs_part(hook_channel_joinpart_t *hdata)
 
 	if (CURRTIME - mc->used >= 3600)
 		if (chanacs_user_flags(mc, cu->user) & CA_USEDUPDATE)
+		{
 			mc->used = CURRTIME;
+			expire_touch(EXPIRE_MYCHAN, mc);
+		}
 
 	/*
 	 * When channel_part is fired, we haven't yet removed the
@@ -41,7 +41,7 @@ static void cs_cmd_set_property(sourceinfo_t *si, int parc, char *parv[])
 	char *value = strtok(NULL, "");
 	bool changed;
 	unsigned int count;
-	mowgli_patricia_iteration_state_t state;
+	metadata_iteration_state_t state;
 	metadata_t *md;
 
 	if (!property)
@@ -90,13 +90,10 @@ static void cs_cmd_set_property(sourceinfo_t *si, int parc, char *parv[])
 	}
 
 	count = 0;
-	if (object(mc)->metadata)
+	METADATA_FOREACH(md, &state, mc)
 	{
-		MOWGLI_PATRICIA_FOREACH(md, &state, object(mc)->metadata)
-		{
-			if (strncmp(md->name, "private:", 8))
-				count++;
-		}
+		if (strncmp(md->name, "private:", 8))
+			count++;
 	}
 	if (count >= me.mdlimit)
 	{
@@ -102,14 +102,13 @@ static const char *pbkdf2_salt(void)
 	return buf;
 }
 
-static const char *pbkdf2_crypt(const char *key, const char *salt)
+static const char *pbkdf2_crypt_r(const char *key, const char *salt, char *outbuf, size_t outlen)
 {
-	static char outbuf[PASSLEN];
-	static unsigned char digestbuf[SHA512_DIGEST_LENGTH];
+	unsigned char digestbuf[SHA512_DIGEST_LENGTH];
 	int res, iter;
 
-	if (strlen(salt) < SALTLEN)
-		salt = pbkdf2_salt();
+	if (strlen(salt) < SALTLEN || outlen < SALTLEN + (SHA512_DIGEST_LENGTH * 2) + 1)
+		return NULL;
 
 	memcpy(outbuf, salt, SALTLEN);
 
@@ -121,10 +120,21 @@ static const char *pbkdf2_crypt(const char *key, const char *salt)
 	return outbuf;
 }
 
+static const char *pbkdf2_crypt(const char *key, const char *salt)
+{
+	static char outbuf[PASSLEN];
+
+	if (strlen(salt) < SALTLEN)
+		salt = pbkdf2_salt();
+
+	return pbkdf2_crypt_r(key, salt, outbuf, sizeof outbuf);
+}
+
 static crypt_impl_t pbkdf2_crypt_impl = {
 	.id = "pbkdf2",
 	.crypt = &pbkdf2_crypt,
-	.salt = &pbkdf2_salt
+	.salt = &pbkdf2_salt,
+	.crypt_r = &pbkdf2_crypt_r,
 };
 
 void _modinit(module_t *m)
@@ -124,7 +124,7 @@ static const char *pbkdf2v2_make_salt(void)
 	return result;
 }
 
-static const char *pbkdf2v2_crypt(const char *pass, const char *crypt_str)
+static const char *pbkdf2v2_crypt_r(const char *pass, const char *crypt_str, char *result, size_t resultlen)
 {
 	unsigned int	prf = 0, iter = 0;
 	char		salt[PBKDF2_SALTLEN + 1];
@@ -132,7 +132,6 @@ static const char *pbkdf2v2_crypt(const char *pass, const char *crypt_str)
 	const EVP_MD*	md = NULL;
 	unsigned char	digest[EVP_MAX_MD_SIZE];
 	char		digest_b64[(EVP_MAX_MD_SIZE * 2) + 5];
-	static char	result[PASSLEN];
 
 	/*
 	 * Attempt to extract the PRF, iteration count and salt
@@ -174,13 +173,20 @@ static const char *pbkdf2v2_crypt(const char *pass, const char *crypt_str)
 	                     digest_b64, sizeof digest_b64);
 
 	/* Format the result */
-	memset(result, 0x00, sizeof result);
-	(void) snprintf(result, sizeof result, PBKDF2_F_PRINT,
+	memset(result, 0x00, resultlen);
+	(void) snprintf(result, resultlen, PBKDF2_F_PRINT,
 	                prf, iter, salt, digest_b64);
 
 	return result;
 }
 
+static const char *pbkdf2v2_crypt(const char *pass, const char *crypt_str)
+{
+	static char	result[PASSLEN];
+
+	return pbkdf2v2_crypt_r(pass, crypt_str, result, sizeof result);
+}
+
 static bool pbkdf2v2_needs_param_upgrade(const char *user_pass_string)
 {
 	unsigned int	prf = 0, iter = 0;
@@ -203,6 +209,7 @@ static crypt_impl_t pbkdf2_crypt_impl = {
 	.crypt = &pbkdf2v2_crypt,
 	.salt = &pbkdf2v2_make_salt,
 	.needs_param_upgrade = &pbkdf2v2_needs_param_upgrade,
+	.crypt_r = &pbkdf2v2_crypt_r,
 };
 
 void _modinit(module_t* m)
@@ -75,7 +75,7 @@ static void gs_cmd_fflags(sourceinfo_t *si, int parc, char *parv[])
 	}
 
 	if (ga != NULL && flags != 0)
-		ga->flags = flags;
+		groupacs_set_flags(ga, flags);
 	else if (ga != NULL)
 	{
 		groupacs_delete(mg, mt);
@@ -13,7 +13,7 @@ static void write_groupdb(database_handle_t *db)
 {
 	myentity_t *mt;
 	myentity_iteration_state_t state;
-	mowgli_patricia_iteration_state_t state2;
+	metadata_iteration_state_t state2;
 	metadata_t *md;
 
 	db_start_row(db, "GDBV");
@@ -65,16 +65,13 @@ static void write_groupdb(database_handle_t *db)
 			db_commit_row(db);
 		}
 
-		if (object(mg)->metadata)
+		METADATA_FOREACH(md, &state2, mg)
 		{
-			MOWGLI_PATRICIA_FOREACH(md, &state2, object(mg)->metadata)
-			{
-				db_start_row(db, "MDG");
-				db_write_word(db, entity(mg)->name);
-				db_write_word(db, md->name);
-				db_write_str(db, md->value);
-				db_commit_row(db);
-			}
+			db_start_row(db, "MDG");
+			db_write_word(db, entity(mg)->name);
+			db_write_word(db, md->name);
+			db_write_str(db, md->value);
+			db_commit_row(db);
 		}
 	}
 }
@@ -30,6 +30,9 @@ groupserv_config_t gs_config;
 
 mowgli_heap_t *mygroup_heap, *groupacs_heap, *groupinvite_heap;
 
+/* bumped whenever any group membership changes; see groupclosure_get() */
+static unsigned int groupacs_gen = 1;
+
 void mygroups_init(void)
 {
 	mygroup_heap = mowgli_heap_create(sizeof(mygroup_t), HEAP_USER, BH_NOW);
@@ -67,6 +70,8 @@ static void mygroup_delete(mygroup_t *mg)
 		object_unref(gi);
 	}
 
+	groupacs_gen++;
+
 	metadata_delete_all(mg);
 	strshare_unref(entity(mg)->name);
 	mowgli_heap_free(mygroup_heap, mg);
@@ -142,50 +147,209 @@ groupacs_t *groupacs_add(mygroup_t *mg, myentity_t *mt, unsigned int flags)
 	mowgli_node_add(ga, &ga->gnode, &mg->acs);
 	mowgli_node_add(ga, &ga->unode, myentity_get_membership_list(mt));
 
+	groupacs_gen++;
+
 	return ga;
 }
 
-groupacs_t *groupacs_find(mygroup_t *mg, myentity_t *mt, unsigned int flags, bool allow_recurse)
+void groupacs_set_flags(groupacs_t *ga, unsigned int flags)
+{
+	return_if_fail(ga != NULL);
+
+	ga->flags = flags;
+	groupacs_gen++;
+}
+
+static int groupclosure_entry_cmp(const void *a, const void *b)
+{
+	const groupclosure_entry_t *ea = a, *eb = b;
+
+	if (ea->mg == eb->mg)
+		return 0;
+
+	return ea->mg < eb->mg ? -1 : 1;
+}
+
+static bool groupclosure_merge(groupclosure_t *gc, mygroup_t *mg, unsigned int flags, groupacs_t *via)
 {
+	unsigned int i;
+
+	for (i = 0; i < gc->count; i++)
+	{
+		if (gc->entries[i].mg != mg)
+			continue;
+
+		if ((flags & ~gc->entries[i].flags) == 0)
+			return false;
+
+		gc->entries[i].flags |= flags;
+		return true;
+	}
+
+	if (gc->count == gc->size)
+	{
+		gc->size = gc->size ? gc->size * 2 : 8;
+		gc->entries = srealloc(gc->entries, gc->size * sizeof(groupclosure_entry_t));
+	}
+
+	gc->entries[gc->count].mg = mg;
+	gc->entries[gc->count].flags = flags;
+	gc->entries[gc->count].via = via;
+	gc->count++;
+
+	return true;
+}
+
+/*
+ * groupclosure_get(myentity_t *mt)
+ *
+ * Every group an account is in, directly or through groups that are
+ * themselves members, with the flags it has there: the union of its
+ * own flags in each group on the way. The result is cached on the
+ * account and rebuilt on first use after any membership changes.
+ *
+ * Inputs:
+ *      - an account entity
+ *
+ * Outputs:
+ *      - its closure, sorted by group
+ *
+ * Side Effects:
+ *      - the closure may be rebuilt
+ */
+groupclosure_t *groupclosure_get(myentity_t *mt)
+{
+	groupclosure_t *gc;
 	mowgli_node_t *n;
-	groupacs_t *out = NULL;
+	mowgli_list_t *l;
+	mygroup_t **stack = NULL;
+	unsigned int depth = 0, stacksize = 0, i;
 
-	return_val_if_fail(mg != NULL, NULL);
 	return_val_if_fail(mt != NULL, NULL);
 
-	mg->visited = true;
+	gc = privatedata_get(mt, "groupserv:closure");
+	if (gc == NULL)
+	{
+		gc = smalloc(sizeof(groupclosure_t));
+		privatedata_set(mt, "groupserv:closure", gc);
+	}
+	else if (gc->gen == groupacs_gen)
+		return gc;
 
-	MOWGLI_ITER_FOREACH(n, mg->acs.head)
+	gc->count = 0;
+
+	/* groups the account is in directly, then upwards until nothing new turns up */
+	l = myentity_get_membership_list(mt);
+	MOWGLI_ITER_FOREACH(n, l->head)
 	{
 		groupacs_t *ga = n->data;
 
-		if (out != NULL)
-			break;
+		if (!groupclosure_merge(gc, ga->mg, ga->flags, ga))
+			continue;
 
-		if (isgroup(ga->mt) && allow_recurse && !(group(ga->mt)->visited))
+		if (depth == stacksize)
 		{
-			groupacs_t *ga2;
+			stacksize = stacksize ? stacksize * 2 : 16;
+			stack = srealloc(stack, stacksize * sizeof(mygroup_t *));
+		}
+		stack[depth++] = ga->mg;
+	}
 
-			ga2 = groupacs_find(group(ga->mt), mt, flags, allow_recurse);
+	while (depth > 0)
+	{
+		mygroup_t *mg = stack[--depth];
+		unsigned int flags = 0;
 
-			if (ga2 != NULL)
-				out = ga;
-		}
-		else
+		for (i = 0; i < gc->count; i++)
+			if (gc->entries[i].mg == mg)
+				flags = gc->entries[i].flags;
+
+		l = myentity_get_membership_list(entity(mg));
+		MOWGLI_ITER_FOREACH(n, l->head)
 		{
-			if (flags)
+			groupacs_t *ga = n->data;
+
+			if (!groupclosure_merge(gc, ga->mg, flags, ga))
+				continue;
+
+			if (depth == stacksize)
 			{
-				if (ga->mt == mt && ga->mg == mg && (ga->flags & flags))
-					out = ga;
+				stacksize = stacksize ? stacksize * 2 : 16;
+				stack = srealloc(stack, stacksize * sizeof(mygroup_t *));
 			}
-			else if (ga->mt == mt && ga->mg == mg)
-				out = ga;
+			stack[depth++] = ga->mg;
 		}
 	}
 
-	mg->visited = false;
+	free(stack);
+
+	qsort(gc->entries, gc->count, sizeof(groupclosure_entry_t), groupclosure_entry_cmp);
+	gc->gen = groupacs_gen;
+
+	return gc;
+}
+
+groupclosure_entry_t *groupclosure_find(myentity_t *mt, mygroup_t *mg)
+{
+	groupclosure_t *gc;
+	groupclosure_entry_t key;
+
+	gc = groupclosure_get(mt);
+	return_val_if_fail(gc != NULL, NULL);
+
+	if (gc->count == 0)
+		return NULL;
+
+	key.mg = mg;
+
+	return bsearch(&key, gc->entries, gc->count, sizeof(groupclosure_entry_t), groupclosure_entry_cmp);
+}
+
+void groupclosure_free(myentity_t *mt)
+{
+	groupclosure_t *gc;
+
+	gc = privatedata_delete(mt, "groupserv:closure");
+	if (gc == NULL)
+		return;
+
+	free(gc->entries);
+	free(gc);
+}
+
+groupacs_t *groupacs_find(mygroup_t *mg, myentity_t *mt, unsigned int flags, bool allow_recurse)
+{
+	mowgli_node_t *n;
+
+	return_val_if_fail(mg != NULL, NULL);
+	return_val_if_fail(mt != NULL, NULL);
+
+	/* nested groups only ever grant access to accounts */
+	if (allow_recurse && isuser(mt))
+	{
+		groupclosure_entry_t *ge;
+
+		ge = groupclosure_find(mt, mg);
+		if (ge == NULL || (flags && !(ge->flags & flags)))
+			return NULL;
+
+		return ge->via;
+	}
+
+	MOWGLI_ITER_FOREACH(n, mg->acs.head)
+	{
+		groupacs_t *ga = n->data;
+
+		if (ga->mt != mt)
+			continue;
+
+		if (flags && !(ga->flags & flags))
+			continue;
 
-	return out;
+		return ga;
+	}
+
+	return NULL;
 }
 
 void groupacs_delete(mygroup_t *mg, myentity_t *mt)
@@ -198,6 +362,8 @@ void groupacs_delete(mygroup_t *mg, myentity_t *mt)
 		mowgli_node_delete(&ga->gnode, &mg->acs);
 		mowgli_node_delete(&ga->unode, myentity_get_membership_list(mt));
 		object_unref(ga);
+
+		groupacs_gen++;
 	}
 }
 
@@ -208,13 +374,13 @@ bool groupacs_sourceinfo_has_flag(mygroup_t *mg, sourceinfo_t *si, unsigned int
 
 unsigned int groupacs_sourceinfo_flags(mygroup_t *mg, sourceinfo_t *si)
 {
-	groupacs_t *ga;
+	groupclosure_entry_t *ge;
 
-	ga = groupacs_find(mg, entity(si->smu), 0, true);
-	if (ga == NULL)
+	ge = groupclosure_find(entity(si->smu), mg);
+	if (ge == NULL)
 		return 0;
 
-	return ga->flags;
+	return ge->flags;
 }
 
 static void groupinvite_des(groupinvite_t *gi)
@@ -31,8 +31,6 @@ struct mygroup_ {
 	time_t regtime;
 
 	unsigned int flags;
-
-	bool visited;
 };
 
 #define GA_FOUNDER		0x00000001
@@ -63,6 +61,18 @@ struct groupacs_ {
 	mowgli_node_t unode;
 };
 
+typedef struct {
+	mygroup_t *mg;
+	unsigned int flags;	/* merged over every path to mg */
+	groupacs_t *via;	/* the entry in mg->acs leading to the account */
+} groupclosure_entry_t;
+
+typedef struct {
+	unsigned int gen;
+	unsigned int count, size;
+	groupclosure_entry_t *entries;	/* sorted by mg */
+} groupclosure_t;
+
 typedef struct groupinvite_ groupinvite_t;
 
 struct groupinvite_ {
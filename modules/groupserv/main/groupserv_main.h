@@ -19,6 +19,11 @@ E mygroup_t *mygroup_find(const char *name);
 E groupacs_t *groupacs_add(mygroup_t *mg, myentity_t *mt, unsigned int flags);
 E groupacs_t *groupacs_find(mygroup_t *mg, myentity_t *mt, unsigned int flags, bool allow_recurse);
 E void groupacs_delete(mygroup_t *mg, myentity_t *mt);
+E void groupacs_set_flags(groupacs_t *ga, unsigned int flags);
+
+E groupclosure_t *groupclosure_get(myentity_t *mt);
+E groupclosure_entry_t *groupclosure_find(myentity_t *mt, mygroup_t *mg);
+E void groupclosure_free(myentity_t *mt);
 
 E bool groupacs_sourceinfo_has_flag(mygroup_t *mg, sourceinfo_t *si, unsigned int flag);
 
@@ -24,86 +24,107 @@ static void mygroup_expire(void *unused)
 	}
 }
 
+/* returns false if the user was kicked from the channel */
+static bool grant_group_access(user_t *u, chanuser_t *cu, chanacs_t *ca)
+{
+	if (ca->level & CA_AKICK && !(ca->level & CA_EXEMPT))
+	{
+		/* Stay on channel if this would empty it -- jilles */
+		if (ca->mychan->chan->nummembers - ca->mychan->chan->numsvcmembers == 1)
+		{
+			ca->mychan->flags |= MC_INHABIT;
+			if (ca->mychan->chan->numsvcmembers == 0)
+				join(cu->chan->name, chansvs.nick);
+		}
+		ban(chansvs.me->me, ca->mychan->chan, u);
+		remove_ban_exceptions(chansvs.me->me, ca->mychan->chan, u);
+		kick(chansvs.me->me, ca->mychan->chan, u, "User is banned from this channel");
+		return false;
+	}
+
+	if (ca->level & CA_USEDUPDATE)
+	{
+		ca->mychan->used = CURRTIME;
+		expire_touch(EXPIRE_MYCHAN, ca->mychan);
+	}
+
+	if (ca->mychan->flags & MC_NOOP || u->myuser->flags & MU_NOOP)
+		return true;
+
+	if (ircd->uses_owner && !(cu->modes & ircd->owner_mode) && ca->level & CA_AUTOOP && ca->level & CA_USEOWNER)
+	{
+		modestack_mode_param(chansvs.nick, ca->mychan->chan, MTYPE_ADD, ircd->owner_mchar[1], CLIENT_NAME(u));
+		cu->modes |= ircd->owner_mode;
+	}
+
+	if (ircd->uses_protect && !(cu->modes & ircd->protect_mode) && !(ircd->uses_owner && cu->modes & ircd->owner_mode) && ca->level & CA_AUTOOP && ca->level & CA_USEPROTECT)
+	{
+		modestack_mode_param(chansvs.nick, ca->mychan->chan, MTYPE_ADD, ircd->protect_mchar[1], CLIENT_NAME(u));
+		cu->modes |= ircd->protect_mode;
+	}
+
+	if (!(cu->modes & CSTATUS_OP) && ca->level & CA_AUTOOP)
+	{
+		modestack_mode_param(chansvs.nick, ca->mychan->chan, MTYPE_ADD, 'o', CLIENT_NAME(u));
+		cu->modes |= CSTATUS_OP;
+	}
+
+	if (ircd->uses_halfops && !(cu->modes & (CSTATUS_OP | ircd->halfops_mode)) && ca->level & CA_AUTOHALFOP)
+	{
+		modestack_mode_param(chansvs.nick, ca->mychan->chan, MTYPE_ADD, 'h', CLIENT_NAME(u));
+		cu->modes |= ircd->halfops_mode;
+	}
+
+	if (!(cu->modes & (CSTATUS_OP | ircd->halfops_mode | CSTATUS_VOICE)) && ca->level & CA_AUTOVOICE)
+	{
+		modestack_mode_param(chansvs.nick, ca->mychan->chan, MTYPE_ADD, 'v', CLIENT_NAME(u));
+		cu->modes |= CSTATUS_VOICE;
+	}
+
+	return true;
+}
+
+/*
+ * Looks up each channel the user is on against the groups they are in
+ * (including nested ones), rather than walking every group's access
+ * entries and looking the user up on each channel.
+ */
 static void grant_channel_access_hook(user_t *u)
 {
 	mowgli_node_t *n, *tn;
-	mowgli_list_t *l;
+	groupclosure_t *gc;
+	unsigned int i;
 
 	return_if_fail(u->myuser != NULL);
 
-	l = myentity_get_membership_list(entity(u->myuser));
+	if (chansvs.me == NULL || MOWGLI_LIST_LENGTH(&u->channels) == 0)
+		return;
 
-	MOWGLI_ITER_FOREACH_SAFE(n, tn, l->head)
+	gc = groupclosure_get(entity(u->myuser));
+	if (gc == NULL || gc->count == 0)
+		return;
+
+	MOWGLI_ITER_FOREACH_SAFE(n, tn, u->channels.head)
 	{
-		groupacs_t *ga = n->data;
+		chanuser_t *cu = n->data;
+		mychan_t *mc;
 
-		if (!(ga->flags & GA_CHANACS))
+		if ((mc = mychan_from(cu->chan)) == NULL)
 			continue;
 
-		MOWGLI_ITER_FOREACH(n, entity(ga->mg)->chanacs.head)
+		for (i = 0; i < gc->count; i++)
 		{
 			chanacs_t *ca;
-			chanuser_t *cu;
 
-			ca = (chanacs_t *)n->data;
+			if (!(gc->entries[i].flags & GA_CHANACS))
+				continue;
 
-			if (ca->mychan->chan == NULL)
+			ca = chanacs_find_literal(mc, entity(gc->entries[i].mg), 0);
+			if (ca == NULL)
 				continue;
 
-			cu = chanuser_find(ca->mychan->chan, u);
-			if (cu && chansvs.me != NULL)
-			{
-				if (ca->level & CA_AKICK && !(ca->level & CA_EXEMPT))
-				{
-					/* Stay on channel if this would empty it -- jilles */
-					if (ca->mychan->chan->nummembers - ca->mychan->chan->numsvcmembers == 1)
-					{
-						ca->mychan->flags |= MC_INHABIT;
-						if (ca->mychan->chan->numsvcmembers == 0)
-							join(cu->chan->name, chansvs.nick);
-					}
-					ban(chansvs.me->me, ca->mychan->chan, u);
-					remove_ban_exceptions(chansvs.me->me, ca->mychan->chan, u);
-					kick(chansvs.me->me, ca->mychan->chan, u, "User is banned from this channel");
-					continue;
-				}
-
-				if (ca->level & CA_USEDUPDATE)
-					ca->mychan->used = CURRTIME;
-
-				if (ca->mychan->flags & MC_NOOP || u->myuser->flags & MU_NOOP)
-					continue;
-
-				if (ircd->uses_owner && !(cu->modes & ircd->owner_mode) && ca->level & CA_AUTOOP && ca->level & CA_USEOWNER)
-				{
-					modestack_mode_param(chansvs.nick, ca->mychan->chan, MTYPE_ADD, ircd->owner_mchar[1], CLIENT_NAME(u));
-					cu->modes |= ircd->owner_mode;
-				}
-
-				if (ircd->uses_protect && !(cu->modes & ircd->protect_mode) && !(ircd->uses_owner && cu->modes & ircd->owner_mode) && ca->level & CA_AUTOOP && ca->level & CA_USEPROTECT)
-				{
-					modestack_mode_param(chansvs.nick, ca->mychan->chan, MTYPE_ADD, ircd->protect_mchar[1], CLIENT_NAME(u));
-					cu->modes |= ircd->protect_mode;
-				}
-
-				if (!(cu->modes & CSTATUS_OP) && ca->level & CA_AUTOOP)
-				{
-					modestack_mode_param(chansvs.nick, ca->mychan->chan, MTYPE_ADD, 'o', CLIENT_NAME(u));
-					cu->modes |= CSTATUS_OP;
-				}
-
-				if (ircd->uses_halfops && !(cu->modes & (CSTATUS_OP | ircd->halfops_mode)) && ca->level & CA_AUTOHALFOP)
-				{
-					modestack_mode_param(chansvs.nick, ca->mychan->chan, MTYPE_ADD, 'h', CLIENT_NAME(u));
-					cu->modes |= ircd->halfops_mode;
-				}
-
-				if (!(cu->modes & (CSTATUS_OP | ircd->halfops_mode | CSTATUS_VOICE)) && ca->level & CA_AUTOVOICE)
-				{
-					modestack_mode_param(chansvs.nick, ca->mychan->chan, MTYPE_ADD, 'v', CLIENT_NAME(u));
-					cu->modes |= CSTATUS_VOICE;
-				}
-			}
+			if (!grant_group_access(u, cu, ca))
+				break;
 		}
 	}
 }
@@ -183,6 +204,7 @@ static void myuser_delete_hook(myuser_t *mu)
 	}
 
 	mowgli_list_free(l);
+	groupclosure_free(entity(mu));
 
 	MYENTITY_FOREACH_T(mt, &state, ENT_GROUP)
 	{
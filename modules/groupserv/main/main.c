@@ -60,6 +60,9 @@ void _modinit(module_t *m)
 
 void _moddeinit(module_unload_intent_t intent)
 {
+	myentity_iteration_state_t iter;
+	myentity_t *mt;
+
 	gs_db_deinit();
 	gs_hooks_deinit();
 	del_conf_item("MAXGROUPS", &groupsvs->conf_table);
@@ -70,6 +73,10 @@ void _moddeinit(module_unload_intent_t intent)
 	if (groupsvs)
 		service_delete(groupsvs);
 
+	/* closures are only valid against this instance's generation count */
+	MYENTITY_FOREACH_T(mt, &iter, ENT_USER)
+		groupclosure_free(mt);
+
 	switch (intent)
 	{
 		case MODULE_UNLOAD_INTENT_RELOAD:
@@ -46,9 +46,9 @@ mowgli_list_t helpserv_reqlist;
 
 void _modinit(module_t *m)
 {
-	if (!module_find_published("backend/opensex"))
+	if (db_mod == NULL)
 	{
-		slog(LG_INFO, "Module %s requires use of the OpenSEX database backend, refusing to load.", m->name);
+		slog(LG_INFO, "Module %s requires a row-based database backend such as OpenSEX, refusing to load.", m->name);
 		m->mflags = MODTYPE_FAIL;
 		return;
 	}
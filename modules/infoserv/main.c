@@ -512,9 +512,9 @@ static void is_cmd_olist(sourceinfo_t *si, int parc, char *parv[])
 
 void _modinit(module_t *m)
 {
-	if (!module_find_published("backend/opensex"))
+	if (db_mod == NULL)
 	{
-		slog(LG_INFO, "Module %s requires use of the OpenSEX database backend, refusing to load.", m->name);
+		slog(LG_INFO, "Module %s requires a row-based database backend such as OpenSEX, refusing to load.", m->name);
 		m->mflags = MODTYPE_FAIL;
 		return;
 	}
@@ -121,25 +121,12 @@ static void ms_cmd_forward(sourceinfo_t *si, int parc, char *parv[])
 	si->smu->memo_ratelimit_time = CURRTIME;
 
 	/* Make sure we're not on ignore */
-	MOWGLI_ITER_FOREACH(n, tmu->memo_ignores.head)
+	if (memo_ignores(tmu, si->smu))
 	{
-		mynick_t *mn;
-		myuser_t *mu;
-
-		if (nicksvs.no_nick_ownership)
-			mu = myuser_find((const char *)n->data);
-		else
-		{
-			mn = mynick_find((const char *)n->data);
-			mu = mn != NULL ? mn->owner : NULL;
-		}
-		if (mu == si->smu)
-		{
-			/* Lie... change this if you want it to fail silent */
-			logcommand(si, CMDLOG_SET, "failed FORWARD to \2%s\2 (on ignore list)", entity(tmu)->name);
-			command_success_nodata(si, _("The memo has been successfully forwarded to \2%s\2."), target);
-			return;
-		}
+		/* Lie... change this if you want it to fail silent */
+		logcommand(si, CMDLOG_SET, "failed FORWARD to \2%s\2 (on ignore list)", entity(tmu)->name);
+		command_success_nodata(si, _("The memo has been successfully forwarded to \2%s\2."), target);
+		return;
 	}
 	logcommand(si, CMDLOG_SET, "FORWARD: to \2%s\2", entity(tmu)->name);
 
@@ -150,13 +137,9 @@ static void ms_cmd_forward(sourceinfo_t *si, int parc, char *parv[])
 		{
 			/* should have some function for send here...  ask nenolod*/
 			memo = (mymemo_t *)n->data;
-			newmemo = smalloc(sizeof(mymemo_t));
 
 			/* Create memo */
-			newmemo->sent = CURRTIME;
-			newmemo->status = 0;
-			mowgli_strlcpy(newmemo->sender,entity(si->smu)->name,NICKLEN);
-			mowgli_strlcpy(newmemo->text,memo->text,MEMOLEN);
+			newmemo = mymemo_create(entity(si->smu)->name, mymemo_text(memo), CURRTIME, 0);
 
 			/* Create node, add to their linked list of memos */
 			temp = mowgli_node_create();
@@ -166,7 +149,7 @@ static void ms_cmd_forward(sourceinfo_t *si, int parc, char *parv[])
 			/* Should we email this? */
 			if (tmu->flags & MU_EMAILMEMOS)
 			{
-				sendemail(si->su, tmu, EMAIL_MEMO, tmu->email, memo->text);
+				sendemail(si->su, tmu, EMAIL_MEMO, tmu->email, mymemo_text(newmemo));
 			}
 		}
 		i++;
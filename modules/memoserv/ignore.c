@@ -84,9 +84,7 @@ static void ms_cmd_ignore(sourceinfo_t *si, int parc, char *parv[])
 static void ms_cmd_ignore_add(sourceinfo_t *si, int parc, char *parv[])
 {
 	myuser_t *tmu;
-	mowgli_node_t *n;
-	const char *newnick;
-	char *temp;
+	const char *newnick, *temp;
 
 	/* Arg check */
 	if (parc < 1)
@@ -113,28 +111,21 @@ static void ms_cmd_ignore_add(sourceinfo_t *si, int parc, char *parv[])
 	newnick = entity(tmu)->name;
 
 	/* Ignore list is full */
-	if (si->smu->memo_ignores.count >= MAXMSIGNORES)
+	if (memo_ignore_count(si->smu) >= MAXMSIGNORES)
 	{
 		command_fail(si, fault_toomany, _("Your ignore list is full, please DEL an account."));
 		return;
 	}
 
-	/* Iterate through list, make sure target not in it, if last node append */
-	MOWGLI_ITER_FOREACH(n, si->smu->memo_ignores.head)
+	/* Already in the list */
+	if ((temp = memo_ignore_find(si->smu, newnick)) != NULL)
 	{
-		temp = (char *)n->data;
-
-		/* Already in the list */
-		if (!irccasecmp(temp, newnick))
-		{
-			command_fail(si, fault_nochange, _("Account \2%s\2 is already in your ignore list."), temp);
-			return;
-		}
+		command_fail(si, fault_nochange, _("Account \2%s\2 is already in your ignore list."), temp);
+		return;
 	}
 
 	/* Add to ignore list */
-	temp = sstrdup(newnick);
-	mowgli_node_add(temp, mowgli_node_create(), &si->smu->memo_ignores);
+	memo_ignore_add(si->smu, newnick);
 	logcommand(si, CMDLOG_SET, "IGNORE:ADD: \2%s\2", newnick);
 	command_success_nodata(si, _("Account \2%s\2 added to your ignore list."), newnick);
 	return;
@@ -142,8 +133,7 @@ static void ms_cmd_ignore_add(sourceinfo_t *si, int parc, char *parv[])
 
 static void ms_cmd_ignore_del(sourceinfo_t *si, int parc, char *parv[])
 {
-	mowgli_node_t *n, *tn;
-	char *temp;
+	const char *temp;
 
 	/* Arg check */
 	if (parc < 1)
@@ -153,44 +143,27 @@ static void ms_cmd_ignore_del(sourceinfo_t *si, int parc, char *parv[])
 		return;
 	}
 
-	/* Iterate through list, make sure they're not in it, if last node append */
-	MOWGLI_ITER_FOREACH_SAFE(n, tn, si->smu->memo_ignores.head)
+	if ((temp = memo_ignore_find(si->smu, parv[0])) == NULL)
 	{
-		temp = (char *)n->data;
-
-		/* Not using list or clear, but we've found our target in the ignore list */
-		if (!irccasecmp(temp, parv[0]))
-		{
-			logcommand(si, CMDLOG_SET, "IGNORE:DEL: \2%s\2", temp);
-			command_success_nodata(si, _("Account \2%s\2 removed from ignore list."), temp);
-			mowgli_node_delete(n, &si->smu->memo_ignores);
-			mowgli_node_free(n);
-			free(temp);
-
-			return;
-		}
+		command_fail(si, fault_nosuch_target, _("\2%s\2 is not in your ignore list."), parv[0]);
+		return;
 	}
 
-	command_fail(si, fault_nosuch_target, _("\2%s\2 is not in your ignore list."), parv[0]);
+	logcommand(si, CMDLOG_SET, "IGNORE:DEL: \2%s\2", temp);
+	command_success_nodata(si, _("Account \2%s\2 removed from ignore list."), temp);
+	memo_ignore_delete(si->smu, parv[0]);
 	return;
 }
 
 static void ms_cmd_ignore_clear(sourceinfo_t *si, int parc, char *parv[])
 {
-	mowgli_node_t *n, *tn;
-
-	if (MOWGLI_LIST_LENGTH(&si->smu->memo_ignores) == 0)
+	if (memo_ignore_count(si->smu) == 0)
 	{
 		command_fail(si, fault_nochange, _("Ignore list already empty."));
 		return;
 	}
 
-	MOWGLI_ITER_FOREACH_SAFE(n, tn, si->smu->memo_ignores.head)
-	{
-		free(n->data);
-		mowgli_node_delete(n,&si->smu->memo_ignores);
-		mowgli_node_free(n);
-	}
+	memo_ignore_clear(si->smu);
 
 	/* Let them know list is clear */
 	command_success_nodata(si, _("Ignore list cleared."));
@@ -200,18 +173,21 @@ static void ms_cmd_ignore_clear(sourceinfo_t *si, int parc, char *parv[])
 
 static void ms_cmd_ignore_list(sourceinfo_t *si, int parc, char *parv[])
 {
-	mowgli_node_t *n;
+	mowgli_patricia_iteration_state_t state;
+	const char *name;
 	unsigned int i = 1;
 
 	/* Throw in list header */
 	command_success_nodata(si, _("Ignore list:"));
 	command_success_nodata(si, "-------------------------");
 
-	/* Iterate through list, make sure they're not in it, if last node append */
-	MOWGLI_ITER_FOREACH(n, si->smu->memo_ignores.head)
+	if (si->smu->memo_ignores != NULL)
 	{
-		command_success_nodata(si, "%d - %s", i, (char *)n->data);
-		i++;
+		MOWGLI_PATRICIA_FOREACH(name, &state, si->smu->memo_ignores)
+		{
+			command_success_nodata(si, "%d - %s", i, name);
+			i++;
+		}
 	}
 
 	/* Ignore list footer */
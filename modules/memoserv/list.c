@@ -40,6 +40,7 @@ static void ms_cmd_list(sourceinfo_t *si, int parc, char *parv[])
 	struct tm tm;
 	char line[512];
 	char chan[CHANNELLEN];
+	const char *text;
 	char *p;
 
 	command_success_nodata(si, ngettext(N_("You have %zu memo (%d new)."),
@@ -64,12 +65,14 @@ static void ms_cmd_list(sourceinfo_t *si, int parc, char *parv[])
 
 		snprintf(line, sizeof line, _("- %d From: %s Sent: %s"),
 				i, memo->sender, strfbuf);
-		if (memo->status & MEMO_CHANNEL && *memo->text == '#')
+		/* channel memos start with the channel name; the text of
+		 * others is not needed here */
+		if (memo->status & MEMO_CHANNEL && *(text = mymemo_text(memo)) == '#')
 		{
 			mowgli_strlcat(line, " ", sizeof line);
 			mowgli_strlcat(line, _("To:"), sizeof line);
 			mowgli_strlcat(line, " ", sizeof line);
-			mowgli_strlcpy(chan, memo->text, sizeof chan);
+			mowgli_strlcpy(chan, text, sizeof chan);
 			p = strchr(chan, ' ');
 			if (p != NULL)
 				*p = '\0';
@@ -9,6 +9,9 @@
 #include "atheme.h"
 #include <limits.h>
 
+#define IN_MEMOSERV_MAIN
+#include "memoserv.h"
+
 DECLARE_MODULE_V1
 (
 	"memoserv/main", false, _modinit, _moddeinit,
@@ -18,6 +21,7 @@ DECLARE_MODULE_V1
 
 static void on_user_identify(user_t *u);
 static void on_user_away(user_t *u);
+static bool memo_fanout_step(job_t *job);
 
 service_t *memosvs = NULL;
 /*struct memoserv_conf *memosvs_conf;*/
@@ -38,6 +42,17 @@ void _modinit(module_t *m)
 
 void _moddeinit(module_unload_intent_t intent)
 {
+	mowgli_node_t *n, *tn;
+	job_t *job;
+
+	MOWGLI_ITER_FOREACH_SAFE(n, tn, jobs.head)
+	{
+		job = n->data;
+
+		if (job->step == memo_fanout_step)
+			job_cancel(job);
+	}
+
         if (memosvs != NULL)
                 service_delete(memosvs);
 }
@@ -82,6 +97,165 @@ static void on_user_away(user_t *u)
 	}
 }
 
+/* a memo on its way to many accounts */
+typedef struct {
+	char sender[IDLEN];
+	char *nick;		/* nick it was sent from, if not the account name */
+	char *text;
+	char *what;		/* who the targets are, e.g. "accounts" */
+	char (*targets)[IDLEN];
+	unsigned int sent;
+} memo_fanout_t;
+
+/* gives one account the memo, if it takes memos from the sender */
+static void memo_fanout_deliver(memo_fanout_t *mf, myuser_t *smu, myuser_t *tmu)
+{
+	mymemo_t *memo;
+	user_t *u;
+
+	/* Does the user allow memos? --pfish */
+	if (tmu->flags & MU_NOMEMO)
+		return;
+
+	/* Check to make sure target inbox not full */
+	if (tmu->memos.count >= maxmemos)
+		return;
+
+	/* As in SEND to a single user, make ignore fail silently */
+	mf->sent++;
+
+	if (memo_ignores(tmu, smu))
+		return;
+
+	memo = mymemo_create(entity(smu)->name, mf->text, CURRTIME, MEMO_CHANNEL);
+	mowgli_node_add(memo, mowgli_node_create(), &tmu->memos);
+	tmu->memoct_new++;
+
+	/* Should we email this? The sender may have left by now. */
+	if (tmu->flags & MU_EMAILMEMOS)
+	{
+		u = user_find_named(mf->nick != NULL ? mf->nick : entity(smu)->name);
+		if (u == NULL || u->myuser != smu)
+			u = memosvs->me;
+		sendemail(u, tmu, EMAIL_MEMO, tmu->email, mf->text);
+	}
+
+	/* Is the user online? If so, tell them about the new memo. */
+	if (mf->nick == NULL)
+		myuser_notice(memosvs->me->nick, tmu, "You have a new memo from %s (%zu).", entity(smu)->name, MOWGLI_LIST_LENGTH(&tmu->memos));
+	else
+		myuser_notice(memosvs->me->nick, tmu, "You have a new memo from %s (nick: %s) (%zu).", entity(smu)->name, mf->nick, MOWGLI_LIST_LENGTH(&tmu->memos));
+	myuser_notice(memosvs->me->nick, tmu, _("To read it, type /%s%s READ %zu"),
+				ircd->uses_rcommand ? "" : "msg ", memosvs->disp, MOWGLI_LIST_LENGTH(&tmu->memos));
+}
+
+static bool memo_fanout_step(job_t *job)
+{
+	memo_fanout_t *mf = job->data;
+	myuser_t *smu, *tmu;
+
+	/* the sender has been dropped */
+	if ((smu = user(myentity_find_uid(mf->sender))) == NULL)
+		return false;
+
+	tmu = user(myentity_find_uid(mf->targets[job->progress++]));
+	if (tmu != NULL && tmu != smu)
+		memo_fanout_deliver(mf, smu, tmu);
+
+	return job->progress < job->total;
+}
+
+static void memo_fanout_free(memo_fanout_t *mf)
+{
+	free(mf->nick);
+	free(mf->text);
+	free(mf->what);
+	free(mf->targets);
+	free(mf);
+}
+
+static void memo_fanout_done(job_t *job)
+{
+	memo_fanout_t *mf = job->data;
+	myuser_t *smu;
+
+	slog(LG_INFO, "memo_fanout_done(): job %u (%s by %s) %s after %u/%u accounts, %u sent",
+			job->id, job->name, job->owner,
+			job->progress < job->total ? "stopped" : "finished",
+			job->progress, job->total, mf->sent);
+
+	if ((smu = user(myentity_find_uid(mf->sender))) != NULL)
+	{
+		if (job->progress < job->total)
+			myuser_notice(memosvs->me->nick, smu, "%s job %u was cancelled; the memo was sent to %u %s before that.",
+					job->name, job->id, mf->sent, mf->what);
+		else
+			myuser_notice(memosvs->me->nick, smu, "%s job %u is done; the memo has been successfully sent to %u %s.",
+					job->name, job->id, mf->sent, mf->what);
+	}
+
+	memo_fanout_free(mf);
+}
+
+/*
+ * memo_fanout(sourceinfo_t *si, const char *command, const char *what,
+ *     const char *text, myuser_t **targets, unsigned int count,
+ *     unsigned int *sent)
+ *
+ * Sends a channel memo from si->smu to many accounts. Up to
+ * MEMO_FANOUT_INLINE accounts get it right away; more than that are left
+ * to a job, so services stay responsive while it is delivered.
+ *
+ * Inputs:
+ *      - who is sending the memo
+ *      - the command, which names the job
+ *      - who the targets are, for the message when the job is done
+ *      - the text of the memo
+ *      - the accounts to send it to, not including the sender
+ *      - how many there are
+ *      - where to store how many accounts took the memo
+ *
+ * Outputs:
+ *      - NULL if the memo has been delivered, and *sent is set;
+ *        otherwise the job delivering it
+ *
+ * Side Effects:
+ *      - memos are sent, now or later
+ */
+job_t *memo_fanout(sourceinfo_t *si, const char *command, const char *what, const char *text,
+		myuser_t **targets, unsigned int count, unsigned int *sent)
+{
+	memo_fanout_t *mf;
+	unsigned int i;
+
+	return_val_if_fail(si != NULL && si->smu != NULL, NULL);
+	return_val_if_fail(sent != NULL, NULL);
+
+	mf = scalloc(sizeof *mf, 1);
+	mowgli_strlcpy(mf->sender, entity(si->smu)->id, sizeof mf->sender);
+	if (si->su != NULL && irccasecmp(si->su->nick, entity(si->smu)->name))
+		mf->nick = sstrdup(si->su->nick);
+	mf->text = sstrdup(text);
+	mf->what = sstrdup(what);
+
+	if (count <= MEMO_FANOUT_INLINE)
+	{
+		for (i = 0; i < count; i++)
+			memo_fanout_deliver(mf, si->smu, targets[i]);
+
+		*sent = mf->sent;
+		memo_fanout_free(mf);
+		return NULL;
+	}
+
+	mf->targets = smalloc(count * sizeof *mf->targets);
+	for (i = 0; i < count; i++)
+		mowgli_strlcpy(mf->targets[i], entity(targets[i])->id, sizeof mf->targets[i]);
+
+	*sent = 0;
+	return job_start(command, entity(si->smu)->name, count, memo_fanout_step, memo_fanout_done, mf);
+}
+
 /* vim:cinoptions=>s,e0,n0,f0,{0,}0,^0,=s,ps,t0,c3,+s,(2s,us,)20,*30,gs,hs
  * vim:ts=8
  * vim:sw=8
@@ -0,0 +1,26 @@
+/* memoserv.h - memoserv public interface
+ *
+ * Include this header for modules other than memoserv/main
+ * that need to send memos to many accounts.
+ *
+ * Copyright (c) 2014- Shaltúre project (http://github.com/shalture)
+ */
+
+#ifndef MEMOSERV_H
+#define MEMOSERV_H
+
+/* fan-outs to at most this many accounts are delivered right away */
+#define MEMO_FANOUT_INLINE	100
+
+#ifndef IN_MEMOSERV_MAIN
+job_t *(*memo_fanout)(sourceinfo_t *si, const char *command, const char *what, const char *text,
+		myuser_t **targets, unsigned int count, unsigned int *sent);
+
+static inline void use_memoserv_main_symbols(module_t *m)
+{
+    MODULE_TRY_REQUEST_DEPENDENCY(m, "memoserv/main");
+    MODULE_TRY_REQUEST_SYMBOL(m, memo_fanout, "memoserv/main", "memo_fanout");
+}
+#endif
+
+#endif /* !MEMOSERV_H */
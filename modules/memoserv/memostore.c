@@ -0,0 +1,521 @@
+/*
+ * Copyright (c) 2014- Shaltúre project (http://github.com/shalture)
+ * Rights to this code are as documented in doc/LICENSE.
+ *
+ * Keeps memo texts in an append-only file instead of in memory.
+ *
+ * Texts are appended to <datadir>/memostore.<generation>, one per line;
+ * memos only remember where theirs starts and how long it is, and the
+ * database stores that instead of the text (MES rows). A text is read back
+ * when MemoServ READ or LIST needs it. The same text sent to many accounts
+ * in a row (SENDALL, SENDOPS, SENDGROUP) is stored once.
+ *
+ * Deleted memos leave their text behind. Once an hour, if more than half
+ * of the file is garbage, the live texts are copied to the next generation.
+ * The old file stays until two more database saves have completed, as the
+ * database on disk may still refer to it.
+ *
+ */
+
+#include "atheme.h"
+
+#ifndef MOWGLI_OS_WIN
+#include <dirent.h>
+#include <sys/stat.h>
+#endif
+
+DECLARE_MODULE_V1
+(
+	"memoserv/memostore", false, _modinit, _moddeinit,
+	PACKAGE_STRING,
+	"Shaltúre developers <https://github.com/shalture>"
+);
+
+#define MEMOSTORE_COMPACT_INTERVAL	3600
+#define MEMOSTORE_COMPACT_MIN		(1024 * 1024)
+
+static int store_fd = -1;
+static unsigned int store_gen = 0;	/* 0 until the database or startup picks one */
+static bool store_gen_loaded = false;	/* from the database */
+static off_t store_size = 0;
+static unsigned int saves_since_compact = 2;
+
+/* the text last appended, to store repeats only once */
+static char *last_text = NULL;
+static off_t last_offset;
+
+static char *fetch_buf = NULL;
+static size_t fetch_size = 0;
+
+static mowgli_eventloop_timer_t *compact_timer = NULL;
+static mowgli_eventloop_timer_t *migrate_timer = NULL;
+
+static void memostore_path(char *buf, size_t size, unsigned int gen)
+{
+	snprintf(buf, size, "%s/memostore.%u", datadir, gen);
+}
+
+/* calls cb on the generation of every memo store file in datadir */
+static void memostore_scan(void (*cb)(unsigned int gen))
+{
+#ifndef MOWGLI_OS_WIN
+	DIR *dir;
+	struct dirent *de;
+	unsigned int gen;
+	char c;
+
+	if ((dir = opendir(datadir)) == NULL)
+		return;
+
+	while ((de = readdir(dir)) != NULL)
+		if (sscanf(de->d_name, "memostore.%u%c", &gen, &c) == 1)
+			cb(gen);
+
+	closedir(dir);
+#endif
+}
+
+static void memostore_scan_max(unsigned int gen)
+{
+	if (gen > store_gen)
+		store_gen = gen;
+}
+
+/* removes files the database can no longer refer to */
+static void memostore_scan_stale(unsigned int gen)
+{
+	char path[BUFSIZE];
+
+	if (gen == store_gen || (gen + 1 == store_gen && saves_since_compact < 2))
+		return;
+
+	memostore_path(path, sizeof path, gen);
+	slog(LG_DEBUG, "memostore: removing %s", path);
+	unlink(path);
+}
+
+static bool memostore_open(void)
+{
+	char path[BUFSIZE];
+	struct stat sb;
+
+	if (store_fd >= 0)
+		return true;
+
+	/* never reuse a file the database does not know about */
+	if (store_gen == 0)
+	{
+		memostore_scan(memostore_scan_max);
+		store_gen++;
+	}
+
+	memostore_path(path, sizeof path, store_gen);
+
+	if ((store_fd = open(path, O_RDWR | O_CREAT | O_APPEND, 0600)) < 0 || fstat(store_fd, &sb) < 0)
+	{
+		slog(LG_ERROR, "memostore_open(): cannot open %s: %s", path, strerror(errno));
+		if (store_fd >= 0)
+			close(store_fd);
+		store_fd = -1;
+		return false;
+	}
+
+	store_size = sb.st_size;
+	return true;
+}
+
+static bool memostore_write(int fd, const char *buf, size_t len)
+{
+	ssize_t r;
+
+	while (len > 0)
+	{
+		if ((r = write(fd, buf, len)) < 0)
+		{
+			if (errno == EINTR)
+				continue;
+			return false;
+		}
+
+		buf += r;
+		len -= r;
+	}
+
+	return true;
+}
+
+static bool memostore_read(int fd, char *buf, size_t len, off_t offset)
+{
+	ssize_t r;
+
+	while (len > 0)
+	{
+		if ((r = pread(fd, buf, len, offset)) <= 0)
+		{
+			if (r < 0 && errno == EINTR)
+				continue;
+			return false;
+		}
+
+		buf += r;
+		len -= r;
+		offset += r;
+	}
+
+	return true;
+}
+
+static bool memostore_store(mymemo_t *memo, const char *text)
+{
+	/* the database says which file to use only once it is loaded */
+	if (runflags & RF_STARTING)
+		return false;
+
+	if (!memostore_open())
+		return false;
+
+	if (last_text != NULL && !strcmp(last_text, text))
+	{
+		memo->offset = last_offset;
+		return true;
+	}
+
+	if (!memostore_write(store_fd, text, memo->len) || !memostore_write(store_fd, "\n", 1))
+	{
+		slog(LG_ERROR, "memostore_store(): cannot write memo: %s", strerror(errno));
+		if (ftruncate(store_fd, store_size) < 0)
+			slog(LG_ERROR, "memostore_store(): cannot truncate memo store: %s", strerror(errno));
+		return false;
+	}
+
+	memo->offset = store_size;
+	store_size += memo->len + 1;
+
+	free(last_text);
+	last_text = sstrdup(text);
+	last_offset = memo->offset;
+
+	return true;
+}
+
+static const char *memostore_fetch(mymemo_t *memo)
+{
+	if (!memostore_open())
+		return NULL;
+
+	if (fetch_size < memo->len + 1)
+	{
+		fetch_size = memo->len + 1;
+		fetch_buf = srealloc(fetch_buf, fetch_size);
+	}
+
+	if (!memostore_read(store_fd, fetch_buf, memo->len, memo->offset))
+	{
+		slog(LG_ERROR, "memostore_fetch(): cannot read memo at %llu in generation %u",
+				(unsigned long long)memo->offset, store_gen);
+		return NULL;
+	}
+
+	fetch_buf[memo->len] = '\0';
+	return fetch_buf;
+}
+
+static memo_store_t memostore = { memostore_store, memostore_fetch };
+
+/* moves the texts of memos kept in memory to the store */
+static void memostore_migrate(void *unused)
+{
+	myentity_iteration_state_t state;
+	myentity_t *mt;
+	mowgli_node_t *n;
+	mymemo_t *memo;
+	unsigned int moved = 0;
+
+	migrate_timer = NULL;
+
+	MYENTITY_FOREACH_T(mt, &state, ENT_USER)
+	{
+		MOWGLI_ITER_FOREACH(n, user(mt)->memos.head)
+		{
+			memo = n->data;
+
+			if (memo->text == NULL || !memostore_store(memo, memo->text))
+				continue;
+
+			free(memo->text);
+			memo->text = NULL;
+			moved++;
+		}
+	}
+
+	if (moved != 0)
+		slog(LG_INFO, "memostore: moved %u memo texts to generation %u", moved, store_gen);
+
+	if (store_gen_loaded)
+		memostore_scan(memostore_scan_stale);
+}
+
+/* brings the texts back into memory, for unloading */
+static void memostore_restore(void)
+{
+	myentity_iteration_state_t state;
+	myentity_t *mt;
+	mowgli_node_t *n;
+	mymemo_t *memo;
+	const char *text;
+
+	MYENTITY_FOREACH_T(mt, &state, ENT_USER)
+	{
+		MOWGLI_ITER_FOREACH(n, user(mt)->memos.head)
+		{
+			memo = n->data;
+
+			if (memo->text != NULL)
+				continue;
+
+			text = memostore_fetch(memo);
+			memo->text = sstrdup(text != NULL ? text : "");
+		}
+	}
+}
+
+typedef struct {
+	off_t from, to;
+} memostore_move_t;
+
+static int memostore_move_cmp(const void *a, const void *b)
+{
+	const memostore_move_t *ma = a, *mb = b;
+
+	return ma->from < mb->from ? -1 : ma->from > mb->from;
+}
+
+/* collects where every stored text is, each once, sorted */
+static memostore_move_t *memostore_live(size_t *count, off_t *live)
+{
+	myentity_iteration_state_t state;
+	myentity_t *mt;
+	mowgli_node_t *n;
+	mymemo_t *memo;
+	memostore_move_t *moves = NULL;
+	size_t i, j, size = 0;
+
+	*count = 0;
+	*live = 0;
+
+	MYENTITY_FOREACH_T(mt, &state, ENT_USER)
+	{
+		MOWGLI_ITER_FOREACH(n, user(mt)->memos.head)
+		{
+			memo = n->data;
+
+			if (memo->text != NULL)
+				continue;
+
+			if (*count == size)
+			{
+				size = size != 0 ? size * 2 : 1024;
+				moves = srealloc(moves, size * sizeof *moves);
+			}
+
+			moves[*count].from = memo->offset;
+			moves[*count].to = memo->len;	/* until moved */
+			(*count)++;
+		}
+	}
+
+	if (*count == 0)
+		return moves;
+
+	qsort(moves, *count, sizeof *moves, memostore_move_cmp);
+
+	for (i = j = 0; i < *count; i++)
+	{
+		if (j != 0 && moves[j - 1].from == moves[i].from)
+			continue;
+
+		moves[j++] = moves[i];
+		*live += moves[i].to + 1;
+	}
+
+	*count = j;
+	return moves;
+}
+
+static void memostore_compact(void *unused)
+{
+	myentity_iteration_state_t state;
+	myentity_t *mt;
+	mowgli_node_t *n;
+	mymemo_t *memo;
+	memostore_move_t *moves, key, *move;
+	size_t i, count, len;
+	off_t live, size = 0;
+	char path[BUFSIZE], newpath[BUFSIZE];
+	int fd;
+
+	/* the database on disk may still refer to the previous file */
+	if (store_fd < 0 || saves_since_compact < 2)
+		return;
+
+	moves = memostore_live(&count, &live);
+
+	if (store_size - live < MEMOSTORE_COMPACT_MIN || store_size - live < live)
+	{
+		free(moves);
+		return;
+	}
+
+	memostore_path(path, sizeof path, store_gen);
+	memostore_path(newpath, sizeof newpath, store_gen + 1);
+
+	if ((fd = open(newpath, O_RDWR | O_CREAT | O_TRUNC | O_APPEND, 0600)) < 0)
+	{
+		slog(LG_ERROR, "memostore_compact(): cannot create %s: %s", newpath, strerror(errno));
+		free(moves);
+		return;
+	}
+
+	for (i = 0; i < count; i++)
+	{
+		len = moves[i].to;
+
+		if (fetch_size < len + 1)
+		{
+			fetch_size = len + 1;
+			fetch_buf = srealloc(fetch_buf, fetch_size);
+		}
+
+		if (!memostore_read(store_fd, fetch_buf, len + 1, moves[i].from) ||
+				!memostore_write(fd, fetch_buf, len + 1))
+			break;
+
+		moves[i].to = size;
+		size += len + 1;
+	}
+
+	if (i < count || fsync(fd) < 0)
+	{
+		slog(LG_ERROR, "memostore_compact(): cannot copy memos to %s: %s", newpath, strerror(errno));
+		close(fd);
+		unlink(newpath);
+		free(moves);
+		return;
+	}
+
+	MYENTITY_FOREACH_T(mt, &state, ENT_USER)
+	{
+		MOWGLI_ITER_FOREACH(n, user(mt)->memos.head)
+		{
+			memo = n->data;
+
+			if (memo->text != NULL)
+				continue;
+
+			key.from = memo->offset;
+			move = bsearch(&key, moves, count, sizeof *moves, memostore_move_cmp);
+			memo->offset = move->to;
+		}
+	}
+
+	slog(LG_INFO, "memostore: compacted %s (%llu bytes) to %s (%llu bytes)", path,
+			(unsigned long long)store_size, newpath, (unsigned long long)size);
+
+	close(store_fd);
+	store_fd = fd;
+	store_size = size;
+	store_gen++;
+	saves_since_compact = 0;
+
+	free(last_text);
+	last_text = NULL;
+
+	free(moves);
+
+	/* anything older than the file we just left is no longer referred to */
+	memostore_scan(memostore_scan_stale);
+}
+
+static void memostore_db_write(database_handle_t *db)
+{
+	if (store_gen == 0)
+		return;
+
+	db_start_row(db, "MSF");
+	db_write_uint(db, store_gen);
+	db_commit_row(db);
+}
+
+static void memostore_db_saved(void *unused)
+{
+	saves_since_compact++;
+}
+
+static void memostore_h_msf(database_handle_t *db, const char *type)
+{
+	unsigned int gen = db_sread_uint(db);
+
+	if (store_fd >= 0)
+		return;
+
+	store_gen = gen;
+	store_gen_loaded = true;
+}
+
+void _modinit(module_t *m)
+{
+	if (memo_store != NULL)
+	{
+		slog(LG_ERROR, "memoserv/memostore: another memo store is already loaded");
+		m->mflags = MODTYPE_FAIL;
+		return;
+	}
+
+	memo_store = &memostore;
+
+	hook_add_event("db_write");
+	hook_add_db_write(memostore_db_write);
+
+	hook_add_event("db_saved");
+	hook_add_db_saved(memostore_db_saved);
+
+	db_register_type_handler("MSF", memostore_h_msf);
+
+	compact_timer = mowgli_timer_add(base_eventloop, "memostore_compact", memostore_compact, NULL, MEMOSTORE_COMPACT_INTERVAL);
+
+	/* at startup, once the database is loaded */
+	if (runflags & RF_STARTING)
+		migrate_timer = mowgli_timer_add_once(base_eventloop, "memostore_migrate", memostore_migrate, NULL, 0);
+	else
+		memostore_migrate(NULL);
+}
+
+void _moddeinit(module_unload_intent_t intent)
+{
+	if (memo_store != &memostore)
+		return;
+
+	memostore_restore();
+	memo_store = NULL;
+
+	if (migrate_timer != NULL)
+		mowgli_timer_destroy(base_eventloop, migrate_timer);
+	mowgli_timer_destroy(base_eventloop, compact_timer);
+
+	db_unregister_type_handler("MSF");
+
+	hook_del_db_write(memostore_db_write);
+	hook_del_db_saved(memostore_db_saved);
+
+	if (store_fd >= 0)
+		close(store_fd);
+
+	free(last_text);
+	free(fetch_buf);
+}
+
+/* vim:cinoptions=>s,e0,n0,f0,{0,}0,^0,=s,ps,t0,c3,+s,(2s,us,)20,*30,gs,hs
+ * vim:ts=8
+ * vim:sw=8
+ * vim:noexpandtab
+ */
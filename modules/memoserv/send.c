@@ -123,33 +123,16 @@ static void ms_cmd_send(sourceinfo_t *si, int parc, char *parv[])
 
 
 		/* Make sure we're not on ignore */
-		MOWGLI_ITER_FOREACH(n, tmu->memo_ignores.head)
+		if (memo_ignores(tmu, si->smu))
 		{
-			mynick_t *mn;
-			myuser_t *mu;
-
-			if (nicksvs.no_nick_ownership)
-				mu = myuser_find((const char *)n->data);
-			else
-			{
-				mn = mynick_find((const char *)n->data);
-				mu = mn != NULL ? mn->owner : NULL;
-			}
-			if (mu == si->smu)
-			{
-				logcommand(si, CMDLOG_SET, "failed SEND to \2%s\2 (on ignore list)", entity(tmu)->name);
-				command_success_nodata(si, _("The memo has been successfully sent to \2%s\2."), target);
-				return;
-			}
+			logcommand(si, CMDLOG_SET, "failed SEND to \2%s\2 (on ignore list)", entity(tmu)->name);
+			command_success_nodata(si, _("The memo has been successfully sent to \2%s\2."), target);
+			return;
 		}
 		logcommand(si, CMDLOG_SET, "SEND: to \2%s\2", entity(tmu)->name);
 
 		/* Malloc and populate struct */
-		memo = smalloc(sizeof(mymemo_t));
-		memo->sent = CURRTIME;
-		memo->status = 0;
-		mowgli_strlcpy(memo->sender,entity(si->smu)->name,NICKLEN);
-		mowgli_strlcpy(memo->text,m,MEMOLEN);
+		memo = mymemo_create(entity(si->smu)->name, m, CURRTIME, 0);
 
 		/* Create a linked list node and add to memos */
 		n = mowgli_node_create();
@@ -159,7 +142,7 @@ static void ms_cmd_send(sourceinfo_t *si, int parc, char *parv[])
 		/* Should we email this? */
 	        if (tmu->flags & MU_EMAILMEMOS)
 		{
-			sendemail(si->su, tmu, EMAIL_MEMO, tmu->email, memo->text);
+			sendemail(si->su, tmu, EMAIL_MEMO, tmu->email, m);
 	        }
 
 		/* Note: do not disclose other nicks they're logged in with
@@ -6,6 +6,7 @@
  */
 
 #include "atheme.h"
+#include "memoserv.h"
 
 DECLARE_MODULE_V1
 (
@@ -18,12 +19,12 @@ static void ms_cmd_sendall(sourceinfo_t *si, int parc, char *parv[]);
 
 command_t ms_sendall = { "SENDALL", N_("Sends a memo to all accounts."),
                          PRIV_ADMIN, 1, ms_cmd_sendall, { .path = "memoserv/sendall" } };
-static unsigned int *maxmemos;
 
 void _modinit(module_t *m)
 {
+	use_memoserv_main_symbols(m);
+
         service_named_bind_command("memoserv", &ms_sendall);
-        MODULE_TRY_REQUEST_SYMBOL(m, maxmemos, "memoserv/main", "maxmemos");
 }
 
 void _moddeinit(module_unload_intent_t intent)
@@ -35,11 +36,9 @@ static void ms_cmd_sendall(sourceinfo_t *si, int parc, char *parv[])
 {
 	/* misc structs etc */
 	myentity_t *mt;
-	mowgli_node_t *n;
-	mymemo_t *memo;
-	int sent = 0, tried = 0;
-	bool ignored;
-	service_t *memoserv;
+	myuser_t **targets;
+	unsigned int count = 0, sent;
+	job_t *job;
 	myentity_iteration_state_t state;
 
 	/* Grab args */
@@ -93,75 +92,25 @@ static void ms_cmd_sendall(sourceinfo_t *si, int parc, char *parv[])
 	si->smu->memo_ratelimit_num++;
 	si->smu->memo_ratelimit_time = CURRTIME;
 
+	targets = smalloc(cnt.myuser * sizeof *targets);
+
 	MYENTITY_FOREACH_T(mt, &state, ENT_USER)
 	{
 		myuser_t *tmu = user(mt);
 
-		if (tmu == si->smu)
-			continue;
-
-		tried++;
-
-		/* Does the user allow memos? --pfish */
-		if (tmu->flags & MU_NOMEMO)
-			continue;
-
-		/* Check to make sure target inbox not full */
-		if (tmu->memos.count >= *maxmemos)
-			continue;
-
-		/* As in SEND to a single user, make ignore fail silently */
-		sent++;
-
-		/* Make sure we're not on ignore */
-		ignored = false;
-		MOWGLI_ITER_FOREACH(n, tmu->memo_ignores.head)
-		{
-			mynick_t *mn;
-			myuser_t *mu;
-
-			if (nicksvs.no_nick_ownership)
-				mu = myuser_find((const char *)n->data);
-			else
-			{
-				mn = mynick_find((const char *)n->data);
-				mu = mn != NULL ? mn->owner : NULL;
-			}
-			if (mu == si->smu)
-				ignored = true;
-		}
-		if (ignored)
-			continue;
-
-		/* Malloc and populate struct */
-		memo = smalloc(sizeof(mymemo_t));
-		memo->sent = CURRTIME;
-		memo->status = MEMO_CHANNEL;
-		mowgli_strlcpy(memo->sender,entity(si->smu)->name,NICKLEN);
-		mowgli_strlcpy(memo->text, m, MEMOLEN);
-
-		/* Create a linked list node and add to memos */
-		n = mowgli_node_create();
-		mowgli_node_add(memo, n, &tmu->memos);
-		tmu->memoct_new++;
-
-		/* Should we email this? */
-		if (tmu->flags & MU_EMAILMEMOS)
-		{
-			sendemail(si->su, tmu, EMAIL_MEMO, tmu->email, memo->text);
-		}
-
-		memoserv = service_find("memoserv");
-		if (memoserv == NULL)
-			memoserv = si->service;
-
-		/* Is the user online? If so, tell them about the new memo. */
-		if (si->su == NULL || !irccasecmp(si->su->nick, entity(si->smu)->name))
-			myuser_notice(memoserv->nick, tmu, "You have a new memo from %s (%zu).", entity(si->smu)->name, MOWGLI_LIST_LENGTH(&tmu->memos));
-		else
-			myuser_notice(memoserv->nick, tmu, "You have a new memo from %s (nick: %s) (%zu).", entity(si->smu)->name, si->su->nick, MOWGLI_LIST_LENGTH(&tmu->memos));
-		myuser_notice(memoserv->nick, tmu, _("To read it, type /%s%s READ %zu"),
-					ircd->uses_rcommand ? "" : "msg ", memoserv->disp, MOWGLI_LIST_LENGTH(&tmu->memos));
+		if (tmu != si->smu)
+			targets[count++] = tmu;
+	}
+
+	job = memo_fanout(si, "SENDALL", "accounts", m, targets, count, &sent);
+	free(targets);
+
+	if (job != NULL)
+	{
+		command_add_flood(si, FLOOD_HEAVY);
+		logcommand(si, CMDLOG_ADMIN, "SENDALL: \2%s\2 (%u accounts, job %u)", m, count, job->id);
+		command_success_nodata(si, _("The memo is being sent to %u accounts as job %u; you will be told when it is done."), count, job->id);
+		return;
 	}
 
 	/* Tell user memo sent, return */
@@ -169,8 +118,8 @@ static void ms_cmd_sendall(sourceinfo_t *si, int parc, char *parv[])
 		command_add_flood(si, FLOOD_HEAVY);
 	else if (sent > 1)
 		command_add_flood(si, FLOOD_MODERATE);
-	logcommand(si, CMDLOG_ADMIN, "SENDALL: \2%s\2 (%d/%d sent)", m, sent, tried);
-	command_success_nodata(si, _("The memo has been successfully sent to %d accounts."), sent);
+	logcommand(si, CMDLOG_ADMIN, "SENDALL: \2%s\2 (%u/%u sent)", m, sent, count);
+	command_success_nodata(si, _("The memo has been successfully sent to %u accounts."), sent);
 	return;
 }
 
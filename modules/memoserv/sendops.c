@@ -7,6 +7,7 @@
  */
 
 #include "atheme.h"
+#include "memoserv.h"
 
 DECLARE_MODULE_V1
 (
@@ -19,12 +20,12 @@ static void ms_cmd_sendops(sourceinfo_t *si, int parc, char *parv[]);
 
 command_t ms_sendops = { "SENDOPS", N_("Sends a memo to all ops on a channel."),
                           AC_AUTHENTICATED, 2, ms_cmd_sendops, { .path = "memoserv/sendops" } };
-static unsigned int *maxmemos;
 
 void _modinit(module_t *m)
 {
+	use_memoserv_main_symbols(m);
+
         service_named_bind_command("memoserv", &ms_sendops);
-        MODULE_TRY_REQUEST_SYMBOL(m, maxmemos, "memoserv/main", "maxmemos");
 }
 
 void _moddeinit(module_unload_intent_t intent)
@@ -35,13 +36,13 @@ void _moddeinit(module_unload_intent_t intent)
 static void ms_cmd_sendops(sourceinfo_t *si, int parc, char *parv[])
 {
 	/* misc structs etc */
-	myuser_t *tmu;
-	mowgli_node_t *n, *tn;
-	mymemo_t *memo;
+	myuser_t *tmu, **targets;
+	mowgli_node_t *tn;
 	mychan_t *mc;
-	int sent = 0, tried = 0;
-	bool ignored, operoverride = false;
-	service_t *memoserv;
+	unsigned int count = 0, sent;
+	bool operoverride = false;
+	job_t *job;
+	char text[MEMOLEN], what[BUFSIZE];
 
 	/* Grab args */
 	char *target = parv[0];
@@ -108,6 +109,10 @@ static void ms_cmd_sendops(sourceinfo_t *si, int parc, char *parv[])
 	si->smu->memo_ratelimit_num++;
 	si->smu->memo_ratelimit_time = CURRTIME;
 
+	snprintf(text, sizeof text, "%s %s", mc->name, m);
+
+	targets = smalloc(MOWGLI_LIST_LENGTH(&mc->chanacs) * sizeof *targets);
+
 	MOWGLI_ITER_FOREACH(tn, mc->chanacs.head)
 	{
 		chanacs_t *ca = (chanacs_t *) tn->data;
@@ -116,68 +121,22 @@ static void ms_cmd_sendops(sourceinfo_t *si, int parc, char *parv[])
 		if (!(ca->level & (CA_OP | CA_AUTOOP)) || tmu == NULL || tmu == si->smu)
 			continue;
 
-		tried++;
-
-		/* Does the user allow memos? --pfish */
-		if (tmu->flags & MU_NOMEMO)
-			continue;
-
-		/* Check to make sure target inbox not full */
-		if (tmu->memos.count >= *maxmemos)
-			continue;
-
-		/* As in SEND to a single user, make ignore fail silently */
-		sent++;
-
-		/* Make sure we're not on ignore */
-		ignored = false;
-		MOWGLI_ITER_FOREACH(n, tmu->memo_ignores.head)
-		{
-			mynick_t *mn;
-			myuser_t *mu;
-
-			if (nicksvs.no_nick_ownership)
-				mu = myuser_find((const char *)n->data);
-			else
-			{
-				mn = mynick_find((const char *)n->data);
-				mu = mn != NULL ? mn->owner : NULL;
-			}
-			if (mu == si->smu)
-				ignored = true;
-		}
-		if (ignored)
-			continue;
-
-		/* Malloc and populate struct */
-		memo = smalloc(sizeof(mymemo_t));
-		memo->sent = CURRTIME;
-		memo->status = MEMO_CHANNEL;
-		mowgli_strlcpy(memo->sender,entity(si->smu)->name,NICKLEN);
-		snprintf(memo->text, MEMOLEN, "%s %s", mc->name, m);
-
-		/* Create a linked list node and add to memos */
-		n = mowgli_node_create();
-		mowgli_node_add(memo, n, &tmu->memos);
-		tmu->memoct_new++;
-
-		/* Should we email this? */
-		if (tmu->flags & MU_EMAILMEMOS)
-		{
-			sendemail(si->su, tmu, EMAIL_MEMO, tmu->email, memo->text);
-		}
+		targets[count++] = tmu;
+	}
 
-		memoserv = service_find("memoserv");
-		if (memoserv == NULL)
-			memoserv = si->service;
+	snprintf(what, sizeof what, "ops on \2%s\2", mc->name);
+	job = memo_fanout(si, "SENDOPS", what, text, targets, count, &sent);
+	free(targets);
 
-		/* Is the user online? If so, tell them about the new memo. */
-		if (si->su == NULL || !irccasecmp(si->su->nick, entity(si->smu)->name))
-			myuser_notice(memoserv->nick, tmu, "You have a new memo from %s (%zu).", entity(si->smu)->name, MOWGLI_LIST_LENGTH(&tmu->memos));
+	if (job != NULL)
+	{
+		command_add_flood(si, FLOOD_HEAVY);
+		if (operoverride)
+			logcommand(si, CMDLOG_ADMIN, "SENDOPS: to \2%s\2 (%u accounts, job %u) (oper override)", mc->name, count, job->id);
 		else
-			myuser_notice(memoserv->nick, tmu, "You have a new memo from %s (nick: %s) (%zu).", entity(si->smu)->name, si->su->nick, MOWGLI_LIST_LENGTH(&tmu->memos));
-		myuser_notice(memoserv->nick, tmu, _("To read it, type /%s%s READ %zu"),
-					ircd->uses_rcommand ? "" : "msg ", memoserv->disp, MOWGLI_LIST_LENGTH(&tmu->memos));
+			logcommand(si, CMDLOG_SET, "SENDOPS: to \2%s\2 (%u accounts, job %u)", mc->name, count, job->id);
+		command_success_nodata(si, _("The memo is being sent to %u ops on \2%s\2 as job %u; you will be told when it is done."), count, mc->name, job->id);
+		return;
 	}
 
 	/* Tell user memo sent, return */
@@ -186,10 +145,10 @@ static void ms_cmd_sendops(sourceinfo_t *si, int parc, char *parv[])
 	else if (sent > 1)
 		command_add_flood(si, FLOOD_MODERATE);
 	if (operoverride)
-		logcommand(si, CMDLOG_ADMIN, "SENDOPS: to \2%s\2 (%d/%d sent) (oper override)", mc->name, sent, tried);
+		logcommand(si, CMDLOG_ADMIN, "SENDOPS: to \2%s\2 (%u/%u sent) (oper override)", mc->name, sent, count);
 	else
-		logcommand(si, CMDLOG_SET, "SENDOPS: to \2%s\2 (%d/%d sent)", mc->name, sent, tried);
-	command_success_nodata(si, _("The memo has been successfully sent to %d ops on \2%s\2."), sent, mc->name);
+		logcommand(si, CMDLOG_SET, "SENDOPS: to \2%s\2 (%u/%u sent)", mc->name, sent, count);
+	command_success_nodata(si, _("The memo has been successfully sent to %u ops on \2%s\2."), sent, mc->name);
 	return;
 }
 
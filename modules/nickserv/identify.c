@@ -25,6 +25,19 @@ DECLARE_MODULE_V1
 );
 
 static void ns_cmd_login(sourceinfo_t *si, int parc, char *parv[]);
+static void ns_login_verified(myuser_t *mu, bool verified, void *priv);
+static void ns_login_result(sourceinfo_t *si, myuser_t *mu, bool verified);
+static void ns_login_user_delete(user_t *u);
+
+/* an IDENTIFY waiting for its password to be checked */
+typedef struct {
+	sourceinfo_t *si;
+	char *target;
+	verify_request_t *req;
+	mowgli_node_t node;
+} login_pending_t;
+
+static mowgli_list_t pending_logins;
 
 #ifdef NICKSERV_LOGIN
 command_t ns_login = { "LOGIN", N_("Authenticates to a services account."), AC_NONE, 2, ns_cmd_login, { .path = "nickserv/login" } };
@@ -34,6 +47,9 @@ command_t ns_identify = { "IDENTIFY", N_("Identifies to services for a nickname.
 
 void _modinit(module_t *m)
 {
+	hook_add_event("user_delete");
+	hook_add_user_delete(ns_login_user_delete);
+
 #ifdef NICKSERV_LOGIN
 	service_named_bind_command("nickserv", &ns_login);
 #else
@@ -41,8 +57,28 @@ void _modinit(module_t *m)
 #endif
 }
 
+static void login_pending_free(login_pending_t *lp)
+{
+	object_unref(lp->si);
+	free(lp->target);
+	free(lp);
+}
+
 void _moddeinit(module_unload_intent_t intent)
 {
+	mowgli_node_t *n, *tn;
+
+	MOWGLI_ITER_FOREACH_SAFE(n, tn, pending_logins.head)
+	{
+		login_pending_t *lp = n->data;
+
+		verify_password_cancel(lp->req);
+		mowgli_node_delete(&lp->node, &pending_logins);
+		login_pending_free(lp);
+	}
+
+	hook_del_user_delete(ns_login_user_delete);
+
 #ifdef NICKSERV_LOGIN
 	service_named_unbind_command("nickserv", &ns_login);
 #else
@@ -54,10 +90,9 @@ static void ns_cmd_login(sourceinfo_t *si, int parc, char *parv[])
 {
 	user_t *u = si->su;
 	myuser_t *mu;
-	mowgli_node_t *n, *tn;
+	login_pending_t *lp;
 	const char *target = parv[0];
 	const char *password = parv[1];
-	char lau[BUFSIZE];
 
 	if (si->su == NULL)
 	{
@@ -114,7 +149,67 @@ static void ns_cmd_login(sourceinfo_t *si, int parc, char *parv[])
 		return;
 	}
 
-	if (verify_password(mu, password))
+	lp = smalloc(sizeof *lp);
+	lp->req = verify_password_async(mu, password, ns_login_verified, lp);
+	if (lp->req == NULL)
+	{
+		free(lp);
+		ns_login_result(si, mu, verify_password(mu, password));
+		return;
+	}
+
+	lp->si = object_ref(si);
+	lp->target = sstrdup(entity(mu)->name);
+	mowgli_node_add(lp, &lp->node, &pending_logins);
+}
+
+static void ns_login_verified(myuser_t *mu, bool verified, void *priv)
+{
+	login_pending_t *lp = priv;
+	sourceinfo_t *si = lp->si;
+	user_t *u = si->su;
+
+	/* logging in may kill the user; don't let our user_delete hook see us */
+	mowgli_node_delete(&lp->node, &pending_logins);
+
+	/* things may have changed while the password was being checked */
+	si->smu = u->myuser;
+
+	if (mu == NULL)
+		command_fail(si, fault_nosuch_target, _("\2%s\2 is not a registered nickname."), lp->target);
+	else if (u->myuser == mu)
+		command_fail(si, fault_nochange, _("You are already logged in as \2%s\2."), entity(u->myuser)->name);
+	else
+		ns_login_result(si, mu, verified);
+
+	login_pending_free(lp);
+}
+
+/* the user quit; forget about their IDENTIFY */
+static void ns_login_user_delete(user_t *u)
+{
+	mowgli_node_t *n, *tn;
+
+	MOWGLI_ITER_FOREACH_SAFE(n, tn, pending_logins.head)
+	{
+		login_pending_t *lp = n->data;
+
+		if (lp->si->su != u)
+			continue;
+
+		verify_password_cancel(lp->req);
+		mowgli_node_delete(&lp->node, &pending_logins);
+		login_pending_free(lp);
+	}
+}
+
+static void ns_login_result(sourceinfo_t *si, myuser_t *mu, bool verified)
+{
+	user_t *u = si->su;
+	mowgli_node_t *n, *tn;
+	char lau[BUFSIZE];
+
+	if (verified)
 	{
 		if (MOWGLI_LIST_LENGTH(&mu->logins) >= me.maxlogins)
 		{
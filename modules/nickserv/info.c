@@ -43,7 +43,7 @@ static void ns_cmd_info(sourceinfo_t *si, int parc, char *parv[])
 	struct tm tm, tm2;
 	metadata_t *md;
 	mowgli_node_t *n;
-	mowgli_patricia_iteration_state_t state;
+	metadata_iteration_state_t state;
 	const char *vhost;
 	const char *vhost_timestring;
 	const char *vhost_assigner;
@@ -285,7 +285,7 @@ static void ns_cmd_info(sourceinfo_t *si, int parc, char *parv[])
 		command_success_nodata(si, _("Email      : %s%s"), mu->email,
 					(mu->flags & MU_HIDEMAIL) ? " (hidden)": "");
 
-	MOWGLI_PATRICIA_FOREACH(md, &state, object(mu)->metadata)
+	METADATA_FOREACH(md, &state, mu)
 	{
 		if (!strncmp(md->name, "private:", 8))
 			continue;
@@ -42,7 +42,7 @@ static void ns_cmd_set_property(sourceinfo_t *si, int parc, char *parv[])
 	char *value = strtok(NULL, "");
 	bool changed;
 	unsigned int count;
-	mowgli_patricia_iteration_state_t state;
+	metadata_iteration_state_t state;
 	metadata_t *md;
 	hook_metadata_change_t mdchange;
 
@@ -83,7 +83,7 @@ static void ns_cmd_set_property(sourceinfo_t *si, int parc, char *parv[])
 	}
 
 	count = 0;
-	MOWGLI_PATRICIA_FOREACH(md, &state, object(si->smu)->metadata)
+	METADATA_FOREACH(md, &state, si->smu)
 	{
 		if (strncmp(md->name, "private:", 8))
 			count++;
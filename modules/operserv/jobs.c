@@ -0,0 +1,103 @@
+/*
+ * Copyright (c) 2014- Shaltúre project (http://github.com/shalture)
+ * Rights to this code are as documented in doc/LICENSE.
+ *
+ * This file contains code for OS JOBS
+ *
+ */
+
+#include "atheme.h"
+
+DECLARE_MODULE_V1
+(
+	"operserv/jobs", false, _modinit, _moddeinit,
+	PACKAGE_STRING,
+	"Shaltúre developers <https://github.com/shalture>"
+);
+
+static void os_cmd_jobs(sourceinfo_t *si, int parc, char *parv[]);
+
+command_t os_jobs = { "JOBS", N_("Shows or cancels jobs running in the background."), PRIV_SERVER_AUSPEX, 2, os_cmd_jobs, { .path = "oservice/jobs" } };
+
+void _modinit(module_t *m)
+{
+	service_named_bind_command("operserv", &os_jobs);
+}
+
+void _moddeinit(module_unload_intent_t intent)
+{
+	service_named_unbind_command("operserv", &os_jobs);
+}
+
+static void os_cmd_jobs_list(sourceinfo_t *si)
+{
+	mowgli_node_t *n;
+	job_t *job;
+
+	MOWGLI_ITER_FOREACH(n, jobs.head)
+	{
+		job = n->data;
+
+		command_success_nodata(si, _("%u: %s by %s, %u/%u done (%u%%), running for %s"),
+				job->id, job->name, job->owner, job->progress, job->total,
+				job->total != 0 ? (unsigned int)((unsigned long long)job->progress * 100 / job->total) : 100,
+				timediff(CURRTIME - job->started));
+	}
+
+	command_success_nodata(si, ngettext(N_("%zu job running."), N_("%zu jobs running."),
+				MOWGLI_LIST_LENGTH(&jobs)), MOWGLI_LIST_LENGTH(&jobs));
+	logcommand(si, CMDLOG_GET, "JOBS");
+}
+
+static void os_cmd_jobs_cancel(sourceinfo_t *si, const char *arg)
+{
+	job_t *job;
+	char *end;
+	unsigned long id;
+
+	if (!has_priv(si, PRIV_ADMIN))
+	{
+		command_fail(si, fault_noprivs, STR_NO_PRIVILEGE, PRIV_ADMIN);
+		return;
+	}
+
+	if (arg == NULL)
+	{
+		command_fail(si, fault_needmoreparams, STR_INSUFFICIENT_PARAMS, "JOBS CANCEL");
+		command_fail(si, fault_needmoreparams, _("Syntax: JOBS CANCEL <id>"));
+		return;
+	}
+
+	id = strtoul(arg, &end, 10);
+	if (*end != '\0' || id == 0 || id > UINT_MAX || (job = job_find(id)) == NULL)
+	{
+		command_fail(si, fault_nosuch_target, _("There is no job \2%s\2."), arg);
+		return;
+	}
+
+	logcommand(si, CMDLOG_ADMIN, "JOBS:CANCEL: \2%u\2 (%s by %s, %u/%u done)",
+			job->id, job->name, job->owner, job->progress, job->total);
+	command_success_nodata(si, _("Job \2%u\2 (%s by %s) has been cancelled after %u of %u steps."),
+			job->id, job->name, job->owner, job->progress, job->total);
+
+	job_cancel(job);
+}
+
+static void os_cmd_jobs(sourceinfo_t *si, int parc, char *parv[])
+{
+	if (parc == 0 || !strcasecmp(parv[0], "LIST"))
+		os_cmd_jobs_list(si);
+	else if (!strcasecmp(parv[0], "CANCEL"))
+		os_cmd_jobs_cancel(si, parc > 1 ? parv[1] : NULL);
+	else
+	{
+		command_fail(si, fault_badparams, STR_INVALID_PARAMS, "JOBS");
+		command_fail(si, fault_badparams, _("Syntax: JOBS [LIST|CANCEL <id>]"));
+	}
+}
+
+/* vim:cinoptions=>s,e0,n0,f0,{0,}0,^0,=s,ps,t0,c3,+s,(2s,us,)20,*30,gs,hs
+ * vim:ts=8
+ * vim:sw=8
+ * vim:noexpandtab
+ */
@@ -15,6 +15,10 @@ DECLARE_MODULE_V1
 	"Shaltúre developers <https://github.com/shalture>"
 );
 
+static void rwatch_matcher_build(void);
+static void rwatch_matcher_free(void);
+static unsigned int rwatch_match(const char *mask, const char *oldmask);
+
 static void rwatch_newuser(hook_user_nick_t *data);
 static void rwatch_nickchange(hook_user_nick_t *data);
 
@@ -23,6 +27,7 @@ static void os_cmd_rwatch_list(sourceinfo_t *si, int parc, char *parv[]);
 static void os_cmd_rwatch_add(sourceinfo_t *si, int parc, char *parv[]);
 static void os_cmd_rwatch_del(sourceinfo_t *si, int parc, char *parv[]);
 static void os_cmd_rwatch_set(sourceinfo_t *si, int parc, char *parv[]);
+static void os_cmd_rwatch_stats(sourceinfo_t *si, int parc, char *parv[]);
 
 static void write_rwatchdb(database_handle_t *db);
 static void load_rwatchdb(char *path);
@@ -45,8 +50,53 @@ struct rwatch_
 	char *reason;
 	int actions; /* RWACT_* */
 	atheme_regex_t *re;
+
+	/* filled in by rwatch_matcher_build() */
+	unsigned int id;
+	char *literal; /* every match contains this, or NULL */
+	size_t literal_len;
+	rwatch_t *next_out;
+
+	unsigned long hits;
+	unsigned long runs;
+	unsigned long long nsec;
 };
 
+/*
+ * All watches are checked together: an Aho-Corasick automaton over a
+ * literal substring taken from each regex finds, in one pass over the
+ * mask, which watches can possibly match. Only those regexes (and the
+ * ones without a usable literal) are run. The automaton is rebuilt on
+ * the first match after the list changes.
+ */
+#define RWATCH_MIN_LITERAL	3
+
+#define RWCAND_NEW		1
+#define RWCAND_OLD		2
+
+#define RWLOWER(c)		((c) >= 'A' && (c) <= 'Z' ? (c) + ('a' - 'A') : (c))
+
+static struct
+{
+	bool dirty;
+
+	unsigned int nwatches;
+	rwatch_t **watches; /* in list order */
+	unsigned char *cand; /* RWCAND_* */
+	bool *matched;
+
+	unsigned int map[256]; /* byte -> symbol, 0 is "not in any literal" */
+	unsigned int nsymbols;
+	unsigned int nstates;
+	unsigned int *next; /* nstates * nsymbols */
+	unsigned int *dict; /* next state on the fail chain with output */
+	rwatch_t **out;
+
+	unsigned long masks;
+	unsigned long skipped;
+	unsigned long long nsec;
+} matcher = { .dirty = true };
+
 service_t *serviceinfo;
 
 command_t os_rwatch = { "RWATCH", N_("Performs actions on connecting clients matching regexes."), PRIV_USER_AUSPEX, 2, os_cmd_rwatch, { .path = "oservice/rwatch" } };
@@ -55,6 +105,7 @@ command_t os_rwatch_add = { "ADD", N_("Adds an entry to the regex watch list."),
 command_t os_rwatch_del = { "DEL", N_("Removes an entry from the regex watch list."), AC_NONE, 1, os_cmd_rwatch_del, { .path = "" } };
 command_t os_rwatch_list = { "LIST", N_("Displays the regex watch list."), AC_NONE, 1, os_cmd_rwatch_list, { .path = "" } };
 command_t os_rwatch_set = { "SET", N_("Changes actions on an entry in the regex watch list."), AC_NONE, 1, os_cmd_rwatch_set, { .path = "" } };
+command_t os_rwatch_stats = { "STATS", N_("Shows match counts and times for the regex watch list."), AC_NONE, 1, os_cmd_rwatch_stats, { .path = "" } };
 
 rwatch_t *rwread = NULL;
 FILE *f;
@@ -69,6 +120,7 @@ void _modinit(module_t *m)
 	command_add(&os_rwatch_del, os_rwatch_cmds);
 	command_add(&os_rwatch_list, os_rwatch_cmds);
 	command_add(&os_rwatch_set, os_rwatch_cmds);
+	command_add(&os_rwatch_stats, os_rwatch_cmds);
 
 	hook_add_event("user_add");
 	hook_add_user_add(rwatch_newuser);
@@ -104,6 +156,7 @@ void _moddeinit(module_unload_intent_t intent)
 
 		free(rw->regex);
 		free(rw->reason);
+		free(rw->literal);
 		if (rw->re != NULL)
 			regex_destroy(rw->re);
 		free(rw);
@@ -112,12 +165,15 @@ void _moddeinit(module_unload_intent_t intent)
 		mowgli_node_free(n);
 	}
 
+	rwatch_matcher_free();
+
 	service_named_unbind_command("operserv", &os_rwatch);
 
 	command_delete(&os_rwatch_add, os_rwatch_cmds);
 	command_delete(&os_rwatch_del, os_rwatch_cmds);
 	command_delete(&os_rwatch_list, os_rwatch_cmds);
 	command_delete(&os_rwatch_set, os_rwatch_cmds);
+	command_delete(&os_rwatch_stats, os_rwatch_cmds);
 
 	hook_del_user_add(rwatch_newuser);
 	hook_del_user_nickchange(rwatch_nickchange);
@@ -193,6 +249,7 @@ static void load_rwatchdb(char *path)
 				rw->actions = atoi(actionstr);
 				rw->reason = sstrdup(reason);
 				mowgli_node_add(rw, mowgli_node_create(), &rwatch_list);
+				matcher.dirty = true;
 				rw = NULL;
 			}
 		}
@@ -239,6 +296,7 @@ static void db_h_rr(database_handle_t *db, const char *type)
 	rwread->actions = actions;
 	rwread->reason = sstrdup(reason);
 	mowgli_node_add(rwread, mowgli_node_create(), &rwatch_list);
+	matcher.dirty = true;
 	rwread = NULL;
 }
 
@@ -252,7 +310,7 @@ static void os_cmd_rwatch(sourceinfo_t *si, int parc, char *parv[])
 	if (!cmd)
 	{
 		command_fail(si, fault_needmoreparams, STR_INSUFFICIENT_PARAMS, "RWATCH");
-		command_fail(si, fault_needmoreparams, _("Syntax: RWATCH ADD|DEL|LIST|SET"));
+		command_fail(si, fault_needmoreparams, _("Syntax: RWATCH ADD|DEL|LIST|SET|STATS"));
 		return;
 	}
 
@@ -319,7 +377,7 @@ static void os_cmd_rwatch_add(sourceinfo_t *si, int parc, char *parv[])
 		return;
 	}
 
-	rw = malloc(sizeof(rwatch_t));
+	rw = smalloc(sizeof(rwatch_t));
 	rw->regex = sstrdup(pattern);
 	rw->reflags = flags;
 	rw->reason = sstrdup(reason);
@@ -327,6 +385,7 @@ static void os_cmd_rwatch_add(sourceinfo_t *si, int parc, char *parv[])
 	rw->re = regex;
 
 	mowgli_node_add(rw, mowgli_node_create(), &rwatch_list);
+	matcher.dirty = true;
 	command_success_nodata(si, _("Added \2%s\2 to regex watch list."), pattern);
 	logcommand(si, CMDLOG_ADMIN, "RWATCH:ADD: \2%s\2 (reason: \2%s\2)", pattern, reason);
 }
@@ -379,11 +438,13 @@ static void os_cmd_rwatch_del(sourceinfo_t *si, int parc, char *parv[])
 			}
 			free(rw->regex);
 			free(rw->reason);
+			free(rw->literal);
 			if (rw->re != NULL)
 				regex_destroy(rw->re);
 			free(rw);
 			mowgli_node_delete(n, &rwatch_list);
 			mowgli_node_free(n);
+			matcher.dirty = true;
 			command_success_nodata(si, _("Removed \2%s\2 from regex watch list."), pattern);
 			logcommand(si, CMDLOG_ADMIN, "RWATCH:DEL: \2%s\2", pattern);
 			return;
@@ -517,11 +578,394 @@ static void os_cmd_rwatch_set(sourceinfo_t *si, int parc, char *parv[])
 	command_fail(si, fault_nosuch_target, _("\2%s\2 not found in regex watch list."), pattern);
 }
 
+static void os_cmd_rwatch_stats(sourceinfo_t *si, int parc, char *parv[])
+{
+	unsigned int i;
+	rwatch_t *rw;
+
+	if (matcher.dirty)
+		rwatch_matcher_build();
+
+	for (i = 0; i < matcher.nwatches; i++)
+	{
+		rw = matcher.watches[i];
+
+		command_success_nodata(si, _("%s (%s%s) - %lu hits, %lu runs, %llu.%03llu ms, prefilter %s"),
+				rw->regex,
+				rw->reflags & AREGEX_ICASE ? "i" : "",
+				rw->reflags & AREGEX_PCRE ? "p" : "",
+				rw->hits, rw->runs,
+				rw->nsec / 1000000, rw->nsec / 1000 % 1000,
+				rw->literal != NULL ? rw->literal : _("(none)"));
+	}
+
+	command_success_nodata(si, _("%lu masks checked in %llu.%03llu ms, %lu regex runs skipped by the prefilter"),
+			matcher.masks, matcher.nsec / 1000000, matcher.nsec / 1000 % 1000,
+			matcher.skipped);
+	command_success_nodata(si, _("End of RWATCH STATS"));
+	logcommand(si, CMDLOG_GET, "RWATCH:STATS");
+}
+
+static void rwatch_literal_drop(char *run, size_t *runlen)
+{
+	/* a quantifier may apply to a whole multibyte character */
+	if (*runlen > 0 && (unsigned char)run[*runlen - 1] < 0x80)
+	{
+		(*runlen)--;
+		return;
+	}
+	while (*runlen > 0 && (unsigned char)run[*runlen - 1] >= 0x80)
+		(*runlen)--;
+}
+
+/*
+ * Finds the longest run of plain characters that every match of the
+ * pattern must contain. Anything not understood ends the run (or, for
+ * escapes, the search), and a top-level alternation means there is no
+ * such run at all.
+ */
+static size_t rwatch_literal(const char *pattern, int reflags, char *best, size_t bestsize)
+{
+	char run[BUFSIZE];
+	size_t runlen = 0, bestlen = 0;
+	bool pcre = (reflags & AREGEX_PCRE) != 0;
+	bool icase = (reflags & AREGEX_ICASE) != 0;
+	bool tainted = false;
+	unsigned int depth = 0;
+	const char *p, *q;
+
+	/* inline options can change case sensitivity halfway through */
+	if (strstr(pattern, "(?") || strstr(pattern, "(*") || (pcre && strstr(pattern, "\\Q")))
+		return 0;
+
+	for (p = pattern; *p != '\0'; p++)
+	{
+		unsigned char c = *p;
+		bool literal = false;
+
+		switch (c)
+		{
+			case '\\':
+				/* classes, backreferences, \x escapes... */
+				if (p[1] == '\0' || isalnum((unsigned char)p[1]))
+				{
+					tainted = true;
+					break;
+				}
+				c = *++p;
+				literal = true;
+				break;
+			case '[':
+				p++;
+				if (*p == '^')
+					p++;
+				if (*p == ']')
+					p++;
+				while (*p != '\0' && *p != ']')
+				{
+					if (*p == '[' && (p[1] == ':' || p[1] == '.' || p[1] == '='))
+					{
+						for (q = p + 2; *q != '\0' && (q[0] != p[1] || q[1] != ']'); q++)
+							;
+						if (*q == '\0')
+							return 0;
+						p = q + 1;
+					}
+					else if (pcre && *p == '\\' && p[1] != '\0')
+						p++;
+					p++;
+				}
+				if (*p == '\0')
+					return 0;
+				break;
+			case '(':
+				depth++;
+				break;
+			case ')':
+				if (depth > 0)
+					depth--;
+				break;
+			case '|':
+				if (depth == 0)
+					return 0;
+				break;
+			case '*':
+			case '?':
+				rwatch_literal_drop(run, &runlen);
+				break;
+			case '{':
+				rwatch_literal_drop(run, &runlen);
+				for (q = p + 1; isdigit((unsigned char)*q) || *q == ','; q++)
+					;
+				if (*q == '}')
+					p = q;
+				else
+					tainted = true;
+				break;
+			case '+':
+			case '.':
+			case '^':
+			case '$':
+				break;
+			default:
+				literal = true;
+		}
+
+		if (literal && depth == 0 && !tainted && !(icase && c >= 0x80) && runlen < sizeof run - 1)
+		{
+			run[runlen++] = c;
+			continue;
+		}
+
+		if (runlen > bestlen && runlen < bestsize)
+		{
+			memcpy(best, run, runlen);
+			bestlen = runlen;
+		}
+		runlen = 0;
+	}
+
+	if (runlen > bestlen && runlen < bestsize)
+	{
+		memcpy(best, run, runlen);
+		bestlen = runlen;
+	}
+	best[bestlen] = '\0';
+
+	return bestlen;
+}
+
+static void rwatch_matcher_free(void)
+{
+	free(matcher.watches);
+	free(matcher.cand);
+	free(matcher.matched);
+	free(matcher.next);
+	free(matcher.dict);
+	free(matcher.out);
+
+	matcher.watches = NULL;
+	matcher.cand = NULL;
+	matcher.matched = NULL;
+	matcher.next = NULL;
+	matcher.dict = NULL;
+	matcher.out = NULL;
+	matcher.nwatches = 0;
+	matcher.nstates = 0;
+	memset(matcher.map, 0, sizeof matcher.map);
+	matcher.dirty = true;
+}
+
+static void rwatch_matcher_build(void)
+{
+	mowgli_node_t *n;
+	rwatch_t *rw;
+	unsigned int i, s, t, f, sym, nsym, maxstates, head, tail;
+	unsigned int *fail, *queue;
+	const char *p;
+	char buf[BUFSIZE];
+	size_t len;
+
+	rwatch_matcher_free();
+
+	matcher.watches = smalloc((MOWGLI_LIST_LENGTH(&rwatch_list) + 1) * sizeof(rwatch_t *));
+	nsym = 1;
+	maxstates = 1;
+
+	MOWGLI_ITER_FOREACH(n, rwatch_list.head)
+	{
+		rw = n->data;
+
+		free(rw->literal);
+		rw->literal = NULL;
+		rw->next_out = NULL;
+
+		if (rw->re == NULL)
+			continue;
+
+		rw->id = matcher.nwatches;
+		matcher.watches[matcher.nwatches++] = rw;
+
+		len = rwatch_literal(rw->regex, rw->reflags, buf, sizeof buf);
+		if (len < RWATCH_MIN_LITERAL)
+			continue;
+
+		rw->literal = sstrdup(buf);
+		rw->literal_len = len;
+		maxstates += len;
+
+		for (p = buf; *p != '\0'; p++)
+			if (matcher.map[RWLOWER((unsigned char)*p)] == 0)
+				matcher.map[RWLOWER((unsigned char)*p)] = nsym++;
+	}
+
+	matcher.cand = smalloc(matcher.nwatches + 1);
+	matcher.matched = smalloc((matcher.nwatches + 1) * sizeof(bool));
+
+	/* uppercase bytes share their lowercase symbol */
+	for (i = 'A'; i <= 'Z'; i++)
+		matcher.map[i] = matcher.map[RWLOWER(i)];
+
+	matcher.nsymbols = nsym;
+	matcher.next = smalloc(maxstates * nsym * sizeof(unsigned int));
+	matcher.dict = smalloc(maxstates * sizeof(unsigned int));
+	matcher.out = smalloc(maxstates * sizeof(rwatch_t *));
+	matcher.nstates = 1;
+
+	/* a trie of the literals, ignoring case */
+	for (i = 0; i < matcher.nwatches; i++)
+	{
+		rw = matcher.watches[i];
+		if (rw->literal == NULL)
+			continue;
+
+		s = 0;
+		for (p = rw->literal; *p != '\0'; p++)
+		{
+			sym = matcher.map[(unsigned char)*p];
+			t = matcher.next[s * nsym + sym];
+			if (t == 0)
+			{
+				t = matcher.nstates++;
+				matcher.next[s * nsym + sym] = t;
+			}
+			s = t;
+		}
+
+		rw->next_out = matcher.out[s];
+		matcher.out[s] = rw;
+	}
+
+	/*
+	 * Fill in the missing transitions from the fail links. Breadth-first,
+	 * so a state's fail state is always complete before it is used.
+	 */
+	fail = smalloc(matcher.nstates * sizeof(unsigned int));
+	queue = smalloc(matcher.nstates * sizeof(unsigned int));
+	head = tail = 0;
+
+	for (sym = 0; sym < nsym; sym++)
+		if ((t = matcher.next[sym]) != 0)
+			queue[tail++] = t;
+
+	while (head < tail)
+	{
+		s = queue[head++];
+
+		for (sym = 0; sym < nsym; sym++)
+		{
+			t = matcher.next[s * nsym + sym];
+			f = matcher.next[fail[s] * nsym + sym];
+
+			if (t == 0)
+			{
+				matcher.next[s * nsym + sym] = f;
+				continue;
+			}
+
+			fail[t] = f;
+			matcher.dict[t] = matcher.out[f] != NULL ? f : matcher.dict[f];
+			queue[tail++] = t;
+		}
+	}
+
+	free(fail);
+	free(queue);
+
+	matcher.dirty = false;
+
+	slog(LG_DEBUG, "rwatch_matcher_build(): %u watches, %u states, %u symbols",
+			matcher.nwatches, matcher.nstates, matcher.nsymbols);
+}
+
+/* marks the watches whose literal occurs in mask */
+static void rwatch_prefilter(const char *mask, unsigned char bit)
+{
+	const unsigned char *p;
+	unsigned int s = 0, t;
+	rwatch_t *rw;
+
+	if (matcher.nstates <= 1)
+		return;
+
+	for (p = (const unsigned char *)mask; *p != '\0'; p++)
+	{
+		s = matcher.next[s * matcher.nsymbols + matcher.map[*p]];
+
+		for (t = matcher.out[s] != NULL ? s : matcher.dict[s]; t != 0; t = matcher.dict[t])
+			for (rw = matcher.out[t]; rw != NULL; rw = rw->next_out)
+				if ((rw->reflags & AREGEX_ICASE) || !memcmp(p + 1 - rw->literal_len, rw->literal, rw->literal_len))
+					matcher.cand[rw->id] |= bit;
+	}
+}
+
+static bool rwatch_try(rwatch_t *rw, const char *mask)
+{
+	unsigned long long start = prof_now();
+	bool ret;
+
+	ret = regex_match(rw->re, (char *)mask);
+
+	rw->runs++;
+	rw->nsec += prof_now() - start;
+
+	return ret;
+}
+
+/*
+ * Sets matcher.matched[] for every watch that matches mask but (if given)
+ * not oldmask, and returns how many there are.
+ */
+static unsigned int rwatch_match(const char *mask, const char *oldmask)
+{
+	unsigned long long start = prof_now();
+	unsigned int i, count = 0;
+	rwatch_t *rw;
+
+	if (matcher.dirty)
+		rwatch_matcher_build();
+
+	for (i = 0; i < matcher.nwatches; i++)
+	{
+		matcher.cand[i] = matcher.watches[i]->literal != NULL ? 0 : RWCAND_NEW | RWCAND_OLD;
+		matcher.matched[i] = false;
+	}
+
+	rwatch_prefilter(mask, RWCAND_NEW);
+	if (oldmask != NULL)
+		rwatch_prefilter(oldmask, RWCAND_OLD);
+
+	for (i = 0; i < matcher.nwatches; i++)
+	{
+		rw = matcher.watches[i];
+
+		if (!(matcher.cand[i] & RWCAND_NEW))
+		{
+			matcher.skipped++;
+			continue;
+		}
+
+		if (!rwatch_try(rw, mask))
+			continue;
+		if (oldmask != NULL && (matcher.cand[i] & RWCAND_OLD) && rwatch_try(rw, oldmask))
+			continue;
+
+		matcher.matched[i] = true;
+		rw->hits++;
+		count++;
+	}
+
+	matcher.masks++;
+	matcher.nsec += prof_now() - start;
+
+	return count;
+}
+
 static void rwatch_newuser(hook_user_nick_t *data)
 {
 	user_t *u = data->u;
 	char usermask[NICKLEN+USERLEN+HOSTLEN+GECOSLEN];
-	mowgli_node_t *n;
+	unsigned int i;
 	rwatch_t *rw;
 
 	/* If the user has been killed, don't do anything. */
@@ -533,12 +977,13 @@ static void rwatch_newuser(hook_user_nick_t *data)
 
 	snprintf(usermask, sizeof usermask, "%s!%s@%s %s", u->nick, u->user, u->host, u->gecos);
 
-	MOWGLI_ITER_FOREACH(n, rwatch_list.head)
+	if (rwatch_match(usermask, NULL) == 0)
+		return;
+
+	for (i = 0; i < matcher.nwatches; i++)
 	{
-		rw = n->data;
-		if (!rw->re)
-			continue;
-		if (regex_match(rw->re, usermask))
+		rw = matcher.watches[i];
+		if (matcher.matched[i])
 		{
 			if (rw->actions & RWACT_SNOOP)
 			{
@@ -583,7 +1028,7 @@ static void rwatch_nickchange(hook_user_nick_t *data)
 	user_t *u = data->u;
 	char usermask[NICKLEN+USERLEN+HOSTLEN+GECOSLEN];
 	char oldusermask[NICKLEN+USERLEN+HOSTLEN+GECOSLEN];
-	mowgli_node_t *n;
+	unsigned int i;
 	rwatch_t *rw;
 
 	/* If the user has been killed, don't do anything. */
@@ -596,16 +1041,15 @@ static void rwatch_nickchange(hook_user_nick_t *data)
 	snprintf(usermask, sizeof usermask, "%s!%s@%s %s", u->nick, u->user, u->host, u->gecos);
 	snprintf(oldusermask, sizeof oldusermask, "%s!%s@%s %s", data->oldnick, u->user, u->host, u->gecos);
 
-	MOWGLI_ITER_FOREACH(n, rwatch_list.head)
+	/* Only process watches they did not match before. */
+	if (rwatch_match(usermask, oldusermask) == 0)
+		return;
+
+	for (i = 0; i < matcher.nwatches; i++)
 	{
-		rw = n->data;
-		if (!rw->re)
-			continue;
-		if (regex_match(rw->re, usermask))
+		rw = matcher.watches[i];
+		if (matcher.matched[i])
 		{
-			/* Only process if they did not match before. */
-			if (regex_match(rw->re, oldusermask))
-				continue;
 			if (rw->actions & RWACT_SNOOP)
 			{
 				slog(LG_INFO, "RWATCH:NICKCHANGE:%s \2%s\2 -> \2%s\2 matches \2%s\2 (reason: \2%s\2)",
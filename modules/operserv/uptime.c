@@ -31,6 +31,9 @@ void _moddeinit(module_unload_intent_t intent)
 
 static void os_cmd_uptime(sourceinfo_t *si, int parc, char *parv[])
 {
+	verify_stats_t vs;
+	mailqueue_stats_t ms;
+
 	logcommand(si, CMDLOG_GET, "UPTIME");
 
         command_success_nodata(si, "%s [%s] Build Date: %s", PACKAGE_STRING, revision, __DATE__);
@@ -41,6 +44,24 @@ static void os_cmd_uptime(sourceinfo_t *si, int parc, char *parv[])
         	command_success_nodata(si, _("Registered nicknames: %d"), cnt.mynick);
         command_success_nodata(si, _("Registered channels: %d"), cnt.mychan);
         command_success_nodata(si, _("Users currently online: %d"), cnt.user - me.me->users);
+
+	verify_password_stats(&vs);
+	if (vs.threads != 0 || vs.completed != 0)
+	{
+		command_success_nodata(si, _("Password checks: %u threads, %u queued, %u pending"),
+				vs.threads, vs.queued, vs.outstanding);
+		command_success_nodata(si, _("Password check latency: %lums average, %lums maximum over %u checks"),
+				vs.completed ? vs.total_usec / vs.completed / 1000 : 0, vs.max_usec / 1000, vs.completed);
+	}
+
+	mailqueue_stats(&ms);
+	if (me.mta != NULL)
+	{
+		command_success_nodata(si, _("Email queue: %u waiting, %u being delivered, %u delivered, %u retried, %u failed, %u timed out"),
+				ms.queued, ms.running, ms.delivered, ms.retried, ms.failed, ms.timedout);
+		command_success_nodata(si, _("Email latency: %lus average, %lus maximum"),
+				ms.delivered ? ms.total_sec / ms.delivered : 0, ms.max_sec);
+	}
 }
 
 /* vim:cinoptions=>s,e0,n0,f0,{0,}0,^0,=s,ps,t0,c3,+s,(2s,us,)20,*30,gs,hs
@@ -560,18 +560,17 @@ static void m_sjoin(sourceinfo_t *si, int parc, char *parv[])
 
 		userc = sjtoken(parv[parc - 1], ' ', userv);
 
-		if (keep_new_modes)
-			for (i = 0; i < userc; i++)
-				chanuser_add(c, userv[i]);
-		else
+		if (!keep_new_modes)
 			for (i = 0; i < userc; i++)
 			{
 				p = userv[i];
 				while (*p == '@' || *p == '%' || *p == '+')
 					p++;
-				chanuser_add(c, p);
+				userv[i] = p;
 			}
 
+		chanuser_add_batch(c, userv, userc);
+
 		if (c->nummembers == 0 && !(c->modes & ircd->perm_mode))
 			channel_delete(c);
 	}
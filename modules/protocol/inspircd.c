@@ -898,13 +898,12 @@ static void m_fjoin(sourceinfo_t *si, int parc, char *parv[])
 {
 	/* :08X FJOIN #flaps 1234 +nt vh,0F8XXXXN ,08XGH75C ,001CCCC3 aq,00ABBBB1 */
 	channel_t *c;
-	unsigned int userc;
+	unsigned int userc, nusers;
 	unsigned int i;
 	unsigned int nlen;
-	bool prefix = true;
 	bool keep_new_modes = true;
 	char *userv[256];
-	char prefixandnick[51];
+	char *p, *comma;
 	time_t ts;
 
 	c = channel_find(parv[0]);
@@ -970,53 +969,30 @@ static void m_fjoin(sourceinfo_t *si, int parc, char *parv[])
 		channel_mode(NULL, c, parc - 3, parv + 2);
 	}
 
-	/* loop over all the users in this fjoin */
-	for (i = 0; i < userc; i++)
+	/* loop over all the users in this fjoin, turning "vh,0F8XXXXN" into
+	 * "+%0F8XXXXN" in place (a prefix is never longer than its mode
+	 * letter), so they can all be added at once */
+	for (i = 0, nusers = 0; i < userc; i++)
 	{
-		nlen = 0;
-		prefix = true;
-
 		slog(LG_DEBUG, "m_fjoin(): processing user: %s", userv[i]);
 
-		/*
-		 * ok, now look at the chars in the nick.. we have something like "@%,w00t", but need @%w00t.. and
-		 * we also want to ignore unknown prefixes.. loop through the chars
-		 */
-		for (; *userv[i]; userv[i]++)
-		{
-			map_a_prefix(*userv[i], prefixandnick, &nlen);
-
-			/* it's not a known prefix char, have we reached the end of the prefixes? */
-			if (*userv[i] == ',')
-			{
-				/* yup, skip over the comma */
-				userv[i]++;
+		/* no comma, no user */
+		if ((comma = strchr(userv[i], ',')) == NULL)
+			continue;
 
-				/* if we're ignoring status (keep_new_modes is false) then just add them to chan here.. */
-				if (keep_new_modes == false)
-				{
-					/* This ignores the @%, and just adds 'w00t' to the chan */
-					chanuser_add(c, userv[i]);
-				}
-				else
-				{
-					/* else, we do care about their prefixes.. add '@%w00t' to the chan */
-					mowgli_strlcpy(prefixandnick + nlen, userv[i], sizeof(prefixandnick) - nlen);
-					chanuser_add(c, prefixandnick);
-				}
+		nlen = 0;
 
-				/* added them.. break out of this loop, which will move us to the next user */
-				break;
-			}
-			else
-			{
-				/* unknown prefix char */
-			}
-		}
+		/* if we're ignoring status (keep_new_modes is false) then just add them to chan */
+		if (keep_new_modes)
+			for (p = userv[i]; p < comma; p++)
+				map_a_prefix(*p, userv[i], &nlen);
 
-		/* go to the next user */
+		memmove(userv[i] + nlen, comma + 1, strlen(comma + 1) + 1);
+		userv[nusers++] = userv[i];
 	}
 
+	chanuser_add_batch(c, userv, nusers);
+
 	if (c->nummembers == 0 && !(c->modes & ircd->perm_mode))
 		channel_delete(c);
 }
@@ -1328,6 +1304,7 @@ static void m_fident(sourceinfo_t *si, int parc, char *parv[])
 {
 	strshare_unref(si->su->user);
 	si->su->user = strshare_get(parv[0]);
+	svsignore_invalidate(si->su);
 }
 
 static void m_fhost(sourceinfo_t *si, int parc, char *parv[])
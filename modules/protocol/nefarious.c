@@ -410,6 +410,7 @@ static void m_nick(sourceinfo_t *si, int parc, char *parv[])
 
 					strshare_unref(u->user);
 					u->user = strshare_get(userbuf);
+					svsignore_invalidate(u);
 				}
 				i++;
 			}
@@ -502,6 +503,7 @@ static void m_mode(sourceinfo_t *si, int parc, char *parv[])
 
 					strshare_unref(u->user);
 					u->user = strshare_get(userbuf);
+					svsignore_invalidate(u);
 				}
 				slog(LG_DEBUG, "m_mode(): user %s setting vhost %s@%s", u->nick, u->user, u->vhost);
 			}
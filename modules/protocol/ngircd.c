@@ -480,7 +480,6 @@ static void m_njoin(sourceinfo_t *si, int parc, char *parv[])
 	channel_t *c;
 	unsigned int userc;
 	char *userv[256];
-	unsigned int i;
 
 	c = channel_find(parv[0]);
 
@@ -502,8 +501,7 @@ static void m_njoin(sourceinfo_t *si, int parc, char *parv[])
 
 	userc = sjtoken(parv[parc - 1], ',', userv);
 
-	for (i = 0; i < userc; i++)
-		chanuser_add(c, userv[i]);
+	chanuser_add_batch(c, userv, userc);
 
 	if (c->nummembers == 0 && !(c->modes & ircd->perm_mode))
 		channel_delete(c);
@@ -482,7 +482,7 @@ static void m_burst(sourceinfo_t *si, int parc, char *parv[])
 	unsigned int i;
 	int j;
 	char prefix[16];
-	char newnick[16+NICKLEN];
+	char (*newnicks)[16+NICKLEN];
 	char *p;
 	time_t ts;
 	bool keep_new_modes = true;
@@ -561,6 +561,9 @@ static void m_burst(sourceinfo_t *si, int parc, char *parv[])
 		else
 		{
 			userc = sjtoken(parv[j++], ',', userv);
+			if (userc == 0)
+				continue;
+			newnicks = smalloc(userc * sizeof *newnicks);
 
 			prefix[0] = '\0';
 			for (i = 0; i < userc; i++)
@@ -583,10 +586,13 @@ static void m_burst(sourceinfo_t *si, int parc, char *parv[])
 							p++;
 						}
 				}
-				mowgli_strlcpy(newnick, prefix, sizeof newnick);
-				mowgli_strlcat(newnick, userv[i], sizeof newnick);
-				chanuser_add(c, newnick);
+				mowgli_strlcpy(newnicks[i], prefix, sizeof newnicks[i]);
+				mowgli_strlcat(newnicks[i], userv[i], sizeof newnicks[i]);
+				userv[i] = newnicks[i];
 			}
+
+			chanuser_add_batch(c, userv, userc);
+			free(newnicks);
 		}
 	}
 
@@ -759,10 +759,7 @@ static void m_sjoin(sourceinfo_t *si, int parc, char *parv[])
 
 	userc = sjtoken(parv[parc - 1], ' ', userv);
 
-	if (keep_new_modes)
-		for (i = 0; i < userc; i++)
-			chanuser_add(c, userv[i]);
-	else
+	if (!keep_new_modes)
 		for (i = 0; i < userc; i++)
 		{
 			p = userv[i];
@@ -771,9 +768,11 @@ static void m_sjoin(sourceinfo_t *si, int parc, char *parv[])
 			/* XXX for TS5 we should mark them deopped
 			 * if they were opped and drop modes from them
 			 * -- jilles */
-			chanuser_add(c, p);
+			userv[i] = p;
 		}
 
+	chanuser_add_batch(c, userv, userc);
+
 	if (c->nummembers == 0 && !(c->modes & ircd->perm_mode))
 		channel_delete(c);
 }
@@ -1268,6 +1267,7 @@ static void m_encap(sourceinfo_t *si, int parc, char *parv[])
 
 		strshare_unref(u->host);
 		u->host = strshare_get(parv[2]);
+		svsignore_invalidate(u);
 	}
 	else if (!irccasecmp(parv[1], "CHGHOST"))
 	{
@@ -1344,6 +1344,7 @@ static void m_signon(sourceinfo_t *si, int parc, char *parv[])
 	/* USER */
 	strshare_unref(u->user);
 	u->user = strshare_get(parv[1]);
+	svsignore_invalidate(u);
 
 	/* HOST */
 	strshare_unref(u->vhost);
@@ -873,7 +873,7 @@ static void m_sjoin(sourceinfo_t *si, int parc, char *parv[])
 	 */
 
 	channel_t *c;
-	unsigned int userc;
+	unsigned int userc, nusers;
 	char *userv[256];
 	unsigned int i;
 	time_t ts;
@@ -901,7 +901,8 @@ static void m_sjoin(sourceinfo_t *si, int parc, char *parv[])
 		channel_mode(NULL, c, parc - 3, parv + 2);
 		userc = sjtoken(parv[parc - 1], ' ', userv);
 
-		for (i = 0; i < userc; i++)
+		/* list modes go in first, the users then join together */
+		for (i = 0, nusers = 0; i < userc; i++)
 			if (*userv[i] == '&')	/* channel ban */
 				chanban_add(c, userv[i] + 1, 'b');
 			else if (*userv[i] == '"')	/* exception */
@@ -909,7 +910,9 @@ static void m_sjoin(sourceinfo_t *si, int parc, char *parv[])
 			else if (*userv[i] == '\'')	/* invex */
 				chanban_add(c, userv[i] + 1, 'I');
 			else
-				chanuser_add(c, userv[i]);
+				userv[nusers++] = userv[i];
+
+		chanuser_add_batch(c, userv, nusers);
 	}
 	else if (parc == 3)
 	{
@@ -935,7 +938,8 @@ static void m_sjoin(sourceinfo_t *si, int parc, char *parv[])
 
 		userc = sjtoken(parv[parc - 1], ' ', userv);
 
-		for (i = 0; i < userc; i++)
+		/* list modes go in first, the users then join together */
+		for (i = 0, nusers = 0; i < userc; i++)
 			if (*userv[i] == '&')	/* channel ban */
 				chanban_add(c, userv[i] + 1, 'b');
 			else if (*userv[i] == '"')	/* exception */
@@ -943,7 +947,9 @@ static void m_sjoin(sourceinfo_t *si, int parc, char *parv[])
 			else if (*userv[i] == '\'')	/* invex */
 				chanban_add(c, userv[i] + 1, 'I');
 			else
-				chanuser_add(c, userv[i]);
+				userv[nusers++] = userv[i];
+
+		chanuser_add_batch(c, userv, nusers);
 	}
 	else if (parc == 2)
 	{
@@ -58,6 +58,12 @@
  *	"dnsbl.dronebl.org";
  *	"rbl.efnetrbl.org";
  * };
+ *
+ * Answers are cached per blacklist and IP for as long as the reply's TTL
+ * allows (clamped to DNSBL_MIN_TTL..DNSBL_MAX_TTL). Users connecting from
+ * an IP that is already being looked up wait for that query instead of
+ * sending their own, and at most DNSBL_MAX_INFLIGHT queries per blacklist
+ * are outstanding at once; up to DNSBL_MAX_QUEUED more wait their turn.
  */
 
 #include "atheme.h"
@@ -92,22 +98,58 @@ const char *action_names[] = {
 
 #undef ITEM_DESC
 
+#define DNSBL_MAX_INFLIGHT	32
+#define DNSBL_MAX_QUEUED	1024
+#define DNSBL_MIN_TTL		60
+#define DNSBL_MAX_TTL		86400
+#define DNSBL_NEGATIVE_TTL	900	/* NXDOMAIN without an SOA to take it from */
+#define DNSBL_EXPIRE_INTERVAL	300
+
 /* A configured DNSBL */
 struct Blacklist {
 	object_t parent;
 	char host[IRCD_RES_HOSTLEN + 1];
 	unsigned int hits;
 	time_t lastwarning;
+	bool stale;			/* gone from the config after a rehash */
+
+	mowgli_patricia_t *cache;	/* struct BlacklistEntry by IP */
+	mowgli_list_t queue;		/* entries waiting for a free query slot */
+	unsigned int inflight;
+
+	unsigned int cache_hits;
+	unsigned int cache_misses;
+	unsigned int coalesced;
+	unsigned int dropped;
+	unsigned int failed;
 
 	mowgli_node_t node;
 };
 
-/* A lookup in progress for a particular DNSBL for a particular client */
-struct BlacklistClient {
+enum blacklist_state {
+	BL_QUEUED,
+	BL_INFLIGHT,
+	BL_LISTED,
+	BL_CLEAN,
+};
+
+/* What a DNSBL says about an IP, or a lookup of it in progress */
+struct BlacklistEntry {
 	struct Blacklist *blacklist;
-	user_t *u;
+	char ip[HOSTIPLEN + 1];
+	enum blacklist_state state;
+	time_t expires;
 	dns_query_t dns_query;
-	mowgli_node_t node;
+	mowgli_list_t clients;		/* BlacklistClients waiting for the answer */
+	mowgli_node_t node;		/* in blacklist->queue while BL_QUEUED */
+};
+
+/* A client waiting for a lookup */
+struct BlacklistClient {
+	struct BlacklistEntry *entry;
+	user_t *u;
+	mowgli_node_t node;		/* in the user's dnsbl:queries */
+	mowgli_node_t enode;		/* in entry->clients */
 };
 
 struct dnsbl_exempt_ {
@@ -123,6 +165,8 @@ typedef struct dnsbl_exempt_ dnsbl_exempt_t;
 
 mowgli_list_t dnsbl_elist;
 
+static mowgli_eventloop_timer_t *dnsbl_expire_timer;
+
 static void os_cmd_set_dnsblaction(sourceinfo_t *si, int parc, char *parv[]);
 static void dnsbl_hit(user_t *u, struct Blacklist *blptr);
 static void abort_blacklist_queries(user_t *u);
@@ -131,6 +175,7 @@ static void ps_cmd_dnsblscan(sourceinfo_t *si, int parc, char *parv[]);
 static void write_dnsbl_exempt_db(database_handle_t *db);
 static void db_h_ble(database_handle_t *db, const char *type);
 static void lookup_blacklists(user_t *u);
+static void blacklist_entry_free(struct BlacklistEntry *e);
 
 command_t os_set_dnsblaction = { "DNSBLACTION", N_("Changes what happens to a user when they hit a DNSBL."), PRIV_USER_ADMIN, 1, os_cmd_set_dnsblaction, { .path = "proxyscan/set_dnsblaction" } };
 command_t ps_dnsblexempt = { "DNSBLEXEMPT", N_("Manage the list of IP's exempt from DNSBL checking."), PRIV_USER_ADMIN, 3, ps_cmd_dnsblexempt, { .path = "proxyscan/dnsblexempt" } };
@@ -321,77 +366,212 @@ static struct Blacklist *find_blacklist(char *name)
 	return NULL;
 }
 
+static void blacklist_client_free(struct BlacklistClient *blcptr)
+{
+	mowgli_list_t *l = privatedata_get(blcptr->u, "dnsbl:queries");
+
+	if (l != NULL)
+		mowgli_node_delete(&blcptr->node, l);
+	mowgli_node_delete(&blcptr->enode, &blcptr->entry->clients);
+	free(blcptr);
+}
+
+static void blacklist_client_add(struct BlacklistEntry *e, user_t *u)
+{
+	struct BlacklistClient *blcptr = smalloc(sizeof(struct BlacklistClient));
+
+	blcptr->entry = e;
+	blcptr->u = u;
+
+	mowgli_node_add(blcptr, &blcptr->enode, &e->clients);
+	mowgli_node_add(blcptr, &blcptr->node, dnsbl_queries(u));
+}
+
+static void blacklist_send(struct BlacklistEntry *e)
+{
+	char buf[IRCD_RES_HOSTLEN + 1];
+	int ip[4];
+
+	/* we made e->ip ourselves, so this cannot fail */
+	sscanf(e->ip, "%d.%d.%d.%d", &ip[3], &ip[2], &ip[1], &ip[0]);
+
+	/* becomes 2.0.0.127.torbl.ahbl.org or whatever */
+	snprintf(buf, sizeof buf, "%d.%d.%d.%d.%s", ip[0], ip[1], ip[2], ip[3], e->blacklist->host);
+
+	e->state = BL_INFLIGHT;
+	e->blacklist->inflight++;
+
+	gethost_byname_type(buf, &e->dns_query, T_A);
+}
+
+/* sends queued lookups while there is room for them */
+static void blacklist_run_queue(struct Blacklist *blptr)
+{
+	struct BlacklistEntry *e;
+
+	while (blptr->inflight < DNSBL_MAX_INFLIGHT && blptr->queue.head != NULL)
+	{
+		e = blptr->queue.head->data;
+		mowgli_node_delete(&e->node, &blptr->queue);
+		blacklist_send(e);
+	}
+}
+
+static void blacklist_entry_free(struct BlacklistEntry *e)
+{
+	struct Blacklist *blptr = e->blacklist;
+	mowgli_node_t *n, *tn;
+
+	MOWGLI_ITER_FOREACH_SAFE(n, tn, e->clients.head)
+		blacklist_client_free(n->data);
+
+	if (e->state == BL_INFLIGHT)
+	{
+		delete_resolver_queries(&e->dns_query);
+		blptr->inflight--;
+	}
+	else if (e->state == BL_QUEUED)
+		mowgli_node_delete(&e->node, &blptr->queue);
+
+	mowgli_patricia_delete(blptr->cache, e->ip);
+	free(e);
+}
+
 static void blacklist_dns_callback(void *vptr, dns_reply_t *reply)
 {
-	struct BlacklistClient *blcptr = (struct BlacklistClient *) vptr;
-	int listed = 0;
-	mowgli_list_t *l;
+	struct BlacklistEntry *e = vptr;
+	struct Blacklist *blptr;
+	struct BlacklistClient *blcptr;
+	unsigned int ttl;
+	user_t *u;
 
-	if (blcptr == NULL)
+	if (e == NULL)
 		return;
 
-	if (blcptr->u == NULL)
+	blptr = e->blacklist;
+	blptr->inflight--;
+
+	ttl = e->dns_query.ttl;
+	e->state = BL_CLEAN;
+
+	switch (e->dns_query.result)
 	{
-		free(blcptr);
-		return;
+		case DNS_ANSWER:
+			/* only accept 127.x.y.z as a listing */
+			if (reply->addr.saddr.sa.sa_family == AF_INET &&
+					!memcmp(&((struct sockaddr_in *)&reply->addr)->sin_addr, "\177", 1))
+				e->state = BL_LISTED;
+			else if (blptr->lastwarning + 3600 < CURRTIME)
+			{
+				slog(LG_DEBUG,
+						"Garbage reply from blacklist %s",
+						blptr->host);
+				blptr->lastwarning = CURRTIME;
+			}
+			break;
+
+		case DNS_NEGATIVE:
+			if (ttl == 0)
+				ttl = DNSBL_NEGATIVE_TTL;
+			break;
+
+		default:
+			/* not cached; the next user from this IP tries again */
+			blptr->failed++;
+			ttl = 0;
+			break;
 	}
 
-	l = dnsbl_queries(blcptr->u);
-	mowgli_node_delete(&blcptr->node, l);
+	if (ttl < DNSBL_MIN_TTL && e->dns_query.result != DNS_FAILED)
+		ttl = DNSBL_MIN_TTL;
+	if (ttl > DNSBL_MAX_TTL)
+		ttl = DNSBL_MAX_TTL;
+	e->expires = CURRTIME + ttl;
 
-	if (reply != NULL)
+	/* a hit aborts all of that user's lookups, so take them one at a time */
+	while (e->clients.head != NULL)
 	{
-		/* only accept 127.x.y.z as a listing */
-		if (reply->addr.saddr.sa.sa_family == AF_INET &&
-				!memcmp(&((struct sockaddr_in *)&reply->addr)->sin_addr, "\177", 1))
-			listed++;
-		else if (blcptr->blacklist->lastwarning + 3600 < CURRTIME)
-		{
-			slog(LG_DEBUG,
-					"Garbage reply from blacklist %s",
-					blcptr->blacklist->host);
-			blcptr->blacklist->lastwarning = CURRTIME;
-		}
+		blcptr = e->clients.head->data;
+		u = blcptr->u;
+		blacklist_client_free(blcptr);
+
+		/* they have a blacklist entry for this client */
+		if (e->state == BL_LISTED)
+			dnsbl_hit(u, blptr);
 	}
 
-	/* they have a blacklist entry for this client */
-	if (listed)
-		dnsbl_hit(blcptr->u, blcptr->blacklist);
+	if (ttl == 0)
+		blacklist_entry_free(e);
 
-	object_unref(blcptr->blacklist);
-	free(blcptr);
+	blacklist_run_queue(blptr);
 }
 
 /* XXX: no IPv6 implementation, not to concerned right now though. */
 /* 2015-12-06: at least we shouldn't crash on bad inputs anymore... -bcode */
-static void initiate_blacklist_dnsquery(struct Blacklist *blptr, user_t *u)
+/* returns true if the user turned out to be listed already */
+static bool initiate_blacklist_dnsquery(struct Blacklist *blptr, user_t *u)
 {
-	char buf[IRCD_RES_HOSTLEN + 1];
+	char ipbuf[HOSTIPLEN + 1];
 	int ip[4];
-	mowgli_list_t *l;
+	struct BlacklistEntry *e;
 
 	if (u->ip == NULL)
-		return;
+		return false;
 
 	/* A sscanf worked fine for chary for many years, it'll be fine here */
-	if (sscanf(u->ip, "%d.%d.%d.%d", &ip[3], &ip[2], &ip[1], &ip[0]) != 4)
-		return;
+	if (sscanf(u->ip, "%d.%d.%d.%d", &ip[0], &ip[1], &ip[2], &ip[3]) != 4)
+		return false;
 
-	struct BlacklistClient *blcptr = malloc(sizeof(struct BlacklistClient));
+	snprintf(ipbuf, sizeof ipbuf, "%d.%d.%d.%d", ip[0], ip[1], ip[2], ip[3]);
 
-	blcptr->blacklist = object_ref(blptr);
-	blcptr->u = u;
+	e = mowgli_patricia_retrieve(blptr->cache, ipbuf);
 
-	blcptr->dns_query.ptr = blcptr;
-	blcptr->dns_query.callback = blacklist_dns_callback;
+	if (e != NULL && (e->state == BL_QUEUED || e->state == BL_INFLIGHT))
+	{
+		blptr->coalesced++;
+		blacklist_client_add(e, u);
+		return false;
+	}
 
-	/* becomes 2.0.0.127.torbl.ahbl.org or whatever */
-	snprintf(buf, sizeof buf, "%d.%d.%d.%d.%s", ip[0], ip[1], ip[2], ip[3], blptr->host);
+	if (e != NULL && e->expires > CURRTIME)
+	{
+		blptr->cache_hits++;
+		if (e->state != BL_LISTED)
+			return false;
 
-	gethost_byname_type(buf, &blcptr->dns_query, T_A);
+		dnsbl_hit(u, blptr);
+		return true;
+	}
+
+	blptr->cache_misses++;
+
+	if (blptr->inflight >= DNSBL_MAX_INFLIGHT && MOWGLI_LIST_LENGTH(&blptr->queue) >= DNSBL_MAX_QUEUED)
+	{
+		blptr->dropped++;
+		return false;
+	}
 
-	l = dnsbl_queries(u);
-	mowgli_node_add(blcptr, &blcptr->node, l);
+	if (e == NULL)
+	{
+		e = smalloc(sizeof(struct BlacklistEntry));
+		e->blacklist = blptr;
+		mowgli_strlcpy(e->ip, ipbuf, sizeof e->ip);
+		e->dns_query.ptr = e;
+		e->dns_query.callback = blacklist_dns_callback;
+		mowgli_patricia_add(blptr->cache, e->ip, e);
+	}
+
+	blacklist_client_add(e, u);
+
+	if (blptr->inflight < DNSBL_MAX_INFLIGHT)
+		blacklist_send(e);
+	else
+	{
+		e->state = BL_QUEUED;
+		mowgli_node_add(e, &e->node, &blptr->queue);
+	}
+
+	return false;
 }
 
 /* public interfaces */
@@ -406,13 +586,15 @@ static struct Blacklist *new_blacklist(char *name)
 
 	if (blptr == NULL)
 	{
-		blptr = malloc(sizeof(struct Blacklist));
+		blptr = smalloc(sizeof(struct Blacklist));
 		object_init(object(blptr), "proxyscan dnsbl", NULL);
+		blptr->cache = mowgli_patricia_create(strcasecanon);
 		mowgli_node_add(object_ref(blptr), &blptr->node, &blacklist_list);
 	}
 
 	mowgli_strlcpy(blptr->host, name, IRCD_RES_HOSTLEN + 1);
 	blptr->lastwarning = 0;
+	blptr->stale = false;
 
 	return blptr;
 }
@@ -428,21 +610,48 @@ static void lookup_blacklists(user_t *u)
 		if (u == NULL)
 			return;
 
-		initiate_blacklist_dnsquery(blptr, u);
+		if (initiate_blacklist_dnsquery(blptr, u))
+			return;
 	}
 }
 
+static void destroy_blacklist(struct Blacklist *blptr)
+{
+	mowgli_patricia_iteration_state_t state;
+	struct BlacklistEntry *e;
+
+	MOWGLI_PATRICIA_FOREACH(e, &state, blptr->cache)
+		blacklist_entry_free(e);
+	mowgli_patricia_destroy(blptr->cache, NULL, NULL);
+	blptr->cache = NULL;
+
+	mowgli_node_delete(&blptr->node, &blacklist_list);
+	object_unref(blptr);
+}
+
 static void destroy_blacklists(void)
 {
 	mowgli_node_t *n, *tn;
-	struct Blacklist *blptr;
 
 	MOWGLI_ITER_FOREACH_SAFE(n, tn, blacklist_list.head)
+		destroy_blacklist(n->data);
+}
+
+static void expire_blacklist_cache(void *unused)
+{
+	mowgli_node_t *n;
+	mowgli_patricia_iteration_state_t state;
+	struct BlacklistEntry *e;
+
+	MOWGLI_ITER_FOREACH(n, blacklist_list.head)
 	{
-		blptr = n->data;
+		struct Blacklist *blptr = (struct Blacklist *) n->data;
 
-		mowgli_node_delete(n, &blacklist_list);
-		object_unref(blptr);
+		MOWGLI_PATRICIA_FOREACH(e, &state, blptr->cache)
+		{
+			if ((e->state == BL_LISTED || e->state == BL_CLEAN) && e->expires <= CURRTIME)
+				blacklist_entry_free(e);
+		}
 	}
 }
 
@@ -460,9 +669,30 @@ static int dnsbl_config_handler(mowgli_config_file_entry_t *ce)
 	return 0;
 }
 
+/* blacklists still in the config keep their cache across a rehash */
 static void dnsbl_config_purge(void *unused)
 {
-	destroy_blacklists();
+	mowgli_node_t *n;
+
+	MOWGLI_ITER_FOREACH(n, blacklist_list.head)
+	{
+		struct Blacklist *blptr = (struct Blacklist *) n->data;
+
+		blptr->stale = true;
+	}
+}
+
+static void dnsbl_config_ready(void *unused)
+{
+	mowgli_node_t *n, *tn;
+
+	MOWGLI_ITER_FOREACH_SAFE(n, tn, blacklist_list.head)
+	{
+		struct Blacklist *blptr = (struct Blacklist *) n->data;
+
+		if (blptr->stale)
+			destroy_blacklist(blptr);
+	}
 }
 
 static int dnsbl_action_config_handler(mowgli_config_file_entry_t *ce)
@@ -517,6 +747,7 @@ static void dnsbl_hit(user_t *u, struct Blacklist *blptr)
 
 	svs = service_find("operserv");
 
+	blptr->hits++;
 	abort_blacklist_queries(u);
 
 	switch (action)
@@ -539,21 +770,37 @@ static void dnsbl_hit(user_t *u, struct Blacklist *blptr)
 	}
 }
 
+/* lookups already sent are left to finish, so their answer is cached */
 static void abort_blacklist_queries(user_t *u)
 {
 	mowgli_node_t *n, *tn;
-	mowgli_list_t *l = dnsbl_queries(u);
+	mowgli_list_t *l = privatedata_get(u, "dnsbl:queries");
+
+	if (l == NULL)
+		return;
 
 	MOWGLI_ITER_FOREACH_SAFE(n, tn, l->head)
 	{
 		struct BlacklistClient *blcptr = n->data;
+		struct BlacklistEntry *e = blcptr->entry;
+
+		blacklist_client_free(blcptr);
 
-		delete_resolver_queries(&blcptr->dns_query);
-		mowgli_node_delete(n, l);
-		free(blcptr);
+		if (e->state == BL_QUEUED && e->clients.head == NULL)
+			blacklist_entry_free(e);
 	}
 }
 
+static void dnsbl_user_delete(user_t *u)
+{
+	mowgli_list_t *l;
+
+	abort_blacklist_queries(u);
+
+	if ((l = privatedata_delete(u, "dnsbl:queries")) != NULL)
+		mowgli_list_free(l);
+}
+
 static void osinfo_hook(sourceinfo_t *si)
 {
 	mowgli_node_t *n;
@@ -567,7 +814,14 @@ static void osinfo_hook(sourceinfo_t *si)
 	{
 		struct Blacklist *blptr = (struct Blacklist *) n->data;
 
-		command_success_nodata(si, "Blacklist(s): %s", blptr->host);
+		unsigned int lookups = blptr->cache_hits + blptr->cache_misses;
+
+		command_success_nodata(si, "Blacklist(s): %s (%u listed, %u/%u lookups cached (%u%%), %u coalesced, "
+				"%u in flight, %zu queued, %u dropped, %u failed, %u cached)",
+				blptr->host, blptr->hits, blptr->cache_hits, lookups,
+				lookups ? (unsigned int)(blptr->cache_hits * 100ULL / lookups) : 0,
+				blptr->coalesced, blptr->inflight, MOWGLI_LIST_LENGTH(&blptr->queue),
+				blptr->dropped, blptr->failed, mowgli_patricia_size(blptr->cache));
 	}
 }
 
@@ -612,9 +866,9 @@ _modinit(module_t *m)
 
 	MODULE_TRY_REQUEST_SYMBOL(m, os_set_cmdtree, "operserv/set", "os_set_cmdtree");
 
-	if (!module_find_published("backend/opensex"))
+	if (db_mod == NULL)
 	{
-		slog(LG_INFO, "Module %s requires use of the OpenSEX database backend, refusing to load.", m->name);
+		slog(LG_INFO, "Module %s requires a row-based database backend such as OpenSEX, refusing to load.", m->name);
 		m->mflags = MODTYPE_FAIL;
 		return;
 	}
@@ -631,11 +885,14 @@ _modinit(module_t *m)
 	hook_add_event("config_purge");
 	hook_add_config_purge(dnsbl_config_purge);
 
+	hook_add_event("config_ready");
+	hook_add_config_ready(dnsbl_config_ready);
+
 	hook_add_event("user_add");
 	hook_add_user_add(check_dnsbls);
 
 	hook_add_event("user_delete");
-	hook_add_user_delete(abort_blacklist_queries);
+	hook_add_user_delete(dnsbl_user_delete);
 
 	hook_add_event("operserv_info");
 	hook_add_operserv_info(osinfo_hook);
@@ -644,17 +901,33 @@ _modinit(module_t *m)
 	add_conf_item("BLACKLISTS", &proxyscan->conf_table, dnsbl_config_handler);
 
 	command_add(&os_set_dnsblaction, *os_set_cmdtree);
+
+	dnsbl_expire_timer = mowgli_timer_add(base_eventloop, "expire_blacklist_cache", expire_blacklist_cache, NULL, DNSBL_EXPIRE_INTERVAL);
 }
 
 void
 _moddeinit(module_unload_intent_t intent)
 {
 	service_t *proxyscan;
+	mowgli_patricia_iteration_state_t state;
+	mowgli_list_t *l;
+	user_t *u;
+
+	mowgli_timer_destroy(base_eventloop, dnsbl_expire_timer);
+
+	destroy_blacklists();
+
+	MOWGLI_PATRICIA_FOREACH(u, &state, userlist)
+	{
+		if ((l = privatedata_delete(u, "dnsbl:queries")) != NULL)
+			mowgli_list_free(l);
+	}
 
 	hook_del_db_write(write_dnsbl_exempt_db);
 	hook_del_user_add(check_dnsbls);
-	hook_del_user_delete(abort_blacklist_queries);
+	hook_del_user_delete(dnsbl_user_delete);
 	hook_del_config_purge(dnsbl_config_purge);
+	hook_del_config_ready(dnsbl_config_ready);
 	hook_del_operserv_info(osinfo_hook);
 
 	db_unregister_type_handler("BLE");
@@ -25,6 +25,8 @@ void destroy_session(sasl_session_t *p);
 static void sasl_logcommand(sasl_session_t *p, myuser_t *login, int level, const char *fmt, ...);
 static void sasl_input(sasl_message_t *smsg);
 static void sasl_packet(sasl_session_t *p, char *buf, int len);
+static void sasl_step_result(sasl_session_t *p, int rc, char *out, size_t out_len);
+static void sasl_step_complete(sasl_session_t *p, int rc);
 static void sasl_write(char *target, char *data, int length);
 static bool may_impersonate(myuser_t *source_mu, myuser_t *target_mu);
 static myuser_t *login_user(sasl_session_t *p);
@@ -36,7 +38,7 @@ static void sasl_mech_unregister(sasl_mechanism_t *mech);
 static void mechlist_build_string(char *ptr, size_t buflen);
 static void mechlist_do_rebuild(void);
 
-sasl_mech_register_func_t sasl_mech_register_funcs = { &sasl_mech_register, &sasl_mech_unregister };
+sasl_mech_register_func_t sasl_mech_register_funcs = { &sasl_mech_register, &sasl_mech_unregister, &sasl_step_complete };
 
 /* main services client routine */
 static void saslserv(sourceinfo_t *si, int parc, char *parv[])
@@ -355,11 +357,20 @@ static void sasl_packet(sasl_session_t *p, char *buf, int len)
 {
 	int rc;
 	size_t tlen = 0;
-	char *cloak, *out = NULL;
+	char *out = NULL;
 	char temp[BUFSIZE];
 	char mech[61];
 	size_t out_len = 0;
-	metadata_t *md;
+
+	/* The client may not send more data while the mechanism is
+	 * still working on the previous step.
+	 */
+	if(p->flags & ASASL_STEP_PENDING)
+	{
+		sasl_sts(p->uid, 'D', "F");
+		destroy_session(p);
+		return;
+	}
 
 	/* First piece of data in a session is the name of
 	 * the SASL mechanism that will be used.
@@ -400,6 +411,33 @@ static void sasl_packet(sasl_session_t *p, char *buf, int len)
 	/* Some progress has been made, reset timeout. */
 	p->flags &= ~ASASL_MARKED_FOR_DELETION;
 
+	if(rc == ASASL_ASYNC)
+	{
+		p->flags |= ASASL_STEP_PENDING;
+		free(out);
+		return;
+	}
+
+	sasl_step_result(p, rc, out, out_len);
+}
+
+/* a mechanism that returned ASASL_ASYNC from mech_step has its answer */
+static void sasl_step_complete(sasl_session_t *p, int rc)
+{
+	return_if_fail(p->flags & ASASL_STEP_PENDING);
+
+	p->flags &= ~(ASASL_STEP_PENDING | ASASL_MARKED_FOR_DELETION);
+
+	sasl_step_result(p, rc, NULL, 0);
+}
+
+/* act on the result of a mechanism step and answer the client */
+static void sasl_step_result(sasl_session_t *p, int rc, char *out, size_t out_len)
+{
+	char *cloak;
+	char temp[BUFSIZE];
+	metadata_t *md;
+
 	if(rc == ASASL_DONE)
 	{
 		myuser_t *mu = login_user(p);
@@ -32,6 +32,15 @@ DECLARE_MODULE_V1
 	"Shaltúre developers <https://github.com/shalture>"
 );
 
+/* undo the splitting of origin and command, for log messages */
+static void unsplit_line(char *pos, char *message)
+{
+	if (pos != NULL)
+		pos[-1] = ' ';
+	if (message != NULL && message != pos)
+		message[-1] = ' ';
+}
+
 /* parses a P10 IRC stream */
 static void p10_parse(char *line)
 {
@@ -64,9 +73,11 @@ static void p10_parse(char *line)
 		if (*line == '\000')
 			goto cleanup;
 
-		/* copy the original line so we know what we crashed on */
-		memset((char *)&coreLine, '\0', BUFSIZE);
-		mowgli_strlcpy(coreLine, line, BUFSIZE);
+		/* the line is parsed in place in the receive queue, so a
+		 * core file still has it; keep a clean copy for debugging
+		 */
+		if (log_debug_enabled())
+			mowgli_strlcpy(coreLine, line, BUFSIZE);
 
 		slog(LG_RAWDATA, "-> %s", line);
 
@@ -120,12 +131,14 @@ static void p10_parse(char *line)
                 }
 		if (si->s == me.me)
 		{
-                        slog(LG_INFO, "p10_parse(): got message supposedly from myself %s: %s", si->s->name, coreLine);
+			unsplit_line(pos, message);
+                        slog(LG_INFO, "p10_parse(): got message supposedly from myself %s: %s", si->s->name, line);
                         goto cleanup;
 		}
 		if (si->su != NULL && si->su->server == me.me)
 		{
-                        slog(LG_INFO, "p10_parse(): got message supposedly from my own client %s: %s", si->su->nick, coreLine);
+			unsplit_line(pos, message);
+                        slog(LG_INFO, "p10_parse(): got message supposedly from my own client %s: %s", si->su->nick, line);
                         goto cleanup;
 		}
 		si->smu = si->su != NULL ? si->su->myuser : NULL;
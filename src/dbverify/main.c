@@ -21,6 +21,8 @@
 #include "atheme.h"
 #include "libathemecore.h"
 
+#include <ext/getopt_long.h> /* XXX */
+
 static unsigned int verify_entity_uids(void)
 {
 	unsigned int errcnt = 0;
@@ -70,6 +72,7 @@ static void verify_channel_registrations(void)
 			if (key == NULL)
 			{
 				slog(LG_INFO, "*** phase 3: %s: chanacs entry %p is dangling; unlinking from object store", mc->name, ca);
+				chanacs_unindex(ca);
 				mowgli_node_delete(&ca->cnode, &mc->chanacs);
 				continue;
 			}
@@ -77,6 +80,7 @@ static void verify_channel_registrations(void)
 			if ((ca2 = mowgli_patricia_retrieve(known, key)) != NULL)
 			{
 				slog(LG_INFO, "*** phase 3: %s: chanacs entry '%s' (%p) duplicates chanacs entry %p", mc->name, ca->entity != NULL ? ca->entity->name : ca->host, ca, ca2);
+				chanacs_unindex(ca);
 				mowgli_node_delete(&ca->cnode, &mc->chanacs);
 				continue;
 			}
@@ -104,28 +108,174 @@ static void handle_mdep(database_handle_t *db, const char *type)
 	module_load(modname);
 }
 
+static database_module_t *load_backend(const char *name)
+{
+	char path[BUFSIZE];
+
+	snprintf(path, sizeof path, "backend/%s", name);
+
+	db_mod = NULL;
+	if (module_load(path) == NULL || db_mod == NULL)
+	{
+		slog(LG_ERROR, "dbverify: cannot load database backend %s", path);
+		exit(EXIT_FAILURE);
+	}
+
+	return db_mod;
+}
+
+/*
+ * Copies every row of infile (in backend from) to outfile (in backend to)
+ * without interpreting it, so nothing depends on which modules are loaded.
+ * OpenSEX rows are plain text, so each row is carried as its type followed
+ * by the rest of the line; the binary backend stores that remainder as
+ * separate words so it can still be read back with typed reads.
+ */
+static int convert_database(database_module_t *from, database_module_t *to, const char *infile, const char *outfile)
+{
+	database_handle_t *in, *out;
+	const char *type, *rest;
+	unsigned int rows = 0;
+	bool split;
+	char *buf, *p, *q;
+
+	db_mod = from;
+	if ((in = db_open(infile, DB_READ)) == NULL)
+		return EXIT_FAILURE;
+
+	db_mod = to;
+	if ((out = db_open(outfile, DB_WRITE)) == NULL)
+		return EXIT_FAILURE;
+
+	split = strcmp(out->vt->name, "opensex") != 0;
+
+	while (db_read_next_row(in))
+	{
+		type = db_read_word(in);
+
+		/* comments, blank lines and the OpenSEX grammar version are
+		 * properties of the file, not of the data.
+		 */
+		if (type == NULL || !*type || strchr("#\n\t \r", *type) || !strcmp(type, "GRVER"))
+			continue;
+
+		rest = db_read_str(in);
+
+		db_start_row(out, type);
+
+		if (rest == NULL)
+			;
+		else if (!split)
+			db_write_str(out, rest);
+		else
+		{
+			buf = sstrdup(rest);
+			for (p = buf; p != NULL; p = q)
+			{
+				if ((q = strchr(p, ' ')) != NULL)
+					*q++ = '\0';
+
+				db_write_word(out, p);
+			}
+			free(buf);
+		}
+
+		db_commit_row(out);
+		rows++;
+	}
+
+	db_mod = from;
+	db_close(in);
+
+	db_mod = to;
+	if (!db_close(out))
+		return EXIT_FAILURE;
+
+	slog(LG_INFO, "dbverify: converted %u rows from %s to %s", rows, infile, outfile);
+
+	return EXIT_SUCCESS;
+}
+
+static void print_help(void)
+{
+	printf("usage: dbverify [-h] [-f backend] [-t backend] [infile [outfile]]\n\n"
+	       "-f <backend> Backend infile is stored in (default: opensex)\n"
+	       "-t <backend> Convert infile to this backend instead of verifying it\n"
+	       "-h           Print this message and exit\n");
+}
+
 int main(int argc, char *argv[])
 {
 	shalture_bootstrap();
 	shalture_init(argv[0], LOGDIR "/dbverify.log");
 	shalture_setup();
-	module_t *m;
+	database_module_t *from, *to;
 	unsigned int errcnt;
-	char *filename = argv[1] ? argv[1] : "services.db";
+	const char *from_name = "opensex", *to_name = NULL;
+	char *filename, *outfile;
+	int r;
+	mowgli_getopt_option_t long_opts[] = {
+		{ NULL, 0, NULL, 0, 0 },
+	};
+
+	while ((r = mowgli_getopt_long(argc, argv, "f:ht:", long_opts, NULL)) != -1)
+	{
+		switch (r)
+		{
+		  case 'f':
+			  from_name = mowgli_optarg;
+			  break;
+		  case 't':
+			  to_name = mowgli_optarg;
+			  break;
+		  case 'h':
+			  print_help();
+			  exit(EXIT_SUCCESS);
+			  break;
+		  default:
+			  print_help();
+			  exit(EXIT_FAILURE);
+			  break;
+		}
+	}
+
+	filename = mowgli_optind < argc ? argv[mowgli_optind] : "services.db";
 
 	runflags = RF_LIVE;
 	datadir = DATADIR;
 	strict_mode = false;
 	offline_mode = true;
 
-	slog(LG_INFO, "dbverify is operating on %s", filename);
+	from = load_backend(from_name);
+
+	if (to_name != NULL)
+	{
+		if (!strcmp(from_name, to_name))
+		{
+			slog(LG_ERROR, "dbverify: %s and %s are the same backend", from_name, to_name);
+			return EXIT_FAILURE;
+		}
+
+		outfile = mowgli_optind + 1 < argc ? argv[mowgli_optind + 1] : NULL;
+		if (outfile == NULL || !strcmp(outfile, filename))
+		{
+			slog(LG_ERROR, "dbverify: converting needs an output file different from %s", filename);
+			return EXIT_FAILURE;
+		}
+
+		to = load_backend(to_name);
+
+		slog(LG_INFO, "dbverify is converting %s (%s) to %s (%s)", filename, from_name, outfile, to_name);
 
-	m = module_load("backend/opensex");
+		return convert_database(from, to, filename, outfile);
+	}
+
+	slog(LG_INFO, "dbverify is operating on %s", filename);
 
 	db_unregister_type_handler("MDEP");
 	db_register_type_handler("MDEP", handle_mdep);
 
-	slog(LG_INFO, "*** phase 1: demarshaling objects from opensex datastore");
+	slog(LG_INFO, "*** phase 1: demarshaling objects from %s datastore", from_name);
 
 	runflags &= ~RF_LIVE;
 	db_load(filename);
@@ -146,7 +296,7 @@ int main(int argc, char *argv[])
 
 	slog(LG_INFO, "*** phase 5: writing corrected state to object store");
 
-	db_save(filename);
+	db_save(filename, DB_SAVE_BLOCKING);
 
 	return EXIT_SUCCESS;
 }
@@ -23,10 +23,21 @@
 #include "uplink.h"
 #include "pmodule.h"
 #include "conf.h"
+#include "datastream.h"
+#include <ext/getopt_long.h> /* XXX */
+#include <sys/resource.h>
+
+/* replayed lines are framed in place like the uplink receive queue does */
+#define REPLAY_FLUSH_LINES	1024
 
 static struct timeval burstbegin;
 static bool bursting = false;
 
+static const char *report_file = NULL;
+static unsigned long long flush_nsec = 0;
+static unsigned long flush_calls = 0;
+static int replay_sink = -1;
+
 void bootstrap(void)
 {
 	if (me.name == NULL)
@@ -88,6 +99,58 @@ void phase_buildworld(void)
 	slog(LG_INFO, "world created in %d msec", tv2ms(&te));
 }
 
+/*
+ * Prints where the burst went, and writes the same numbers as one JSON
+ * object to report_file ("-" for stdout) so runs can be compared. Phase
+ * times include the phases nested in them: user_add includes the hooks
+ * it runs, parse includes everything.
+ */
+static void report(const char *mode, unsigned long long bytes, unsigned long long nsec)
+{
+	struct rusage ru;
+	unsigned long lines = prof_counters[PROF_PARSE].calls;
+	double secs = nsec / 1e9;
+	FILE *f;
+	int i;
+
+	getrusage(RUSAGE_SELF, &ru);
+
+	slog(LG_INFO, "%s: %lu lines, %llu bytes in %.3f sec, %.0f lines/sec, peak RSS %ld KB",
+			mode, lines, bytes, secs, secs > 0 ? lines / secs : 0.0, (long) ru.ru_maxrss);
+	slog(LG_INFO, "%s: %u users, %u channels, %u channel members",
+			mode, cnt.user, cnt.chan, cnt.chanuser);
+
+	for (i = 0; i < PROF_COUNT; i++)
+		slog(LG_INFO, "  %-14s %10lu calls %10.3f msec", prof_names[i],
+				prof_counters[i].calls, prof_counters[i].nsec / 1e6);
+	if (flush_calls != 0)
+		slog(LG_INFO, "  %-14s %10lu calls %10.3f msec", "flush", flush_calls, flush_nsec / 1e6);
+
+	if (report_file == NULL)
+		return;
+
+	if (!strcmp(report_file, "-"))
+		f = stdout;
+	else if ((f = fopen(report_file, "w")) == NULL)
+	{
+		slog(LG_ERROR, "report(): cannot write %s: %s", report_file, strerror(errno));
+		return;
+	}
+
+	fprintf(f, "{\"mode\": \"%s\", \"protocol\": \"%s\", \"lines\": %lu, \"bytes\": %llu, "
+			"\"nsec\": %llu, \"lines_per_sec\": %.0f, \"peak_rss_kb\": %ld, "
+			"\"users\": %u, \"channels\": %u, \"chanusers\": %u, \"phases\": {",
+			mode, ircd->ircdname, lines, bytes, nsec, secs > 0 ? lines / secs : 0.0,
+			(long) ru.ru_maxrss, cnt.user, cnt.chan, cnt.chanuser);
+	for (i = 0; i < PROF_COUNT; i++)
+		fprintf(f, "\"%s\": {\"calls\": %lu, \"nsec\": %llu}, ", prof_names[i],
+				prof_counters[i].calls, prof_counters[i].nsec);
+	fprintf(f, "\"flush\": {\"calls\": %lu, \"nsec\": %llu}}}\n", flush_calls, flush_nsec);
+
+	if (f != stdout)
+		fclose(f);
+}
+
 static void m_pong(sourceinfo_t *si, int parc, char *parv[])
 {
 	struct timeval te;
@@ -101,6 +164,7 @@ static void m_pong(sourceinfo_t *si, int parc, char *parv[])
 	e_time(burstbegin, &te);
 
 	slog(LG_INFO, "burst took %d msec", tv2ms(&te));
+	report("link", cnt.bin, te.tv_sec * 1000000000ULL + te.tv_usec * 1000ULL);
 
 	runflags |= RF_SHUTDOWN;
 }
@@ -111,14 +175,179 @@ void hijack_pong_handler(void)
 	pcommand_add("PONG", m_pong, 1, MSRC_SERVER);
 }
 
+static void replay_close(connection_t *cptr)
+{
+	me.connected = false;
+	curr_uplink->conn = NULL;
+}
+
+/* stand in for the uplink: what services send goes to a socket we drain */
+static bool replay_connect(void)
+{
+	int fds[2];
+
+	if (uplinks.head == NULL)
+	{
+		slog(LG_ERROR, "replay_connect(): no uplink configured");
+		return false;
+	}
+	curr_uplink = uplinks.head->data;
+
+	if (socketpair(AF_UNIX, SOCK_STREAM, 0, fds) < 0)
+	{
+		slog(LG_ERROR, "replay_connect(): socketpair: %s", strerror(errno));
+		return false;
+	}
+	fcntl(fds[0], F_SETFL, fcntl(fds[0], F_GETFL) | O_NONBLOCK);
+	fcntl(fds[1], F_SETFL, fcntl(fds[1], F_GETFL) | O_NONBLOCK);
+
+	curr_uplink->conn = connection_add(curr_uplink->name, fds[0], CF_UPLINK, NULL, NULL);
+	curr_uplink->conn->close_handler = replay_close;
+	replay_sink = fds[1];
+
+	me.connected = true;
+	me.recvsvr = false;
+	server_login();
+
+	return true;
+}
+
+static void replay_flush(void)
+{
+	connection_t *cptr = curr_uplink->conn;
+	char buf[65536];
+	unsigned long long start = prof_now();
+
+	while (cptr != NULL && !(cptr->flags & CF_DEAD) && sendq_nonempty(cptr))
+	{
+		sendq_flush(cptr);
+		while (recv(replay_sink, buf, sizeof buf, 0) > 0)
+			;
+	}
+
+	flush_calls++;
+	flush_nsec += prof_now() - start;
+}
+
+/*
+ * Feeds a recorded burst (for example one written by tools/createburst)
+ * through the protocol module's parser, as if the uplink had sent it.
+ */
+static int replay_burst(const char *filename)
+{
+	FILE *f;
+	char *buf, *line, *p, *end;
+	size_t len, n;
+	unsigned long long start, pstart;
+	unsigned long lineno = 0;
+
+	if ((f = fopen(filename, "rb")) == NULL)
+	{
+		slog(LG_ERROR, "replay_burst(): cannot open %s: %s", filename, strerror(errno));
+		return EXIT_FAILURE;
+	}
+
+	/* read it all first so disk I/O is not part of the timings */
+	len = 0;
+	n = 1048576;
+	buf = smalloc(n + 1);
+	while (!feof(f) && !ferror(f))
+	{
+		if (len == n)
+		{
+			n *= 2;
+			buf = srealloc(buf, n + 1);
+		}
+		len += fread(buf + len, 1, n - len, f);
+	}
+	fclose(f);
+	buf[len] = '\0';
+
+	slog(LG_INFO, "replaying %zu bytes from %s", len, filename);
+
+	if (!replay_connect())
+	{
+		free(buf);
+		return EXIT_FAILURE;
+	}
+
+	prof_reset();
+	prof_enabled = true;
+	start = prof_now();
+
+	for (line = buf, end = buf + len; line < end && me.connected; line = p + 1)
+	{
+		if ((p = memchr(line, '\n', end - line)) == NULL)
+			p = end;
+		*p = '\0';
+		if (p > line && p[-1] == '\r')
+			p[-1] = '\0';
+		if (p - line > BUFSIZE)
+			line[BUFSIZE] = '\0';
+
+		cnt.bin += p - line + 1;
+		pstart = prof_begin();
+		parse(line);
+		prof_end(PROF_PARSE, pstart);
+
+		if (++lineno % REPLAY_FLUSH_LINES == 0)
+			replay_flush();
+	}
+	replay_flush();
+
+	prof_enabled = false;
+
+	if (!me.connected)
+		slog(LG_ERROR, "replay_burst(): link dropped at line %lu", lineno);
+
+	report("replay", len, prof_now() - start);
+
+	free(buf);
+	return me.connected ? EXIT_SUCCESS : EXIT_FAILURE;
+}
+
+static void print_help(void)
+{
+	printf("usage: dragon [-h] [-f burstfile] [-o report] [config]\n\n"
+	       "-f <burstfile> Replay this burst instead of linking to the uplink\n"
+	       "-o <report>    Write results as JSON to this file (- for stdout)\n"
+	       "-h             Print this message and exit\n");
+}
+
 int main(int argc, char *argv[])
 {
-	atheme_bootstrap();
-	atheme_init(argv[0], LOGDIR "/dbverify.log");
-	atheme_setup();
-	module_t *m;
-	unsigned int errcnt;
-	char *config_file = argv[1] != NULL ? argv[1] : "./dragon.conf";
+	shalture_bootstrap();
+	shalture_init(argv[0], LOGDIR "/dragon.log");
+	shalture_setup();
+	const char *burst_file = NULL;
+	char *config_file;
+	int r;
+	mowgli_getopt_option_t long_opts[] = {
+		{ NULL, 0, NULL, 0, 0 },
+	};
+
+	while ((r = mowgli_getopt_long(argc, argv, "f:ho:", long_opts, NULL)) != -1)
+	{
+		switch (r)
+		{
+		  case 'f':
+			  burst_file = mowgli_optarg;
+			  break;
+		  case 'o':
+			  report_file = mowgli_optarg;
+			  break;
+		  case 'h':
+			  print_help();
+			  exit(EXIT_SUCCESS);
+			  break;
+		  default:
+			  print_help();
+			  exit(EXIT_FAILURE);
+			  break;
+		}
+	}
+
+	config_file = mowgli_optind < argc ? argv[mowgli_optind] : "./dragon.conf";
 
 	runflags = RF_LIVE;
 	datadir = DATADIR;
@@ -133,17 +362,22 @@ int main(int argc, char *argv[])
 
 	slog(LG_INFO, "link implementation: %s @%p", ircd->ircdname, ircd);
 
-	hijack_pong_handler();
-
 	mowgli_eventloop_synchronize(base_eventloop);
 	CURRTIME = mowgli_eventloop_get_time(base_eventloop);
 
+	if (burst_file != NULL)
+		return replay_burst(burst_file);
+
+	hijack_pong_handler();
+
 	phase_buildworld();
 	uplink_connect();
 
 	slog(LG_INFO, "uplink: %s @%p", curr_uplink->name, curr_uplink);
 
+	prof_enabled = true;
 	io_loop();
 
 	return EXIT_SUCCESS;
 }
+
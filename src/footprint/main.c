@@ -6,14 +6,294 @@
  */
 
 #include "atheme.h"
+#include "libathemecore.h"
 #include "serno.h"
 
+#include <ext/getopt_long.h> /* XXX */
+
+/*
+ * The layout metadata used to have: a patricia dictionary per object, as
+ * in libmowgli-2 patricia.c, with a strdup'd key per leaf and a metadata_t
+ * holding a separately allocated value.
+ */
+struct old_patricia {
+	void (*canonize_cb)(char *key);
+	void *root;
+	unsigned int count;
+	char *id;
+};
+
+struct old_patricia_leaf {
+	int nibnum;
+	void *data;
+	const char *key;
+	void *parent;
+	char parent_val;
+};
+
+struct old_patricia_node {
+	int nibnum;
+	void *down[16];
+	void *parent;
+	char parent_val;
+};
+
+struct old_metadata {
+	char *name;
+	char *value;
+};
+
+typedef struct {
+	const char *what;
+	unsigned int objects, bare, entries;
+	size_t now, before;
+} md_footprint_t;
+
+static int keycmp(const void *a, const void *b)
+{
+	return strcmp(*(char * const *)a, *(char * const *)b);
+}
+
+/* nibbles two canonical keys have in common, as patricia compares them */
+static size_t nibble_prefix(const char *a, const char *b)
+{
+	size_t i;
+
+	for (i = 0; a[i] == b[i] && a[i] != '\0'; i++)
+		;
+
+	return i * 2 + ((a[i] & 0xF0) == (b[i] & 0xF0));
+}
+
+/*
+ * A patricia tree has one node per distinct branch point. With the keys
+ * sorted, every branch point is the common prefix of some adjacent pair.
+ */
+static unsigned int patricia_nodes(char **keys, unsigned int count)
+{
+	size_t *prefix;
+	unsigned int i, j, nodes = 0;
+
+	if (count < 2)
+		return 0;
+
+	prefix = smalloc(count * sizeof *prefix);
+
+	for (i = 1; i < count; i++)
+	{
+		prefix[i] = nibble_prefix(keys[i - 1], keys[i]);
+
+		for (j = i - 1; j > 0 && prefix[j] > prefix[i]; j--)
+			;
+
+		if (j == 0 || prefix[j] < prefix[i])
+			nodes++;
+	}
+
+	free(prefix);
+	return nodes;
+}
+
+static size_t patricia_bytes(char **keys, unsigned int count)
+{
+	size_t bytes;
+	unsigned int i;
+
+	qsort(keys, count, sizeof *keys, keycmp);
+
+	bytes = sizeof(struct old_patricia) + count * sizeof(struct old_patricia_leaf) +
+		patricia_nodes(keys, count) * sizeof(struct old_patricia_node);
+
+	for (i = 0; i < count; i++)
+		bytes += strlen(keys[i]) + 1;
+
+	return bytes;
+}
+
+static void measure_object(md_footprint_t *fp, void *target)
+{
+	metadata_iteration_state_t state;
+	metadata_t *md;
+	char **keys;
+	unsigned int i, count;
+
+	if ((count = metadata_count(target)) == 0)
+	{
+		fp->bare++;
+		return;
+	}
+
+	keys = smalloc(count * sizeof *keys);
+	i = 0;
+
+	METADATA_FOREACH(md, &state, target)
+	{
+		keys[i] = sstrdup(md->name);
+		strcasecanon(keys[i]);
+		fp->before += sizeof(struct old_metadata) + strlen(md->value) + 1;
+		i++;
+	}
+
+	fp->before += patricia_bytes(keys, count);
+	fp->now += metadata_footprint(target);
+	fp->objects++;
+	fp->entries += count;
+
+	for (i = 0; i < count; i++)
+		free(keys[i]);
+	free(keys);
+}
+
+static void print_metadata_footprint(void)
+{
+	md_footprint_t fp[] = {
+		{ "accounts" }, { "groups" }, { "channels" }, { "channel access" }, { "old names" },
+	}, total = { "total" };
+	myentity_iteration_state_t mestate;
+	mowgli_patricia_iteration_state_t state;
+	myentity_t *mt;
+	mychan_t *mc;
+	myuser_name_t *mun;
+	mowgli_node_t *n;
+	unsigned int i, keycount;
+	size_t keybytes;
+
+	MYENTITY_FOREACH_T(mt, &mestate, ENT_ANY)
+		measure_object(&fp[mt->type == ENT_USER ? 0 : 1], mt);
+
+	MOWGLI_PATRICIA_FOREACH(mc, &state, mclist)
+	{
+		measure_object(&fp[2], mc);
+
+		MOWGLI_ITER_FOREACH(n, mc->chanacs.head)
+			measure_object(&fp[3], n->data);
+	}
+
+	MOWGLI_PATRICIA_FOREACH(mun, &state, oldnameslist)
+		measure_object(&fp[4], mun);
+
+	printf("metadata: %-16s %10s %10s %10s %12s %12s\n", "", "objects", "without", "entries", "now (B)", "before (B)");
+
+	for (i = 0; i < ARRAY_SIZE(fp); i++)
+	{
+		printf("metadata: %-16s %10u %10u %10u %12zu %12zu\n", fp[i].what,
+				fp[i].objects, fp[i].bare, fp[i].entries, fp[i].now, fp[i].before);
+
+		total.objects += fp[i].objects;
+		total.bare += fp[i].bare;
+		total.entries += fp[i].entries;
+		total.now += fp[i].now;
+		total.before += fp[i].before;
+	}
+
+	keybytes = metadata_key_footprint(&keycount);
+	total.now += keybytes;
+
+	printf("metadata: %-16s %10s %10s %10u %12zu %12s\n", "interned keys", "", "", keycount, keybytes, "-");
+	printf("metadata: %-16s %10u %10u %10u %12zu %12zu\n", total.what,
+			total.objects, total.bare, total.entries, total.now, total.before);
+
+	printf("\n");
+
+	if (total.before >= total.now)
+		printf("metadata now takes %zu KB, %zu KB less than before\n",
+				total.now / 1024, (total.before - total.now) / 1024);
+	else
+		printf("metadata now takes %zu KB, %zu KB more than before\n",
+				total.now / 1024, (total.now - total.before) / 1024);
+
+	/* the old metadata_find() and metadata_delete() created an empty
+	 * dictionary on any object they were called on */
+	printf("objects without metadata no longer risk an empty dictionary each (up to %zu KB)\n",
+			total.bare * sizeof(struct old_patricia) / 1024);
+}
+
+static void handle_mdep(database_handle_t *db, const char *type)
+{
+	const char *modname = db_sread_word(db);
+
+	module_load(modname);
+}
+
+static int measure_database(const char *backend, const char *filename)
+{
+	char path[BUFSIZE];
+
+	shalture_bootstrap();
+	shalture_init("footprint", LOGDIR "/footprint.log");
+	shalture_setup();
+
+	runflags = RF_LIVE;
+	datadir = DATADIR;
+	strict_mode = false;
+	offline_mode = true;
+
+	snprintf(path, sizeof path, "backend/%s", backend);
+
+	db_mod = NULL;
+	if (module_load(path) == NULL || db_mod == NULL)
+	{
+		slog(LG_ERROR, "footprint: cannot load database backend %s", path);
+		return EXIT_FAILURE;
+	}
+
+	db_unregister_type_handler("MDEP");
+	db_register_type_handler("MDEP", handle_mdep);
+
+	runflags &= ~RF_LIVE;
+	db_load(filename);
+	runflags |= RF_LIVE;
+
+	printf("footprint for atheme %s (%s) of %s\n", PACKAGE_VERSION, SERNO, filename);
+
+	printf("\n* * *\n\n");
+
+	print_metadata_footprint();
+
+	return EXIT_SUCCESS;
+}
+
+static void print_help(void)
+{
+	printf("usage: footprint [-h] [-f backend] [database]\n\n"
+	       "Without a database, estimates the memory used by a random network.\n"
+	       "With one, loads it and reports the memory used by its metadata.\n\n"
+	       "-f <backend> Backend the database is stored in (default: opensex)\n"
+	       "-h           Print this message and exit\n");
+}
+
 int main(int argc, char *argv[])
 {
 	unsigned int usercount = 0, channelcount = 0, membercount = 0,
 		klinecount = 0, qlinecount = 0, xlinecount = 0, regchannelcount = 0,
 		servercount = 0, regusercount = 0;
 	unsigned int i;
+	const char *backend = "opensex";
+	int r;
+	mowgli_getopt_option_t long_opts[] = {
+		{ NULL, 0, NULL, 0, 0 },
+	};
+
+	while ((r = mowgli_getopt_long(argc, argv, "f:h", long_opts, NULL)) != -1)
+	{
+		switch (r)
+		{
+		  case 'f':
+			  backend = mowgli_optarg;
+			  break;
+		  case 'h':
+			  print_help();
+			  exit(EXIT_SUCCESS);
+			  break;
+		  default:
+			  print_help();
+			  exit(EXIT_FAILURE);
+			  break;
+		}
+	}
+
+	if (mowgli_optind < argc)
+		return measure_database(backend, argv[mowgli_optind]);
 
 	servercount = arc4random_uniform(30) + 1;
 
@@ -64,6 +64,16 @@ main(int argc, char *argv[])
 				(unsigned long)now, MUFLAGS);
 		printf("MN %s %s %lu %lu\n", nick, nick, (unsigned long)now,
 				(unsigned long)now);
+		printf("MDU %s private:host:actual %s@192.0.2.%d\n", nick, nick, i % 256);
+		printf("MDU %s private:host:vhost %s@user/%s\n", nick, nick, nick);
+		if (i % 4 == 0)
+			printf("MDU %s private:usercloak %s.users.example.org\n", nick, nick);
+		if (i % 10 == 0)
+		{
+			printf("MDU %s private:mark:setter createtestdb\n", nick);
+			printf("MDU %s private:mark:reason test account\n", nick);
+			printf("MDU %s private:mark:timestamp %lu\n", nick, (unsigned long)now);
+		}
 	}
 
 	return 0;